@@ -17,69 +17,317 @@
  * 
  * ********************************************************************************************************************/
 #include "btcomm.h"
+#include "btcomm_cmd.h"
+#include "btcomm_stats.h"
 					     
 //#define __BT_debug			// Uncomment to trigger printing of BT messages for debug purposes
 
-// These are required to keep track of messages and help set state
-int message_id_counter=1;		// <-- This is a global message_id counter, used to keep track of
-                                //     messages sent to the EV3
-int *socket_id;				    // <-- Socked identifier for your EV3
-int ref_angle=0;                // <-- Reference angle, once set it makes the current measurement from gyro equal to 0 degrees
+// The connection used by the BT_* calls. Programs that talk to more than one brick open a BT_ev3 for each
+// (see EV3_open()) and use the EV3_* calls instead.
+BT_ev3 BT_default_ev3={-1,NULL,1};
+
+// Pipelined command engine - states of a reply slot (BT_ev3.pending). A reply that arrives while we are
+// waiting on a different message id is stored in its slot until BT_wait_reply() is called for it.
+#define BT_SLOT_FREE 0
+#define BT_SLOT_PENDING 1
+#define BT_SLOT_DONE 2
+
+static int BT_write_all(int fd, const unsigned char *buf, int len);
+static int BT_next_id(BT_ev3 *ev3);
+static void BT_stamp(BT_ev3 *ev3, unsigned char *cmd_string);
+static int BT_send_tracked(BT_ev3 *ev3, const unsigned char *cmd_string, int len);
+static int BT_exchange(BT_ev3 *ev3, const void *cmd, int len, void *reply, int maxlen);
+static int BT_io_exchange(BT_ev3 *ev3, const unsigned char *cmd_string, int len, unsigned char *reply, int maxlen);
+static int BT_actuate(BT_ev3 *ev3, void *cmd, int len, void *reply, int maxlen);
+static void BT_dir_clear(BT_ev3 *ev3);
+static void BT_capture_frame(BT_ev3 *ev3, int dir, const unsigned char *frame, int len);
+
+typedef struct
+{
+ char *data;
+ int len, size;
+} BT_text;
 
-int BT_open(const char *device_id)
+static int BT_fetch(BT_ev3 *ev3, const char *caller, unsigned char begin, unsigned char cont, const char *src,
+                    BT_sink sink, void *arg, BT_transfer_stats *stats);
+static int BT_text_sink(void *arg, const unsigned char *data, int len);
+
+static void BT_reset_pending(BT_ev3 *ev3)
+{
+ for (int i=0; i<BT_MAX_INFLIGHT; i++) ev3->pending[i].state=BT_SLOT_FREE;
+ ev3->n_inflight=0;
+}
+
+static void BT_ev3_init(BT_ev3 *ev3, int fd)
+{
+ // Start a fresh session on a connection - no replies pending, nothing buffered
+ ev3->socket=fd;
+ ev3->transport=NULL;
+ BT_reset_pending(ev3);
+ ev3->rx_start=ev3->rx_end=0;
+ ev3->io_running=0;
+ ev3->io_users=0;
+}
+
+static BT_ev3 *BT_ev3_new()
+{
+ BT_ev3 *ev3;
+ ev3=(BT_ev3 *)calloc(1,sizeof(BT_ev3));
+ if (ev3==NULL)
+ {
+  fprintf(stderr,"EV3_open: Out of memory\n");
+  return(NULL);
+ }
+ ev3->socket=-1;
+ ev3->msg_id=1;
+ return(ev3);
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Transports (Oct 2026)
+//
+// A transport turns the rest of an address into a connected stream socket; from then on the command engine only
+// reads, writes and polls the descriptor, so every BT_* call runs unchanged whatever the link. BT_connect() picks
+// the transport by the address prefix, and falls back to RFCOMM for plain Bluetooth addresses.
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+#define BT_MAX_TRANSPORTS 8
+#define BT_WIFI_PORT "5555"				// The EV3's direct command port over WiFi
+
+static int BT_connect_rfcomm(const char *address)
 {
- //////////////////////////////////////////////////////////////////////////////////////////////////////
- // Open a socket to the specified Lego EV3 device specified by the provided hex ID string
- //
- // Input: The hex string identifier for the Lego EV3 block
- // Returns: 0 on success
- //          -1 otherwise 
- //
  // Derived from bluetooth.c by Don Neumann
- //////////////////////////////////////////////////////////////////////////////////////////////////////
-  
- int rv;
  struct sockaddr_rc addr = { 0 };
- int s, status;
- char dest[18];
- socket_id=(int*)malloc(sizeof(int));   
- fprintf(stderr,"Request to connect to device %s\n",device_id);
- 
- *socket_id = socket(AF_BLUETOOTH, SOCK_STREAM, BTPROTO_RFCOMM);
+ int fd;
+
+ fd = socket(AF_BLUETOOTH, SOCK_STREAM, BTPROTO_RFCOMM);
  // set the connection parameters (who to connect to)
  addr.rc_family = AF_BLUETOOTH;
  addr.rc_channel = (uint8_t) 1;
- str2ba(device_id, &addr.rc_bdaddr );
+ str2ba(address, &addr.rc_bdaddr );
 
- status = connect(*socket_id, (struct sockaddr *)&addr, sizeof(addr));
- if( status == 0 ) {
-	printf("Connection to %s established at socket: %d.\n", device_id, *socket_id);
- }
- if( status < 0 ) {
+ if (fd<0||connect(fd, (struct sockaddr *)&addr, sizeof(addr))<0) {
        perror("Connection attempt failed ");
+       if (fd>=0) close(fd);
        return(-1);
  }
- return 0;
+ return(fd);
+}
+
+static int BT_connect_tcp(const char *address)
+{
+ // address is serial@host[:port]. The EV3 only takes direct commands over TCP after an unlock request
+ // naming its serial number, which it answers with "Accept:EV340".
+ struct addrinfo hints, *res=NULL, *ai;
+ char serial[32], host[256], unlock[128], answer[32];
+ const char *at=strchr(address,'@'), *port=BT_WIFI_PORT, *colon;
+ int fd=-1, one=1, n=0, rv;
+
+ if (at==NULL||at-address>=(int)sizeof(serial)||strlen(at+1)>=sizeof(host))
+ {
+  fprintf(stderr,"BT_open: TCP addresses are tcp:<serial>@<host>[:<port>]\n");
+  return(-1);
+ }
+ memcpy(&serial[0],address,at-address);
+ serial[at-address]='\0';
+ strcpy(&host[0],at+1);
+ colon=strrchr(&host[0],':');
+ if (colon!=NULL&&strchr(&host[0],':')==colon)
+ {
+  host[colon-&host[0]]='\0';
+  port=colon+1;
+ }
+
+ memset(&hints,0,sizeof(hints));
+ hints.ai_family=AF_UNSPEC;
+ hints.ai_socktype=SOCK_STREAM;
+ rv=getaddrinfo(&host[0],port,&hints,&res);
+ if (rv!=0)
+ {
+  fprintf(stderr,"BT_open: %s: %s\n",&host[0],gai_strerror(rv));
+  return(-1);
+ }
+ for (ai=res; ai!=NULL; ai=ai->ai_next)
+ {
+  fd=socket(ai->ai_family,ai->ai_socktype,ai->ai_protocol);
+  if (fd>=0&&connect(fd,ai->ai_addr,ai->ai_addrlen)==0) break;
+  if (fd>=0) close(fd);
+  fd=-1;
+ }
+ freeaddrinfo(res);
+ if (fd<0)
+ {
+  perror("Connection attempt failed ");
+  return(-1);
+ }
+ // Commands are small and latency bound - send each one as soon as it is written
+ setsockopt(fd,IPPROTO_TCP,TCP_NODELAY,&one,sizeof(one));
+
+ snprintf(&unlock[0],sizeof(unlock),"GET /target?sn=%sVMTP1.0\nProtocol: EV3",&serial[0]);
+ if (BT_write_all(fd,(const unsigned char *)&unlock[0],strlen(unlock))<0) n=-1;
+ while (n>=0&&n<(int)sizeof(answer)-1&&(n<4||memcmp(&answer[n-4],"\r\n\r\n",4)!=0))
+ {
+  rv=read(fd,&answer[n],1);
+  if (rv<0&&errno==EINTR) continue;
+  n=(rv==1)?n+1:-1;
+ }
+ if (n<12||memcmp(&answer[0],"Accept:EV340",12)!=0)
+ {
+  fprintf(stderr,"BT_open: The EV3 at %s refused the connection\n",&host[0]);
+  close(fd);
+  return(-1);
+ }
+ return(fd);
 }
 
+static int BT_connect_unix(const char *path)
+{
+ // Connect to a stand-in brick listening on a Unix domain socket
+ struct sockaddr_un addr;
+ int fd;
 
-int BT_close()
+ memset(&addr,0,sizeof(addr));
+ addr.sun_family=AF_UNIX;
+ if (strlen(path)>=sizeof(addr.sun_path))
+ {
+  fprintf(stderr,"BT_open: Socket path too long\n");
+  return(-1);
+ }
+ strcpy(addr.sun_path,path);
+ fd=socket(AF_UNIX,SOCK_STREAM,0);
+ if (fd<0||connect(fd,(struct sockaddr *)&addr,sizeof(addr))<0)
+ {
+  perror("Connection attempt failed ");
+  if (fd>=0) close(fd);
+  return(-1);
+ }
+ return(fd);
+}
+
+static const BT_transport BT_builtin_transports[3]={
+ {"bt:","rfcomm",BT_connect_rfcomm},
+ {"tcp:","tcp",BT_connect_tcp},
+ {"unix:","unix",BT_connect_unix},
+};
+static const BT_transport *BT_transports[BT_MAX_TRANSPORTS]={
+ &BT_builtin_transports[0],&BT_builtin_transports[1],&BT_builtin_transports[2]};
+static int BT_n_transports=3;
+static pthread_mutex_t BT_transport_lock=PTHREAD_MUTEX_INITIALIZER;
+
+int BT_add_transport(const BT_transport *transport)
+{
+ //////////////////////////////////////////////////////////////////////////////////////////////////////
+ // Make BT_open() and EV3_open() accept addresses starting with transport->scheme. A transport
+ // added later replaces an earlier one with the same scheme, built-in ones included. The structure
+ // must stay valid for as long as connections may be opened.
+ //
+ // Returns: 0 on success
+ //          -1 if the scheme is empty or the table is full
+ //////////////////////////////////////////////////////////////////////////////////////////////////////
+ int i;
+ if (transport->scheme==NULL||transport->scheme[0]=='\0'||transport->connect==NULL)
+ {
+  fprintf(stderr,"BT_add_transport: A transport needs a scheme and a connect function\n");
+  return(-1);
+ }
+ pthread_mutex_lock(&BT_transport_lock);
+ for (i=0; i<BT_n_transports; i++) if (strcmp(BT_transports[i]->scheme,transport->scheme)==0) break;
+ if (i==BT_MAX_TRANSPORTS)
+ {
+  pthread_mutex_unlock(&BT_transport_lock);
+  fprintf(stderr,"BT_add_transport: Too many transports\n");
+  return(-1);
+ }
+ BT_transports[i]=transport;
+ if (i==BT_n_transports) BT_n_transports++;
+ pthread_mutex_unlock(&BT_transport_lock);
+ return(0);
+}
+
+static int BT_connect(BT_ev3 *ev3, const char *device_id)
+{
+ //////////////////////////////////////////////////////////////////////////////////////////////////////
+ // Open a connection to the Lego EV3 at the given address (see BT_open() in btcomm.h)
+ //
+ // Input: The address, a Bluetooth hex ID string with or without a transport prefix
+ // Returns: 0 on success
+ //          -1 otherwise 
+ //////////////////////////////////////////////////////////////////////////////////////////////////////
+ const BT_transport *transport=&BT_builtin_transports[0];
+ const char *address=device_id;
+
+ BT_ev3_init(ev3,-1);
+ fprintf(stderr,"Request to connect to device %s\n",device_id);
+ pthread_mutex_lock(&BT_transport_lock);
+ for (int i=0; i<BT_n_transports; i++)
+  if (strncmp(device_id,BT_transports[i]->scheme,strlen(BT_transports[i]->scheme))==0)
+  {
+   transport=BT_transports[i];
+   address=device_id+strlen(transport->scheme);
+  }
+ pthread_mutex_unlock(&BT_transport_lock);
+
+ ev3->socket=transport->connect(address);
+ if (ev3->socket<0) return(-1);
+ ev3->transport=transport;
+ printf("Connection to %s established at socket: %d.\n", device_id, ev3->socket);
+ return(0);
+}
+
+int BT_open(const char *device_id)
+{
+ return(BT_connect(&BT_default_ev3,device_id));
+}
+
+BT_ev3 *EV3_open(const char *device_id)
+{
+ //////////////////////////////////////////////////////////////////////////////////////////////////////
+ // Same as BT_open(), but returns a new connection instead of using the default one, so that
+ // several bricks can be used at the same time.
+ //
+ // Input: The hex string identifier for the Lego EV3 block
+ // Returns: the connection, to be released with EV3_close()
+ //          NULL otherwise
+ //////////////////////////////////////////////////////////////////////////////////////////////////////
+ BT_ev3 *ev3=BT_ev3_new();
+ if (ev3==NULL) return(NULL);
+ if (BT_connect(ev3,device_id)<0)
+ {
+  if (ev3->socket>=0) close(ev3->socket);
+  free(ev3);
+  return(NULL);
+ }
+ return(ev3);
+}
+
+int EV3_close(BT_ev3 *ev3)
 {
  /////////////////////////////////////////////////////////////////////////////////////////////////////
- // Close the communication socket to the EV3
+ // Close the communication socket to the EV3. Connections made with EV3_open() or EV3_attach()
+ // are released as well.
  /////////////////////////////////////////////////////////////////////////////////////////////////////  
- fprintf(stderr,"Request to close connection to device at socket id %d\n",*socket_id);
- close(*socket_id);
- free(socket_id);
+ fprintf(stderr,"Request to close connection to device at socket id %d\n",ev3->socket);
+ if (__atomic_load_n(&ev3->io_running,__ATOMIC_ACQUIRE)) EV3_io_stop(ev3);
+ if (ev3->capture!=NULL) EV3_capture_stop(ev3);
+ close(ev3->socket);
+ ev3->socket=-1;
+ BT_dir_clear(ev3);
+ if (ev3!=&BT_default_ev3) free(ev3);
+ return(0);
+}
+
+int BT_close()
+{
+ return(EV3_close(&BT_default_ev3));
 }
 
 
-int BT_setEV3name(const char *name)
+int EV3_setEV3name(BT_ev3 *ev3, const char *name)
 {
  /////////////////////////////////////////////////////////////////////////////////////////////////////
  // This function can be used to name your EV3. 
  // Inputs: A zero-terminated string containing the desired name, length <=  12 characters
  /////////////////////////////////////////////////////////////////////////////////////////////////////
+ BT_stats_begin(BT_CALL_SETEV3NAME);
 
  char cmd_string[1024];
  unsigned char cmd_prefix[11]={0x00,0x00,    0x00,0x00,    0x00,    0x00,0x00,    0xD4,     0x08,   0x84,              0x00};
@@ -96,11 +344,11 @@ int BT_setEV3name(const char *name)
  if (len>12)
  {
   fprintf(stderr,"BT_setEV3name(): The input name string is too long - 12 characters max, no white spaces or special characters\n");
-  return(-1);
+  return(BT_stats_end(-1));
  }
  memcpy(&cmd_string[0],&cmd_prefix[0],10*sizeof(unsigned char));
  strncpy(&cmd_string[10],name,1013);
- cmd_string[1024]=0x00;
+ cmd_string[1023]=0x00;
 
  // Update message length, and update sequence counter (length and cnt_id fields) 
  len+=9;
@@ -109,10 +357,7 @@ int BT_setEV3name(const char *name)
  cmd_string[0]=*cp;
  cmd_string[1]=*(cp+1);
 
- lp=(void *)&message_id_counter;
- cp=(unsigned char *)lp;
- cmd_string[2]=*cp;
- cmd_string[3]=*(cp+1);
+ BT_stamp(ev3,(unsigned char *)&cmd_string[0]);
  
 #ifdef __BT_debug 
  fprintf(stderr,"Set name command:\n");
@@ -123,8 +368,7 @@ int BT_setEV3name(const char *name)
  fprintf(stderr,"\n");
 #endif  
 
- write(*socket_id,&cmd_string[0],len+2);
- read(*socket_id,&reply[0],1023);
+ BT_exchange(ev3,&cmd_string[0],len+2,&reply[0],1024);
 
 #ifdef __BT_debug
  fprintf(stderr,"Set name reply:\n");
@@ -138,11 +382,11 @@ int BT_setEV3name(const char *name)
  else
   fprintf(stderr,"BT_setEV3name(): Command failed, name must not contain spaces or special characters\n");
  
- message_id_counter++;
+ return(BT_stats_end(reply[4]==0x02?0:-1));
 }
 
 
-int BT_play_tone_sequence(const int tone_data[50][3])
+int EV3_play_tone_sequence(BT_ev3 *ev3, const int tone_data[50][3])
 {
  //////////////////////////////////////////////////////////////////////////////////////////////////
  // 
@@ -162,6 +406,7 @@ int BT_play_tone_sequence(const int tone_data[50][3])
  // Returns:  0 on success
  //           -1 otherwise
  //////////////////////////////////////////////////////////////////////////////////////////////////
+ BT_stats_begin(BT_CALL_PLAY_TONE_SEQUENCE);
   
  int len;
  int freq;
@@ -180,10 +425,7 @@ int BT_play_tone_sequence(const int tone_data[50][3])
  len=5;
  
  // Set message count id
- p=(void *)&message_id_counter;
- cp=(unsigned char *)p;
- cmd_string[2]=*cp;
- cmd_string[3]=*(cp+1);
+ BT_stamp(ev3,&cmd_string[0]);
  
  // Pre-check tone information
  for (int i=0; i<50; i++)
@@ -233,17 +475,13 @@ int BT_play_tone_sequence(const int tone_data[50][3])
  fprintf(stderr,"\n");
 #endif  
 
- write(*socket_id,&cmd_string[0],len+2);
-
- read(*socket_id,&reply[0],1023);
-
- message_id_counter++;
+ BT_actuate(ev3,&cmd_string[0],len+2,&reply[0],1024);
 
- return(0);
+ return(BT_stats_end(0));
 }
 
 
-int BT_motor_port_start(char port_ids, char power)
+int EV3_motor_port_start(BT_ev3 *ev3, char port_ids, char power)
 {
  ////////////////////////////////////////////////////////////////////////////////////////////////
  //
@@ -268,63 +506,48 @@ int BT_motor_port_start(char port_ids, char power)
  // Returins: 0 on success
  //          -1 otherwise  
  //////////////////////////////////////////////////////////////////////////////////////////////////
+ BT_stats_begin(BT_CALL_MOTOR_PORT_START);
 
- void *p;
- unsigned char *cp;
  char reply[1024];
- unsigned char cmd_string[15]={0x0D,0x00, 0x00,0x00, 0x80,  0x00,0x00,  0xA4,      0x00,    0x00,       0x81,0x00,   0xA6,    0x00,   0x00};
- //                          |length-2| | cnt_id | |type| | header |  |set power| |layer|  |port ids|  |power|      |start|  |layer| |port id|
+ unsigned char cmd_string[15];
+ int len;
 
  if (power>100||power<-100)
  {
   fprintf(stderr,"BT_motor_port_start: Power must be in [-100, 100]\n");
-  return(0);
+  return(BT_stats_end(0));
  }
  
  if (port_ids>15)
  {
   fprintf(stderr,"BT_motor_port_start: Invalid port id value\n");
-  return(0);
+  return(BT_stats_end(0));
  }
  
- // Set message count id
- p=(void *)&message_id_counter;
- cp=(unsigned char *)p;
- cmd_string[2]=*cp;
- cmd_string[3]=*(cp+1);
-
- cmd_string[9]=port_ids;
- cmd_string[11]=power;
- cmd_string[14]=port_ids;
+ len=btcmd::direct<0,0>(cmd_string,DIRECT_COMMAND_NO_REPLY,BT_next_id(ev3),
+                        btcmd::op(opOUTPUT_POWER),btcmd::lc0(0),btcmd::lc0(port_ids),btcmd::lc1(power),
+                        btcmd::op(opOUTPUT_START),btcmd::lc0(0),btcmd::lc0(port_ids));
 
 #ifdef __BT_debug 
  fprintf(stderr,"BT_motor_port_start command string:\n");
- for(int i=0; i<15; i++)
+ for(int i=0; i<len; i++)
  {
   fprintf(stderr,"%X, ",cmd_string[i]&0xff);
  }
  fprintf(stderr,"\n");
 #endif  
  
- write(*socket_id,&cmd_string[0],15);
- read(*socket_id,&reply[0],1023);
-
- message_id_counter++;
-
- if (reply[4]==0x02){
-#ifdef __BT_debug
-  fprintf(stderr,"BT_drive command(): Command successful\n");
-#endif
- }
- else{
+ // This is a no-reply command, so success means it was handed to the link (or the I/O thread)
+ if (BT_actuate(ev3,&cmd_string[0],len,&reply[0],1024)<0){
   fprintf(stderr,"BT_drive command(): Command failed\n");
-  return(-1);
+  return(BT_stats_end(-1));
  }
- return(0); 
+
+ return(BT_stats_end(0)); 
 }
 
 
-int BT_motor_port_stop(char port_ids, int brake_mode)
+int EV3_motor_port_stop(BT_ev3 *ev3, char port_ids, int brake_mode)
 {
  //////////////////////////////////////////////////////////////////////////////////
  // Stop the motor(s) at the specified ports. This does not change the output
@@ -335,45 +558,35 @@ int BT_motor_port_stop(char port_ids, int brake_mode)
  // Returns: 0 on success
  //          -1 otherwise
  //////////////////////////////////////////////////////////////////////////////////
- void *p;
- unsigned char *cp;
+ BT_stats_begin(BT_CALL_MOTOR_PORT_STOP);
  char reply[1024];
- unsigned char cmd_string[11]={0x09,0x00, 0x00,0x00, 0x00,  0x00,0x00,  0xA3,   0x00,    0x00,       0x00};
- //                           |length-2| | cnt_id | |type| | header |  |stop|   |layer|  |port ids|  |brake|
+ unsigned char cmd_string[11];
+ int len;
  
  if (port_ids>15)
  {
   fprintf(stderr,"BT_motor_port_stop: Invalid port id value\n");
-  return(0);
+  return(BT_stats_end(0));
  }
  if (brake_mode!=0&&brake_mode!=1)
  {
   fprintf(stderr,"BT_motor_port_start: brake mode must be either 0 or 1\n");
-  return(0);
+  return(BT_stats_end(0));
  }
 
- // Set message count id
- p=(void *)&message_id_counter;
- cp=(unsigned char *)p;
- cmd_string[2]=*cp;
- cmd_string[3]=*(cp+1);
-  
- cmd_string[9]=port_ids;
- cmd_string[10]=brake_mode;
+ len=btcmd::direct<0,0>(cmd_string,DIRECT_COMMAND_REPLY,BT_next_id(ev3),
+                        btcmd::op(opOUTPUT_STOP),btcmd::lc0(0),btcmd::lc0(port_ids),btcmd::lc0(brake_mode));
 
 #ifdef __BT_debug 
  fprintf(stderr,"BT_motor_port_stop command string:\n");
- for(int i=0; i<11; i++)
+ for(int i=0; i<len; i++)
  {
   fprintf(stderr,"%X, ",cmd_string[i]&0xff);
  }
  fprintf(stderr,"\n");
 #endif  
  
- write(*socket_id,&cmd_string[0],11);
- read(*socket_id,&reply[0],1023);
-
- message_id_counter++;
+ BT_actuate(ev3,&cmd_string[0],len,&reply[0],1024);
 
  if (reply[4]==0x02){
 #ifdef __BT_debug
@@ -382,14 +595,14 @@ int BT_motor_port_stop(char port_ids, int brake_mode)
  }
  else{
   fprintf(stderr,"BT_drive command(): Command failed\n");
-  return(-1);
+  return(BT_stats_end(-1));
  }
 
- return(0);
+ return(BT_stats_end(0));
 }
 
 
-int BT_all_stop(int brake_mode){
+int EV3_all_stop(BT_ev3 *ev3, int brake_mode){
  //////////////////////////////////////////////////////////////////////////////////////////////////////
  // Stops all motor ports - provided for convenience, of course you can do the same with the 
  // functions above.
@@ -398,35 +611,26 @@ int BT_all_stop(int brake_mode){
  // Returns: 0 on success
  //          -1 otherwise
  //////////////////////////////////////////////////////////////////////////////////////////////////////
+ BT_stats_begin(BT_CALL_ALL_STOP);
 
- void *p;
- unsigned char *cp;
  char reply[1024];
  char port_ids = MOTOR_A|MOTOR_B|MOTOR_C|MOTOR_D;
- unsigned char cmd_string[11]={0x09,0x00, 0x00,0x00, 0x00,  0x00,0x00,  0xA3,   0x00,    0x00,       0x00};
- //                           |length-2| | cnt_id | |type| | header |  |stop|   |layer|  |port ids|  |brake|
+ unsigned char cmd_string[11];
+ int len;
 
- // Set message count id
- p=(void *)&message_id_counter;
- cp=(unsigned char *)p;
- cmd_string[2]=*cp;
- cmd_string[3]=*(cp+1);
-  
- cmd_string[9]=port_ids;
- cmd_string[10]=brake_mode;
+ len=btcmd::direct<0,0>(cmd_string,DIRECT_COMMAND_REPLY,BT_next_id(ev3),
+                        btcmd::op(opOUTPUT_STOP),btcmd::lc0(0),btcmd::lc0(port_ids),btcmd::lc0(brake_mode));
 
 #ifdef __BT_debug
  fprintf(stderr,"BT_all_stop command string:\n");
- for(int i=0; i<11; i++)
+ for(int i=0; i<len; i++)
  {
   fprintf(stderr,"%X, ",cmd_string[i]&0xff);
  }
  fprintf(stderr,"\n");
 #endif
 
- write(*socket_id,&cmd_string[0],11);
- read(*socket_id,&reply[0],1023);
- message_id_counter++;
+ BT_actuate(ev3,&cmd_string[0],len,&reply[0],1024);
 
  if (reply[4]==0x02){
 #ifdef __BT_debug
@@ -435,14 +639,14 @@ int BT_all_stop(int brake_mode){
  }
  else{
   fprintf(stderr,"BT_drive command(): Command failed\n");
-  return(-1);
+  return(BT_stats_end(-1));
  }
 
- return(0);
+ return(BT_stats_end(0));
 }
 
 
-int BT_drive(char lport, char rport, char power){
+int EV3_drive(BT_ev3 *ev3, char lport, char rport, char power){
  ////////////////////////////////////////////////////////////////////////////////////////////////
  // This function sends a command to the left and right motor ports to set the motor power to
  // the desired value. You can drive forward or backward depending on the sign of the power
@@ -467,51 +671,40 @@ int BT_drive(char lport, char rport, char power){
  // Returns: 0 on success
  //          -1 otherwise
  //////////////////////////////////////////////////////////////////////////////////////////////////
+ BT_stats_begin(BT_CALL_DRIVE);
  
- void *p;
- unsigned char *cp;
  char ports;
  char reply[1024];
- unsigned char cmd_string[15]={0x0D,0x00, 0x00,0x00, 0x00,  0x00,0x00,  0xA4,      0x00,    0x00,       0x81,0x00,   0xA6,    0x00,   0x00};
- //                           |length-2| | cnt_id | |type| | header |  |set power| |layer|  |port ids|  |power|      |start|  |layer| |port id|
+ unsigned char cmd_string[15];
+ int len;
 
  if (power>100||power<-100)
  {
   fprintf(stderr,"BT_drive: Power must be in [-100, 100]\n");
-  return(-1);
+  return(BT_stats_end(-1));
  }
 
  if (lport>8 || rport>8)
  {
   fprintf(stderr,"BT_drive: Invalid port id value\n");
-  return(-1);
+  return(BT_stats_end(-1));
  }
  ports = lport|rport;
 
- // Set message count id
- p=(void *)&message_id_counter;
- cp=(unsigned char *)p;
- cmd_string[2]=*cp;
- cmd_string[3]=*(cp+1);
-
- cmd_string[9]=ports;
- cmd_string[11]=power;
- cmd_string[14]=ports;
-
+ len=btcmd::direct<0,0>(cmd_string,DIRECT_COMMAND_REPLY,BT_next_id(ev3),
+                        btcmd::op(opOUTPUT_POWER),btcmd::lc0(0),btcmd::lc0(ports),btcmd::lc1(power),
+                        btcmd::op(opOUTPUT_START),btcmd::lc0(0),btcmd::lc0(ports));
 
 #ifdef __BT_debug 
  fprintf(stderr,"BT_drive command string:\n");
- for(int i=0; i<16; i++)
+ for(int i=0; i<len; i++)
  {
   fprintf(stderr,"%X, ",cmd_string[i]&0xff);
  }
  fprintf(stderr,"\n");
 #endif  
 
- write(*socket_id,&cmd_string[0],15);
- read(*socket_id,&reply[0],1023);
-
- message_id_counter++;
+ BT_actuate(ev3,&cmd_string[0],len,&reply[0],1024);
 
  if (reply[4]==0x02){
 #ifdef __BT_debug
@@ -520,14 +713,14 @@ int BT_drive(char lport, char rport, char power){
  }
  else{
   fprintf(stderr,"BT_drive command(): Command failed\n");
-  return(-1);
+  return(BT_stats_end(-1));
  }
 
- return(0);
+ return(BT_stats_end(0));
 }
 
 
-int BT_turn(char lport, char lpower, char rport, char rpower){
+int EV3_turn(BT_ev3 *ev3, char lport, char lpower, char rport, char rpower){
  ////////////////////////////////////////////////////////////////////////////////////////////////
  //
  // This function sends a command to the left and right motor ports to set the motor power to
@@ -552,53 +745,38 @@ int BT_turn(char lport, char lpower, char rport, char rpower){
  // Returns: 0 on success
  //          -1 otherwise
  //////////////////////////////////////////////////////////////////////////////////////////////////
- void *p;
- unsigned char *cp;
+ BT_stats_begin(BT_CALL_TURN);
  char reply[1024];
- unsigned char cmd_string[20]={0x12,0x00, 0x00,0x00, 0x00,  0x00,0x00,  0xA4,      0x00,    0x00,      0x81,0x00,    0xA4,     0x00,     0x00, 0x81,0x00,  0xA6,    0x00,   0x00};
- //                          |length-2| | cnt_id | |type| | header |  |set power| |layer|  |lport id|  |power|  |set power| |layer| |rport id| |power|     |start|  |layer| |port ids|
+ unsigned char cmd_string[20];
+ int len;
 
  if (lpower>100||lpower<-100||rpower>100||lpower<-100)
  {
   fprintf(stderr,"BT_drive: Power must be in [-100, 100]\n");
-  return(-1);
+  return(BT_stats_end(-1));
  }
 
  if (lport>8 || rport>8)
  {
   fprintf(stderr,"BT_drive: Invalid port id value\n");
-  return(-1);
+  return(BT_stats_end(-1));
  }
 
- // Set message count id
- p=(void *)&message_id_counter;
- cp=(unsigned char *)p;
- cmd_string[2]=*cp;
- cmd_string[3]=*(cp+1);
-
- //set up power and port for left motor
- cmd_string[9]=lport;
- cmd_string[11]=lpower;
-
- //set up power and port for right motor
- cmd_string[14] = rport;
- cmd_string[16] = rpower;
-
- cmd_string[19] = lport|rport;
+ len=btcmd::direct<0,0>(cmd_string,DIRECT_COMMAND_REPLY,BT_next_id(ev3),
+                        btcmd::op(opOUTPUT_POWER),btcmd::lc0(0),btcmd::lc0(lport),btcmd::lc1(lpower),	// <-- left motor
+                        btcmd::op(opOUTPUT_POWER),btcmd::lc0(0),btcmd::lc0(rport),btcmd::lc1(rpower),	// <-- right motor
+                        btcmd::op(opOUTPUT_START),btcmd::lc0(0),btcmd::lc0(lport|rport));
 
 #ifdef __BT_debug
  fprintf(stderr,"BT_turn command string:\n");
- for(int i=0; i<20; i++)
+ for(int i=0; i<len; i++)
  {
   fprintf(stderr,"%X, ",cmd_string[i]&0xff);
  }
  fprintf(stderr,"\n");
 #endif
 
- write(*socket_id,&cmd_string[0],20);
- read(*socket_id,&reply[0],1023);
-
- message_id_counter++;
+ BT_actuate(ev3,&cmd_string[0],len,&reply[0],1024);
 
  if (reply[4]==0x02){
 #ifdef __BT_debug
@@ -607,14 +785,14 @@ int BT_turn(char lport, char lpower, char rport, char rpower){
  }
  else{
   fprintf(stderr,"BT_turn command(): Command failed\n");
-  return(-1);
+  return(BT_stats_end(-1));
  }
 
- return(0);
+ return(BT_stats_end(0));
 }
 
 
-int BT_timed_motor_port_start(char port_id, char power, int ramp_up_time, int run_time, int ramp_down_time){
+int EV3_timed_motor_port_start(BT_ev3 *ev3, char port_id, char power, int ramp_up_time, int run_time, int ramp_down_time){
  ////////////////////////////////////////////////////////////////////////////////////////////////
  //
  // Provides timed operation of the motor ports. This allows you, for example, to create carefully timed
@@ -635,56 +813,38 @@ int BT_timed_motor_port_start(char port_id, char power, int ramp_up_time, int ru
  // Returns: 0 on success
  //          -1 otherwise
  //////////////////////////////////////////////////////////////////////////////////////////////////
- void *p;
- unsigned char *cp;
+ BT_stats_begin(BT_CALL_TIMED_MOTOR_PORT_START);
  char reply[1024];
- unsigned char cmd_string[22]={0x00,0x00, 0x00,0x00, 0x00,  0x00,0x00,  0x00,  0x00,   0x00,     0x81,0x00, 0x00,0x00,0x00, 0x00,0x00,0x00,  0x00,0x00,0x00,     0x00};
- //                          |length-2| | cnt_id | |type|   |header|    |cmd| |layer| |port ids|  |power|      |ramp up|      |run|           |ramp down|      |brake|
+ unsigned char cmd_string[22];
+ int len;
 
  if (power>100||power<-100)
  {
   fprintf(stderr,"BT_timed_motor_port_start: Power must be in [-100, 100]\n");
-  return(-1);
+  return(BT_stats_end(-1));
  }
 
  if (port_id>8)
  {
   fprintf(stderr,"BT_timed_motor_port_start: Invalid port id value\n");
-  return(-1);
+  return(BT_stats_end(-1));
  }
 
- // Set message count id
- p=(void *)&message_id_counter;
- cp=(unsigned char *)p;
- cmd_string[2]=*cp;
- cmd_string[3]=*(cp+1);
-
- cmd_string[0]=LC0(20);
- cmd_string[7]=opOUTPUT_TIME_POWER;
- cmd_string[9]=port_id;
- cmd_string[11]=power;
- cmd_string[12]=LC2_byte0(); //ramp up
- cmd_string[13]=LX_byte1(ramp_up_time);
- cmd_string[14]=LX_byte2(ramp_up_time);
- cmd_string[15]=LC2_byte0(); //run
- cmd_string[16]=LX_byte1(run_time);
- cmd_string[17]=LX_byte2(run_time);
- cmd_string[18]=LC2_byte0(); //ramp down
- cmd_string[19]=LX_byte1(ramp_down_time);
- cmd_string[20]=LX_byte2(ramp_down_time);
- cmd_string[21]=0;
+ len=btcmd::direct<0,0>(cmd_string,DIRECT_COMMAND_REPLY,BT_next_id(ev3),
+                        btcmd::op(opOUTPUT_TIME_POWER),btcmd::lc0(0),btcmd::lc0(port_id),btcmd::lc1(power),
+                        btcmd::lc2(ramp_up_time),btcmd::lc2(run_time),btcmd::lc2(ramp_down_time),
+                        btcmd::lc0(0));	// <-- brake
 
 #ifdef __BT_debug
  fprintf(stderr,"BT_motor_port_start command string:\n");
- for(int i=0; i<22; i++)
+ for(int i=0; i<len; i++)
  {
   fprintf(stderr,"%X, ",cmd_string[i]&0xff);
  }
  fprintf(stderr,"\n");
 #endif
 
- write(*socket_id,&cmd_string[0],22);
- read(*socket_id,&reply[0],1023);
+ BT_actuate(ev3,&cmd_string[0],len,&reply[0],1024);
 
  if (reply[4]==0x02){
 #ifdef __BT_debug
@@ -693,25 +853,23 @@ int BT_timed_motor_port_start(char port_id, char power, int ramp_up_time, int ru
  }
  else{
   fprintf(stderr,"BT_motor_port_start command(): Command failed\n");
-  return(-1);
+  return(BT_stats_end(-1));
  }
 
  if (reply[4]==0x02){
   fprintf(stderr,"BT_motor_port_start command(): Command successful\n");
-  return(reply[5]!=0);
+  return(BT_stats_end(reply[5]!=0));
  }
  else{
   fprintf(stderr,"BT_motor_port_start command(): Command failed\n");
-  return(-1);
+  return(BT_stats_end(-1));
  }
 
- message_id_counter++;
-
- return(0);
+ return(BT_stats_end(0));
 }
 
 
-int BT_timed_motor_port_start_v2(char port_id, char power, int time){
+int EV3_timed_motor_port_start_v2(BT_ev3 *ev3, char port_id, char power, int time){
  ////////////////////////////////////////////////////////////////////////////////////////////////
  //
  // This is a quick call provided for convenience - it sets the motor to the specified power
@@ -730,60 +888,42 @@ int BT_timed_motor_port_start_v2(char port_id, char power, int time){
  // Returns: 0 on success
  //          -1 otherwise
  //////////////////////////////////////////////////////////////////////////////////////////////////
- void *p;
- unsigned char *cp;
+ BT_stats_begin(BT_CALL_TIMED_MOTOR_PORT_START_V2);
  char reply[1024];
-
- unsigned char cmd[26]= {0x00,0x00, 0x00,0x00, 0x00, 0x00,0x00,  0xA4,   0x00,  0x00, 0x81,0x00, 0xA6,  0x00,   0x00,   0x00, 0x00, 0x00,0x00, 0x00,       0x00,   0x00,      0xA3, 0x00,     0x00,   0x00};
- //                     |length-2| |cnt_id|   |type| |header| |set_pwr| |layer| |port| |power|  |start| |layer| |port|  |wait| |LC2|    |time| |var addr| |ready| |var addr| |stop| |layer| |port_id| |break|
+ unsigned char cmd[26];
+ int len;
 
  if (power>100||power<-100)
  {
   fprintf(stderr,"BT_timed_motor_port_start: Power must be in [-100, 100]\n");
-  return(-1);
+  return(BT_stats_end(-1));
  }
 
  if (port_id>8)
  {
   fprintf(stderr,"BT_timed_motor_port_start: Invalid port id value\n");
-  return(-1);
+  return(BT_stats_end(-1));
  }
 
- BT_motor_port_start(port_id, power);
-
- // Set message count id
- p=(void *)&message_id_counter;
- cp=(unsigned char *)p;
- cmd[2]=*cp;
- cmd[3]=*(cp+1);
-
- cmd[0]=LC0(24);
- cmd[6]=LC0(10<<2); //size of local memory
- cmd[9]=port_id;
- cmd[11]=power;
- cmd[14]=port_id;
-
- cmd[15]=opTIMER_WAIT;
- cmd[16]=LC2_byte0();
- cmd[17]=LX_byte1(time);
- cmd[18]=LX_byte2(time);
- cmd[19]=LV0(0);
+ EV3_motor_port_start(ev3,port_id, power);
 
- cmd[20]=opTIMER_READY;
- cmd[21]=LV0(0);
-
- cmd[24]=port_id;
+ // Start the motor, wait for the timer (kept in local variable 0) to run out, then stop the motor
+ len=btcmd::direct<0,10>(cmd,DIRECT_COMMAND_REPLY,BT_next_id(ev3),
+                         btcmd::op(opOUTPUT_POWER),btcmd::lc0(0),btcmd::lc0(port_id),btcmd::lc1(power),
+                         btcmd::op(opOUTPUT_START),btcmd::lc0(0),btcmd::lc0(port_id),
+                         btcmd::op(opTIMER_WAIT),btcmd::lc2(time),btcmd::lv0(0),
+                         btcmd::op(opTIMER_READY),btcmd::lv0(0),
+                         btcmd::op(opOUTPUT_STOP),btcmd::lc0(0),btcmd::lc0(port_id),btcmd::lc0(0));
 #ifdef __BT_debug
  fprintf(stderr,"BT_timed_motor_port_start timer ready command:\n");
- for(int i=0; i<26; i++)
+ for(int i=0; i<len; i++)
  {
   fprintf(stderr,"%X, ",cmd[i]&0xff);
  }
  fprintf(stderr,"\n");
 #endif
 
- write(*socket_id,&cmd[0],26);
- read(*socket_id,&reply[0],1023);
+ BT_actuate(ev3,&cmd[0],len,&reply[0],1024);
 
  if (reply[4]==0x02){
 #ifdef __BT_debug
@@ -792,16 +932,14 @@ int BT_timed_motor_port_start_v2(char port_id, char power, int time){
  }
  else{
   fprintf(stderr,"BT_motor_port_startv2(): Command failed\n");
-  return(-1);
+  return(BT_stats_end(-1));
  }
 
- message_id_counter++;
-
- return(0);
+ return(BT_stats_end(0));
 }
 
 
-void BT_get_type_mode(char sensor_port){
+void EV3_get_type_mode(BT_ev3 *ev3, char sensor_port){
  ////////////////////////////////////////////////////////////////////////////////////////////////
  //
  // Displays on stderr the type and mode of sensor plugged into the specified sensor port. 
@@ -812,38 +950,28 @@ void BT_get_type_mode(char sensor_port){
  //
  //
  //////////////////////////////////////////////////////////////////////////////////////////////////
- void *p;
+ BT_stats_begin(BT_CALL_GET_TYPE_MODE);
  char reply[1024];
- memset(reply,0,1024);
- unsigned char *cp;
- unsigned char cmd_string[13]={0x0B,0x00, 0x00,0x00, 0x00,  0x02,0x00,  0x00,    0x00,       0x00,    0x00,  0x00, 0x00};
- //                          |length-2| | cnt_id | |type| | header |   |cmd|  |sensor cmd | |layer|  |port| |global var addr|
+ unsigned char cmd_string[13];
+ int len;
 
  if (sensor_port>8)
  {
   fprintf(stderr,"BT_read_colour_sensor: Invalid port id value\n");
  }
 
- // Set message count id
- p=(void *)&message_id_counter;
- cp=(unsigned char *)p;
- cmd_string[2]=*cp;
- cmd_string[3]=*(cp+1);
- cmd_string[7]=opINPUT_DEVICE;
- cmd_string[8]=GET_TYPEMODE;
- cmd_string[10]=sensor_port;
- cmd_string[11]=GV0(0x00); //global var
- cmd_string[12]=GV0(0x01); //global var
+ len=btcmd::direct<2,0>(cmd_string,DIRECT_COMMAND_REPLY,BT_next_id(ev3),
+                        btcmd::op(opINPUT_DEVICE),btcmd::lc0(GET_TYPEMODE),btcmd::lc0(0),btcmd::lc0(sensor_port),
+                        btcmd::gv0(0x00),btcmd::gv0(0x01));	// <-- type, mode
 
  fprintf(stderr,"BT_get_type_mode command string:\n");
- for(int i=0; i<13; i++)
+ for(int i=0; i<len; i++)
  {
   fprintf(stderr,"%X, ",cmd_string[i]&0xff);
  }
  fprintf(stderr,"\n");
 
- write(*socket_id,&cmd_string[0],13);
- read(*socket_id,&reply[0],1023);
+ BT_exchange(ev3,&cmd_string[0],len,&reply[0],1024);
 
  fprintf(stderr,"BT_get_type_mode response string:\n");
  for(int i=0; i<7; i++)
@@ -854,11 +982,11 @@ void BT_get_type_mode(char sensor_port){
 
  printf("type: %d, mode: %d\n", reply[5], reply[6]);
 
- message_id_counter++;
+ BT_stats_end(0);
 }
 
 
-int BT_read_touch_sensor(char sensor_port){
+int EV3_read_touch_sensor(BT_ev3 *ev3, char sensor_port){
  ////////////////////////////////////////////////////////////////////////////////////////////////
  // Reads the value from the touch sensor.
  //
@@ -870,59 +998,46 @@ int BT_read_touch_sensor(char sensor_port){
  //          0 if touch sensor is not pushed
  //          -1 if EV3 returned an error response
  //////////////////////////////////////////////////////////////////////////////////////////////////
- void *p;
+ BT_stats_begin(BT_CALL_READ_TOUCH_SENSOR);
  char reply[1024];
- unsigned char *cp;
- unsigned char cmd_string[15]={0x0D,0x00, 0x00,0x00, 0x00,  0x01,0x00,  0x00,    0x00,       0x00,    0x00,  0x00,  0x00,   0x00,     0x00 };
- //                          |length-2| | cnt_id | |type| | header |   |cmd|  |sensor cmd | |layer|  |port| |type| |mode| |data set| |global var addr|
+ unsigned char cmd_string[15];
+ int len;
 
  if (sensor_port>8)
  {
   fprintf(stderr,"BT_read_touch_sensor: Invalid port id value\n");
-  return(-1);
+  return(BT_stats_end(-1));
  }
 
- // Set message count id
- p=(void *)&message_id_counter;
- cp=(unsigned char *)p;
- cmd_string[2]=*cp;
- cmd_string[3]=*(cp+1);
-
- cmd_string[7]=opINPUT_DEVICE;
- cmd_string[8]=LC0(READY_PCT);
- cmd_string[10]=sensor_port;
- cmd_string[11]=LC0(0x10); //type
- cmd_string[13]=LC0(0x01); //data set
- cmd_string[14]=GV0(0x00); //global var
+ len=btcmd::direct<1,0>(cmd_string,DIRECT_COMMAND_REPLY,BT_next_id(ev3),
+                        btcmd::op(opINPUT_DEVICE),btcmd::lc0(READY_PCT),btcmd::lc0(0),btcmd::lc0(sensor_port),
+                        btcmd::lc0(0x10),btcmd::lc0(0x00),btcmd::lc0(0x01),btcmd::gv0(0x00));	// <-- type, mode, data set, global var
 
 #ifdef __BT_debug
  fprintf(stderr,"BT_read_touch_sensor command string:\n");
- for(int i=0; i<15; i++)
+ for(int i=0; i<len; i++)
  {
   fprintf(stderr,"%X, ",cmd_string[i]&0xff);
  }
  fprintf(stderr,"\n");
 #endif
 
- write(*socket_id,&cmd_string[0],15);
- read(*socket_id,&reply[0],1023);
-
- message_id_counter++;
+ BT_exchange(ev3,&cmd_string[0],len,&reply[0],1024);
 
  if (reply[4]==0x02){
 #ifdef __BT_debug
   fprintf(stderr,"BT_touch_sensor(): Command successful\n");
 #endif
-  return(reply[5]!=0);
+  return(BT_stats_end(reply[5]!=0));
  }
  else{
   fprintf(stderr,"BT_touch_sensor(): Command failed\n");
-  return(-1);
+  return(BT_stats_end(-1));
  }
 }
 
 
-int BT_read_colour_sensor(char sensor_port){
+int EV3_read_colour_sensor(BT_ev3 *ev3, char sensor_port){
  ////////////////////////////////////////////////////////////////////////////////////////////////
  //
  // Reads the value from the colour sensor using the indexed colour method provided by Lego. 
@@ -947,46 +1062,31 @@ int BT_read_colour_sensor(char sensor_port){
  //  6    White
  //  7    Brown
  //////////////////////////////////////////////////////////////////////////////////////////////////
- void *p;
+ BT_stats_begin(BT_CALL_READ_COLOUR_SENSOR);
  char reply[1024];
- memset(&reply[0],0,1024);
- unsigned char *cp;
- unsigned char cmd_string[15]={0x0D,0x00, 0x00,0x00, 0x00,  0x01,0x00,  0x00,    0x00,       0x00,    0x00,  0x00,  0x00,   0x00,     0x00 };
- //                          |length-2| | cnt_id | |type| | header |   |cmd|  |sensor cmd | |layer|  |port| |type| |mode| |data set| |global var addr|
+ unsigned char cmd_string[15];
+ int len;
 
  if (sensor_port>8)
  {
   fprintf(stderr,"BT_read_colour_sensor: Invalid port id value\n");
-  return(-1);
+  return(BT_stats_end(-1));
  }
 
- // Set message count id
- p=(void *)&message_id_counter;
- cp=(unsigned char *)p;
- cmd_string[2]=*cp;
- cmd_string[3]=*(cp+1);
-
- cmd_string[7]=opINPUT_DEVICE;
- cmd_string[8]=LC0(READY_RAW);
- cmd_string[10]=sensor_port;
- cmd_string[11]=LC0(29); //type
- cmd_string[12]=LC0(0x02); //mode
- cmd_string[13]=LC0(0x01); //data set
- cmd_string[14]=GV0(0x00); //global var
+ len=btcmd::direct<1,0>(cmd_string,DIRECT_COMMAND_REPLY,BT_next_id(ev3),
+                        btcmd::op(opINPUT_DEVICE),btcmd::lc0(READY_RAW),btcmd::lc0(0),btcmd::lc0(sensor_port),
+                        btcmd::lc0(EV3_COLOUR),btcmd::lc0(0x02),btcmd::lc0(0x01),btcmd::gv0(0x00));	// <-- type, mode, data set, global var
 
 #ifdef __BT_debug
  fprintf(stderr,"BT_read_colour_sensor command string:\n");
- for(int i=0; i<15; i++)
+ for(int i=0; i<len; i++)
  {
   fprintf(stderr,"%X, ",cmd_string[i]&0xff);
  }
  fprintf(stderr,"\n");
 #endif
 
- write(*socket_id,&cmd_string[0],15);
- read(*socket_id,&reply[0],1023);
-
- message_id_counter++;
+ BT_exchange(ev3,&cmd_string[0],len,&reply[0],1024);
 
  if (reply[4]==0x02){
 #ifdef __BT_debug
@@ -996,11 +1096,11 @@ int BT_read_colour_sensor(char sensor_port){
  else{
   fprintf(stderr,"BT_colour_sensor(): Command failed\n");
  }
- return reply[5];
+ return BT_stats_end(reply[5]);
 }
 
 
-int BT_read_colour_sensor_RGB(char sensor_port, int RGB[3]){
+int EV3_read_colour_sensor_RGB(BT_ev3 *ev3, char sensor_port, int RGB[3]){
  ////////////////////////////////////////////////////////////////////////////////////////////////
  //
  // Reads the value from the colour sensor returning an RGB colour triplet.
@@ -1022,53 +1122,34 @@ int BT_read_colour_sensor_RGB(char sensor_port, int RGB[3]){
  //          -1 if EV3 returned an error response
  //           0 on success
  //////////////////////////////////////////////////////////////////////////////////////////////////
- void *p;
+ BT_stats_begin(BT_CALL_READ_COLOUR_SENSOR_RGB);
  unsigned char reply[1024];
- memset(&reply[0],0,1024); 
- unsigned char *cp;
  uint32_t R=0, G=0, B=0;
- double normalized;
-
- unsigned char cmd_string[17]={0x00,0x00, 0x00,0x00, 0x00,  0x0C,0x00,  0x00,    0x00,       0x00,    0x00,  0x00,  0x00,   0x00,     0x00, 0x00, 0x00};
- //                          |length-2| | cnt_id | |type| | header |   |cmd|  |sensor cmd | |layer|  |port| |type| |mode| |data set| |global var addr|
+ unsigned char cmd_string[17];
+ int len;
 
 
  if (sensor_port>8)
  {
   fprintf(stderr,"BT_read_colour_sensor_RGB: Invalid port id value\n");
-  return(-1);
+  return(BT_stats_end(-1));
  }
 
- cmd_string[0]=LC0(15);
- // Set message count id
- p=(void *)&message_id_counter;
- cp=(unsigned char *)p;
- cmd_string[2]=*cp;
- cmd_string[3]=*(cp+1);
-
- cmd_string[7]=opINPUT_DEVICE;
- cmd_string[8]=LC0(READY_RAW);
- cmd_string[10]=sensor_port;
- cmd_string[11]=LC0(29); //type
- cmd_string[12]=LC0(0x04); //mode
- cmd_string[13]=LC0(3); //data set
- cmd_string[14]=GV0(0x00); //global var
- cmd_string[15]=GV0(0x04);
- cmd_string[16]=GV0(0x08);
+ len=btcmd::direct<12,0>(cmd_string,DIRECT_COMMAND_REPLY,BT_next_id(ev3),
+                         btcmd::op(opINPUT_DEVICE),btcmd::lc0(READY_RAW),btcmd::lc0(0),btcmd::lc0(sensor_port),
+                         btcmd::lc0(EV3_COLOUR),btcmd::lc0(0x04),btcmd::lc0(3),	// <-- type, mode, data set
+                         btcmd::gv0(0x00),btcmd::gv0(0x04),btcmd::gv0(0x08));
 
 #ifdef __BT_debug
  fprintf(stderr,"BT_read_colour_sensor_RGB command string:\n");
- for(int i=0; i<17; i++)
+ for(int i=0; i<len; i++)
  {
   fprintf(stderr,"%X, ",cmd_string[i]&0xff);
  }
  fprintf(stderr,"\n");
 #endif
 
- write(*socket_id,&cmd_string[0],17);
- read(*socket_id,&reply[0],1023);
-
- message_id_counter++;
+ BT_exchange(ev3,&cmd_string[0],len,&reply[0],1024);
 
  if (reply[4]==0x02){
 #ifdef __BT_debug
@@ -1112,13 +1193,13 @@ int BT_read_colour_sensor_RGB(char sensor_port, int RGB[3]){
  }
  else{
   fprintf(stderr,"BT_colour_sensor_RGB(): Command failed\n");
-  return(-1);
+  return(BT_stats_end(-1));
  }
- return (0);
+ return (BT_stats_end(0));
 }
 
 
-int BT_read_ultrasonic_sensor(char sensor_port){
+int EV3_read_ultrasonic_sensor(BT_ev3 *ev3, char sensor_port){
  ////////////////////////////////////////////////////////////////////////////////////////////////
  //
  // Reads the value from ultrasonic sensor and returns distance in mm to any object in front of the sensor.
@@ -1130,48 +1211,32 @@ int BT_read_ultrasonic_sensor(char sensor_port){
  // Returns: distance in mm
  //          -1 if EV3 returned an error response
  //////////////////////////////////////////////////////////////////////////////////////////////////
- void *p;
+ BT_stats_begin(BT_CALL_READ_ULTRASONIC_SENSOR);
  unsigned char reply[1024];
- memset(&reply[0],0,1024);
- unsigned char *cp;
-
- unsigned char cmd_string[15]={0x00,0x00, 0x00,0x00, 0x00,  0x01,0x00,  0x00,    0x00,       0x00,    0x00,  0x00,  0x00,   0x00,     0x00};
- //                          |length-2| | cnt_id | |type| | header |   |cmd|  |sensor cmd | |layer|  |port| |type| |mode| |data set| |global var addr|
+ unsigned char cmd_string[15];
+ int len;
 
 
  if (sensor_port>8)
  {
   fprintf(stderr,"BT_read_ultrasonic_sensor: Invalid port id value\n");
-  return(-1);
+  return(BT_stats_end(-1));
  }
 
- cmd_string[0]=LC0(13);
- // Set message count id
- p=(void *)&message_id_counter;
- cp=(unsigned char *)p;
- cmd_string[2]=*cp;
- cmd_string[3]=*(cp+1);
-
- cmd_string[7]=opINPUT_DEVICE;
- cmd_string[8]=LC0(READY_RAW);
- cmd_string[10]=sensor_port;
- cmd_string[11]=LC0(30); //type
- cmd_string[13]=LC0(0x01); //data set
- cmd_string[14]=GV0(0x00); //global var
+ len=btcmd::direct<1,0>(cmd_string,DIRECT_COMMAND_REPLY,BT_next_id(ev3),
+                        btcmd::op(opINPUT_DEVICE),btcmd::lc0(READY_RAW),btcmd::lc0(0),btcmd::lc0(sensor_port),
+                        btcmd::lc0(30),btcmd::lc0(0x00),btcmd::lc0(0x01),btcmd::gv0(0x00));	// <-- type, mode, data set, global var
 
 #ifdef __BT_debug
  fprintf(stderr,"BT_read_ultrasonic_sensor command string\n");
- for(int i=0; i<15; i++)
+ for(int i=0; i<len; i++)
  {
   fprintf(stderr,"%X, ",cmd_string[i]&0xff);
  }
  fprintf(stderr,"\n");
 #endif
 
- write(*socket_id,&cmd_string[0],15);
- read(*socket_id,&reply[0],1023);
-
- message_id_counter++;
+ BT_exchange(ev3,&cmd_string[0],len,&reply[0],1024);
 
  if (reply[4]==0x02){
 #ifdef __BT_debug
@@ -1180,12 +1245,12 @@ int BT_read_ultrasonic_sensor(char sensor_port){
  }
  else{
   fprintf(stderr,"BT_ultrasonic_sensor: Command failed\n");
-  return(-1);
+  return(BT_stats_end(-1));
  }
- return (reply[5]);
+ return (BT_stats_end(reply[5]));
 }
 
-int BT_read_colour_RGBraw_NXT(char sensor_port, int *R, int *G, int *B, int *A)
+int EV3_read_colour_RGBraw_NXT(BT_ev3 *ev3, char sensor_port, int *R, int *G, int *B, int *A)
 {
     ////////////////////////////////////////////////////////////////////////////////////////////
     //
@@ -1213,39 +1278,27 @@ int BT_read_colour_RGBraw_NXT(char sensor_port, int *R, int *G, int *B, int *A)
     // Returns: -1 if something went wrong
     //           1 on success
     ////////////////////////////////////////////////////////////////////////////////////////////
+ BT_stats_begin(BT_CALL_READ_COLOUR_RGBRAW_NXT);
     
- void *p;
  unsigned char reply[1024];
- unsigned char *cp;
  int16_t r,g,b,a;
  int cmdlen;
  int replen;
+ unsigned char cmd_string[17];
 
- // Reset the reply message buffer
- memset(&reply[0],0,1024);
  r=g=b=0;
- 
- // Pre-defined command sequence for reading the gyro sensor's angle and rate 
- unsigned char CMD_READ_COLOUR_RGBRAW[17]={0x0F,0x00,0x8E,0x00,0x00,0x0C,0x00,0x99,0x1C,0x00,0x00,0x1D,0x04,0x03,0x60,0x64,0x68};     // Pre-defined as per the ev3_dc library
-
- cmdlen=CMD_READ_COLOUR_RGBRAW[0]+2;
- unsigned char cmd_string[1024];
- memcpy(&cmd_string[0],&CMD_READ_COLOUR_RGBRAW[0],cmdlen);
 
  if (sensor_port>4)
  {
   fprintf(stderr,"BT_read_colour_RGBraw(): Invalid port id value\n");
-  return(-1);
+  return(BT_stats_end(-1));
  }
 
- // Set message count id            // Message id count is kept in an int variable, but it has to be stuffed in little endian format, 
- p=(void *)&message_id_counter;     // so the code here stuffs the counter in the right order in the string, lowest byte first
- cp=(unsigned char *)p;
- cmd_string[2]=*(cp);
- cmd_string[3]=*(cp+1);
- cmd_string[10]=sensor_port;         // Sensor port
- cmd_string[11]=0x04;		         // Set type to NXT color sensor
- cmd_string[12]=0x05;		         // Set NXT sensor mode 5 RGB+A
+ // Command sequence as per the ev3_dc library - raw read of NXT colour sensor (type 4) in mode 5 (RGB+A)
+ cmdlen=btcmd::direct<12,0>(cmd_string,DIRECT_COMMAND_REPLY,BT_next_id(ev3),
+                            btcmd::op(opINPUT_DEVICE),btcmd::lc0(READY_RAW),btcmd::lc0(0),btcmd::lc0(sensor_port),
+                            btcmd::lc0(0x04),btcmd::lc0(0x05),btcmd::lc0(3),	// <-- type, mode, data set
+                            btcmd::gv0(0x00),btcmd::gv0(0x04),btcmd::gv0(0x08));
 
  #ifdef __BT_debug
  fprintf(stderr,"BT_read_colour_RGBraw_NXT() command string\n");
@@ -1256,9 +1309,7 @@ int BT_read_colour_RGBraw_NXT(char sensor_port, int *R, int *G, int *B, int *A)
  fprintf(stderr,"\n");
 #endif
 
- write(*socket_id,&cmd_string[0],cmdlen);
- while(read(*socket_id,&reply[0],1023)==0);       // Wait for a reply!
- message_id_counter++;
+ BT_exchange(ev3,&cmd_string[0],cmdlen,&reply[0],1024);
  
  if (reply[4]==0x02){
   r=*((int16_t *)&reply[5]);                      // Unpack return data and copy to destination (int) variables
@@ -1284,13 +1335,13 @@ int BT_read_colour_RGBraw_NXT(char sensor_port, int *R, int *G, int *B, int *A)
  }
  else{
   fprintf(stderr,"BT_read_color_RGBraw(): Command failed\n");
-  return(-1);
+  return(BT_stats_end(-1));
  }
- return(1); 
+ return(BT_stats_end(1)); 
 }
 
 
-int BT_read_gyro(char sensor_port, int reset, int *angle, int *rate){
+int EV3_read_gyro(BT_ev3 *ev3, char sensor_port, int reset, int *angle, int *rate){
  ////////////////////////////////////////////////////////////////////////////////////////////////
  //
  // Updates the current angle and reate of change according to the gyro sensor on the robot. 
@@ -1311,36 +1362,26 @@ int BT_read_gyro(char sensor_port, int reset, int *angle, int *rate){
  // Returns: 1 on success
  //          -1 if EV3 returned an error response
  //////////////////////////////////////////////////////////////////////////////////////////////////
- void *p;
+ BT_stats_begin(BT_CALL_READ_GYRO);
  unsigned char reply[1024];
- unsigned char *cp;
  int ang=0;
  int rat=0;
  int cmdlen;
  int replen;
-
- // Reset the reply message buffer
- memset(&reply[0],0,1024);
- 
- // Pre-defined command sequence for reading the gyro sensor's angle and rate 
- unsigned char CMD_READ_GYRO_ANGRATE[17]={0x0F,0x00,0x00,0x00,0x00,0x80,0x00,0x99,0x1C,0x00,0x01,0x81,0x20,0x03,0x02,0x60,0x64};
-
- cmdlen=CMD_READ_GYRO_ANGRATE[0]+2;
- unsigned char cmd_string[1024];
- memcpy(&cmd_string[0],&CMD_READ_GYRO_ANGRATE[0],cmdlen);
+ unsigned char cmd_string[17];
 
  if (sensor_port>4)
  {
   fprintf(stderr,"BT_read_gyro_sensor(): Invalid port id value\n");
-  return(-1);
+  return(BT_stats_end(-1));
  }
 
- // Set message count id            // Message id count is kept in an int variable, but it has to be stuffed in little endian format, 
- p=(void *)&message_id_counter;     // so the code here stuffs the counter in the right order in the string, lowest byte first
- cp=(unsigned char *)p;
- cmd_string[2]=*(cp);
- cmd_string[3]=*(cp+1);
- cmd_string[10]=sensor_port;         // Port
+ // Command sequence for reading the gyro sensor's angle and rate (type 32, mode 3, two values). Only the
+ // 8 bytes of global space the two values need are requested, so the reply stays short.
+ cmdlen=btcmd::direct<8,0>(cmd_string,DIRECT_COMMAND_REPLY,BT_next_id(ev3),
+                           btcmd::op(opINPUT_DEVICE),btcmd::lc0(READY_RAW),btcmd::lc0(0),btcmd::lc0(sensor_port),
+                           btcmd::lc1(EV3_GYRO),btcmd::lc0(3),btcmd::lc0(2),	// <-- type, mode, data set
+                           btcmd::gv0(0x00),btcmd::gv0(0x04));
 
 #ifdef __BT_debug
  fprintf(stderr,"BT_read_gyro_sensor() command string\n");
@@ -1351,14 +1392,12 @@ int BT_read_gyro(char sensor_port, int reset, int *angle, int *rate){
  fprintf(stderr,"\n");
 #endif
 
- write(*socket_id,&cmd_string[0],cmdlen);
- while(read(*socket_id,&reply[0],1023)==0);       // Wait for a reply!
- message_id_counter++;
+ BT_exchange(ev3,&cmd_string[0],cmdlen,&reply[0],1024);
  
  if (reply[4]==0x02){
   ang=*((int *)&reply[5]);
-  if (reset>0) ref_angle=ang;
-  ang=ang-ref_angle;
+  if (reset>0) ev3->ref_angle=ang;
+  ang=ang-ev3->ref_angle;
   rat=*((int *)&reply[9]);    
   
   *(angle)=ang;
@@ -1378,13 +1417,13 @@ int BT_read_gyro(char sensor_port, int reset, int *angle, int *rate){
  }
  else{
   fprintf(stderr,"BT_read_gyro_sensor(): Command failed\n");
-  return(-1);
+  return(BT_stats_end(-1));
  }
- return(1);
+ return(BT_stats_end(1));
 }
 
 
-int BT_play_sound_file(const char *path, int volume){
+int EV3_play_sound_file(BT_ev3 *ev3, const char *path, int volume){
  ////////////////////////////////////////////////////////////////////////////////////////////////
  //
  // Plays the sound at the specified path, the file path should not include the extension.
@@ -1395,11 +1434,10 @@ int BT_play_sound_file(const char *path, int volume){
  // Returns: success code on successfull execution
  //          error code on error
  //////////////////////////////////////////////////////////////////////////////////////////////////
+ BT_stats_begin(BT_CALL_PLAY_SOUND_FILE);
 
- void *p;
  char reply[1024];
  memset(&reply[0],0,1024);
- unsigned char *cp;
  int msg_length=0;
  int path_len=0;
  path_len=strnlen(path, 1011);
@@ -1409,10 +1447,7 @@ int BT_play_sound_file(const char *path, int volume){
  cmd_string[0]=LX_byte1(12+path_len+1-2); //length-2
  cmd_string[1]=LX_byte2(12+path_len+1-2); //length-2
  // Set message count id
- p=(void *)&message_id_counter;
- cp=(unsigned char *)p;
- cmd_string[2]=*cp;
- cmd_string[3]=*(cp+1);
+ BT_stamp(ev3,&cmd_string[0]);
 
  cmd_string[4]=0; //command type - with reply
  cmd_string[5]=0; //global and local memory
@@ -1435,9 +1470,7 @@ int BT_play_sound_file(const char *path, int volume){
  fprintf(stderr,"\n");
 #endif
 
- write(*socket_id,&cmd_string[0],12+path_len+1);
- read(*socket_id,&reply[0],1023);
- message_id_counter++;
+ BT_actuate(ev3,&cmd_string[0],12+path_len+1,&reply[0],1024);
 
  if (reply[4]==0x02){
   fprintf(stderr,"BT_play_sound_file(): Command successful\n");
@@ -1457,106 +1490,44 @@ int BT_play_sound_file(const char *path, int volume){
    fprintf(stderr,"%X, ",reply[i]&0xff);
   }
   fprintf(stderr,"\n");
-  return(-1);
+  return(BT_stats_end(-1));
  }
- return (0);
+ return (BT_stats_end(0));
 }
 
 
-//TODO: add the ability to read long directories that cannot be finished in one read
-int BT_list_files(char *path, char **msg_reply){
+int EV3_list_files(BT_ev3 *ev3, char *path, char **msg_reply){
  ////////////////////////////////////////////////////////////////////////////////////////////////
  //
  // Reads the directory contents at the null-terminated path.
  //
- // Inputs: path - null-terminated path, with maximum length of 1012 bytes including the nullbyte
+ // Inputs: path - null-terminated path, with maximum length of 1011 bytes not including the nullbyte
  //         msg_reply - memory will be allocated by list_files to hold the response,
  //         the response string contains subdirectories/files specified by path delimeted by '\n'
  //         the calling code is responsible for freeing the memory from msg_reply
  //
+ // Long directories are read in as many pieces as needed, see BT_list_dir() for a parsed listing.
+ //
  // Returns: success code on successfull execution
  //          error code on error
  //////////////////////////////////////////////////////////////////////////////////////////////////
+ BT_stats_begin(BT_CALL_LIST_FILES);
+ BT_text text={NULL,0,0};
+ int status;
 
- void *p;
- int i;
- char reply[1024];
- memset(reply,0,1024);
- unsigned char *cp;
- unsigned int msg_length=0;
- int path_len=0;
- path_len=strnlen(path, 1011);
- unsigned char cmd_string[1024];
- memset(cmd_string,0,1024);
-
- cmd_string[0]=LX_byte1(8+path_len-2+1); //length-2
- cmd_string[1]=LX_byte2(8+path_len-2+1); //length-2
- // Set message count id
- p=(void *)&message_id_counter;
- cp=(unsigned char *)p;
- cmd_string[2]=*cp;
- cmd_string[3]=*(cp+1);
-
- cmd_string[4]=SYSTEM_COMMAND_REPLY; //type
- cmd_string[5]=LIST_FILES; //system_cmd
- cmd_string[6]=LX_byte1(1012); //max bytes to read
- cmd_string[7]=LX_byte2(1012);
- for (i=0; i<path_len; i++){
-   cmd_string[i+8]=path[i];
- }
- cmd_string[8+path_len]='\0';
-
-#ifdef __BT_debug
- fprintf(stderr,"BT_list_files command string\n");
- for(i=0; i<8+path_len+1; i++)
+ *msg_reply=NULL;
+ status=BT_fetch(ev3,"BT_list_files",LIST_FILES,CONTINUE_LIST_FILES,path,BT_text_sink,&text,NULL);
+ if (status!=SUCCESS||BT_text_sink(&text,(const unsigned char *)"",1)<0)
  {
-  fprintf(stderr,"%X, ",cmd_string[i]&0xff);
- }
- fprintf(stderr,"\n");
-#endif
-
- write(*socket_id,&cmd_string[0],8+path_len+1);
- read(*socket_id,&reply,1023);
-
- message_id_counter++;
-
- if (reply[4]==SYSTEM_REPLY){
-  msg_length |= (unsigned char)reply[1];
-  msg_length<<=8;
-  msg_length |= (unsigned char)reply[0];
-  msg_length += 2;
-#ifdef __BT_debug
-  fprintf(stderr,"BT_list_files(): Command successful\n");
-  fprintf(stderr,"BT_list_files response string:\n");
-  for(int i=0; i<msg_length; i++)
-  {
-   fprintf(stderr,"%X, ",reply[i]&0xff);
-  }
-  fprintf(stderr,"\n");
-#endif
-  *msg_reply=(char *)calloc(msg_length-11, sizeof(char));
-  if (*msg_reply == NULL){
-    perror("calloc");
-    return(-1);
-  }
-
-  if (reply[6] == SUCCESS || reply[6] == END_OF_FILE){
-    strncpy(*msg_reply, &reply[12], msg_length-11);
-  }
-  else {
-    return reply[6];
-  }
-  fprintf(stderr,"\n");
- }
- else{
-  fprintf(stderr,"BT_list_files: Command failed\n");
-  return(reply[4]);
+  free(text.data);
+  return(BT_stats_end(status!=SUCCESS?status:-1));
  }
- return (reply[6]);
+ *msg_reply=text.data;
+ return(BT_stats_end(SUCCESS));
 }
 
 
-int BT_upload_file(char const *dest, char const *src){
+int EV3_upload_file(BT_ev3 *ev3, char const *dest, char const *src){
  ////////////////////////////////////////////////////////////////////////////////////////////////
  //
  // Upload the file at src on the PC to dest on EV3 brick.
@@ -1569,182 +1540,17 @@ int BT_upload_file(char const *dest, char const *src){
  //         the files should be placed inside a subfolder so that they will be visible in the EV3 display.
  //         The path will be truncated at 1011 bytes, not including the null-byte.
  //
+ // The file is sent with BT_UPLOAD_WINDOW chunks in flight, see BT_upload_file_windowed().
  //
  // Returns: success code on successfull execution
  //          error code on error
  //////////////////////////////////////////////////////////////////////////////////////////////////
-
- FILE *fp;
- void *p;
- char buffer[PARTITION_SIZE];
- int i, size, remainder, n;
- char reply[1024];
- memset(&reply[0],0,1024);
- unsigned char *cp;
- const char *p1="/home/root/lms2012/apps";
- const char *p2="/home/root/lms2012/prjs";
- const char *p3="/home/root/lms2012/tools";
-
- int path_len=0;
- unsigned int msg_length=0;
- int handle;
-
- unsigned char cmd_string[1024];
- memset(&cmd_string[0],0,1024);
- struct stat st;
-
- if ((dest[0] == '/') && (strncmp(p1, dest, strlen(p1)) != 0) && (strncmp(p2, dest, strlen(p2)) != 0) && (strncmp(p3, dest, strlen(p3)) != 0)){
-   fprintf(stderr, "Absolute destination path should begin with /home/root/lms2012/app, /home/root/lms2012/prjs or /home/root/lms2012/tools\n");
-   return(-1);
- }
-
- path_len=strnlen(dest, 1011);
-
- stat(src, &st);
- size=st.st_size;
-
- cmd_string[0]=LX_byte1(10+path_len-2+1); //length-2
- cmd_string[1]=LX_byte2(10+path_len-2+1); //length-2
- // Set message count id
- p=(void *)&message_id_counter;
- cp=(unsigned char *)p;
- cmd_string[2]=*cp;
- cmd_string[3]=*(cp+1);
-
- cmd_string[4]=SYSTEM_COMMAND_REPLY; //type
- cmd_string[5]=BEGIN_DOWNLOAD; //system_cmd
- cmd_string[6]=LX_byte1(size); //file size
- cmd_string[7]=LX_byte2(size);
- cmd_string[8]=LX_byte3(size);
- cmd_string[9]=LX_byte4(size);
- for (i=0; i<path_len; i++){
-   cmd_string[i+10]=dest[i];
- }
- cmd_string[10+path_len]='\0';
-
-#ifdef __BT_debug
- fprintf(stderr,"BT_upload_file command string\n");
- for(i=0; i<10+path_len+1; i++)
- {
-  fprintf(stderr,"%X, ",cmd_string[i]&0xff);
- }
- fprintf(stderr,"\n");
-#endif
-
- write(*socket_id,&cmd_string[0],10+path_len+1); //this will return a handle to the file
- read(*socket_id,&reply[0],1023);
-
- message_id_counter++;
-
- if (reply[4]==SYSTEM_REPLY){
-  msg_length = (unsigned char)reply[1];
-  msg_length<<=8;
-  msg_length |= (unsigned char)reply[0];
-  msg_length += 2;
-#ifdef __BT_debug
-  fprintf(stderr,"BT_upload_file response string:\n");
-  for(int i=0; i<msg_length; i++)
-  {
-   fprintf(stderr,"%X, ",reply[i]&0xff);
-  }
-  fprintf(stderr,"\n");
-#endif
-  if (reply[6] == SUCCESS){
-    fprintf(stderr,"BT_upload_file(): Command successful\n");
-    handle=reply[8];
-  }
-  else {
-    return reply[6];
-  }
-  fprintf(stderr,"\n");
- }
- else{
-  fprintf(stderr,"BT_upload_file: Command failed\n");
-  return(reply[4]);
- }
-
- if((fp = fopen(src, "rb")) == NULL) {
-  perror(src);
-  return(-1);
- }
-
- remainder = size > PARTITION_SIZE ? PARTITION_SIZE : size;
- while (remainder > 0){
-   memset(&cmd_string[0],0,1024);
-
-   n = fread(buffer, 1, remainder, fp);
-   cmd_string[0]=LX_byte1(7+remainder-2); //length-2
-   cmd_string[1]=LX_byte2(7+remainder-2); //length-2
-   // Set message count id
-   p=(void *)&message_id_counter;
-   cp=(unsigned char *)p;
-   cmd_string[2]=*cp;
-   cmd_string[3]=*(cp+1);
-
-   cmd_string[4]=SYSTEM_COMMAND_REPLY; //type
-   cmd_string[5]=CONTINUE_DOWNLOAD; //system_cmd
-   cmd_string[6]=LX_byte1(handle); //handle
-   for (i=0; i<remainder; i++){
-     cmd_string[i+7]=buffer[i];
-   }
-
-#ifdef __BT_debug
-   fprintf(stderr,"BT_upload_file command string\n");
-   for(i=0; i<7+remainder; i++)
-   {
-     fprintf(stderr,"%X, ",cmd_string[i]&0xff);
-   }
-   fprintf(stderr,"\n");
-#endif
-
-   write(*socket_id,&cmd_string[0],7+remainder);
-   read(*socket_id,&reply[0],1023);
-
-   message_id_counter++;
-
-   if (reply[4]==SYSTEM_REPLY){
-    msg_length = (unsigned char)reply[1];
-    msg_length<<=8;
-    msg_length |= (unsigned char)reply[0];
-    msg_length += 2;
-#ifdef __BT_debug
-    fprintf(stderr,"BT_upload_file response string:\n");
-    for(int i=0; i<msg_length; i++)
-    {
-      fprintf(stderr,"%X, ",reply[i]&0xff);
-    }
-    fprintf(stderr,"\n");
-#endif
-    if (reply[6] == SUCCESS){
-#ifdef __BT_debug
-      fprintf(stderr,"BT_upload_file(): Command successful\n");
-#endif
-    }
-    else if (reply[6] == END_OF_FILE){
-#ifdef __BT_debug
-      fprintf(stderr,"BT_upload_file(): Command completed\n");
-#endif
-    }
-    else {
-      return reply[6];
-    }
-    fprintf(stderr,"\n");
-   }
-   else{
-#ifdef __BT_debug
-    fprintf(stderr,"BT_upload_file: Command failed\n");
-#endif
-    return(reply[4]);
-   }
-   size-=n;
-   remainder = size > PARTITION_SIZE ? PARTITION_SIZE : size;
- }
- fclose(fp);
- return (reply[6]);
+ BT_stats_begin(BT_CALL_UPLOAD_FILE);
+ return(BT_stats_end(EV3_upload_file_windowed(ev3,dest,src,BT_UPLOAD_WINDOW,NULL)));
 }
 
 
-int BT_set_LED_colour(int colour){
+int EV3_set_LED_colour(BT_ev3 *ev3, int colour){
  ////////////////////////////////////////////////////////////////////////////////////////////////
  //
  // Set the LED around the EV3 buttons to specified colour.
@@ -1756,43 +1562,31 @@ int BT_set_LED_colour(int colour){
  // Returns: success code on successfull execution
  //          error code on error
  //////////////////////////////////////////////////////////////////////////////////////////////////
+ BT_stats_begin(BT_CALL_SET_LED_COLOUR);
 
- unsigned char cmd_string[10]={0x00,0x00, 0x00,0x00, 0x00,  0x00,0x00,  0x00,    0x00,      0x00};
- //                          |length-2| | cnt_id | |type| | header |   |cmd|  |ui cmd | |colour|
-
- void *p;
- unsigned char *cp;
+ unsigned char cmd_string[10];
+ int len;
  char reply[1024];
- memset(&reply[0],0,1024);
 
  if (colour != LED_BLACK && colour != LED_GREEN && colour != LED_RED && colour != LED_ORANGE && colour != LED_GREEN_FLASH && 
     colour != LED_RED_FLASH && colour != LED_ORANGE_FLASH && colour != LED_GREEN_PULSE && colour != LED_ORANGE_PULSE){
     fprintf(stderr,"BT_set_LED_colour: Invalid colour value\n");
-    return(-1);
+    return(BT_stats_end(-1));
  }
 
- p=(void *)&message_id_counter;
- cp=(unsigned char *)p;
- cmd_string[0]=LC0(8);
- cmd_string[2]=*cp;
- cmd_string[3]=*(cp+1);
- cmd_string[7]=opUI_WRITE;
- cmd_string[8]=LED;
- cmd_string[9]=colour;
+ len=btcmd::direct<0,0>(cmd_string,DIRECT_COMMAND_REPLY,BT_next_id(ev3),
+                        btcmd::op(opUI_WRITE),btcmd::lc0(LED),btcmd::lc0(colour));
 
 #ifdef __BT_debug
  fprintf(stderr,"BT_set_LED_colour command string\n");
- for(int i=0; i<10; i++)
+ for(int i=0; i<len; i++)
  {
   fprintf(stderr,"%X, ",cmd_string[i]&0xff);
  }
  fprintf(stderr,"\n");
 #endif
 
- write(*socket_id,&cmd_string[0],10);
- read(*socket_id,&reply[0],1023);
-
- message_id_counter++;
+ BT_actuate(ev3,&cmd_string[0],len,&reply[0],1024);
 
 #ifdef __BT_debug
   fprintf(stderr,"BT_set_LED_colour(): response string\n");
@@ -1810,13 +1604,13 @@ int BT_set_LED_colour(int colour){
  }
  else{
   fprintf(stderr,"BT_set_LED_colour: Command failed\n");
-  return(-1);
+  return(BT_stats_end(-1));
  }
- return (0);
+ return (BT_stats_end(0));
 }
 
 
-int BT_draw_image_from_file(int colour, int x_0, int y_0, const char *file_path){
+int EV3_draw_image_from_file(BT_ev3 *ev3, int colour, int x_0, int y_0, const char *file_path){
  ////////////////////////////////////////////////////////////////////////////////////////////////
  //
  // Display the image at specified file path on display starting at x_0, y_0. The file should be
@@ -1830,9 +1624,8 @@ int BT_draw_image_from_file(int colour, int x_0, int y_0, const char *file_path)
  // Returns: success code on successfull execution
  //          error code on error
  //////////////////////////////////////////////////////////////////////////////////////////////////
+ BT_stats_begin(BT_CALL_DRAW_IMAGE_FROM_FILE);
 
- void *p;
- unsigned char *cp;
  int i;
  char reply[1024];
  memset(&reply[0],0,1024);
@@ -1845,26 +1638,23 @@ int BT_draw_image_from_file(int colour, int x_0, int y_0, const char *file_path)
 
  if (x_0 < 0 || x_0 > 177){
     fprintf(stderr,"BT_draw_image_file: Invalid x_0 coordinate\n");
-    return(-1);
+    return(BT_stats_end(-1));
  }
 
  if (y_0 < 0 || y_0 > 127){
     fprintf(stderr,"BT_draw_image_file: Invalid y_0 coordinate\n");
-    return(-1);
+    return(BT_stats_end(-1));
  }
 
  if (colour != 0 && colour != 1){
     fprintf(stderr,"BT_draw_image_file: Invalid colour\n");
-    return(-1);
+    return(BT_stats_end(-1));
  }
 
  cmd_string[0]=LX_byte1(20+path_len-2+1); //length-2
  cmd_string[1]=LX_byte2(20+path_len-2+1); //length-2
 
- p=(void *)&message_id_counter;
- cp=(unsigned char *)p;
- cmd_string[2]=*cp;
- cmd_string[3]=*(cp+1);
+ BT_stamp(ev3,&cmd_string[0]);
  cmd_string[7]=opUI_DRAW;
  cmd_string[8]=BMPFILE;
  cmd_string[9]=LC1_byte0(); //colour
@@ -1892,10 +1682,7 @@ int BT_draw_image_from_file(int colour, int x_0, int y_0, const char *file_path)
  fprintf(stderr,"\n");
 #endif
 
- write(*socket_id,&cmd_string[0],20+path_len+1);
- read(*socket_id,&reply[0],1023);
-
- message_id_counter++;
+ BT_actuate(ev3,&cmd_string[0],20+path_len+1,&reply[0],1024);
 
 #ifdef __BT_debug
   fprintf(stderr,"BT_draw_image_from_file(): response string\n");
@@ -1913,13 +1700,13 @@ int BT_draw_image_from_file(int colour, int x_0, int y_0, const char *file_path)
  }
  else{
   fprintf(stderr,"BT_draw_image_file: Command failed\n");
-  return(-1);
+  return(BT_stats_end(-1));
  }
- return (0);
+ return (BT_stats_end(0));
 }
 
 
-int BT_store_current_display(int no){
+int EV3_store_current_display(BT_ev3 *ev3, int no){
  ////////////////////////////////////////////////////////////////////////////////////////////////
  //
  // Store the current display, can be used to restore the display to the current state using
@@ -1930,37 +1717,25 @@ int BT_store_current_display(int no){
  // Returns: success code on successfull execution
  //          error code on error
  //////////////////////////////////////////////////////////////////////////////////////////////////
+ BT_stats_begin(BT_CALL_STORE_CURRENT_DISPLAY);
 
- unsigned char cmd_string[10]={0x00,0x00, 0x00,0x00, 0x00,  0x00,0x00,  0x00,    0x00,      0x00};
- //                          |length-2| | cnt_id | |type| | header |   |cmd|  |ui cmd |    |no|
-
- void *p;
- unsigned char *cp;
+ unsigned char cmd_string[10];
+ int len;
  char reply[1024];
- memset(&reply[0],0,1024);
 
- p=(void *)&message_id_counter;
- cp=(unsigned char *)p;
- cmd_string[0]=LC0(8);
- cmd_string[2]=*cp;
- cmd_string[3]=*(cp+1);
- cmd_string[7]=opUI_DRAW;
- cmd_string[8]=STORE;
- cmd_string[9]=no;
+ len=btcmd::direct<0,0>(cmd_string,DIRECT_COMMAND_REPLY,BT_next_id(ev3),
+                        btcmd::op(opUI_DRAW),btcmd::lc0(STORE),btcmd::lc0(no));
 
 #ifdef __BT_debug
  fprintf(stderr,"BT_set_current_display command string\n");
- for(int i=0; i<10; i++)
+ for(int i=0; i<len; i++)
  {
   fprintf(stderr,"%X, ",cmd_string[i]&0xff);
  }
  fprintf(stderr,"\n");
 #endif
 
- write(*socket_id,&cmd_string[0],10);
- read(*socket_id,&reply[0],1023);
-
- message_id_counter++;
+ BT_actuate(ev3,&cmd_string[0],len,&reply[0],1024);
 
 #ifdef __BT_debug
   fprintf(stderr,"BT_set_current_display(): response string\n");
@@ -1978,13 +1753,13 @@ int BT_store_current_display(int no){
  }
  else{
   fprintf(stderr,"BT_set_current_display: Command failed\n");
-  return(-1);
+  return(BT_stats_end(-1));
  }
- return (0);
+ return (BT_stats_end(0));
 }
 
 
-int BT_restore_previous_display(int no){
+int EV3_restore_previous_display(BT_ev3 *ev3, int no){
  ////////////////////////////////////////////////////////////////////////////////////////////////
  //
  // Restore the display to the one stored at no set by call to store_current_display.
@@ -1995,39 +1770,26 @@ int BT_restore_previous_display(int no){
  // Returns: success code on successfull execution
  //          error code on error
  //////////////////////////////////////////////////////////////////////////////////////////////////
+ BT_stats_begin(BT_CALL_RESTORE_PREVIOUS_DISPLAY);
 
- unsigned char cmd_string[12]={0x00,0x00, 0x00,0x00, 0x00,  0x00,0x00,  0x00,    0x00,      0x00};
- //                          |length-2| | cnt_id | |type| | header |   |cmd|  |ui cmd |    |no|
-
- void *p;
- unsigned char *cp;
+ unsigned char cmd_string[12];
+ int len;
  char reply[1024];
- memset(&reply[0],0,1024);
 
- p=(void *)&message_id_counter;
- cp=(unsigned char *)p;
- cmd_string[0]=LC0(10);
- cmd_string[2]=*cp;
- cmd_string[3]=*(cp+1);
- cmd_string[7]=opUI_DRAW;
- cmd_string[8]=RESTORE;
- cmd_string[9]=no;
- cmd_string[10]=opUI_DRAW;;
- cmd_string[11]=UPDATE;
+ len=btcmd::direct<0,0>(cmd_string,DIRECT_COMMAND_REPLY,BT_next_id(ev3),
+                        btcmd::op(opUI_DRAW),btcmd::lc0(RESTORE),btcmd::lc0(no),
+                        btcmd::op(opUI_DRAW),btcmd::lc0(UPDATE));	// <-- refresh the display
 
 #ifdef __BT_debug
  fprintf(stderr,"BT_restore_previous_display command string\n");
- for(int i=0; i<12; i++)
+ for(int i=0; i<len; i++)
  {
   fprintf(stderr,"%X, ",cmd_string[i]&0xff);
  }
  fprintf(stderr,"\n");
 #endif
 
- write(*socket_id,&cmd_string[0],12);
- read(*socket_id,&reply[0],1023);
-
- message_id_counter++;
+ BT_actuate(ev3,&cmd_string[0],len,&reply[0],1024);
 
 #ifdef __BT_debug
   fprintf(stderr,"BT_restore_previous_display(): response string\n");
@@ -2045,7 +1807,4380 @@ int BT_restore_previous_display(int no){
  }
  else{
   fprintf(stderr,"BT_restore_previous_display: Command failed\n");
+  return(BT_stats_end(-1));
+ }
+ return (BT_stats_end(0));
+}
+
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Pipelined command engine (Oct 2026)
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+static int BT_write_all(int fd, const unsigned char *buf, int len)
+{
+ // write() on a stream socket may accept only part of the buffer, keep going until all of it is out
+ int done=0, n;
+ while (done<len)
+ {
+  n=write(fd,buf+done,len-done);
+  if (n<0&&errno==EINTR) continue;
+  if (n<=0) return(-1);
+  done+=n;
+ }
+ return(done);
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Reply framing
+//
+// RFCOMM is a byte stream - one read() may return part of a reply, or the end of one reply and the start of the
+// next. Every reply starts with its own length (2 bytes, little endian, not counting the length field), so we read
+// from the socket into rx_buf in large pieces and cut complete frames out of it. Bytes past the end of a frame stay
+// in rx_buf for the next call.
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+static int BT_fill_rx(BT_ev3 *ev3, int need)
+{
+ // Make sure at least 'need' bytes are waiting in rx_buf. Returns 0 on success, -1 if the connection was
+ // closed or failed.
+ int n;
+ if (ev3->rx_end-ev3->rx_start>=need) return(0);
+ if (ev3->rx_start>0)
+ {
+  memmove(&ev3->rx_buf[0],&ev3->rx_buf[ev3->rx_start],ev3->rx_end-ev3->rx_start);
+  ev3->rx_end-=ev3->rx_start;
+  ev3->rx_start=0;
+ }
+ while (ev3->rx_end<need)
+ {
+  n=read(ev3->socket,&ev3->rx_buf[ev3->rx_end],BT_RX_BUFFER-ev3->rx_end);
+  if (n<0&&errno==EINTR) continue;
+  if (n<0&&(errno==EAGAIN||errno==EWOULDBLOCK))
+  {
+   // The I/O thread keeps the socket non-blocking; a frame longer than rx_buf is read to its end all the same
+   struct pollfd pfd={ev3->socket,POLLIN,0};
+   poll(&pfd,1,-1);
+   continue;
+  }
+  if (n<=0) return(-1);
+  ev3->rx_end+=n;
+ }
+ return(0);
+}
+
+static int BT_rx_pump(BT_ev3 *ev3)
+{
+ // One read() into rx_buf, for callers that already know the socket is readable. Returns the number of
+ // bytes read (0 if there was nothing after all), or -1 if the connection was closed or failed.
+ int n;
+ if (ev3->rx_start>0)
+ {
+  memmove(&ev3->rx_buf[0],&ev3->rx_buf[ev3->rx_start],ev3->rx_end-ev3->rx_start);
+  ev3->rx_end-=ev3->rx_start;
+  ev3->rx_start=0;
+ }
+ do n=read(ev3->socket,&ev3->rx_buf[ev3->rx_end],BT_RX_BUFFER-ev3->rx_end); while (n<0&&errno==EINTR);
+ if (n<0&&(errno==EAGAIN||errno==EWOULDBLOCK)) return(0);
+ if (n<=0) return(-1);
+ ev3->rx_end+=n;
+ return(n);
+}
+
+static int BT_rx_has_frame(BT_ev3 *ev3)
+{
+ // True if BT_read_frame() can return a frame without blocking
+ int len;
+ if (ev3->rx_end-ev3->rx_start<2) return(0);
+ len=(ev3->rx_buf[ev3->rx_start]|(ev3->rx_buf[ev3->rx_start+1]<<8))+2;
+ return(ev3->rx_end-ev3->rx_start>=len||len>BT_RX_BUFFER);
+}
+
+int EV3_read_frame(BT_ev3 *ev3, unsigned char *frame, int maxlen)
+{
+ //////////////////////////////////////////////////////////////////////////////////////////////////////
+ // Read exactly one reply frame from the EV3: the 2-byte length field, then exactly that many bytes.
+ // Extra bytes that arrived with it are kept for the next call.
+ //
+ // Inputs: frame - buffer for the reply (length field included)
+ //         maxlen - size of the buffer. Longer replies are truncated, but the rest of the frame is
+ //                  still consumed so the next call starts on a frame boundary.
+ //
+ // Returns: the number of bytes stored in frame
+ //          -1 if the connection was closed or failed
+ //////////////////////////////////////////////////////////////////////////////////////////////////////
+ int len, stored, chunk;
+
+ if (maxlen<2||BT_fill_rx(ev3,2)<0) return(-1);
+ len=ev3->rx_buf[ev3->rx_start]|(ev3->rx_buf[ev3->rx_start+1]<<8);
+ frame[0]=ev3->rx_buf[ev3->rx_start];
+ frame[1]=ev3->rx_buf[ev3->rx_start+1];
+ ev3->rx_start+=2;
+
+ // Copy the body out in buffer-sized pieces, so frames longer than rx_buf are still handled
+ stored=2;
+ while (len>0)
+ {
+  if (BT_fill_rx(ev3,1)<0) return(-1);
+  chunk=MIN(len,ev3->rx_end-ev3->rx_start);
+  if (stored<maxlen) memcpy(frame+stored,&ev3->rx_buf[ev3->rx_start],MIN(chunk,maxlen-stored));
+  stored=MIN(stored+chunk,maxlen);
+  ev3->rx_start+=chunk;
+  len-=chunk;
+ }
+ BT_capture_frame(ev3,BT_CAPTURE_RX,frame,stored);
+ BT_stats_received(ev3,frame,stored);
+
+#ifdef __BT_debug
+ fprintf(stderr,"BT_read_frame reply string:\n");
+ for(int i=0; i<stored; i++)
+ {
+  fprintf(stderr,"%X, ",frame[i]&0xff);
+ }
+ fprintf(stderr,"\n");
+#endif
+ return(stored);
+}
+
+int BT_attach(int fd)
+{
+ //////////////////////////////////////////////////////////////////////////////////////////////////////
+ // Use an already connected stream socket to talk to the EV3 instead of opening a new RFCOMM link.
+ // This is how a stand-in brick (see btcomm_emu.h) is plugged in for testing and benchmarking
+ // without hardware. BT_close() will close the socket.
+ //
+ // Input: A connected socket descriptor
+ // Returns: 0 on success
+ //          -1 otherwise
+ //////////////////////////////////////////////////////////////////////////////////////////////////////
+ if (fd<0)
+ {
+  fprintf(stderr,"BT_attach: Invalid socket descriptor\n");
+  return(-1);
+ }
+ BT_ev3_init(&BT_default_ev3,fd);
+ return(0);
+}
+
+BT_ev3 *EV3_attach(int fd)
+{
+ //////////////////////////////////////////////////////////////////////////////////////////////////////
+ // Same as BT_attach(), but returns a new connection instead of using the default one.
+ //
+ // Input: A connected socket descriptor
+ // Returns: the connection, to be released with EV3_close() (which closes the socket)
+ //          NULL otherwise
+ //////////////////////////////////////////////////////////////////////////////////////////////////////
+ BT_ev3 *ev3;
+ if (fd<0)
+ {
+  fprintf(stderr,"EV3_attach: Invalid socket descriptor\n");
+  return(NULL);
+ }
+ ev3=BT_ev3_new();
+ if (ev3==NULL) return(NULL);
+ BT_ev3_init(ev3,fd);
+ return(ev3);
+}
+
+static int BT_next_id(BT_ev3 *ev3)
+{
+ // Take the next message id. Calls may come from several threads while the I/O thread runs (it stamps its own
+ // ids then, and hands the counter back when it lets go of the connection), so the counter is only ever
+ // touched atomically.
+ return(__atomic_fetch_add(&ev3->msg_id,1,__ATOMIC_RELAXED)&0xFFFF);
+}
+
+static void BT_stamp(BT_ev3 *ev3, unsigned char *cmd_string)
+{
+ // Write the next message id into the cnt_id field (bytes 2-3) of a command
+ int msg_id=BT_next_id(ev3);
+
+ cmd_string[2]=LX_byte1(msg_id);
+ cmd_string[3]=LX_byte2(msg_id);
+}
+
+int EV3_submit(BT_ev3 *ev3, unsigned char *cmd_string, int len)
+{
+ //////////////////////////////////////////////////////////////////////////////////////////////////////
+ // Send a fully formatted command string to the EV3 without waiting for the reply.
+ //
+ // The connection's message counter is stamped into the cnt_id field (bytes 2-3) and the counter is
+ // advanced, so the caller does not need to fill in those bytes. The length field must already be
+ // correct. If the command type asks for a reply, a slot is reserved for it and the reply must later
+ // be collected with BT_wait_reply().
+ //
+ // Inputs: cmd_string - the command (length, cnt_id, type, header, payload)
+ //         len - total number of bytes in cmd_string
+ //
+ // Returns: the message id to pass to BT_wait_reply() (0-65535)
+ //          -1 on error, or if BT_MAX_INFLIGHT replies are already outstanding
+ //////////////////////////////////////////////////////////////////////////////////////////////////////
+ if (len<5||len>1024)
+ {
+  fprintf(stderr,"BT_submit: Invalid command length\n");
   return(-1);
  }
- return (0);
+ if (__atomic_load_n(&ev3->io_running,__ATOMIC_ACQUIRE))
+ {
+  fprintf(stderr,"BT_submit: The I/O thread owns the connection, use BT_io_submit() instead\n");
+  return(-1);
+ }
+
+ BT_stamp(ev3,cmd_string);
+ return(BT_send_tracked(ev3,cmd_string,len));
+}
+
+static int BT_send_tracked(BT_ev3 *ev3, const unsigned char *cmd_string, int len)
+{
+ // Sends a command whose cnt_id field is already filled in, and reserves a reply slot for it if the
+ // command type asks for a reply. Returns the message id, or -1 on error.
+ int msg_id, slot=-1;
+ int wants_reply=(cmd_string[4]&0x80)==0;
+
+ msg_id=cmd_string[2]|(cmd_string[3]<<8);
+ if (wants_reply)
+ {
+  for (int i=0; i<BT_MAX_INFLIGHT; i++)
+   if (ev3->pending[i].state==BT_SLOT_FREE) {slot=i; break;}
+  if (slot<0)
+  {
+   fprintf(stderr,"BT_submit: Too many requests in flight\n");
+   return(-1);
+  }
+ }
+
+#ifdef __BT_debug
+ fprintf(stderr,"BT_submit command string:\n");
+ for(int i=0; i<len; i++)
+ {
+  fprintf(stderr,"%X, ",cmd_string[i]&0xff);
+ }
+ fprintf(stderr,"\n");
+#endif
+
+ if (BT_write_all(ev3->socket,cmd_string,len)<0)
+ {
+  perror("BT_submit");
+  return(-1);
+ }
+ BT_capture_frame(ev3,BT_CAPTURE_TX,cmd_string,len);
+ BT_stats_sent(ev3,cmd_string,len);
+
+ if (wants_reply)
+ {
+  ev3->pending[slot].msg_id=msg_id;
+  ev3->pending[slot].state=BT_SLOT_PENDING;
+  ev3->pending[slot].len=0;
+  ev3->n_inflight++;
+ }
+ return(msg_id);
+}
+
+static int BT_exchange(BT_ev3 *ev3, const void *cmd, int len, void *reply, int maxlen)
+{
+ // One complete round trip for the BT_* calls above: send a command that already carries its message id,
+ // then wait for the reply with that id. Going through the reply slots (rather than reading the socket
+ // directly) means a blocking call can safely be mixed with requests issued through BT_submit(). While
+ // the I/O thread is running the command is handed to it instead, so any thread may call this.
+ // Commands that do not ask for a reply return 0 as soon as they are sent.
+ // Returns the reply length. On error returns -1 and clears the start of the reply so that the caller's
+ // status check (reply[4]) fails.
+ int msg_id, rlen=-1;
+
+ if (__atomic_load_n(&ev3->io_running,__ATOMIC_ACQUIRE)) rlen=BT_io_exchange(ev3,(const unsigned char *)cmd,len,(unsigned char *)reply,maxlen);
+ else
+ {
+  msg_id=BT_send_tracked(ev3,(const unsigned char *)cmd,len);
+  if (msg_id>=0&&(((const unsigned char *)cmd)[4]&0x80)) return(0);
+  if (msg_id>=0) rlen=EV3_wait_reply(ev3,msg_id,(unsigned char *)reply,maxlen);
+ }
+ BT_stats_check(reply,rlen);
+ if (rlen<0) memset(reply,0,MIN(maxlen,8));
+ return(rlen);
+}
+
+static void BT_file_reply(BT_ev3 *ev3, const unsigned char *frame, int len)
+{
+ // Store a reply in the slot of the request it answers, so its owner can collect it
+ int id=frame[2]|(frame[3]<<8), owner=-1;
+ for (int i=0; i<BT_MAX_INFLIGHT; i++)
+  if (ev3->pending[i].state==BT_SLOT_PENDING&&ev3->pending[i].msg_id==id) {owner=i; break;}
+ if (owner<0)
+ {
+#ifdef __BT_debug
+  fprintf(stderr,"BT_wait_reply: Dropping reply for unknown message id %d\n",id);
+#endif
+  return;
+ }
+ memcpy(&ev3->pending[owner].data[0],frame,len);
+ ev3->pending[owner].len=len;
+ ev3->pending[owner].state=BT_SLOT_DONE;
+}
+
+int EV3_wait_reply(BT_ev3 *ev3, int msg_id, unsigned char *reply, int maxlen)
+{
+ //////////////////////////////////////////////////////////////////////////////////////////////////////
+ // Wait for the reply to a command sent with BT_submit(). Replies to other outstanding commands that
+ // arrive first are stored and handed out when they are asked for, so replies may be collected in
+ // any order.
+ //
+ // Inputs: msg_id - the value returned by BT_submit()
+ //         reply - buffer for the reply (length, cnt_id, reply type, data)
+ //         maxlen - size of the reply buffer, longer replies are truncated
+ //
+ // Returns: the number of bytes stored in reply
+ //          -1 if msg_id is not outstanding, or on a communication error
+ //////////////////////////////////////////////////////////////////////////////////////////////////////
+ int slot=-1, len;
+ unsigned char frame[BT_MAX_REPLY];
+
+ if (__atomic_load_n(&ev3->io_running,__ATOMIC_ACQUIRE))
+ {
+  fprintf(stderr,"BT_wait_reply: The I/O thread owns the connection, use BT_future_wait() instead\n");
+  return(-1);
+ }
+
+ for (int i=0; i<BT_MAX_INFLIGHT; i++)
+  if (ev3->pending[i].state!=BT_SLOT_FREE&&ev3->pending[i].msg_id==msg_id) {slot=i; break;}
+ if (slot<0)
+ {
+  fprintf(stderr,"BT_wait_reply: No request with message id %d in flight\n",msg_id);
+  return(-1);
+ }
+
+ while (ev3->pending[slot].state!=BT_SLOT_DONE)
+ {
+  len=EV3_read_frame(ev3,&frame[0],BT_MAX_REPLY);
+  if (len<5)
+  {
+   fprintf(stderr,"BT_wait_reply: Connection lost while waiting for message id %d\n",msg_id);
+   return(-1);
+  }
+  BT_file_reply(ev3,&frame[0],len);
+ }
+
+ len=MIN(ev3->pending[slot].len,maxlen);
+ memcpy(reply,&ev3->pending[slot].data[0],len);
+ ev3->pending[slot].state=BT_SLOT_FREE;
+ ev3->n_inflight--;
+ return(len);
+}
+
+int EV3_inflight(BT_ev3 *ev3)
+{
+ //////////////////////////////////////////////////////////////////////////////////////////////////////
+ // Returns the number of commands sent with BT_submit() whose replies have not been collected yet.
+ //////////////////////////////////////////////////////////////////////////////////////////////////////
+ return(ev3->n_inflight);
+}
+
+int EV3_pump(BT_ev3 *ev3)
+{
+ //////////////////////////////////////////////////////////////////////////////////////////////////////
+ // For event loops: read whatever the socket has to offer, without blocking, and file every
+ // complete reply into the slot of its request. Call it when poll() reports the socket readable
+ // (calling it at other times is harmless). Then BT_reply_ready() tells which replies are in.
+ //
+ // Returns: the number of replies filed, 0 if no reply is complete yet
+ //          -1 if the connection was closed or failed
+ //////////////////////////////////////////////////////////////////////////////////////////////////////
+ unsigned char frame[BT_MAX_REPLY];
+ struct pollfd pfd;
+ int len, n=0;
+
+ if (__atomic_load_n(&ev3->io_running,__ATOMIC_ACQUIRE))
+ {
+  fprintf(stderr,"BT_pump: The I/O thread owns the connection\n");
+  return(-1);
+ }
+ pfd.fd=ev3->socket;
+ pfd.events=POLLIN;
+ if (!BT_rx_has_frame(ev3)&&poll(&pfd,1,0)>0&&BT_rx_pump(ev3)<0) return(-1);
+ while (BT_rx_has_frame(ev3))
+ {
+  len=EV3_read_frame(ev3,&frame[0],BT_MAX_REPLY);
+  if (len<5) return(-1);
+  BT_file_reply(ev3,&frame[0],len);
+  n++;
+ }
+ return(n);
+}
+
+int EV3_reply_ready(BT_ev3 *ev3, int msg_id)
+{
+ //////////////////////////////////////////////////////////////////////////////////////////////////////
+ // Returns: 1 if the reply to msg_id has arrived, and BT_wait_reply() will return it at once
+ //          0 if it has not arrived yet
+ //          -1 if no request with that message id is in flight
+ //////////////////////////////////////////////////////////////////////////////////////////////////////
+ for (int i=0; i<BT_MAX_INFLIGHT; i++)
+  if (ev3->pending[i].state!=BT_SLOT_FREE&&ev3->pending[i].msg_id==msg_id)
+   return(ev3->pending[i].state==BT_SLOT_DONE);
+ return(-1);
+}
+
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Sensor snapshot (Oct 2026)
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+static unsigned char *BT_put_const(unsigned char *p, int v)
+{
+ // Encode a constant parameter in the shortest form that holds it (LC0, LC1, LC2 or LC4)
+ if (v>=-32&&v<=31) *(p++)=LC0(v);
+ else if (v>=-128&&v<=127) {*(p++)=LC1_byte0(); *(p++)=LX_byte1(v);}
+ else if (v>=-32768&&v<=32767) {*(p++)=LC2_byte0(); *(p++)=LX_byte1(v); *(p++)=LX_byte2(v);}
+ else {*(p++)=PRIMPAR_LONG|PRIMPAR_CONST|PRIMPAR_4_BYTES; *(p++)=LX_byte1(v); *(p++)=LX_byte2(v); *(p++)=LX_byte3(v); *(p++)=LX_byte4(v);}
+ return(p);
+}
+
+static unsigned char *BT_put_global(unsigned char *p, int offset)
+{
+ // Encode a global variable reference (GV0 for offsets below 32, GV1 below 256, GV2 otherwise)
+ if (offset<32) *(p++)=GV0(offset);
+ else if (offset<256) {*(p++)=GV1_byte0(offset); *(p++)=LX_byte1(offset);}
+ else {*(p++)=PRIMPAR_LONG|PRIMPAR_VARIABEL|PRIMPAR_GLOBAL|PRIMPAR_2_BYTES; *(p++)=LX_byte1(offset); *(p++)=LX_byte2(offset);}
+ return(p);
+}
+
+static int BT_get_int32(const unsigned char *p)
+{
+ return((int)((uint32_t)p[0]|((uint32_t)p[1]<<8)|((uint32_t)p[2]<<16)|((uint32_t)p[3]<<24)));
+}
+
+// Per sensor kind: opINPUT_DEVICE sub-command, type, mode, number of values, bytes per value
+static const int BT_kind[6][5]={{0,0,0,0,0},
+                                {READY_PCT,16,0,1,1},	// Touch
+                                {READY_RAW,29,2,1,4},	// Colour, indexed
+                                {READY_RAW,29,4,3,4},	// Colour, RGB
+                                {READY_RAW,30,0,1,4},	// Ultrasonic, distance
+                                {READY_RAW,32,3,2,4}};	// Gyro, angle and rate
+
+static int BT_check_map(const BT_port_map *map, const char *caller)
+{
+ for (int port=0; port<4; port++)
+  if (map->sensor[port]<BT_SENSOR_NONE||map->sensor[port]>BT_SENSOR_GYRO)
+  {
+   fprintf(stderr,"%s: Invalid sensor type for port %d\n",caller,port+1);
+   return(-1);
+  }
+ if (map->motors>15||map->motors<0)
+ {
+  fprintf(stderr,"%s: Invalid motor port value\n",caller);
+  return(-1);
+ }
+ return(0);
+}
+
+static int BT_layout(const BT_port_map *map, int samples, int i, int offset[4], int tacho_offset[4])
+{
+ // Works out where the values of sample i (out of samples) go in the global variable area, and returns
+ // the size of that area. The EV3 wants 32-bit globals aligned and placed before 8-bit ones, so the
+ // 32-bit values (raw sensor readings and tacho counts) of every sample come first, and the touch
+ // sensors (8-bit PCT reads) of every sample last.
+ int size32=0, size8=0, k;
+
+ for (int port=0; port<4; port++)
+ {
+  k=map->sensor[port];
+  offset[port]=-1;
+  if (k!=BT_SENSOR_NONE&&BT_kind[k][4]==4) {offset[port]=size32; size32+=4*BT_kind[k][3];}
+ }
+ for (int motor=0; motor<4; motor++)
+ {
+  tacho_offset[motor]=-1;
+  if (map->motors&(1<<motor)) {tacho_offset[motor]=size32; size32+=4;}
+ }
+ for (int port=0; port<4; port++)
+ {
+  k=map->sensor[port];
+  if (k!=BT_SENSOR_NONE&&BT_kind[k][4]==1) {offset[port]=samples*size32+i*size8; size8+=BT_kind[k][3];}
+  else if (offset[port]>=0) offset[port]+=i*size32;
+ }
+ for (int motor=0; motor<4; motor++)
+  if (tacho_offset[motor]>=0) tacho_offset[motor]+=i*size32;
+ return(samples*(size32+size8));
+}
+
+static unsigned char *BT_put_reads(unsigned char *cp, const BT_port_map *map, const int offset[4], const int tacho_offset[4])
+{
+ // Emit the opcodes that read every sensor and tacho count in the map into the given globals
+ int k;
+
+ for (int port=0; port<4; port++)
+ {
+  k=map->sensor[port];
+  if (k==BT_SENSOR_NONE) continue;
+  *(cp++)=opINPUT_DEVICE;
+  *(cp++)=LC0(BT_kind[k][0]);
+  *(cp++)=LC0(0);				// <-- layer
+  *(cp++)=LC0(port);
+  cp=BT_put_const(cp,BT_kind[k][1]);		// <-- type
+  *(cp++)=LC0(BT_kind[k][2]);			// <-- mode
+  *(cp++)=LC0(BT_kind[k][3]);			// <-- number of values
+  for (int v=0; v<BT_kind[k][3]; v++)
+   cp=BT_put_global(cp,offset[port]+v*BT_kind[k][4]);
+ }
+ for (int motor=0; motor<4; motor++)
+ {
+  if (tacho_offset[motor]<0) continue;
+  *(cp++)=opOUTPUT_GET_COUNT;
+  *(cp++)=LC0(0);				// <-- layer
+  *(cp++)=LC0(motor);				// <-- port number (0=A), not the MOTOR_x bit mask
+  cp=BT_put_global(cp,tacho_offset[motor]);
+ }
+ return(cp);
+}
+
+static void BT_get_values(BT_ev3 *ev3, const BT_port_map *map, const unsigned char *gv, const int offset[4],
+                          const int tacho_offset[4], BT_snapshot *snap)
+{
+ // The reverse of BT_put_reads() - unpack the values from the reply's global variable area
+ int off;
+
+ for (int port=0; port<4; port++)
+ {
+  off=offset[port];
+  switch (map->sensor[port])
+  {
+   case BT_SENSOR_TOUCH:
+    snap->touch[port]=(gv[off]!=0);
+    break;
+   case BT_SENSOR_COLOUR:
+    snap->colour[port]=BT_get_int32(gv+off);
+    break;
+   case BT_SENSOR_COLOUR_RGB:
+    for (int c=0; c<3; c++) snap->RGB[port][c]=BT_get_int32(gv+off+4*c);
+    break;
+   case BT_SENSOR_ULTRASONIC:
+    snap->distance[port]=BT_get_int32(gv+off);
+    break;
+   case BT_SENSOR_GYRO:
+    snap->angle[port]=BT_get_int32(gv+off)-ev3->ref_angle;
+    snap->rate[port]=BT_get_int32(gv+off+4);
+    break;
+  }
+ }
+ for (int motor=0; motor<4; motor++)
+  if (tacho_offset[motor]>=0) snap->tacho[motor]=BT_get_int32(gv+tacho_offset[motor]);
+}
+
+int BT_snapshot_init(BT_snapshot_plan *plan, const BT_port_map *map)
+{
+ ////////////////////////////////////////////////////////////////////////////////////////////////
+ //
+ // Prepares the direct command used by BT_read_snapshot(). This works out where each value
+ // will be placed in the global variable area of the reply and builds the command string once,
+ // so each later snapshot only has to stamp in a new message id.
+ //
+ // Inputs: plan - the snapshot plan to fill in
+ //         map - what is plugged into each input port, and which motors to read
+ //
+ // Returns: 0 on success
+ //          -1 if the port map is invalid
+ //////////////////////////////////////////////////////////////////////////////////////////////////
+ unsigned char *cp;
+ int globals;
+
+ if (BT_check_map(map,"BT_snapshot_init")<0) return(-1);
+ memcpy(&plan->map,map,sizeof(BT_port_map));
+ globals=BT_layout(map,1,0,plan->offset,plan->tacho_offset);
+
+ cp=&plan->cmd_string[0];
+ *(cp++)=0x00; *(cp++)=0x00;			// <-- length, filled in below
+ *(cp++)=0x00; *(cp++)=0x00;			// <-- cnt_id, stamped by BT_submit()
+ *(cp++)=DIRECT_COMMAND_REPLY;
+ *(cp++)=LX_byte1(globals);			// <-- header, global variables only
+ *(cp++)=LX_byte2(globals)&0x03;
+ cp=BT_put_reads(cp,map,plan->offset,plan->tacho_offset);
+
+ plan->len=cp-&plan->cmd_string[0];
+ plan->cmd_string[0]=LX_byte1(plan->len-2);
+ plan->cmd_string[1]=LX_byte2(plan->len-2);
+ return(0);
+}
+
+int EV3_read_snapshot(BT_ev3 *ev3, BT_snapshot_plan *plan, BT_snapshot *snap)
+{
+ ////////////////////////////////////////////////////////////////////////////////////////////////
+ //
+ // Reads every sensor and motor count listed in the plan with one round trip to the EV3.
+ //
+ // Inputs: plan - prepared with BT_snapshot_init()
+ //         snap - where the values are returned
+ //
+ // Returns: 0 on success
+ //          -1 if EV3 returned an error response
+ //////////////////////////////////////////////////////////////////////////////////////////////////
+ BT_stats_begin(BT_CALL_READ_SNAPSHOT);
+ unsigned char reply[BT_MAX_REPLY];
+ int len;
+
+ BT_stamp(ev3,&plan->cmd_string[0]);
+ len=BT_exchange(ev3,&plan->cmd_string[0],plan->len,&reply[0],BT_MAX_REPLY);
+ if (EV3_decode_snapshot(ev3,plan,&reply[0],len,snap)<0)
+ {
+  fprintf(stderr,"BT_read_snapshot(): Command failed\n");
+  return(BT_stats_end(-1));
+ }
+ return(BT_stats_end(0));
+}
+
+int EV3_decode_snapshot(BT_ev3 *ev3, const BT_snapshot_plan *plan, const unsigned char *reply, int len, BT_snapshot *snap)
+{
+ ////////////////////////////////////////////////////////////////////////////////////////////////
+ //
+ // Unpacks the reply to a snapshot command that was sent some other way, e.g. through
+ // BT_io_submit().
+ //
+ // Inputs: plan - the plan whose cmd_string was sent
+ //         reply, len - the reply
+ //         snap - where the values are returned
+ //
+ // Returns: 0 on success
+ //          -1 if the reply is an error response, or too short
+ //////////////////////////////////////////////////////////////////////////////////////////////////
+ int globals;
+
+ globals=plan->cmd_string[5]|((plan->cmd_string[6]&0x03)<<8);
+ if (len<5+globals||reply[4]!=DIRECT_REPLY) return(-1);
+ BT_get_values(ev3,&plan->map,&reply[5],plan->offset,plan->tacho_offset,snap);
+ return(0);
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// On-brick sampling (Oct 2026)
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+static int BT_batch_build(BT_batch_plan *plan, int samples)
+{
+ // Build the sampling command for the given number of samples. Returns its length, which may be
+ // over 1024 (the caller then tries fewer samples), or -1 if the globals do not fit.
+ unsigned char cmd[2048];
+ unsigned char *cp=&cmd[0];
+ int offset[4], tacho_offset[4], globals;
+
+ globals=BT_layout(&plan->map,samples,0,offset,tacho_offset);
+ if (globals>1019) return(-1);
+ *(cp++)=0x00; *(cp++)=0x00;			// <-- length, filled in below
+ *(cp++)=0x00; *(cp++)=0x00;			// <-- cnt_id, stamped by BT_submit()
+ *(cp++)=DIRECT_COMMAND_REPLY;
+ *(cp++)=LX_byte1(globals);			// <-- header, 4 bytes of locals for the timer
+ *(cp++)=(LX_byte2(globals)&0x03)|(4<<2);
+ for (int i=0; i<samples&&cp-&cmd[0]<1024; i++)
+ {
+  // Start the period timer, read, then wait for the period to run out - so samples are taken
+  // exactly period_ms apart however long the reads take, and so is the first sample of the
+  // next batch if one is queued right behind this one
+  *(cp++)=opTIMER_WAIT;
+  cp=BT_put_const(cp,plan->period_ms);
+  *(cp++)=LV0(0);
+  BT_layout(&plan->map,samples,i,offset,tacho_offset);
+  cp=BT_put_reads(cp,&plan->map,offset,tacho_offset);
+  *(cp++)=opTIMER_READY;
+  *(cp++)=LV0(0);
+ }
+ plan->len=cp-&cmd[0];
+ if (plan->len<=1024)
+ {
+  memcpy(&plan->cmd_string[0],&cmd[0],plan->len);
+  plan->cmd_string[0]=LX_byte1(plan->len-2);
+  plan->cmd_string[1]=LX_byte2(plan->len-2);
+ }
+ return(plan->len);
+}
+
+int BT_batch_init(BT_batch_plan *plan, const BT_port_map *map, int period_ms, int samples)
+{
+ ////////////////////////////////////////////////////////////////////////////////////////////////
+ //
+ // Prepares a direct command that makes the EV3 itself take a number of samples at a fixed
+ // period, and return all of them in one reply.
+ //
+ // Inputs: plan - the batch plan to fill in
+ //         map - what is plugged into each input port, and which motors to read
+ //         period_ms - time between samples, 1 to 32767 ms
+ //         samples - samples per batch, or 0 for as many as fit in one command
+ //
+ // Returns: the number of samples per batch
+ //          -1 if the port map is invalid, or the requested number of samples does not fit
+ //////////////////////////////////////////////////////////////////////////////////////////////////
+ int offset[4], tacho_offset[4], n;
+
+ if (BT_check_map(map,"BT_batch_init")<0) return(-1);
+ if (period_ms<1||period_ms>32767||samples<0)
+ {
+  fprintf(stderr,"BT_batch_init: Invalid sampling period or number of samples\n");
+  return(-1);
+ }
+ memcpy(&plan->map,map,sizeof(BT_port_map));
+ plan->period_ms=period_ms;
+ n=BT_layout(map,1,0,offset,tacho_offset);
+ if (n==0)
+ {
+  fprintf(stderr,"BT_batch_init: The port map has nothing to read\n");
+  return(-1);
+ }
+ n=samples?samples:1019/n;
+ while (n>0)
+ {
+  int len=BT_batch_build(plan,n);
+  if (len>0&&len<=1024) break;
+  if (samples) n=0;
+  else n--;
+ }
+ if (n==0)
+ {
+  fprintf(stderr,"BT_batch_init: %d samples do not fit in one command\n",samples);
+  return(-1);
+ }
+ plan->samples=n;
+ return(n);
+}
+
+int EV3_read_batch(BT_ev3 *ev3, BT_batch_plan *plan, BT_snapshot *snaps)
+{
+ ////////////////////////////////////////////////////////////////////////////////////////////////
+ //
+ // Has the EV3 take one batch of samples and returns them. This blocks for the whole batch
+ // (samples x period_ms) plus one round trip. To sample continuously, keep two batches in
+ // flight instead (see btcomm.h).
+ //
+ // Inputs: plan - prepared with BT_batch_init()
+ //         snaps - room for plan->samples snapshots, oldest first
+ //
+ // Returns: the number of samples
+ //          -1 if EV3 returned an error response
+ //////////////////////////////////////////////////////////////////////////////////////////////////
+ BT_stats_begin(BT_CALL_READ_BATCH);
+ unsigned char reply[BT_MAX_REPLY];
+ int len;
+
+ BT_stamp(ev3,&plan->cmd_string[0]);
+ len=BT_exchange(ev3,&plan->cmd_string[0],plan->len,&reply[0],BT_MAX_REPLY);
+ if (EV3_decode_batch(ev3,plan,&reply[0],len,snaps)<0)
+ {
+  fprintf(stderr,"BT_read_batch(): Command failed\n");
+  return(BT_stats_end(-1));
+ }
+ return(BT_stats_end(plan->samples));
+}
+
+int EV3_decode_batch(BT_ev3 *ev3, const BT_batch_plan *plan, const unsigned char *reply, int len, BT_snapshot *snaps)
+{
+ ////////////////////////////////////////////////////////////////////////////////////////////////
+ //
+ // Unpacks the reply to a batch command that was sent some other way, e.g. through BT_submit().
+ //
+ // Returns: the number of samples
+ //          -1 if the reply is an error response, or too short
+ //////////////////////////////////////////////////////////////////////////////////////////////////
+ int offset[4], tacho_offset[4], globals;
+
+ globals=plan->cmd_string[5]|((plan->cmd_string[6]&0x03)<<8);
+ if (len<5+globals||reply[4]!=DIRECT_REPLY) return(-1);
+ for (int i=0; i<plan->samples; i++)
+ {
+  BT_layout(&plan->map,plan->samples,i,offset,tacho_offset);
+  BT_get_values(ev3,&plan->map,&reply[5],offset,tacho_offset,&snaps[i]);
+ }
+ return(plan->samples);
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Motor feedback and speed control (Oct 2026)
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+static long long BT_now_ns()
+{
+ struct timespec ts;
+ clock_gettime(CLOCK_MONOTONIC,&ts);
+ return((long long)ts.tv_sec*1000000000LL+ts.tv_nsec);
+}
+
+int EV3_read_motors(BT_ev3 *ev3, char port_ids, BT_motor_state *state)
+{
+ ////////////////////////////////////////////////////////////////////////////////////////////////
+ //
+ // Reads the tacho count and speed of the motors in port_ids with a single command. The
+ // tacho count comes from opOUTPUT_GET_COUNT (degrees since BT_clear_tacho()), the speed
+ // from opOUTPUT_READ, whose own tacho value is relative to the last motor command and is
+ // dropped into a local variable.
+ //
+ // Inputs: port_ids - the motors to read, e.g. MOTOR_A|MOTOR_C
+ //         state - where the values are returned, only the entries for port_ids are set
+ //
+ // Returns: 0 on success
+ //          -1 otherwise
+ //////////////////////////////////////////////////////////////////////////////////////////////////
+ BT_stats_begin(BT_CALL_READ_MOTORS);
+ unsigned char cmd_string[64];
+ unsigned char reply[BT_MAX_REPLY];
+ unsigned char *cp;
+ int offset[4], n=0, globals, len;
+
+ if (port_ids>15||port_ids<1)
+ {
+  fprintf(stderr,"BT_read_motors: Invalid port id value\n");
+  return(BT_stats_end(-1));
+ }
+ for (int motor=0; motor<4; motor++)
+  if (port_ids&(1<<motor)) offset[motor]=4*(n++);
+ globals=5*n;					// <-- counts first, then one speed byte per motor
+
+ cp=&cmd_string[0];
+ *(cp++)=0x00; *(cp++)=0x00;			// <-- length, filled in below
+ *(cp++)=0x00; *(cp++)=0x00;			// <-- cnt_id, stamped below
+ *(cp++)=DIRECT_COMMAND_REPLY;
+ *(cp++)=LX_byte1(globals);			// <-- header, 4 bytes of locals for the dropped value
+ *(cp++)=4<<2;
+ for (int motor=0; motor<4; motor++)
+ {
+  if (!(port_ids&(1<<motor))) continue;
+  *(cp++)=opOUTPUT_GET_COUNT;
+  *(cp++)=LC0(0);				// <-- layer
+  *(cp++)=LC0(motor);				// <-- port number (0=A)
+  *(cp++)=GV0(offset[motor]);
+  *(cp++)=opOUTPUT_READ;
+  *(cp++)=LC0(0);
+  *(cp++)=LC0(motor);
+  *(cp++)=GV0(4*n+offset[motor]/4);		// <-- speed, DATA8
+  *(cp++)=LV0(0);				// <-- tacho since the last command, not needed
+ }
+ len=cp-&cmd_string[0];
+ cmd_string[0]=LX_byte1(len-2);
+ cmd_string[1]=LX_byte2(len-2);
+ BT_stamp(ev3,&cmd_string[0]);
+
+ len=BT_exchange(ev3,&cmd_string[0],len,&reply[0],BT_MAX_REPLY);
+ if (len<5+globals||reply[4]!=DIRECT_REPLY)
+ {
+  fprintf(stderr,"BT_read_motors(): Command failed\n");
+  return(BT_stats_end(-1));
+ }
+ for (int motor=0; motor<4; motor++)
+ {
+  if (!(port_ids&(1<<motor))) continue;
+  state->tacho[motor]=BT_get_int32(&reply[5+offset[motor]]);
+  state->speed[motor]=(signed char)reply[5+4*n+offset[motor]/4];
+ }
+ return(BT_stats_end(0));
+}
+
+int EV3_clear_tacho(BT_ev3 *ev3, char port_ids)
+{
+ ////////////////////////////////////////////////////////////////////////////////////////////////
+ // Sets the tacho count of the motors in port_ids back to 0.
+ //
+ // Returns: 0 on success
+ //          -1 otherwise
+ //////////////////////////////////////////////////////////////////////////////////////////////////
+ BT_stats_begin(BT_CALL_CLEAR_TACHO);
+ char reply[1024];
+ unsigned char cmd_string[10];
+ int len;
+
+ if (port_ids>15||port_ids<1)
+ {
+  fprintf(stderr,"BT_clear_tacho: Invalid port id value\n");
+  return(BT_stats_end(-1));
+ }
+ len=btcmd::direct<0,0>(cmd_string,DIRECT_COMMAND_REPLY,BT_next_id(ev3),
+                        btcmd::op(opOUTPUT_CLR_COUNT),btcmd::lc0(0),btcmd::lc0(port_ids));
+ BT_actuate(ev3,&cmd_string[0],len,&reply[0],1024);
+ if (reply[4]!=0x02)
+ {
+  fprintf(stderr,"BT_clear_tacho(): Command failed\n");
+  return(BT_stats_end(-1));
+ }
+ return(BT_stats_end(0));
+}
+
+void BT_speed_init(BT_speed_ctl *ctl, char port_ids, double kp, double ki, double kd)
+{
+ ////////////////////////////////////////////////////////////////////////////////////////////////
+ // Sets up a speed controller for the motors in port_ids, with all targets at 0 deg/s.
+ //
+ // Inputs: kp - power % per deg/s of speed error
+ //         ki - power % per degree of accumulated error
+ //         kd - power % per deg/s^2 change in measured speed
+ //////////////////////////////////////////////////////////////////////////////////////////////////
+ memset(ctl,0,sizeof(BT_speed_ctl));
+ ctl->motors=port_ids&0x0F;
+ ctl->kp=kp;
+ ctl->ki=ki;
+ ctl->kd=kd;
+}
+
+void BT_speed_set(BT_speed_ctl *ctl, char port_ids, double deg_per_s)
+{
+ // Change the target speed of some of the controlled motors. Safe to call while the controller runs.
+ for (int motor=0; motor<4; motor++)
+  if (port_ids&(1<<motor)) __atomic_store(&ctl->target[motor],&deg_per_s,__ATOMIC_RELAXED);
+}
+
+int EV3_speed_step(BT_ev3 *ev3, BT_speed_ctl *ctl)
+{
+ ////////////////////////////////////////////////////////////////////////////////////////////////
+ //
+ // One control step: read the tacho counts, work out each motor's speed since the last step,
+ // and send new power levels. The first step only takes the reference reading.
+ //
+ // The derivative term works on the measured speed rather than the error, so changing the
+ // target does not kick the motors. While a motor's power is saturated at +/-100 its error is
+ // not accumulated any further, so the integral does not wind up.
+ //
+ // Returns: 0 on success
+ //          -1 otherwise
+ //////////////////////////////////////////////////////////////////////////////////////////////////
+ BT_stats_begin(BT_CALL_SPEED_STEP);
+ BT_motor_state state;
+ unsigned char cmd_string[32];
+ unsigned char *cp;
+ double dt, speed, target, e, integral, out;
+ long long t;
+ int len;
+
+ if (EV3_read_motors(ev3,ctl->motors,&state)<0) return(BT_stats_end(-1));
+ t=BT_now_ns();
+ if (ctl->t_ns==0||t<=ctl->t_ns)
+ {
+  memcpy(&ctl->tacho[0],&state.tacho[0],sizeof(ctl->tacho));
+  ctl->t_ns=t;
+  return(BT_stats_end(0));
+ }
+ dt=(t-ctl->t_ns)*1e-9;
+
+ cp=&cmd_string[0];
+ *(cp++)=0x00; *(cp++)=0x00;			// <-- length, filled in below
+ *(cp++)=0x00; *(cp++)=0x00;			// <-- cnt_id, stamped below
+ *(cp++)=DIRECT_COMMAND_NO_REPLY;
+ *(cp++)=0x00; *(cp++)=0x00;
+ for (int motor=0; motor<4; motor++)
+ {
+  if (!(ctl->motors&(1<<motor))) continue;
+  speed=(state.tacho[motor]-ctl->tacho[motor])/dt;
+  __atomic_load(&ctl->target[motor],&target,__ATOMIC_RELAXED);
+  e=target-speed;
+  integral=ctl->integral[motor]+e*dt;
+  out=ctl->kp*e+ctl->ki*integral-ctl->kd*(speed-ctl->speed[motor])/dt;
+  if (out>100) out=100;
+  else if (out<-100) out=-100;
+  if ((out<100||e<0)&&(out>-100||e>0)) ctl->integral[motor]=integral;
+  ctl->error[motor]=e;
+  ctl->speed[motor]=speed;
+  ctl->tacho[motor]=state.tacho[motor];
+  ctl->power[motor]=(int)(out+(out<0?-0.5:0.5));
+  *(cp++)=opOUTPUT_POWER;
+  *(cp++)=LC0(0);
+  *(cp++)=LC0(1<<motor);
+  *(cp++)=LC1_byte0();
+  *(cp++)=LX_byte1(ctl->power[motor]);
+ }
+ *(cp++)=opOUTPUT_START;
+ *(cp++)=LC0(0);
+ *(cp++)=LC0(ctl->motors);
+ ctl->t_ns=t;
+ len=cp-&cmd_string[0];
+ cmd_string[0]=LX_byte1(len-2);
+ cmd_string[1]=LX_byte2(len-2);
+ BT_stamp(ev3,&cmd_string[0]);
+
+ if (BT_exchange(ev3,&cmd_string[0],len,&cmd_string[0],sizeof(cmd_string))<0)
+ {
+  fprintf(stderr,"BT_speed_step(): Unable to send the power command\n");
+  return(BT_stats_end(-1));
+ }
+ return(BT_stats_end(0));
+}
+
+static void *BT_speed_loop(void *arg)
+{
+ // Body of the controller thread started by EV3_speed_start(): one step per period, on an
+ // absolute schedule so the rate does not drift with the time each step takes
+ BT_speed_ctl *ctl=(BT_speed_ctl *)arg;
+ struct timespec ts;
+ long long next, now;
+
+ next=BT_now_ns();
+ while (!__atomic_load_n(&ctl->stop,__ATOMIC_ACQUIRE))
+ {
+  EV3_speed_step(ctl->ev3,ctl);
+  next+=ctl->period_ms*1000000LL;
+  now=BT_now_ns();
+  if (next<now) next=now;
+  ts.tv_sec=next/1000000000LL;
+  ts.tv_nsec=next%1000000000LL;
+  while (clock_nanosleep(CLOCK_MONOTONIC,TIMER_ABSTIME,&ts,NULL)==EINTR);
+ }
+ return(NULL);
+}
+
+int EV3_speed_start(BT_ev3 *ev3, BT_speed_ctl *ctl, int rate_hz)
+{
+ ////////////////////////////////////////////////////////////////////////////////////////////////
+ // Runs the controller in the background at rate_hz steps per second, until BT_speed_stop().
+ //
+ // Returns: 0 on success
+ //          -1 otherwise
+ //////////////////////////////////////////////////////////////////////////////////////////////////
+ if (rate_hz<1||rate_hz>1000)
+ {
+  fprintf(stderr,"BT_speed_start: The control rate must be in [1, 1000]\n");
+  return(-1);
+ }
+ ctl->ev3=ev3;
+ ctl->period_ms=1000/rate_hz;
+ ctl->stop=0;
+ ctl->started_io=0;
+ ctl->t_ns=0;
+ if (!__atomic_load_n(&ev3->io_running,__ATOMIC_ACQUIRE))
+ {
+  if (EV3_io_start(ev3)<0) return(-1);
+  ctl->started_io=1;
+ }
+ if (pthread_create(&ctl->thread,NULL,BT_speed_loop,ctl)!=0)
+ {
+  fprintf(stderr,"BT_speed_start: Unable to start the controller thread\n");
+  if (ctl->started_io) EV3_io_stop(ev3);
+  ctl->ev3=NULL;
+  return(-1);
+ }
+ return(0);
+}
+
+int BT_speed_stop(BT_speed_ctl *ctl, int brake_mode)
+{
+ ////////////////////////////////////////////////////////////////////////////////////////////////
+ // Stops a controller started with BT_speed_start(), and then the motors it controls.
+ //
+ // Inputs: brake_mode - 0 -> roll to stop, 1 -> active brake
+ //
+ // Returns: 0 on success
+ //          -1 otherwise
+ //////////////////////////////////////////////////////////////////////////////////////////////////
+ BT_ev3 *ev3=ctl->ev3;
+ int ret;
+
+ if (ev3==NULL) return(-1);
+ __atomic_store_n(&ctl->stop,1,__ATOMIC_RELEASE);
+ pthread_join(ctl->thread,NULL);
+ ret=EV3_motor_port_stop(ev3,ctl->motors,brake_mode);
+ if (ctl->started_io) EV3_io_stop(ev3);
+ ctl->ev3=NULL;
+ return(ret);
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Synchronized drive (Oct 2026)
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+static int BT_sync(BT_ev3 *ev3, const char *caller, unsigned char opcode, char lport, char rport, char speed,
+                   int turn, int amount, int brake_mode)
+{
+ // Common part of EV3_drive_sync() and EV3_drive_sync_timed(), which differ only in the opcode
+ char reply[1024];
+ unsigned char cmd_string[24];
+ int len;
+
+ if (speed>100||speed<-100)
+ {
+  fprintf(stderr,"%s: Speed must be in [-100, 100]\n",caller);
+  return(-1);
+ }
+ if (turn>200||turn<-200)
+ {
+  fprintf(stderr,"%s: Turn ratio must be in [-200, 200]\n",caller);
+  return(-1);
+ }
+ if (lport>8||rport>8||lport<1||rport<1||lport==rport||(lport&(lport-1))||(rport&(rport-1)))
+ {
+  fprintf(stderr,"%s: Invalid port id value\n",caller);
+  return(-1);
+ }
+ if (amount<0)
+ {
+  fprintf(stderr,"%s: Step count or time must not be negative\n",caller);
+  return(-1);
+ }
+ if (brake_mode!=0&&brake_mode!=1)
+ {
+  fprintf(stderr,"%s: brake mode must be either 0 or 1\n",caller);
+  return(-1);
+ }
+
+ len=btcmd::direct<0,0>(cmd_string,DIRECT_COMMAND_REPLY,BT_next_id(ev3),
+                        btcmd::op(opcode),btcmd::lc0(0),btcmd::lc0(lport|rport),btcmd::lc1(speed),
+                        btcmd::lc2(turn),btcmd::lc4(amount),btcmd::lc0(brake_mode));
+ BT_actuate(ev3,&cmd_string[0],len,&reply[0],1024);
+ if (reply[4]!=0x02)
+ {
+  fprintf(stderr,"%s(): Command failed\n",caller);
+  return(-1);
+ }
+ return(0);
+}
+
+int EV3_drive_sync(BT_ev3 *ev3, char lport, char rport, char speed, int turn, int degrees, int brake_mode)
+{
+ ////////////////////////////////////////////////////////////////////////////////////////////////
+ // Drive two motors locked together for the given number of degrees (0 = until stopped).
+ // See btcomm.h for the meaning of speed and turn.
+ //
+ // Returns: 0 on success
+ //          -1 otherwise
+ //////////////////////////////////////////////////////////////////////////////////////////////////
+ BT_stats_begin(BT_CALL_DRIVE_SYNC);
+ return(BT_stats_end(BT_sync(ev3,"BT_drive_sync",opOUTPUT_STEP_SYNC,lport,rport,speed,turn,degrees,brake_mode)));
+}
+
+int EV3_drive_sync_timed(BT_ev3 *ev3, char lport, char rport, char speed, int turn, int time_ms, int brake_mode)
+{
+ ////////////////////////////////////////////////////////////////////////////////////////////////
+ // Drive two motors locked together for the given time in ms (0 = until stopped).
+ //
+ // Returns: 0 on success
+ //          -1 otherwise
+ //////////////////////////////////////////////////////////////////////////////////////////////////
+ BT_stats_begin(BT_CALL_DRIVE_SYNC_TIMED);
+ return(BT_stats_end(BT_sync(ev3,"BT_drive_sync_timed",opOUTPUT_TIME_SYNC,lport,rport,speed,turn,time_ms,brake_mode)));
+}
+
+int EV3_motors_busy(BT_ev3 *ev3, char port_ids)
+{
+ ////////////////////////////////////////////////////////////////////////////////////////////////
+ // Check whether any of the motors in port_ids is still running a step or timed command.
+ //
+ // Returns: 1 if busy, 0 if not
+ //          -1 on error
+ //////////////////////////////////////////////////////////////////////////////////////////////////
+ BT_stats_begin(BT_CALL_MOTORS_BUSY);
+ char reply[1024];
+ unsigned char cmd_string[12];
+ int len;
+
+ if (port_ids>15||port_ids<1)
+ {
+  fprintf(stderr,"BT_motors_busy: Invalid port id value\n");
+  return(BT_stats_end(-1));
+ }
+ len=btcmd::direct<1,0>(cmd_string,DIRECT_COMMAND_REPLY,BT_next_id(ev3),
+                        btcmd::op(opOUTPUT_TEST),btcmd::lc0(0),btcmd::lc0(port_ids),btcmd::gv0(0));
+ BT_exchange(ev3,&cmd_string[0],len,&reply[0],1024);
+ if (reply[4]!=0x02)
+ {
+  fprintf(stderr,"BT_motors_busy(): Command failed\n");
+  return(BT_stats_end(-1));
+ }
+ return(BT_stats_end(reply[5]!=0));
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// File transfer (Oct 2026)
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+typedef struct
+{
+ int msg_id;					// Reply slot, when sent with EV3_submit()
+ BT_future *future;				// or the future, when sent through the I/O thread
+ long long t_ns;				// When it was sent
+} BT_ticket;
+
+static int BT_post(BT_ev3 *ev3, unsigned char *cmd_string, int len, BT_ticket *ticket)
+{
+ // Send a command without waiting for its reply, whoever owns the connection. Returns 0, or -1 on error.
+ ticket->t_ns=BT_now_ns();
+ if (__atomic_load_n(&ev3->io_running,__ATOMIC_ACQUIRE))
+ {
+  ticket->future=EV3_io_submit_future(ev3,cmd_string,len);
+  return(ticket->future==NULL?-1:0);
+ }
+ ticket->future=NULL;
+ ticket->msg_id=EV3_submit(ev3,cmd_string,len);
+ return(ticket->msg_id<0?-1:0);
+}
+
+static int BT_collect(BT_ev3 *ev3, BT_ticket *ticket, unsigned char *reply, int maxlen)
+{
+ // Wait for the reply to a command sent with BT_post(). Returns the reply length, or -1.
+ int len;
+ if (ticket->future!=NULL) len=BT_future_wait(ticket->future,reply,maxlen);
+ else len=EV3_wait_reply(ev3,ticket->msg_id,reply,maxlen);
+ BT_stats_check(reply,len);
+ return(len);
+}
+
+static int BT_check_dest(const char *dest)
+{
+ const char *p1="/home/root/lms2012/apps";
+ const char *p2="/home/root/lms2012/prjs";
+ const char *p3="/home/root/lms2012/tools";
+
+ if ((dest[0] == '/') && (strncmp(p1, dest, strlen(p1)) != 0) && (strncmp(p2, dest, strlen(p2)) != 0) && (strncmp(p3, dest, strlen(p3)) != 0)){
+   fprintf(stderr, "Absolute destination path should begin with /home/root/lms2012/app, /home/root/lms2012/prjs or /home/root/lms2012/tools\n");
+   return(-1);
+ }
+ return(0);
+}
+
+static void BT_stats_chunk(BT_transfer_stats *stats, int bytes, long long t0)
+{
+ double us=(BT_now_ns()-t0)/1000.0;
+
+ if (stats==NULL) return;
+ if (stats->chunks==0||us<stats->chunk_us_min) stats->chunk_us_min=us;
+ if (us>stats->chunk_us_max) stats->chunk_us_max=us;
+ stats->chunk_us_avg=(stats->chunk_us_avg*stats->chunks+us)/(stats->chunks+1);
+ stats->chunks++;
+ stats->bytes+=bytes;
+}
+
+static int BT_begin_download(unsigned char *cmd_string, const char *dest, long long size)
+{
+ // Build BEGIN_DOWNLOAD for a file of the given size (the message id is stamped when it is sent)
+ int path_len, len;
+
+ path_len=strnlen(dest,1011);
+ len=10+path_len+1;
+ cmd_string[0]=LX_byte1(len-2);
+ cmd_string[1]=LX_byte2(len-2);
+ cmd_string[4]=SYSTEM_COMMAND_REPLY;
+ cmd_string[5]=BEGIN_DOWNLOAD;
+ cmd_string[6]=LX_byte1(size);			// <-- file size
+ cmd_string[7]=LX_byte2(size);
+ cmd_string[8]=LX_byte3(size);
+ cmd_string[9]=LX_byte4(size);
+ memcpy(&cmd_string[10],dest,path_len);
+ cmd_string[10+path_len]='\0';
+ return(len);
+}
+
+static void BT_continue_download(unsigned char *cmd_string, int handle, int n)
+{
+ // Fill in the header of a CONTINUE_DOWNLOAD whose n payload bytes are already at cmd_string[7]
+ cmd_string[0]=LX_byte1(7+n-2);
+ cmd_string[1]=LX_byte2(7+n-2);
+ cmd_string[4]=SYSTEM_COMMAND_REPLY;
+ cmd_string[5]=CONTINUE_DOWNLOAD;
+ cmd_string[6]=LX_byte1(handle);
+}
+
+static int BT_upload_stream(BT_ev3 *ev3, const char *dest, FILE *fp, long long size, const char *src, int window,
+                            BT_transfer_stats *stats)
+{
+ // The transfer of EV3_upload_file_windowed(), from fp, which holds size bytes and is closed at the end.
+ // src names it in error messages.
+ BT_ticket ticket[BT_MAX_INFLIGHT];
+ int bytes[BT_MAX_INFLIGHT];
+ unsigned char cmd_string[1024];
+ unsigned char reply[BT_MAX_REPLY];
+ long long t_start, left;
+ int handle, len, n, head=0, count=0, status=-1, failed=0;
+
+ if (stats!=NULL) memset(stats,0,sizeof(BT_transfer_stats));
+ t_start=BT_now_ns();
+
+ // Open the file on the brick
+ len=BT_begin_download(&cmd_string[0],dest,size);
+ BT_stamp(ev3,&cmd_string[0]);
+
+ if (BT_exchange(ev3,&cmd_string[0],len,&reply[0],BT_MAX_REPLY)<8||reply[4]!=SYSTEM_REPLY)
+ {
+  fprintf(stderr,"BT_upload_file: Command failed\n");
+  fclose(fp);
+  return(-1);
+ }
+ if (reply[6]!=SUCCESS)
+ {
+  fclose(fp);
+  return(reply[6]);
+ }
+ handle=reply[7];
+ status=SUCCESS;
+
+ // Stream the contents, keeping up to window chunks in flight
+ left=size;
+ while (left>0||count>0)
+ {
+  while (!failed&&left>0&&count<window)
+  {
+   n=fread(&cmd_string[7],1,MIN(left,(long long)PARTITION_SIZE),fp);
+   if (n<=0)
+   {
+    perror(src);
+    failed=1;
+    status=-1;
+    break;
+   }
+   BT_continue_download(&cmd_string[0],handle,n);
+   if (BT_post(ev3,&cmd_string[0],7+n,&ticket[(head+count)%BT_MAX_INFLIGHT])<0)
+   {
+    failed=1;
+    status=-1;
+    break;
+   }
+   bytes[(head+count)%BT_MAX_INFLIGHT]=n;
+   count++;
+   left-=n;
+  }
+  if (failed) left=0;
+  if (count==0) break;
+
+  // Collect the oldest acknowledgement
+  n=BT_collect(ev3,&ticket[head],&reply[0],BT_MAX_REPLY);
+  if (n<7||reply[4]!=SYSTEM_REPLY||(reply[6]!=SUCCESS&&reply[6]!=END_OF_FILE))
+  {
+   if (!failed)
+   {
+    fprintf(stderr,"BT_upload_file: Chunk rejected\n");
+    status=(n>=7&&reply[4]==SYSTEM_REPLY)?reply[6]:-1;
+   }
+   failed=1;
+  }
+  else
+  {
+   BT_stats_chunk(stats,bytes[head],ticket[head].t_ns);
+   if (!failed) status=reply[6];
+  }
+  head=(head+1)%BT_MAX_INFLIGHT;
+  count--;
+ }
+ fclose(fp);
+ EV3_dir_invalidate(ev3,dest);
+ if (stats!=NULL) stats->seconds=(BT_now_ns()-t_start)*1e-9;
+ return(status);
+}
+
+int EV3_upload_file_windowed(BT_ev3 *ev3, const char *dest, const char *src, int window, BT_transfer_stats *stats)
+{
+ ////////////////////////////////////////////////////////////////////////////////////////////////
+ //
+ // Upload the file at src on the PC to dest on the EV3, see BT_upload_file() for the paths.
+ //
+ // After BEGIN_DOWNLOAD has returned a file handle, up to window CONTINUE_DOWNLOAD chunks are
+ // sent before the first acknowledgement is waited for; every acknowledgement lets one more
+ // chunk go. The brick handles the chunks in the order they arrive, so this only removes the
+ // idle time between them. If a chunk is rejected no further chunks are sent, and the ones
+ // already on their way are collected before returning.
+ //
+ // Inputs: window - chunks in flight, 1 to BT_MAX_INFLIGHT
+ //         stats - if not NULL, filled in with the transfer statistics
+ //
+ // Returns: the status of the last reply (SUCCESS or END_OF_FILE when the whole file was sent)
+ //          another status code if the brick rejected the transfer
+ //          -1 on a local or communication error
+ //////////////////////////////////////////////////////////////////////////////////////////////////
+ BT_stats_begin(BT_CALL_UPLOAD_FILE_WINDOWED);
+ FILE *fp;
+ struct stat st;
+
+ if (window<1||window>BT_MAX_INFLIGHT)
+ {
+  fprintf(stderr,"BT_upload_file: The window must be in [1, %d]\n",BT_MAX_INFLIGHT);
+  return(BT_stats_end(-1));
+ }
+ if (BT_check_dest(dest)<0) return(BT_stats_end(-1));
+ if ((fp=fopen(src,"rb"))==NULL||fstat(fileno(fp),&st)<0)
+ {
+  perror(src);
+  if (fp!=NULL) fclose(fp);
+  return(BT_stats_end(-1));
+ }
+ return(BT_stats_end(BT_upload_stream(ev3,dest,fp,st.st_size,src,window,stats)));
+}
+
+static int BT_system_begin(BT_ev3 *ev3, unsigned char command, const char *path, int maxbytes, unsigned char *reply)
+{
+ // Send BEGIN_UPLOAD or BEGIN_GETFILE and wait for the reply. Both replies are laid out as
+ // status, 4-byte file size, handle, payload. Returns the reply length, or -1.
+ unsigned char cmd_string[1024];
+ int path_len, len;
+
+ path_len=strnlen(path,1011);
+ len=8+path_len+1;
+ cmd_string[0]=LX_byte1(len-2);
+ cmd_string[1]=LX_byte2(len-2);
+ cmd_string[4]=SYSTEM_COMMAND_REPLY;
+ cmd_string[5]=command;
+ cmd_string[6]=LX_byte1(maxbytes);		// <-- bytes to read
+ cmd_string[7]=LX_byte2(maxbytes);
+ memcpy(&cmd_string[8],path,path_len);
+ cmd_string[8+path_len]='\0';
+ BT_stamp(ev3,&cmd_string[0]);
+ return(BT_exchange(ev3,&cmd_string[0],len,reply,BT_MAX_REPLY));
+}
+
+static int BT_system_continue(unsigned char *cmd_string, unsigned char command, int handle, int maxbytes)
+{
+ // Build CONTINUE_UPLOAD or CONTINUE_GETFILE (the message id is stamped when it is sent)
+ cmd_string[0]=LX_byte1(9-2);
+ cmd_string[1]=LX_byte2(9-2);
+ cmd_string[4]=SYSTEM_COMMAND_REPLY;
+ cmd_string[5]=command;
+ cmd_string[6]=LX_byte1(handle);
+ cmd_string[7]=LX_byte1(maxbytes);
+ cmd_string[8]=LX_byte2(maxbytes);
+ return(9);
+}
+
+static void BT_close_handle(BT_ev3 *ev3, int handle)
+{
+ // Release a file handle the brick would otherwise keep open. The reply is not checked - the
+ // handle may already have been closed at the end of the file.
+ unsigned char cmd_string[8];
+ unsigned char reply[BT_MAX_REPLY];
+
+ cmd_string[0]=LX_byte1(7-2);
+ cmd_string[1]=LX_byte2(7-2);
+ cmd_string[4]=SYSTEM_COMMAND_REPLY;
+ cmd_string[5]=CLOSE_FILEHANDLE;
+ cmd_string[6]=LX_byte1(handle);
+ BT_stamp(ev3,&cmd_string[0]);
+ BT_exchange(ev3,&cmd_string[0],7,&reply[0],BT_MAX_REPLY);
+}
+
+static int BT_fetch(BT_ev3 *ev3, const char *caller, unsigned char begin, unsigned char cont, const char *src,
+                    BT_sink sink, void *arg, BT_transfer_stats *stats)
+{
+ // Read something the brick hands out in pieces - a file (BEGIN_UPLOAD/CONTINUE_UPLOAD) or a
+ // directory listing (LIST_FILES/CONTINUE_LIST_FILES). Both first replies are laid out as status,
+ // 4-byte total size, handle, payload, and both continue replies as status, handle, payload.
+ //
+ // The first reply gives the total size, so the number of continue requests still needed is
+ // known up front and BT_UPLOAD_WINDOW of them are kept in flight. The brick closes the handle
+ // itself once the last byte has been read; if the sink stops early, the requests already sent
+ // are collected and the handle is closed explicitly. Returns as EV3_download_file().
+ BT_ticket ticket[BT_MAX_INFLIGHT];
+ unsigned char cmd_string[16];
+ unsigned char reply[BT_MAX_REPLY];
+ long long t_start, size, requested, received;
+ int len, n, handle, head=0, count=0, status=0, done=0;
+
+ if (stats!=NULL) memset(stats,0,sizeof(BT_transfer_stats));
+ t_start=BT_now_ns();
+
+ len=BT_system_begin(ev3,begin,src,BT_DOWNLOAD_CHUNK,&reply[0]);
+ if (len<12||reply[4]!=SYSTEM_REPLY)
+ {
+  if (len>=7&&(reply[4]==SYSTEM_REPLY||reply[4]==SYSTEM_REPLY_ERROR)&&reply[6]!=SUCCESS) return(reply[6]);
+  fprintf(stderr,"%s: Command failed\n",caller);
+  return(-1);
+ }
+ if (reply[6]!=SUCCESS&&reply[6]!=END_OF_FILE) return(reply[6]);
+ size=BT_get_int32(&reply[7]);
+ handle=reply[11];
+ received=len-12;
+ requested=received;
+ BT_stats_chunk(stats,len-12,t_start);
+ if (len>12) done=sink(arg,&reply[12],len-12);
+ if (done<0) status=-1;
+
+ while (count>0||(!done&&requested<size))
+ {
+  while (!done&&requested<size&&count<BT_UPLOAD_WINDOW)
+  {
+   n=(int)MIN(size-requested,(long long)BT_DOWNLOAD_CHUNK+4);	// <-- the continue replies have 4 header bytes less
+   len=BT_system_continue(&cmd_string[0],cont,handle,n);
+   if (BT_post(ev3,&cmd_string[0],len,&ticket[(head+count)%BT_MAX_INFLIGHT])<0)
+   {
+    done=1;
+    status=-1;
+    break;
+   }
+   requested+=n;
+   count++;
+  }
+  if (count==0) break;
+
+  len=BT_collect(ev3,&ticket[head],&reply[0],BT_MAX_REPLY);
+  if (len<8||reply[4]!=SYSTEM_REPLY||(reply[6]!=SUCCESS&&reply[6]!=END_OF_FILE))
+  {
+   if (!done)
+   {
+    fprintf(stderr,"%s: Read failed\n",caller);
+    status=(len>=7&&(reply[4]==SYSTEM_REPLY||reply[4]==SYSTEM_REPLY_ERROR))?reply[6]:-1;
+    if (status==SUCCESS) status=-1;
+   }
+   done=1;
+  }
+  else if (!done)
+  {
+   BT_stats_chunk(stats,len-8,ticket[head].t_ns);
+   received+=len-8;
+   if (len>8) done=sink(arg,&reply[8],len-8);
+   if (done<0) status=-1;
+  }
+  head=(head+1)%BT_MAX_INFLIGHT;
+  count--;
+ }
+ if (received<size) BT_close_handle(ev3,handle);
+ if (stats!=NULL) stats->seconds=(BT_now_ns()-t_start)*1e-9;
+ return(status);
+}
+
+int EV3_download_file(BT_ev3 *ev3, const char *src, BT_sink sink, void *arg, BT_transfer_stats *stats)
+{
+ ////////////////////////////////////////////////////////////////////////////////////////////////
+ //
+ // Read the file at src on the EV3 and hand its contents to sink, in order, a piece at a time.
+ //
+ // Inputs: src - path on the EV3, relative to /home/root/lms2012/sys
+ //         sink, arg - called as sink(arg,data,len) for every piece
+ //         stats - if not NULL, filled in with the transfer statistics
+ //
+ // Returns: 0 on success (including when the sink stopped early)
+ //          the status code if the brick refused the file
+ //          -1 on a communication error, or if the sink returned -1
+ //////////////////////////////////////////////////////////////////////////////////////////////////
+ BT_stats_begin(BT_CALL_DOWNLOAD_FILE);
+ return(BT_stats_end(BT_fetch(ev3,"BT_download_file",BEGIN_UPLOAD,CONTINUE_UPLOAD,src,sink,arg,stats)));
+}
+
+static int BT_fd_sink(void *arg, const unsigned char *data, int len)
+{
+ return(BT_write_all(*(int *)arg,data,len)<0?-1:0);
+}
+
+int EV3_download_file_fd(BT_ev3 *ev3, const char *src, int fd, BT_transfer_stats *stats)
+{
+ ////////////////////////////////////////////////////////////////////////////////////////////////
+ // Read the file at src on the EV3 and write it to the file descriptor fd as it arrives.
+ //
+ // Returns: as EV3_download_file()
+ //////////////////////////////////////////////////////////////////////////////////////////////////
+ BT_stats_begin(BT_CALL_DOWNLOAD_FILE_FD);
+ return(BT_stats_end(EV3_download_file(ev3,src,BT_fd_sink,&fd,stats)));
+}
+
+int EV3_tail_file(BT_ev3 *ev3, const char *src, BT_sink sink, void *arg, int poll_ms, int idle_ms)
+{
+ ////////////////////////////////////////////////////////////////////////////////////////////////
+ //
+ // Follow a file on the EV3 that may still be growing, handing every new piece to sink.
+ //
+ // BEGIN_GETFILE/CONTINUE_GETFILE do not close the handle at the end of the file, so once
+ // everything written so far has been read we can keep asking for more. One request is in
+ // flight at a time; when a reply carries no data we wait poll_ms before asking again.
+ //
+ // Inputs: src - path on the EV3
+ //         sink, arg - called as sink(arg,data,len) for every piece
+ //         poll_ms - wait between requests once the end of the file is reached
+ //         idle_ms - stop after this long without new data, 0 to follow until the sink stops
+ //
+ // Returns: 0 when stopped by the sink or the idle timeout
+ //          the status code if the brick refused the file
+ //          -1 on a communication error, or if the sink returned -1
+ //////////////////////////////////////////////////////////////////////////////////////////////////
+ BT_stats_begin(BT_CALL_TAIL_FILE);
+ unsigned char cmd_string[16];
+ unsigned char reply[BT_MAX_REPLY];
+ struct timespec ts;
+ int len, handle, done=0, idle=0;
+
+ if (poll_ms<1)
+ {
+  fprintf(stderr,"BT_tail_file: The poll interval must be at least 1 ms\n");
+  return(BT_stats_end(-1));
+ }
+ ts.tv_sec=poll_ms/1000;
+ ts.tv_nsec=(poll_ms%1000)*1000000L;
+
+ len=BT_system_begin(ev3,BEGIN_GETFILE,src,BT_DOWNLOAD_CHUNK,&reply[0]);
+ if (len<12||reply[4]!=SYSTEM_REPLY)
+ {
+  if (len>=7&&(reply[4]==SYSTEM_REPLY||reply[4]==SYSTEM_REPLY_ERROR)&&reply[6]!=SUCCESS) return(BT_stats_end(reply[6]));
+  fprintf(stderr,"BT_tail_file: Command failed\n");
+  return(BT_stats_end(-1));
+ }
+ if (reply[6]!=SUCCESS&&reply[6]!=END_OF_FILE) return(BT_stats_end(reply[6]));
+ handle=reply[11];
+
+ while (!done)
+ {
+  // Replies to both BEGIN_GETFILE and CONTINUE_GETFILE: status, file size, handle, payload
+  if (len>12)
+  {
+   idle=0;
+   done=sink(arg,&reply[12],len-12);
+  }
+  else
+  {
+   if (idle_ms>0&&idle>=idle_ms) break;
+   nanosleep(&ts,NULL);
+   idle+=poll_ms;
+  }
+  if (done) break;
+
+  len=BT_system_continue(&cmd_string[0],CONTINUE_GETFILE,handle,BT_DOWNLOAD_CHUNK);
+  BT_stamp(ev3,&cmd_string[0]);
+  len=BT_exchange(ev3,&cmd_string[0],len,&reply[0],BT_MAX_REPLY);
+  if (len<12||reply[4]!=SYSTEM_REPLY||(reply[6]!=SUCCESS&&reply[6]!=END_OF_FILE))
+  {
+   fprintf(stderr,"BT_tail_file: Read failed\n");
+   done=-1;
+  }
+ }
+ BT_close_handle(ev3,handle);
+ return(BT_stats_end(done<0?-1:0));
+}
+
+typedef struct BT_dir_cache
+{
+ char *path;
+ int n;
+ BT_dir_entry *entry;
+ struct BT_dir_cache *next;
+} BT_dir_cache;
+
+static pthread_mutex_t dir_lock=PTHREAD_MUTEX_INITIALIZER;	// Guards the listing caches of all connections
+
+static int BT_text_sink(void *arg, const unsigned char *data, int len)
+{
+ // Collects what BT_fetch() reads into one growing buffer
+ BT_text *text=(BT_text *)arg;
+ char *p;
+
+ if (text->len+len>text->size)
+ {
+  text->size=MAX(2*text->size,text->len+len+1024);
+  p=(char *)realloc(text->data,text->size);
+  if (p==NULL)
+  {
+   fprintf(stderr,"BT_list_files: Out of memory\n");
+   return(-1);
+  }
+  text->data=p;
+ }
+ memcpy(text->data+text->len,data,len);
+ text->len+=len;
+ return(0);
+}
+
+static int BT_parse_listing(const char *text, int len, BT_dir_entry **entries)
+{
+ // Split a LIST_FILES listing into entries. Each line is either
+ //    32 hex digits of MD5 + space + 8 hex digits of size + space + file name
+ // or
+ //    directory name + '/'
+ const char *line, *end, *eol;
+ BT_dir_entry *e;
+ int n=0, max=0, l;
+
+ *entries=NULL;
+ end=text+len;
+ for (line=text; line<end; line=eol+1)
+ {
+  eol=(const char *)memchr(line,'\n',end-line);
+  if (eol==NULL) eol=end;
+  l=eol-line;
+  if (l==0) continue;
+  if (n==max)
+  {
+   max=MAX(2*max,16);
+   e=(BT_dir_entry *)realloc(*entries,max*sizeof(BT_dir_entry));
+   if (e==NULL)
+   {
+    fprintf(stderr,"BT_list_dir: Out of memory\n");
+    free(*entries);
+    *entries=NULL;
+    return(-1);
+   }
+   *entries=e;
+  }
+  e=&(*entries)[n];
+  memset(e,0,sizeof(BT_dir_entry));
+  if (line[l-1]=='/')
+  {
+   e->is_dir=1;
+   l--;
+  }
+  else if (l>42&&line[32]==' '&&line[41]==' ')
+  {
+   memcpy(e->md5,line,32);
+   e->size=strtoll(line+33,NULL,16);
+   line+=42;
+   l-=42;
+  }
+  memcpy(e->name,line,MIN(l,255));
+  n++;
+ }
+ return(n);
+}
+
+static int BT_list(BT_ev3 *ev3, const char *path, BT_dir_entry **entries, int *status)
+{
+ // Read and parse the listing of path. Returns the number of entries, or -1 with *status set to
+ // the brick's status code (or -1 for other errors).
+ BT_text text={NULL,0,0};
+ int n;
+
+ *entries=NULL;
+ *status=BT_fetch(ev3,"BT_list_dir",LIST_FILES,CONTINUE_LIST_FILES,path,BT_text_sink,&text,NULL);
+ if (*status!=SUCCESS)
+ {
+  free(text.data);
+  return(-1);
+ }
+ n=BT_parse_listing(text.data,text.len,entries);
+ free(text.data);
+ if (n<0) *status=-1;
+ return(n);
+}
+
+static void BT_dir_key(const char *path, char *key)
+{
+ // Cache key of a directory - the path as given, without trailing slashes
+ int l=strnlen(path,1011);
+
+ while (l>1&&path[l-1]=='/') l--;
+ if (l==0) {key[0]='.'; l=1;}
+ else memcpy(key,path,l);
+ key[l]='\0';
+}
+
+static void BT_dir_parent(const char *path, char *key, const char **name)
+{
+ // Split a file path into the cache key of its directory, and the file name
+ const char *slash;
+ char tmp[1024];
+ int l;
+
+ BT_dir_key(path,tmp);
+ slash=strrchr(tmp,'/');
+ if (slash==NULL)
+ {
+  strcpy(key,".");
+  *name=path;
+  return;
+ }
+ l=slash-tmp;
+ memcpy(key,tmp,l?l:1);
+ key[l?l:1]='\0';
+ *name=path+l+1;
+}
+
+static int BT_dir_copy(const BT_dir_cache *c, BT_dir_entry **entries)
+{
+ *entries=(BT_dir_entry *)malloc(MAX(c->n,1)*sizeof(BT_dir_entry));
+ if (*entries==NULL) return(-1);
+ memcpy(*entries,c->entry,c->n*sizeof(BT_dir_entry));
+ return(c->n);
+}
+
+static BT_dir_cache *BT_dir_find(BT_ev3 *ev3, const char *key)
+{
+ for (BT_dir_cache *c=ev3->dir_cache; c!=NULL; c=c->next)
+  if (strcmp(c->path,key)==0) return(c);
+ return(NULL);
+}
+
+static void BT_dir_drop(BT_ev3 *ev3, const char *key)
+{
+ for (BT_dir_cache **pc=&ev3->dir_cache; *pc!=NULL; pc=&(*pc)->next)
+  if (strcmp((*pc)->path,key)==0)
+  {
+   BT_dir_cache *c=*pc;
+   *pc=c->next;
+   free(c->path);
+   free(c->entry);
+   free(c);
+   return;
+  }
+}
+
+static void BT_dir_store(BT_ev3 *ev3, const char *key, const BT_dir_entry *entries, int n)
+{
+ // Cache a copy of a listing, replacing any older one. If memory is short it is simply not cached.
+ BT_dir_cache *c;
+
+ c=(BT_dir_cache *)calloc(1,sizeof(BT_dir_cache));
+ if (c==NULL) return;
+ c->path=strdup(key);
+ c->n=n;
+ c->entry=(BT_dir_entry *)malloc(MAX(n,1)*sizeof(BT_dir_entry));
+ if (c->path==NULL||c->entry==NULL)
+ {
+  free(c->path);
+  free(c->entry);
+  free(c);
+  return;
+ }
+ if (n>0) memcpy(c->entry,entries,n*sizeof(BT_dir_entry));
+ pthread_mutex_lock(&dir_lock);
+ BT_dir_drop(ev3,key);
+ c->next=ev3->dir_cache;
+ ev3->dir_cache=c;
+ pthread_mutex_unlock(&dir_lock);
+}
+
+static void BT_dir_clear(BT_ev3 *ev3)
+{
+ pthread_mutex_lock(&dir_lock);
+ while (ev3->dir_cache!=NULL) BT_dir_drop(ev3,ev3->dir_cache->path);
+ pthread_mutex_unlock(&dir_lock);
+}
+
+int EV3_list_dir(BT_ev3 *ev3, const char *path, BT_dir_entry **entries)
+{
+ ////////////////////////////////////////////////////////////////////////////////////////////////
+ //
+ // Read the listing of the directory at path from the EV3, however long it is, and parse it.
+ // The cached listing of path is refreshed.
+ //
+ // Inputs: path - directory on the EV3
+ //         entries - set to a newly allocated array, which the caller must free()
+ //
+ // Returns: the number of entries
+ //          -1 on error, or if the directory does not exist
+ //////////////////////////////////////////////////////////////////////////////////////////////////
+ BT_stats_begin(BT_CALL_LIST_DIR);
+ char key[1024];
+ int n, status;
+
+ n=BT_list(ev3,path,entries,&status);
+ if (n<0) return(BT_stats_end(-1));
+ BT_dir_key(path,key);
+ BT_dir_store(ev3,key,*entries,n);
+ return(BT_stats_end(n));
+}
+
+int EV3_list_dir_cached(BT_ev3 *ev3, const char *path, BT_dir_entry **entries)
+{
+ ////////////////////////////////////////////////////////////////////////////////////////////////
+ // As EV3_list_dir(), but answered from the cache if path has been listed before.
+ //////////////////////////////////////////////////////////////////////////////////////////////////
+ BT_stats_begin(BT_CALL_LIST_DIR_CACHED);
+ BT_dir_cache *c;
+ char key[1024];
+ int n=-1;
+
+ BT_dir_key(path,key);
+ pthread_mutex_lock(&dir_lock);
+ c=BT_dir_find(ev3,key);
+ if (c!=NULL) n=BT_dir_copy(c,entries);
+ pthread_mutex_unlock(&dir_lock);
+ if (c!=NULL) return(BT_stats_end(n));
+ return(BT_stats_end(EV3_list_dir(ev3,path,entries)));
+}
+
+int EV3_file_info(BT_ev3 *ev3, const char *path, BT_dir_entry *entry)
+{
+ ////////////////////////////////////////////////////////////////////////////////////////////////
+ //
+ // Look a file or directory up in the (cached) listing of the directory that holds it.
+ //
+ // Inputs: path - file on the EV3
+ //         entry - if not NULL, set to the file's entry when it exists
+ //
+ // Returns: 1 if it exists, 0 if not (also when its directory does not exist)
+ //          -1 on a communication error
+ //////////////////////////////////////////////////////////////////////////////////////////////////
+ BT_stats_begin(BT_CALL_FILE_INFO);
+ BT_dir_entry *entries;
+ BT_dir_cache *c;
+ const char *name;
+ char key[1024];
+ int n, status, found=0;
+
+ BT_dir_parent(path,key,&name);
+ pthread_mutex_lock(&dir_lock);
+ c=BT_dir_find(ev3,key);
+ if (c!=NULL)
+  for (int i=0; i<c->n&&!found; i++)
+   if (strcmp(c->entry[i].name,name)==0)
+   {
+    found=1;
+    if (entry!=NULL) *entry=c->entry[i];
+   }
+ pthread_mutex_unlock(&dir_lock);
+ if (c!=NULL) return(BT_stats_end(found));
+
+ n=BT_list(ev3,key,&entries,&status);
+ if (n<0)
+ {
+  // A directory the brick cannot list simply holds nothing. Remember that as well, so asking
+  // again is free; only a communication failure is an error.
+  if (status<=0) return(BT_stats_end(-1));
+  n=0;
+ }
+ BT_dir_store(ev3,key,entries,n);
+ for (int i=0; i<n&&!found; i++)
+  if (strcmp(entries[i].name,name)==0)
+  {
+   found=1;
+   if (entry!=NULL) *entry=entries[i];
+  }
+ free(entries);
+ return(BT_stats_end(found));
+}
+
+void EV3_dir_invalidate(BT_ev3 *ev3, const char *path)
+{
+ ////////////////////////////////////////////////////////////////////////////////////////////////
+ // Forget the cached listing of path, and of the directory that holds it, so the next lookup
+ // asks the brick again. NULL forgets every listing of this connection.
+ //////////////////////////////////////////////////////////////////////////////////////////////////
+ const char *name;
+ char key[1024];
+
+ if (path==NULL)
+ {
+  BT_dir_clear(ev3);
+  return;
+ }
+ pthread_mutex_lock(&dir_lock);
+ BT_dir_key(path,key);
+ BT_dir_drop(ev3,key);
+ BT_dir_parent(path,key,&name);
+ BT_dir_drop(ev3,key);
+ pthread_mutex_unlock(&dir_lock);
+}
+
+// MD5 (RFC 1321), to compare local files with the hashes in the brick's directory listings
+typedef struct
+{
+ uint32_t h[4];
+ uint64_t len;
+ unsigned char buf[64];
+} BT_md5_ctx;
+
+static void BT_md5_block(BT_md5_ctx *ctx, const unsigned char *p)
+{
+ static const uint32_t K[64]={
+  0xd76aa478,0xe8c7b756,0x242070db,0xc1bdceee,0xf57c0faf,0x4787c62a,0xa8304613,0xfd469501,
+  0x698098d8,0x8b44f7af,0xffff5bb1,0x895cd7be,0x6b901122,0xfd987193,0xa679438e,0x49b40821,
+  0xf61e2562,0xc040b340,0x265e5a51,0xe9b6c7aa,0xd62f105d,0x02441453,0xd8a1e681,0xe7d3fbc8,
+  0x21e1cde6,0xc33707d6,0xf4d50d87,0x455a14ed,0xa9e3e905,0xfcefa3f8,0x676f02d9,0x8d2a4c8a,
+  0xfffa3942,0x8771f681,0x6d9d6122,0xfde5380c,0xa4beea44,0x4bdecfa9,0xf6bb4b60,0xbebfbc70,
+  0x289b7ec6,0xeaa127fa,0xd4ef3085,0x04881d05,0xd9d4d039,0xe6db99e5,0x1fa27cf8,0xc4ac5665,
+  0xf4292244,0x432aff97,0xab9423a7,0xfc93a039,0x655b59c3,0x8f0ccc92,0xffeff47d,0x85845dd1,
+  0x6fa87e4f,0xfe2ce6e0,0xa3014314,0x4e0811a1,0xf7537e82,0xbd3af235,0x2ad7d2bb,0xeb86d391};
+ static const int R[64]={7,12,17,22,7,12,17,22,7,12,17,22,7,12,17,22,5,9,14,20,5,9,14,20,5,9,14,20,5,9,14,20,
+                         4,11,16,23,4,11,16,23,4,11,16,23,4,11,16,23,6,10,15,21,6,10,15,21,6,10,15,21,6,10,15,21};
+ uint32_t w[16], a=ctx->h[0], b=ctx->h[1], c=ctx->h[2], d=ctx->h[3], f, t;
+ int g;
+
+ for (int i=0; i<16; i++) w[i]=(uint32_t)p[4*i]|((uint32_t)p[4*i+1]<<8)|((uint32_t)p[4*i+2]<<16)|((uint32_t)p[4*i+3]<<24);
+ for (int i=0; i<64; i++)
+ {
+  if (i<16) {f=(b&c)|(~b&d); g=i;}
+  else if (i<32) {f=(d&b)|(~d&c); g=(5*i+1)&15;}
+  else if (i<48) {f=b^c^d; g=(3*i+5)&15;}
+  else {f=c^(b|~d); g=(7*i)&15;}
+  t=d;
+  d=c;
+  c=b;
+  f+=a+K[i]+w[g];
+  b+=(f<<R[i])|(f>>(32-R[i]));
+  a=t;
+ }
+ ctx->h[0]+=a; ctx->h[1]+=b; ctx->h[2]+=c; ctx->h[3]+=d;
+}
+
+static void BT_md5_update(BT_md5_ctx *ctx, const unsigned char *p, size_t n)
+{
+ size_t used=ctx->len&63;
+
+ ctx->len+=n;
+ if (used>0)
+ {
+  size_t take=MIN(n,64-used);
+  memcpy(&ctx->buf[used],p,take);
+  p+=take;
+  n-=take;
+  if (used+take<64) return;
+  BT_md5_block(ctx,&ctx->buf[0]);
+ }
+ for (; n>=64; p+=64, n-=64) BT_md5_block(ctx,p);
+ memcpy(&ctx->buf[0],p,n);
+}
+
+static void BT_md5_final(BT_md5_ctx *ctx, char hex[33])
+{
+ static const unsigned char pad[64]={0x80};
+ unsigned char bits[8];
+ uint64_t len=ctx->len;
+
+ for (int i=0; i<8; i++) bits[i]=(unsigned char)((len*8)>>(8*i));
+ BT_md5_update(ctx,pad,1+((119-(len&63))&63));
+ BT_md5_update(ctx,bits,8);
+ for (int i=0; i<16; i++) sprintf(&hex[2*i],"%02x",(ctx->h[i/4]>>(8*(i%4)))&0xFF);
+}
+
+void BT_md5(const void *data, long long len, char hex[33])
+{
+ ////////////////////////////////////////////////////////////////////////////////////////////////
+ // MD5 of a block of memory, as 32 lower case hex digits (the form used in directory listings)
+ //////////////////////////////////////////////////////////////////////////////////////////////////
+ BT_md5_ctx ctx={{0x67452301,0xefcdab89,0x98badcfe,0x10325476},0,{0}};
+
+ BT_md5_update(&ctx,(const unsigned char *)data,(size_t)len);
+ BT_md5_final(&ctx,hex);
+}
+
+static int BT_md5_file(const char *path, char hex[33], long long *size)
+{
+ // Hash a local file. Returns 0, or -1 if it cannot be read.
+ BT_md5_ctx ctx={{0x67452301,0xefcdab89,0x98badcfe,0x10325476},0,{0}};
+ unsigned char buf[16384];
+ FILE *fp;
+ size_t n;
+
+ if ((fp=fopen(path,"rb"))==NULL) return(-1);
+ while ((n=fread(&buf[0],1,sizeof(buf),fp))>0) BT_md5_update(&ctx,&buf[0],n);
+ if (ferror(fp))
+ {
+  fclose(fp);
+  return(-1);
+ }
+ fclose(fp);
+ *size=(long long)ctx.len;
+ BT_md5_final(&ctx,hex);
+ return(0);
+}
+
+// Per-file state of EV3_sync_files()
+#define BT_SYNC_QUEUED 0
+#define BT_SYNC_OPENING 1			// BEGIN_DOWNLOAD sent, waiting for the handle
+#define BT_SYNC_SENDING 2
+#define BT_SYNC_DONE 3
+
+typedef struct
+{
+ BT_sync_file *file;
+ FILE *fp;
+ long long left;				// Bytes not sent yet
+ int handle, state, outstanding;
+} BT_sync_job;
+
+static void BT_sync_end(BT_ev3 *ev3, BT_sync_job *job, BT_sync_stats *stats)
+{
+ // A file whose last request has been answered
+ if (job->fp!=NULL) fclose(job->fp);
+ job->fp=NULL;
+ job->state=BT_SYNC_DONE;
+ if (job->file->status!=0&&job->handle>=0) BT_close_handle(ev3,job->handle);
+ EV3_dir_invalidate(ev3,job->file->path_dest);
+ if (job->file->status==0)
+ {
+  job->file->uploaded=1;
+  stats->uploaded++;
+ }
+ else stats->failed++;
+}
+
+int EV3_sync_files(BT_ev3 *ev3, BT_sync_file *files, int n, BT_sync_stats *stats)
+{
+ ////////////////////////////////////////////////////////////////////////////////////////////////
+ //
+ // Upload the files that are missing or different on the brick, see btcomm.h.
+ //
+ // The files that need uploading form a queue. Up to BT_SYNC_OPEN of them are open on the brick
+ // at a time, and their BEGIN_DOWNLOAD and CONTINUE_DOWNLOAD requests share one window of
+ // BT_UPLOAD_WINDOW requests in flight; replies are collected oldest first. Chunks go to the
+ // oldest open file first so files complete in order, while the next files are already being
+ // opened. A file that fails is abandoned without stopping the others.
+ //
+ // Returns: 0 if all files are up to date
+ //          -1 if any of them failed
+ //////////////////////////////////////////////////////////////////////////////////////////////////
+ BT_stats_begin(BT_CALL_SYNC_FILES);
+ BT_sync_stats local;
+ BT_sync_job *jobs;
+ BT_ticket ticket[BT_MAX_INFLIGHT];
+ int owner[BT_MAX_INFLIGHT], bytes[BT_MAX_INFLIGHT];
+ unsigned char cmd_string[1024];
+ unsigned char reply[BT_MAX_REPLY];
+ BT_dir_entry entry;
+ char md5[33];
+ long long t_start, size;
+ int njobs=0, next=0, active=0, head=0, count=0, len, k, j;
+
+ if (stats==NULL) stats=&local;
+ memset(stats,0,sizeof(BT_sync_stats));
+ stats->files=n;
+ t_start=BT_now_ns();
+ jobs=(BT_sync_job *)calloc(MAX(n,1),sizeof(BT_sync_job));
+ if (jobs==NULL)
+ {
+  fprintf(stderr,"BT_sync_files: Out of memory\n");
+  return(BT_stats_end(-1));
+ }
+
+ // Work out which files need to go
+ for (int i=0; i<n; i++)
+ {
+  files[i].uploaded=0;
+  files[i].status=-1;
+  if (BT_check_dest(files[i].path_dest)<0)
+  {
+   stats->failed++;
+   continue;
+  }
+  if (BT_md5_file(files[i].path_src,md5,&size)<0)
+  {
+   perror(files[i].path_src);
+   stats->failed++;
+   continue;
+  }
+  k=EV3_file_info(ev3,files[i].path_dest,&entry);
+  if (k<0)
+  {
+   stats->failed++;
+   continue;
+  }
+  files[i].status=0;
+  if (k==1&&!entry.is_dir&&entry.size==size&&strcasecmp(entry.md5,md5)==0)
+  {
+   stats->skipped++;
+   continue;
+  }
+  jobs[njobs].file=&files[i];
+  jobs[njobs].left=size;
+  jobs[njobs].handle=-1;
+  njobs++;
+ }
+
+ // Upload them through one shared window
+ while (next<njobs||active>0)
+ {
+  while (count<BT_UPLOAD_WINDOW)
+  {
+   // Oldest open file with data left, otherwise open the next file in the queue
+   k=-1;
+   for (j=0; j<next&&k<0; j++)
+    if (jobs[j].state==BT_SYNC_SENDING&&jobs[j].left>0&&jobs[j].file->status==0) k=j;
+   if (k>=0)
+   {
+    len=fread(&cmd_string[7],1,MIN(jobs[k].left,(long long)PARTITION_SIZE),jobs[k].fp);
+    if (len<=0)
+    {
+     perror(jobs[k].file->path_src);
+     jobs[k].file->status=-1;
+     if (jobs[k].outstanding==0) {BT_sync_end(ev3,&jobs[k],stats); active--;}
+     continue;
+    }
+    BT_continue_download(&cmd_string[0],jobs[k].handle,len);
+    bytes[(head+count)%BT_MAX_INFLIGHT]=len;
+    jobs[k].left-=len;
+    len+=7;
+   }
+   else if (next<njobs&&active<BT_SYNC_OPEN)
+   {
+    k=next++;
+    jobs[k].fp=fopen(jobs[k].file->path_src,"rb");
+    if (jobs[k].fp==NULL)
+    {
+     perror(jobs[k].file->path_src);
+     jobs[k].file->status=-1;
+     jobs[k].state=BT_SYNC_DONE;
+     stats->failed++;
+     continue;
+    }
+    active++;
+    len=BT_begin_download(&cmd_string[0],jobs[k].file->path_dest,jobs[k].left);
+    bytes[(head+count)%BT_MAX_INFLIGHT]=0;
+    jobs[k].state=BT_SYNC_OPENING;
+   }
+   else break;
+
+   if (BT_post(ev3,&cmd_string[0],len,&ticket[(head+count)%BT_MAX_INFLIGHT])<0)
+   {
+    jobs[k].file->status=-1;
+    if (jobs[k].outstanding==0) {BT_sync_end(ev3,&jobs[k],stats); active--;}
+    continue;
+   }
+   owner[(head+count)%BT_MAX_INFLIGHT]=k;
+   jobs[k].outstanding++;
+   count++;
+  }
+  if (count==0) break;
+
+  // Collect the oldest reply
+  k=owner[head];
+  len=BT_collect(ev3,&ticket[head],&reply[0],BT_MAX_REPLY);
+  jobs[k].outstanding--;
+  if (len<7||reply[4]!=SYSTEM_REPLY||(reply[6]!=SUCCESS&&reply[6]!=END_OF_FILE)||
+      (jobs[k].state==BT_SYNC_OPENING&&len<8))
+  {
+   if (jobs[k].file->status==0)
+   {
+    fprintf(stderr,"BT_sync_files: Upload of %s failed\n",jobs[k].file->path_src);
+    jobs[k].file->status=(len>=7&&(reply[4]==SYSTEM_REPLY||reply[4]==SYSTEM_REPLY_ERROR)&&reply[6]!=SUCCESS)?reply[6]:-1;
+   }
+  }
+  else if (jobs[k].state==BT_SYNC_OPENING)
+  {
+   jobs[k].handle=reply[7];
+   jobs[k].state=BT_SYNC_SENDING;
+  }
+  else stats->bytes+=bytes[head];
+  head=(head+1)%BT_MAX_INFLIGHT;
+  count--;
+  if (jobs[k].outstanding==0&&(jobs[k].file->status!=0||(jobs[k].state==BT_SYNC_SENDING&&jobs[k].left==0)))
+  {
+   BT_sync_end(ev3,&jobs[k],stats);
+   active--;
+  }
+ }
+ free(jobs);
+ stats->seconds=(BT_now_ns()-t_start)*1e-9;
+ return(BT_stats_end(stats->failed>0?-1:0));
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Wire capture (Oct 2026)
+//
+// Frames go into a bounded ring with a sequence number in each cell, the same scheme as the I/O thread's submission
+// queue: a producer claims a cell with a compare-and-swap, copies the frame in and publishes it by bumping the
+// sequence number. The writer thread is the only consumer. A connection may record from more than one thread (the
+// caller's, and the I/O thread's), so capture_users counts the producers inside BT_capture_frame(); stopping waits
+// for it to drop to 0 before the capture is freed.
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+#define BT_CAPTURE_FLUSH_MS 5				// How often the writer thread empties the ring
+
+typedef struct
+{
+ unsigned int seq;
+ BT_capture_record rec;
+} BT_capture_cell;
+
+typedef struct BT_capture
+{
+ FILE *fp;
+ long long t0;
+ unsigned int tail, head;
+ int dropped;
+ int stop;
+ pthread_t thread;
+ BT_capture_cell cell[BT_CAPTURE_RING];
+} BT_capture;
+
+static void BT_capture_frame(BT_ev3 *ev3, int dir, const unsigned char *frame, int len)
+{
+ // Record one frame, if the connection is being captured. Never blocks.
+ BT_capture *cap;
+ BT_capture_cell *cell;
+ unsigned int pos, seq;
+ int diff;
+
+ if (__atomic_load_n(&ev3->capture,__ATOMIC_RELAXED)==NULL) return;
+ __atomic_fetch_add(&ev3->capture_users,1,__ATOMIC_SEQ_CST);
+ cap=__atomic_load_n(&ev3->capture,__ATOMIC_SEQ_CST);
+ if (cap!=NULL)
+ {
+  pos=__atomic_load_n(&cap->tail,__ATOMIC_RELAXED);
+  while (1)
+  {
+   cell=&cap->cell[pos&(BT_CAPTURE_RING-1)];
+   seq=__atomic_load_n(&cell->seq,__ATOMIC_ACQUIRE);
+   diff=(int)(seq-pos);
+   if (diff==0)
+   {
+    if (__atomic_compare_exchange_n(&cap->tail,&pos,pos+1,1,__ATOMIC_RELAXED,__ATOMIC_RELAXED)) break;
+   }
+   else if (diff<0) {cell=NULL; break;}
+   else pos=__atomic_load_n(&cap->tail,__ATOMIC_RELAXED);
+  }
+  if (cell==NULL) __atomic_fetch_add(&cap->dropped,1,__ATOMIC_RELAXED);
+  else
+  {
+   cell->rec.t_ns=BT_now_ns()-cap->t0;
+   cell->rec.dir=dir;
+   cell->rec.len=MIN(len,BT_MAX_REPLY);
+   memcpy(&cell->rec.data[0],frame,cell->rec.len);
+   __atomic_store_n(&cell->seq,pos+1,__ATOMIC_RELEASE);
+  }
+ }
+ __atomic_fetch_sub(&ev3->capture_users,1,__ATOMIC_RELEASE);
+}
+
+static void BT_capture_drain(BT_capture *cap)
+{
+ // Writer thread: append every published frame to the file, and free its cell
+ BT_capture_cell *cell;
+ unsigned char hdr[12];
+
+ while (1)
+ {
+  cell=&cap->cell[cap->head&(BT_CAPTURE_RING-1)];
+  if ((int)(__atomic_load_n(&cell->seq,__ATOMIC_ACQUIRE)-(cap->head+1))<0) break;
+  for (int i=0; i<8; i++) hdr[i]=(unsigned char)((unsigned long long)cell->rec.t_ns>>(8*i));
+  hdr[8]=cell->rec.dir;
+  hdr[9]=0;
+  hdr[10]=LX_byte1(cell->rec.len);
+  hdr[11]=LX_byte2(cell->rec.len);
+  fwrite(&hdr[0],1,12,cap->fp);
+  fwrite(&cell->rec.data[0],1,cell->rec.len,cap->fp);
+  __atomic_store_n(&cell->seq,cap->head+BT_CAPTURE_RING,__ATOMIC_RELEASE);
+  cap->head++;
+ }
+}
+
+static void *BT_capture_loop(void *arg)
+{
+ BT_capture *cap=(BT_capture *)arg;
+ struct timespec ts={0,BT_CAPTURE_FLUSH_MS*1000000L};
+
+ while (!__atomic_load_n(&cap->stop,__ATOMIC_ACQUIRE))
+ {
+  BT_capture_drain(cap);
+  nanosleep(&ts,NULL);
+ }
+ BT_capture_drain(cap);
+ return(NULL);
+}
+
+int EV3_capture_start(BT_ev3 *ev3, const char *path)
+{
+ ////////////////////////////////////////////////////////////////////////////////////////////////
+ // Start recording the traffic of a connection into the file at path (see btcomm.h).
+ //
+ // Returns: 0 on success
+ //          -1 if the file cannot be created, or the connection is already being captured
+ //////////////////////////////////////////////////////////////////////////////////////////////////
+ static const unsigned char magic[8]={'B','T','C','A','P',0,1,0};
+ BT_capture *cap;
+
+ if (ev3->capture!=NULL)
+ {
+  fprintf(stderr,"BT_capture_start: The connection is already being captured\n");
+  return(-1);
+ }
+ cap=(BT_capture *)calloc(1,sizeof(BT_capture));
+ if (cap==NULL)
+ {
+  fprintf(stderr,"BT_capture_start: Out of memory\n");
+  return(-1);
+ }
+ for (unsigned int i=0; i<BT_CAPTURE_RING; i++) cap->cell[i].seq=i;
+ cap->fp=fopen(path,"wb");
+ if (cap->fp==NULL||fwrite(&magic[0],1,8,cap->fp)!=8)
+ {
+  perror(path);
+  if (cap->fp!=NULL) fclose(cap->fp);
+  free(cap);
+  return(-1);
+ }
+ cap->t0=BT_now_ns();
+ if (pthread_create(&cap->thread,NULL,BT_capture_loop,cap)!=0)
+ {
+  fprintf(stderr,"BT_capture_start: Unable to start the writer thread\n");
+  fclose(cap->fp);
+  free(cap);
+  return(-1);
+ }
+ __atomic_store_n(&ev3->capture,cap,__ATOMIC_SEQ_CST);
+ return(0);
+}
+
+int EV3_capture_stop(BT_ev3 *ev3)
+{
+ ////////////////////////////////////////////////////////////////////////////////////////////////
+ // Stop recording, write out what is still buffered and close the file.
+ //
+ // Returns: the number of frames that were dropped because the writer could not keep up
+ //          -1 if the connection was not being captured
+ //////////////////////////////////////////////////////////////////////////////////////////////////
+ BT_capture *cap=ev3->capture;
+ int dropped;
+
+ if (cap==NULL) return(-1);
+ __atomic_store_n(&ev3->capture,(BT_capture *)NULL,__ATOMIC_SEQ_CST);
+ while (__atomic_load_n(&ev3->capture_users,__ATOMIC_SEQ_CST)>0) sched_yield();
+ __atomic_store_n(&cap->stop,1,__ATOMIC_RELEASE);
+ pthread_join(cap->thread,NULL);
+ fclose(cap->fp);
+ dropped=cap->dropped;
+ free(cap);
+ return(dropped);
+}
+
+int BT_capture_read(FILE *fp, BT_capture_record *record)
+{
+ ////////////////////////////////////////////////////////////////////////////////////////////////
+ // Read the next record of a capture file. The 8-byte file header is checked and skipped
+ // when reading from the start of the file.
+ //
+ // Returns: 1 if a record was read, 0 at the end of the file, -1 if the file is not a capture
+ //////////////////////////////////////////////////////////////////////////////////////////////////
+ unsigned char hdr[12];
+
+ if (ftell(fp)==0)
+ {
+  if (fread(&hdr[0],1,8,fp)!=8||memcmp(&hdr[0],"BTCAP\0\1",7)!=0)
+  {
+   fprintf(stderr,"BT_capture_read: Not a capture file\n");
+   return(-1);
+  }
+ }
+ if (fread(&hdr[0],1,12,fp)!=12) return(0);
+ record->t_ns=0;
+ for (int i=7; i>=0; i--) record->t_ns=(record->t_ns<<8)|hdr[i];
+ record->dir=hdr[8];
+ record->len=hdr[10]|(hdr[11]<<8);
+ if (record->len>BT_MAX_REPLY||fread(&record->data[0],1,record->len,fp)!=(size_t)record->len)
+ {
+  fprintf(stderr,"BT_capture_read: Truncated record\n");
+  return(-1);
+ }
+ return(1);
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// I/O thread (Oct 2026)
+//
+// One thread serves every connection handed to it with EV3_io_start(). It waits on all of their sockets, and on an
+// eventfd that is signalled when requests are queued, with a single epoll set. The thread is started with the
+// first connection and stopped with the last one. Sockets are non-blocking while the thread has them: bytes a
+// socket will not take yet wait in the connection's io_tx until epoll reports room (EPOLLOUT), so one slow brick
+// never holds up the others.
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+#define BT_IO_COMMAND 0			// Kinds of request - a command for the brick,
+#define BT_IO_ATTACH 1				// or a connection joining or leaving the I/O thread
+#define BT_IO_DETACH 2
+#define BT_IO_EVENTS 64				// Socket events handled per epoll_wait()
+
+typedef struct BT_io_request BT_io_request;
+struct BT_io_request
+{
+ BT_ev3 *ev3;
+ int kind;
+ unsigned char cmd_string[1024];
+ int len;
+ unsigned char *reply;			// Where the reply goes - the caller's buffer, or data[] below
+ int maxlen;
+ int rlen;				// Reply length, -1 on error
+ BT_io_callback callback;		// If set, runs on the I/O thread and the request is then freed...
+ void *arg;
+ sem_t done;				// ...otherwise this is posted once rlen is valid
+ BT_io_request *next;			// Link in the connection's backlog
+ int merge_at;				// Where this command's global variables start in its merged packet
+ unsigned char data[BT_MAX_REPLY];
+};
+
+// Submission queue: a bounded ring with a sequence number in each cell (after D. Vyukov's MPMC queue). A producer
+// claims a position with a compare-and-swap on io_tail, stores its request and then publishes the cell by bumping
+// its sequence number. The I/O thread is the only consumer, so io_head is plain.
+typedef struct
+{
+ unsigned int seq;
+ BT_io_request *req;
+} BT_io_cell;
+
+static BT_io_cell io_queue[BT_IO_QUEUE];
+static unsigned int io_tail=0, io_head=0;
+static int io_event=-1;				// eventfd that wakes the I/O thread up
+static int io_epoll=-1;
+static int io_quit=0;
+static int io_bricks=0;				// Connections served by the I/O thread
+static int io_timer=-1;				// timerfd that fires when the next merged packet is due
+static BT_ev3 *io_merging=NULL;			// Connections gathering a merged packet
+static pthread_t io_thread;
+static pthread_mutex_t io_lock=PTHREAD_MUTEX_INITIALIZER;	// Serializes EV3_io_start() and EV3_io_stop()
+
+static int BT_io_push(BT_io_request *req)
+{
+ // Returns 0 once req is in the queue, or -1 if the queue is full
+ unsigned int pos=__atomic_load_n(&io_tail,__ATOMIC_RELAXED), seq;
+ BT_io_cell *cell;
+ int diff;
+
+ while (1)
+ {
+  cell=&io_queue[pos&(BT_IO_QUEUE-1)];
+  seq=__atomic_load_n(&cell->seq,__ATOMIC_ACQUIRE);
+  diff=(int)(seq-pos);
+  if (diff==0)
+  {
+   if (__atomic_compare_exchange_n(&io_tail,&pos,pos+1,1,__ATOMIC_RELAXED,__ATOMIC_RELAXED)) break;
+  }
+  else if (diff<0) return(-1);
+  else pos=__atomic_load_n(&io_tail,__ATOMIC_RELAXED);
+ }
+ cell->req=req;
+ __atomic_store_n(&cell->seq,pos+1,__ATOMIC_RELEASE);
+ return(0);
+}
+
+static BT_io_request *BT_io_pop()
+{
+ // I/O thread only. Returns the oldest published request, or NULL if there is none.
+ BT_io_cell *cell=&io_queue[io_head&(BT_IO_QUEUE-1)];
+ BT_io_request *req;
+
+ if ((int)(__atomic_load_n(&cell->seq,__ATOMIC_ACQUIRE)-(io_head+1))<0) return(NULL);
+ req=cell->req;
+ __atomic_store_n(&cell->seq,io_head+BT_IO_QUEUE,__ATOMIC_RELEASE);
+ io_head++;
+ return(req);
+}
+
+static void BT_io_discard(void *arg, const unsigned char *reply, int len)
+{
+}
+
+static int BT_io_prepare(BT_ev3 *ev3, BT_io_request *req, const unsigned char *cmd_string, int len)
+{
+ // On success the caller is counted in io_users until BT_io_enqueue(), so EV3_io_stop() does not stop the
+ // I/O thread between here and there
+ if (len<5||len>1024)
+ {
+  fprintf(stderr,"BT_io_submit: Invalid command length\n");
+  return(-1);
+ }
+ __atomic_fetch_add(&ev3->io_users,1,__ATOMIC_SEQ_CST);
+ if (!__atomic_load_n(&ev3->io_running,__ATOMIC_SEQ_CST))
+ {
+  __atomic_fetch_sub(&ev3->io_users,1,__ATOMIC_RELEASE);
+  fprintf(stderr,"BT_io_submit: The I/O thread is not running\n");
+  return(-1);
+ }
+ req->ev3=ev3;
+ req->kind=BT_IO_COMMAND;
+ memcpy(&req->cmd_string[0],cmd_string,len);
+ req->len=len;
+ req->reply=&req->data[0];
+ req->maxlen=BT_MAX_REPLY;
+ req->rlen=-1;
+ req->callback=NULL;
+ req->arg=NULL;
+ req->next=NULL;
+ return(0);
+}
+
+static int BT_io_enqueue(BT_io_request *req)
+{
+ // Queue a request and wake the I/O thread. Once queued, the request may be gone at any time.
+ BT_ev3 *ev3=req->ev3;
+ int command=(req->kind==BT_IO_COMMAND), r=0;
+ uint64_t one=1;
+
+ while (BT_io_push(req)<0)
+ {
+  if (command&&!__atomic_load_n(&ev3->io_running,__ATOMIC_ACQUIRE))
+  {
+   r=-1;
+   break;
+  }
+  sched_yield();			// Queue full, let the I/O thread drain it
+ }
+ if (r==0&&write(io_event,&one,sizeof(one))<0&&errno!=EAGAIN) r=-1;
+ if (command) __atomic_fetch_sub(&ev3->io_users,1,__ATOMIC_RELEASE);	// Counted in by BT_io_prepare()
+ return(r);
+}
+
+static void BT_io_finish(BT_io_request *req, const unsigned char *frame, int len)
+{
+ // Hand a reply (or an error, len=-1) back to whoever is waiting for req. After this the request
+ // may no longer exist.
+ if (len>req->maxlen) len=req->maxlen;
+ if (len>0) memcpy(req->reply,frame,len);
+ req->rlen=len;
+ if (req->callback)
+ {
+  req->callback(req->arg,req->reply,len);
+  free(req);
+ }
+ else sem_post(&req->done);
+}
+
+static BT_io_request *BT_io_take_merge(BT_ev3 *ev3);
+
+static void BT_io_drop(BT_ev3 *ev3)
+{
+ // Fail every request of this connection that is still waiting to be sent or answered
+ BT_io_request *req;
+
+ if ((req=BT_io_take_merge(ev3))!=NULL) BT_io_finish(req,NULL,-1);
+ for (int slot=0; slot<BT_MAX_INFLIGHT; slot++)
+  if (ev3->io_slot[slot]!=NULL)
+  {
+   req=ev3->io_slot[slot];
+   ev3->io_slot[slot]=NULL;
+   BT_io_finish(req,NULL,-1);
+  }
+ while (ev3->io_backlog!=NULL)
+ {
+  req=ev3->io_backlog;
+  ev3->io_backlog=req->next;
+  BT_io_finish(req,NULL,-1);
+ }
+ ev3->io_backlog_end=&ev3->io_backlog;
+}
+
+static void BT_io_fail(BT_ev3 *ev3)
+{
+ // The link to this brick is gone: stop watching it, and fail its requests now and from here on
+ if (!ev3->io_failed)
+ {
+  fprintf(stderr,"BT_io: Connection to the EV3 at socket id %d failed\n",ev3->socket);
+  epoll_ctl(io_epoll,EPOLL_CTL_DEL,ev3->socket,NULL);
+  ev3->io_failed=1;
+ }
+ ev3->io_tx_start=ev3->io_tx_end=0;
+ BT_io_drop(ev3);
+}
+
+static int BT_io_write(BT_ev3 *ev3)
+{
+ // Write as much of io_tx as the socket takes now, and have epoll report when it has room again while some is
+ // left. Returns 0, or -1 if the link failed.
+ struct epoll_event ev;
+ int n, want;
+
+ while (ev3->io_tx_start<ev3->io_tx_end)
+ {
+  n=write(ev3->socket,&ev3->io_tx[ev3->io_tx_start],ev3->io_tx_end-ev3->io_tx_start);
+  if (n<0&&errno==EINTR) continue;
+  if (n<0&&(errno==EAGAIN||errno==EWOULDBLOCK)) break;
+  if (n<=0) return(-1);
+  ev3->io_tx_start+=n;
+ }
+ if (ev3->io_tx_start==ev3->io_tx_end) ev3->io_tx_start=ev3->io_tx_end=0;
+ want=(ev3->io_tx_end>0);
+ if (want!=ev3->io_tx_armed)
+ {
+  ev.events=want?EPOLLIN|EPOLLOUT:EPOLLIN;
+  ev.data.ptr=ev3;
+  if (epoll_ctl(io_epoll,EPOLL_CTL_MOD,ev3->socket,&ev)<0) return(-1);
+  ev3->io_tx_armed=want;
+ }
+ return(0);
+}
+
+static int BT_io_send(BT_ev3 *ev3, BT_io_request *req)
+{
+ // Stamp a fresh message id into the command, queue it in io_tx and keep the request until its reply arrives.
+ // Returns 0 if sent, 1 if all reply slots are taken or io_tx is full (try again later), or -1 if the link
+ // failed.
+ int slot=-1, id;
+
+ if (!(req->cmd_string[4]&0x80))
+ {
+  for (slot=0; slot<BT_MAX_INFLIGHT&&ev3->io_slot[slot]!=NULL; slot++);
+  if (slot==BT_MAX_INFLIGHT) return(1);
+ }
+ if (ev3->io_tx_end+req->len>BT_IO_TX_BUFFER)
+ {
+  if (BT_io_write(ev3)<0) return(-1);
+  if (ev3->io_tx_start>0)
+  {
+   memmove(&ev3->io_tx[0],&ev3->io_tx[ev3->io_tx_start],ev3->io_tx_end-ev3->io_tx_start);
+   ev3->io_tx_end-=ev3->io_tx_start;
+   ev3->io_tx_start=0;
+  }
+  if (ev3->io_tx_end+req->len>BT_IO_TX_BUFFER) return(1);
+ }
+ id=ev3->io_msg_id;
+ ev3->io_msg_id=(ev3->io_msg_id+1)&0xFFFF;
+ req->cmd_string[2]=LX_byte1(id);
+ req->cmd_string[3]=LX_byte2(id);
+ memcpy(&ev3->io_tx[ev3->io_tx_end],&req->cmd_string[0],req->len);
+ ev3->io_tx_end+=req->len;
+ BT_capture_frame(ev3,BT_CAPTURE_TX,&req->cmd_string[0],req->len);
+ BT_stats_sent(ev3,&req->cmd_string[0],req->len);
+ if (slot<0) BT_io_finish(req,NULL,0);	// Nothing will come back for this one
+ else
+ {
+  ev3->io_slot[slot]=req;
+  ev3->io_slot_id[slot]=id;
+ }
+ return(0);
+}
+
+static void BT_io_flush(BT_ev3 *ev3)
+{
+ // Send queued requests, in submission order, for as long as there are free reply slots and room in io_tx,
+ // then hand the socket what it will take
+ BT_io_request *req, *next;
+ int r;
+
+ while (ev3->io_backlog!=NULL)
+ {
+  req=ev3->io_backlog;
+  next=req->next;			// A command without a reply is gone once sent
+  r=ev3->io_failed?-1:BT_io_send(ev3,req);
+  if (r>0) break;
+  ev3->io_backlog=next;
+  if (ev3->io_backlog==NULL) ev3->io_backlog_end=&ev3->io_backlog;
+  if (r<0)
+  {
+   BT_io_finish(req,NULL,-1);
+   BT_io_fail(ev3);
+  }
+ }
+ if (!ev3->io_failed&&BT_io_write(ev3)<0) BT_io_fail(ev3);
+}
+
+// Command coalescing. While a connection has a window set with EV3_io_coalesce(), direct commands are copied
+// into an open packet (io_merge) instead of the backlog, with their variables moved past those of the commands
+// already in it. The packet goes to the backlog when its window ends, when the next command does not fit, or when
+// a command arrives that cannot be merged. Its callback, BT_io_split(), hands each command its part of the reply.
+
+static const signed char BT_ui_draw_args[33]={0,0,3,5,4,4,5,-1,6,5,5,-1,-1,-1,-1,-1,4,1,1,3,-1,7,-1,-1,4,1,1,-1,4,
+                                              -1,-1,-1,-1};	// Parameters of each opUI_DRAW sub-command, -1 if unknown
+
+static int BT_merge_param(const unsigned char **pc, const unsigned char *end, unsigned char **out,
+                          const unsigned char *out_end, int g_off, int l_off, long *value)
+{
+ // Copy one parameter, in any of the encodings of bytecodes.h, moving a global variable by g_off bytes and a
+ // local one by l_off bytes. A moved variable is written in the shortest encoding that holds its new offset.
+ // Returns 1 for a constant (its value in *value), 0 for a variable, -1 if the parameter is malformed or
+ // a label, or -2 if out is full.
+ const unsigned char *p=*pc;
+ unsigned char *q=*out;
+ int b, n, global, flags=0, size=1;
+ long v=0;
+
+ if (p>=end) return(-1);
+ b=*(p++);
+ *value=0;
+ if (!(b&PRIMPAR_LONG))
+ {
+  if (!(b&PRIMPAR_VARIABEL))
+  {
+   *value=(b&PRIMPAR_CONST_SIGN)?(b&PRIMPAR_VALUE)-64:(b&PRIMPAR_VALUE);
+   if (q>=out_end) return(-2);
+   *(q++)=b;
+   *pc=p;
+   *out=q;
+   return(1);
+  }
+  v=b&PRIMPAR_INDEX;
+ }
+ else
+ {
+  n=b&PRIMPAR_BYTES;
+  if (!(b&PRIMPAR_VARIABEL))
+  {
+   if (b&PRIMPAR_LABEL) return(-1);
+   if (n==PRIMPAR_STRING||n==PRIMPAR_STRING_OLD)
+   {
+    while (p<end&&*p) p++;
+    if (p>=end) return(-1);
+    p++;
+   }
+   else
+   {
+    if (n==PRIMPAR_4_BYTES) n=4;
+    if (n>4||p+n>end) return(-1);
+    for (int i=n-1; i>=0; i--) v=(v<<8)|p[i];
+    if (n<4&&(v&(1L<<(8*n-1)))) v-=1L<<(8*n);
+    else if (n==4) v=(int32_t)v;
+    *value=v;
+    p+=n;
+   }
+   if (q+(p-*pc)>out_end) return(-2);
+   memcpy(q,*pc,p-*pc);
+   *out=q+(p-*pc);
+   *pc=p;
+   return(1);
+  }
+  if (n==PRIMPAR_4_BYTES) n=4;
+  if (n<1||n>4||p+n>end) return(-1);
+  for (int i=n-1; i>=0; i--) v=(v<<8)|p[i];
+  p+=n;
+  flags=b&(PRIMPAR_HANDLE|PRIMPAR_ADDR);
+ }
+ global=b&PRIMPAR_GLOBAL;
+ v+=global?g_off:l_off;
+ if (v>=256) size=3;
+ else if (v>=32||flags) size=2;
+ if (q+size>out_end) return(-2);
+ if (size==1) q[0]=PRIMPAR_SHORT|PRIMPAR_VARIABEL|global|v;
+ else
+ {
+  q[0]=PRIMPAR_LONG|PRIMPAR_VARIABEL|global|flags|((size==2)?PRIMPAR_1_BYTE:PRIMPAR_2_BYTES);
+  q[1]=LX_byte1(v);
+  if (size==3) q[2]=LX_byte2(v);
+ }
+ *pc=p;
+ *out=q+size;
+ return(0);
+}
+
+static int BT_merge_ops(const unsigned char *pc, const unsigned char *end, int g_off, int l_off,
+                        unsigned char *out, const unsigned char *out_end)
+{
+ // Copy the byte codes of a direct command to out, with its variables moved by g_off (global) and l_off
+ // (local) bytes. Only opcodes whose parameters we know can be copied this way.
+ // Returns the number of bytes written, -1 if the command cannot be merged, or -2 if it does not fit.
+ unsigned char *q=out;
+ long sub, count;
+ int op, n, r=0;
+
+ while (pc<end)
+ {
+  if (q>=out_end) return(-2);
+  op=*(pc++);
+  *(q++)=op;
+  sub=-1;
+  if (op==opINPUT_DEVICE||op==opSOUND||op==opUI_DRAW||op==opUI_WRITE||op==opCOM_SET)
+  {
+   // The first parameter is a sub-command, which decides the rest
+   if ((r=BT_merge_param(&pc,end,&q,out_end,g_off,l_off,&sub))!=1) return((r==-2)?-2:-1);
+  }
+  switch (op)
+  {
+   case opNOP:
+   case opOUTPUT_PRG_STOP:
+    n=0;
+    break;
+   case opTIMER_READ:
+   case opTIMER_READ_US:
+   case opSOUND_TEST:
+    n=1;
+    break;
+   case opTIMER_WAIT:
+   case opOUTPUT_START:
+   case opOUTPUT_RESET:
+   case opOUTPUT_CLR_COUNT:
+    n=2;
+    break;
+   case opOUTPUT_STOP:
+   case opOUTPUT_POWER:
+   case opOUTPUT_SPEED:
+   case opOUTPUT_POLARITY:
+   case opOUTPUT_SET_TYPE:
+   case opOUTPUT_TEST:
+   case opOUTPUT_GET_COUNT:
+    n=3;
+    break;
+   case opOUTPUT_READ:
+    n=4;
+    break;
+   case opINPUT_READ:
+   case opINPUT_READSI:
+    n=5;
+    break;
+   case opOUTPUT_STEP_SYNC:
+   case opOUTPUT_TIME_SYNC:
+    n=6;
+    break;
+   case opOUTPUT_STEP_POWER:
+   case opOUTPUT_TIME_POWER:
+   case opOUTPUT_STEP_SPEED:
+   case opOUTPUT_TIME_SPEED:
+    n=7;
+    break;
+   case opINPUT_READEXT:
+    n=-6;				// The last parameter counts the values that follow it
+    break;
+   case opINPUT_DEVICE:
+    if (sub==GET_TYPEMODE) n=4;
+    else if (sub==READY_PCT||sub==READY_RAW||sub==READY_SI) n=-5;
+    else if (sub==CLR_ALL) n=1;
+    else return(-1);
+    break;
+   case opSOUND:
+    if (sub==BREAK||sub==SERVICE) n=0;
+    else if (sub==TONE) n=3;
+    else if (sub==PLAY||sub==REPEAT) n=2;
+    else return(-1);
+    break;
+   case opUI_DRAW:
+    if (sub<0||sub>32||BT_ui_draw_args[sub]<0) return(-1);
+    n=BT_ui_draw_args[sub];
+    break;
+   case opUI_WRITE:
+    if (sub!=LED) return(-1);
+    n=1;
+    break;
+   case opCOM_SET:
+    if (sub!=SET_BRICKNAME) return(-1);
+    n=1;
+    break;
+   default:
+    return(-1);			// Unknown, or waits on the brick (opTIMER_READY, opOUTPUT_READY, opSOUND_READY)
+  }
+  for (int i=0; i<abs(n); i++)
+   if ((r=BT_merge_param(&pc,end,&q,out_end,g_off,l_off,&count))<0) return(r);
+  if (n<0)
+  {
+   if (r!=1||count<0) return(-1);
+   for (long i=0; i<count; i++)
+    if ((r=BT_merge_param(&pc,end,&q,out_end,g_off,l_off,&sub))<0) return(r);
+  }
+ }
+ return(q-out);
+}
+
+static void BT_io_split(void *arg, const unsigned char *reply, int len)
+{
+ // Callback of a merged packet: give each command that asked for a reply its own, made of the packet's
+ // reply header and its part of the global variable area
+ BT_io_request *req=(BT_io_request *)arg, *next;
+ unsigned char frame[BT_MAX_REPLY];
+ int globals, n;
+
+ for (; req!=NULL; req=next)
+ {
+  next=req->next;
+  if (len<5)
+  {
+   BT_io_finish(req,NULL,-1);
+   continue;
+  }
+  globals=req->cmd_string[5]|((req->cmd_string[6]&0x03)<<8);
+  n=MAX(0,MIN(globals,len-5-req->merge_at));
+  memcpy(&frame[0],reply,5);
+  frame[0]=LX_byte1((n+3));
+  frame[1]=LX_byte2((n+3));
+  if (n>0) memcpy(&frame[5],&reply[5+req->merge_at],n);
+  BT_io_finish(req,&frame[0],5+n);
+ }
+}
+
+static void BT_io_arm()
+{
+ // Set the timer for the merged packet that is due first, or stop it if there is none
+ struct itimerspec when;
+ long long due=0;
+
+ for (BT_ev3 *ev3=io_merging; ev3!=NULL; ev3=ev3->io_merge_next)
+  if (due==0||ev3->io_merge_due<due) due=ev3->io_merge_due;
+ memset(&when,0,sizeof(when));
+ when.it_value.tv_sec=due/1000000000LL;
+ when.it_value.tv_nsec=due%1000000000LL;
+ timerfd_settime(io_timer,TFD_TIMER_ABSTIME,&when,NULL);
+}
+
+static BT_io_request *BT_io_take_merge(BT_ev3 *ev3)
+{
+ // Detach the packet this connection is gathering, if any, and return it
+ BT_io_request *req=ev3->io_merge;
+ BT_ev3 **link;
+
+ if (req==NULL) return(NULL);
+ for (link=&io_merging; *link!=ev3; link=&(*link)->io_merge_next);
+ *link=ev3->io_merge_next;
+ ev3->io_merge=NULL;
+ ev3->io_merge_next=NULL;
+ return(req);
+}
+
+static void BT_io_close_merge(BT_ev3 *ev3)
+{
+ // The packet this connection is gathering is complete: queue it for sending
+ BT_io_request *req=BT_io_take_merge(ev3);
+
+ if (req==NULL) return;
+ if (req->len==7)
+ {
+  free(req);				// Nothing joined it
+  return;
+ }
+ req->cmd_string[0]=LX_byte1((req->len-2));
+ req->cmd_string[1]=LX_byte2((req->len-2));
+ *ev3->io_backlog_end=req;
+ ev3->io_backlog_end=&req->next;
+}
+
+static BT_io_request *BT_io_open_merge(BT_ev3 *ev3)
+{
+ // Start gathering a packet for this connection. It is due one window from now.
+ BT_io_request *req;
+
+ req=(BT_io_request *)malloc(sizeof(BT_io_request));
+ if (req==NULL) return(NULL);
+ req->ev3=ev3;
+ req->kind=BT_IO_COMMAND;
+ memset(&req->cmd_string[0],0,7);
+ req->cmd_string[4]=DIRECT_COMMAND_NO_REPLY;	// Until a command that wants a reply joins
+ req->len=7;
+ req->reply=&req->data[0];
+ req->maxlen=BT_MAX_REPLY;
+ req->rlen=-1;
+ req->callback=BT_io_split;
+ req->arg=NULL;			// Commands waiting for their part of the reply
+ req->next=NULL;
+ ev3->io_merge=req;
+ ev3->io_merge_due=BT_now_ns()+__atomic_load_n(&ev3->io_coalesce_us,__ATOMIC_RELAXED)*1000LL;
+ ev3->io_merge_next=io_merging;
+ io_merging=ev3;
+ BT_io_arm();
+ return(req);
+}
+
+static int BT_io_merge(BT_ev3 *ev3, BT_io_request *req)
+{
+ // Add a direct command to the packet this connection is gathering, starting a new packet if there is none
+ // or the command does not fit. Returns 0 if the command joined a packet, or -1 if it has to be sent on its own.
+ BT_io_request *group, *last;
+ int globals, locals, g_off, l_off, r;
+
+ if (req->len<7||(req->cmd_string[4]&0x7F)!=DIRECT_COMMAND_REPLY) return(-1);
+ globals=req->cmd_string[5]|((req->cmd_string[6]&0x03)<<8);
+ locals=req->cmd_string[6]>>2;
+ while (1)
+ {
+  group=(ev3->io_merge!=NULL)?ev3->io_merge:BT_io_open_merge(ev3);
+  if (group==NULL) return(-1);
+  g_off=group->cmd_string[5]|((group->cmd_string[6]&0x03)<<8);
+  l_off=group->cmd_string[6]>>2;
+  // The brick reads and writes DATA32 and DATAF variables through aligned pointers, so each command's
+  // variables start on a 4-byte boundary, as they would in a command of its own
+  if (globals>0) g_off=(g_off+3)&~3;
+  if (locals>0) l_off=(l_off+3)&~3;
+  if (g_off+globals>BT_MAX_REPLY-5||l_off+locals>63) r=-2;
+  else r=BT_merge_ops(&req->cmd_string[7],&req->cmd_string[req->len],g_off,l_off,&group->cmd_string[group->len],
+                      &group->cmd_string[1024]);
+  if (r>=0) break;
+  if (r==-1||group->len==7) return(-1);
+  BT_io_close_merge(ev3);		// Full - send it and start another
+ }
+ group->len+=r;
+ globals+=g_off;
+ group->cmd_string[5]=LX_byte1(globals);
+ group->cmd_string[6]=(LX_byte2(globals)&0x03)|((l_off+locals)<<2);
+ if (req->cmd_string[4]&0x80) BT_io_finish(req,NULL,0);	// As good as sent
+ else
+ {
+  group->cmd_string[4]=DIRECT_COMMAND_REPLY;
+  req->merge_at=g_off;
+  req->next=NULL;
+  if (group->arg==NULL) group->arg=req;
+  else
+  {
+   for (last=(BT_io_request *)group->arg; last->next!=NULL; last=last->next);
+   last->next=req;
+  }
+ }
+ return(0);
+}
+
+static void BT_io_merge_due()
+{
+ // The timer fired: queue every merged packet whose window has ended
+ long long now=BT_now_ns();
+ BT_ev3 *ev3, *next;
+
+ for (ev3=io_merging; ev3!=NULL; ev3=next)
+ {
+  next=ev3->io_merge_next;
+  if (ev3->io_merge_due<=now)
+  {
+   BT_io_close_merge(ev3);
+   BT_io_flush(ev3);
+  }
+ }
+ BT_io_arm();
+}
+
+static void BT_io_receive(BT_ev3 *ev3)
+{
+ // The socket is readable: take in what is there and complete every request whose reply is now whole
+ unsigned char frame[BT_MAX_REPLY];
+ BT_io_request *req;
+ int len, id, slot;
+
+ if (BT_rx_pump(ev3)<0)
+ {
+  BT_io_fail(ev3);
+  return;
+ }
+ while (BT_rx_has_frame(ev3))
+ {
+  len=EV3_read_frame(ev3,&frame[0],BT_MAX_REPLY);
+  if (len<0)
+  {
+   BT_io_fail(ev3);
+   return;
+  }
+  if (len<4) continue;
+  id=frame[2]|(frame[3]<<8);
+  for (slot=0; slot<BT_MAX_INFLIGHT; slot++)
+   if (ev3->io_slot[slot]!=NULL&&ev3->io_slot_id[slot]==id)
+   {
+    req=ev3->io_slot[slot];
+    ev3->io_slot[slot]=NULL;
+    BT_io_finish(req,&frame[0],len);
+    break;
+   }
+#ifdef __BT_debug
+  if (slot==BT_MAX_INFLIGHT) fprintf(stderr,"BT_io: Dropped reply with unknown message id %d\n",id);
+#endif
+ }
+ BT_io_flush(ev3);
+}
+
+static void BT_io_detached(BT_ev3 *ev3)
+{
+ // Let go of a connection once everything it sent is on the wire (or the link is gone), and acknowledge
+ // its detach request. After this the connection may no longer exist.
+ BT_io_request *req=ev3->io_detach;
+
+ if (!ev3->io_failed) epoll_ctl(io_epoll,EPOLL_CTL_DEL,ev3->socket,NULL);
+ fcntl(ev3->socket,F_SETFL,ev3->io_flags);
+ ev3->io_attached=0;
+ ev3->io_detach=NULL;
+ __atomic_store_n(&ev3->msg_id,ev3->io_msg_id,__ATOMIC_RELAXED);
+ BT_io_finish(req,NULL,0);
+}
+
+static void BT_io_ready(BT_ev3 *ev3, uint32_t events)
+{
+ // epoll reported the socket readable, or with room for more of io_tx
+ if (events&(EPOLLIN|EPOLLERR|EPOLLHUP)) BT_io_receive(ev3);
+ else BT_io_flush(ev3);
+ if (ev3->io_detach!=NULL&&(ev3->io_failed||ev3->io_tx_end==0)) BT_io_detached(ev3);
+}
+
+static void BT_io_control(BT_io_request *req)
+{
+ // A connection joins or leaves the I/O thread. From here until it leaves, its io_* fields belong to
+ // the I/O thread.
+ BT_ev3 *ev3=req->ev3;
+ struct epoll_event ev;
+
+ if (req->kind==BT_IO_ATTACH)
+ {
+  memset(&ev3->io_slot[0],0,sizeof(ev3->io_slot));
+  ev3->io_backlog=NULL;
+  ev3->io_backlog_end=&ev3->io_backlog;
+  ev3->io_merge=NULL;
+  ev3->io_merge_next=NULL;
+  ev3->io_failed=0;
+  ev3->io_msg_id=__atomic_load_n(&ev3->msg_id,__ATOMIC_RELAXED)&0xFFFF;
+  ev3->io_tx_start=ev3->io_tx_end=ev3->io_tx_armed=0;
+  ev3->io_detach=NULL;
+  // The I/O thread must never wait on one brick's socket, so writes that do not fit wait in io_tx instead
+  ev3->io_flags=fcntl(ev3->socket,F_GETFL);
+  if (ev3->io_flags<0||fcntl(ev3->socket,F_SETFL,ev3->io_flags|O_NONBLOCK)<0)
+  {
+   BT_io_finish(req,NULL,-1);
+   return;
+  }
+  ev.events=EPOLLIN;
+  ev.data.ptr=ev3;
+  if (epoll_ctl(io_epoll,EPOLL_CTL_ADD,ev3->socket,&ev)<0)
+  {
+   fcntl(ev3->socket,F_SETFL,ev3->io_flags);
+   BT_io_finish(req,NULL,-1);
+   return;
+  }
+  ev3->io_attached=1;
+ }
+ else
+ {
+  // Requests still waiting fail, but commands already in io_tx go out first, so the brick is never left
+  // with part of one
+  BT_io_drop(ev3);
+  ev3->io_detach=req;
+  if (ev3->io_failed||ev3->io_tx_end==0) BT_io_detached(ev3);
+  return;
+ }
+ BT_io_finish(req,NULL,0);
+}
+
+static void *BT_io_loop(void *unused)
+{
+ // Body of the I/O thread. Moves replies from the sockets back to their requests, and requests from
+ // the queue onto their connection, until the last connection leaves.
+ struct epoll_event events[BT_IO_EVENTS];
+ BT_io_request *req;
+ BT_ev3 *ev3;
+ uint64_t count;
+ int n;
+
+ while (!__atomic_load_n(&io_quit,__ATOMIC_ACQUIRE))
+ {
+  n=epoll_wait(io_epoll,&events[0],BT_IO_EVENTS,-1);
+  if (n<0)
+  {
+   if (errno==EINTR) continue;
+   perror("BT_io");
+   break;
+  }
+  for (int i=0; i<n; i++)
+   if (events[i].data.ptr==NULL)
+   {
+    if (read(io_event,&count,sizeof(count))<0&&errno!=EAGAIN) perror("BT_io");
+   }
+   else if (events[i].data.ptr==&io_timer)
+   {
+    if (read(io_timer,&count,sizeof(count))<0&&errno!=EAGAIN) perror("BT_io");
+    BT_io_merge_due();
+   }
+   else BT_io_ready((BT_ev3 *)events[i].data.ptr,events[i].events);
+
+  while ((req=BT_io_pop())!=NULL)
+  {
+   ev3=req->ev3;
+   if (req->kind!=BT_IO_COMMAND) BT_io_control(req);
+   else if (!ev3->io_attached||ev3->io_detach!=NULL) BT_io_finish(req,NULL,-1);
+   else
+   {
+    // Add to the packet being gathered, or append to the connection's backlog (after that packet), then
+    // send whatever fits
+    if (!__atomic_load_n(&ev3->io_coalesce_us,__ATOMIC_RELAXED)||ev3->io_failed||BT_io_merge(ev3,req)<0)
+    {
+     BT_io_close_merge(ev3);
+     req->next=NULL;
+     *ev3->io_backlog_end=req;
+     ev3->io_backlog_end=&req->next;
+    }
+    BT_io_flush(ev3);
+   }
+  }
+ }
+ return(NULL);
+}
+
+static int BT_io_launch()
+{
+ // Start the I/O thread (io_lock held)
+ struct epoll_event ev;
+
+ io_event=eventfd(0,EFD_NONBLOCK|EFD_CLOEXEC);
+ io_timer=timerfd_create(CLOCK_MONOTONIC,TFD_NONBLOCK|TFD_CLOEXEC);
+ io_epoll=epoll_create1(EPOLL_CLOEXEC);
+ if (io_event<0||io_timer<0||io_epoll<0)
+ {
+  fprintf(stderr,"BT_io_start: Unable to create the event set\n");
+  if (io_event>=0) close(io_event);
+  if (io_timer>=0) close(io_timer);
+  if (io_epoll>=0) close(io_epoll);
+  return(-1);
+ }
+ ev.events=EPOLLIN;
+ ev.data.ptr=NULL;
+ epoll_ctl(io_epoll,EPOLL_CTL_ADD,io_event,&ev);
+ ev.data.ptr=&io_timer;
+ epoll_ctl(io_epoll,EPOLL_CTL_ADD,io_timer,&ev);
+ io_merging=NULL;
+ for (int i=0; i<BT_IO_QUEUE; i++) io_queue[i].seq=i;
+ io_head=io_tail=0;
+ io_quit=0;
+ if (pthread_create(&io_thread,NULL,BT_io_loop,NULL)!=0)
+ {
+  fprintf(stderr,"BT_io_start: Unable to start the I/O thread\n");
+  close(io_event);
+  close(io_timer);
+  close(io_epoll);
+  return(-1);
+ }
+ return(0);
+}
+
+static void BT_io_shutdown()
+{
+ // Stop the I/O thread once no connection uses it (io_lock held)
+ BT_io_request *req;
+ uint64_t one=1;
+
+ __atomic_store_n(&io_quit,1,__ATOMIC_RELEASE);
+ if (write(io_event,&one,sizeof(one))<0) fprintf(stderr,"BT_io_stop: Unable to wake the I/O thread\n");
+ pthread_join(io_thread,NULL);
+ while ((req=BT_io_pop())!=NULL) BT_io_finish(req,NULL,-1);
+ close(io_event);
+ close(io_timer);
+ close(io_epoll);
+ io_event=io_timer=io_epoll=-1;
+}
+
+static int BT_io_control_wait(BT_ev3 *ev3, int kind)
+{
+ // Ask the I/O thread to attach or detach a connection, and wait until it has
+ BT_io_request req;
+
+ req.ev3=ev3;
+ req.kind=kind;
+ req.maxlen=0;
+ req.callback=NULL;
+ sem_init(&req.done,0,0);
+ if (BT_io_enqueue(&req)<0)
+ {
+  sem_destroy(&req.done);
+  return(-1);
+ }
+ while (sem_wait(&req.done)<0&&errno==EINTR);
+ sem_destroy(&req.done);
+ return(req.rlen);
+}
+
+int EV3_io_start(BT_ev3 *ev3)
+{
+ //////////////////////////////////////////////////////////////////////////////////////////////////////
+ // Hand a connection to the I/O thread (starting it if needed). From here on the thread owns the
+ // connection, and the BT_* / EV3_* calls for it may be made from any thread.
+ //
+ // Inputs: ev3 - a connection opened by EV3_open() or EV3_attach()
+ //
+ // Returns: 0 on success, -1 on error
+ //////////////////////////////////////////////////////////////////////////////////////////////////////
+ pthread_mutex_lock(&io_lock);
+ if (ev3->io_running)
+ {
+  fprintf(stderr,"BT_io_start: The I/O thread already serves this connection\n");
+  pthread_mutex_unlock(&io_lock);
+  return(-1);
+ }
+ if (ev3->n_inflight>0)
+ {
+  fprintf(stderr,"BT_io_start: Collect the replies for requests sent with BT_submit() first\n");
+  pthread_mutex_unlock(&io_lock);
+  return(-1);
+ }
+ if (io_bricks==0&&BT_io_launch()<0)
+ {
+  pthread_mutex_unlock(&io_lock);
+  return(-1);
+ }
+ if (BT_io_control_wait(ev3,BT_IO_ATTACH)<0)
+ {
+  fprintf(stderr,"BT_io_start: Unable to watch socket id %d\n",ev3->socket);
+  if (io_bricks==0) BT_io_shutdown();
+  pthread_mutex_unlock(&io_lock);
+  return(-1);
+ }
+ io_bricks++;
+ __atomic_store_n(&ev3->io_running,1,__ATOMIC_RELEASE);
+ pthread_mutex_unlock(&io_lock);
+ return(0);
+}
+
+int EV3_io_stop(BT_ev3 *ev3)
+{
+ //////////////////////////////////////////////////////////////////////////////////////////////////////
+ // Take a connection back from the I/O thread (stopping the thread if this was the last one).
+ // Requests that have not been answered yet fail, as do those made while it stops. Make sure no
+ // other thread is still submitting requests for this connection.
+ //
+ // Inputs: ev3 - the connection
+ //
+ // Returns: 0 on success, -1 if the I/O thread was not serving this connection
+ //////////////////////////////////////////////////////////////////////////////////////////////////////
+ pthread_mutex_lock(&io_lock);
+ if (!ev3->io_running)
+ {
+  pthread_mutex_unlock(&io_lock);
+  return(-1);
+ }
+ // io_running stays set until the I/O thread has let go of the socket, so no other caller takes the direct
+ // path while the thread may still read or write it. Requests that reach the thread meanwhile fail. Callers
+ // that saw io_running set may still be queueing a request; the thread must outlive them.
+ BT_io_control_wait(ev3,BT_IO_DETACH);
+ __atomic_store_n(&ev3->io_running,0,__ATOMIC_SEQ_CST);
+ while (__atomic_load_n(&ev3->io_users,__ATOMIC_SEQ_CST)>0) sched_yield();
+ if (--io_bricks==0) BT_io_shutdown();
+ pthread_mutex_unlock(&io_lock);
+ return(0);
+}
+
+static int BT_io_exchange(BT_ev3 *ev3, const unsigned char *cmd_string, int len, unsigned char *reply, int maxlen)
+{
+ // Blocking round trip through the I/O thread, used by BT_exchange()
+ BT_io_request req;
+
+ if (BT_io_prepare(ev3,&req,cmd_string,len)<0) return(-1);
+ req.reply=reply;
+ req.maxlen=maxlen;
+ sem_init(&req.done,0,0);
+ if (BT_io_enqueue(&req)<0)
+ {
+  sem_destroy(&req.done);
+  return(-1);
+ }
+ while (sem_wait(&req.done)<0&&errno==EINTR);
+ sem_destroy(&req.done);
+ return(req.rlen);
+}
+
+int EV3_io_submit(BT_ev3 *ev3, const unsigned char *cmd_string, int len, BT_io_callback callback, void *arg)
+{
+ //////////////////////////////////////////////////////////////////////////////////////////////////////
+ // Hand a command to the I/O thread and return immediately. When the reply arrives, the callback
+ // is called on the I/O thread with the reply, or with len=-1 if the request failed. For commands
+ // of type 0x80/0x81 it is called with len=0 once the command has been sent.
+ //
+ // Inputs: ev3 - the connection
+ //         cmd_string, len - an encoded command (the message id is filled in by the I/O thread)
+ //         callback, arg - called as callback(arg,reply,len); NULL discards the reply
+ //
+ // Returns: 0 on success, -1 on error (the callback is not called)
+ //////////////////////////////////////////////////////////////////////////////////////////////////////
+ BT_io_request *req;
+
+ req=(BT_io_request *)malloc(sizeof(BT_io_request));
+ if (req==NULL)
+ {
+  fprintf(stderr,"BT_io_submit: Out of memory\n");
+  return(-1);
+ }
+ if (BT_io_prepare(ev3,req,cmd_string,len)<0)
+ {
+  free(req);
+  return(-1);
+ }
+ req->callback=callback?callback:BT_io_discard;
+ req->arg=arg;
+ if (BT_io_enqueue(req)<0)
+ {
+  free(req);
+  return(-1);
+ }
+ return(0);
+}
+
+BT_future *EV3_io_submit_future(BT_ev3 *ev3, const unsigned char *cmd_string, int len)
+{
+ //////////////////////////////////////////////////////////////////////////////////////////////////////
+ // Hand a command to the I/O thread and return immediately. Collect the reply, from any thread,
+ // with BT_future_wait() - exactly once per future.
+ //
+ // Inputs: ev3 - the connection
+ //         cmd_string, len - an encoded command (the message id is filled in by the I/O thread)
+ //
+ // Returns: the future, or NULL on error
+ //////////////////////////////////////////////////////////////////////////////////////////////////////
+ BT_io_request *req;
+
+ req=(BT_io_request *)malloc(sizeof(BT_io_request));
+ if (req==NULL)
+ {
+  fprintf(stderr,"BT_io_submit: Out of memory\n");
+  return(NULL);
+ }
+ if (BT_io_prepare(ev3,req,cmd_string,len)<0)
+ {
+  free(req);
+  return(NULL);
+ }
+ sem_init(&req->done,0,0);
+ if (BT_io_enqueue(req)<0)
+ {
+  sem_destroy(&req->done);
+  free(req);
+  return(NULL);
+ }
+ return(req);
+}
+
+int BT_future_wait(BT_future *future, unsigned char *reply, int maxlen)
+{
+ //////////////////////////////////////////////////////////////////////////////////////////////////////
+ // Wait for the reply to a request made with BT_io_submit_future(), and release the future.
+ //
+ // Inputs: future - as returned by BT_io_submit_future()
+ //         reply, maxlen - where to copy the reply
+ //
+ // Returns: the number of bytes copied (0 for commands that have no reply), or -1 on error
+ //////////////////////////////////////////////////////////////////////////////////////////////////////
+ int len;
+
+ while (sem_wait(&future->done)<0&&errno==EINTR);
+ len=future->rlen;
+ if (len>maxlen) len=maxlen;
+ if (len>0) memcpy(reply,future->reply,len);
+ sem_destroy(&future->done);
+ free(future);
+ return(len);
+}
+
+int EV3_io_coalesce(BT_ev3 *ev3, int window_us)
+{
+ //////////////////////////////////////////////////////////////////////////////////////////////////////
+ // Set how long the I/O thread may hold direct commands for this connection, to send those that
+ // arrive in the meantime as one packet. A packet already being gathered keeps its window.
+ //
+ // Inputs: ev3 - the connection
+ //         window_us - the window in microseconds (at most 1 second), 0 to send every command at once
+ //
+ // Returns: 0 on success, -1 on error
+ //////////////////////////////////////////////////////////////////////////////////////////////////////
+ if (window_us<0||window_us>1000000)
+ {
+  fprintf(stderr,"BT_io_coalesce: The window must be in [0, 1000000] us\n");
+  return(-1);
+ }
+ __atomic_store_n(&ev3->io_coalesce_us,window_us,__ATOMIC_RELAXED);
+ return(0);
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// No-reply lane (Oct 2026)
+//
+// The actuator calls send their commands through BT_actuate(). Off the lane that is a plain round trip; on it the
+// command goes out as DIRECT_COMMAND_NO_REPLY, and every lane_every calls a fence (a reply-requesting opNOP) is
+// posted without waiting. The next fence waits for that one first.
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+static pthread_mutex_t lane_lock=PTHREAD_MUTEX_INITIALIZER;	// Guards the lane state of all connections
+
+static int BT_fence_post(BT_ev3 *ev3, BT_ticket *ticket)
+{
+ // Send a fence without waiting for it. Returns 0, or -1 on error.
+ unsigned char cmd_string[8];
+ int len;
+
+ len=btcmd::direct<0,0>(cmd_string,DIRECT_COMMAND_REPLY,0,btcmd::op(opNOP));
+ return(BT_post(ev3,&cmd_string[0],len,ticket));
+}
+
+static int BT_fence_collect(BT_ev3 *ev3, BT_ticket *ticket)
+{
+ // Wait for a fence posted with BT_fence_post(). Returns 0 once the brick has answered it, -1 on error.
+ unsigned char reply[BT_MAX_REPLY];
+
+ if (BT_collect(ev3,ticket,&reply[0],BT_MAX_REPLY)<5||reply[4]!=DIRECT_REPLY)
+ {
+  fprintf(stderr,"BT_fence: No confirmation from the EV3\n");
+  return(-1);
+ }
+ return(0);
+}
+
+static int BT_lane_take(BT_ev3 *ev3, BT_ticket *ticket)
+{
+ // Take the lane's fence that is still in flight, if there is one (lane_lock held). Returns 1 if there was.
+ if (!ev3->lane_fence_sent) return(0);
+ ticket->msg_id=ev3->lane_fence_id;
+ ticket->future=ev3->lane_fence_future;
+ ev3->lane_fence_sent=0;
+ return(1);
+}
+
+static int BT_lane_fence(BT_ev3 *ev3)
+{
+ // Post the lane's next fence, after collecting the one before it. Returns 0, or -1 if either failed.
+ BT_ticket ticket;
+ int have, r=0;
+
+ pthread_mutex_lock(&lane_lock);
+ have=BT_lane_take(ev3,&ticket);
+ pthread_mutex_unlock(&lane_lock);
+ if (have&&BT_fence_collect(ev3,&ticket)<0) r=-1;
+ if (BT_fence_post(ev3,&ticket)<0) return(-1);
+ pthread_mutex_lock(&lane_lock);
+ have=ev3->lane_fence_sent;
+ if (!have)
+ {
+  ev3->lane_fence_sent=1;
+  ev3->lane_fence_id=ticket.msg_id;
+  ev3->lane_fence_future=ticket.future;
+ }
+ pthread_mutex_unlock(&lane_lock);
+ if (have&&BT_fence_collect(ev3,&ticket)<0) r=-1;	// Another thread's fence got there first
+ return(r);
+}
+
+static int BT_actuate(BT_ev3 *ev3, void *cmd, int len, void *reply, int maxlen)
+{
+ // Send an actuator command. Off the lane this is BT_exchange(). On the lane the command is sent without
+ // asking for a reply, and once it is on its way reply gets a DIRECT_REPLY header, so the caller's status
+ // check passes. Returns the reply length, or -1 on error (and reply[4] then fails the check).
+ unsigned char *cmd_string=(unsigned char *)cmd, *r=(unsigned char *)reply;
+ int fence=0;
+
+ if (!__atomic_load_n(&ev3->lane_on,__ATOMIC_ACQUIRE)) return(BT_exchange(ev3,cmd,len,reply,maxlen));
+ cmd_string[4]=DIRECT_COMMAND_NO_REPLY;
+ if (BT_exchange(ev3,cmd,len,reply,maxlen)<0) return(-1);
+ pthread_mutex_lock(&lane_lock);
+ if (ev3->lane_every>0&&++ev3->lane_count>=ev3->lane_every)
+ {
+  ev3->lane_count=0;
+  fence=1;
+ }
+ pthread_mutex_unlock(&lane_lock);
+ if (fence&&BT_lane_fence(ev3)<0)
+ {
+  __atomic_store_n(&ev3->lane_failed,1,__ATOMIC_RELEASE);
+  memset(reply,0,MIN(maxlen,5));
+  return(-1);
+ }
+ r[0]=3;
+ r[1]=0;
+ r[2]=cmd_string[2];
+ r[3]=cmd_string[3];
+ r[4]=DIRECT_REPLY;
+ return(5);
+}
+
+int EV3_fence(BT_ev3 *ev3)
+{
+ //////////////////////////////////////////////////////////////////////////////////////////////////////
+ // Wait until the brick has run every command sent to it so far, including those sent on the
+ // no-reply lane. Works on and off the lane.
+ //
+ // Inputs: ev3 - the connection
+ //
+ // Returns: 0 on success
+ //          -1 if the brick did not confirm, or a fence of the lane has failed since the last call
+ //////////////////////////////////////////////////////////////////////////////////////////////////////
+ BT_stats_begin(BT_CALL_FENCE);
+ BT_ticket ticket;
+ int have, r=0;
+
+ pthread_mutex_lock(&lane_lock);
+ have=BT_lane_take(ev3,&ticket);
+ pthread_mutex_unlock(&lane_lock);
+ if (have&&BT_fence_collect(ev3,&ticket)<0) r=-1;
+ if (BT_fence_post(ev3,&ticket)<0||BT_fence_collect(ev3,&ticket)<0) r=-1;
+ if (__atomic_exchange_n(&ev3->lane_failed,0,__ATOMIC_ACQ_REL)) r=-1;
+ return(BT_stats_end(r));
+}
+
+int EV3_lane_start(BT_ev3 *ev3, int fence_every)
+{
+ //////////////////////////////////////////////////////////////////////////////////////////////////////
+ // Put the actuator calls of a connection on the no-reply lane: from here on they return as soon
+ // as their command is sent. See the No-reply lane section of btcomm.h.
+ //
+ // Inputs: ev3 - the connection
+ //         fence_every - post a fence after this many actuator calls, 0 for none
+ //
+ // Returns: 0 on success, -1 on error
+ //////////////////////////////////////////////////////////////////////////////////////////////////////
+ if (fence_every<0)
+ {
+  fprintf(stderr,"BT_lane_start: fence_every must not be negative\n");
+  return(-1);
+ }
+ pthread_mutex_lock(&lane_lock);
+ ev3->lane_every=fence_every;
+ ev3->lane_count=0;
+ pthread_mutex_unlock(&lane_lock);
+ __atomic_store_n(&ev3->lane_on,1,__ATOMIC_RELEASE);
+ return(0);
+}
+
+int EV3_lane_stop(BT_ev3 *ev3)
+{
+ //////////////////////////////////////////////////////////////////////////////////////////////////////
+ // Take the actuator calls of a connection off the no-reply lane, and wait until the brick has run
+ // everything sent on it.
+ //
+ // Inputs: ev3 - the connection
+ //
+ // Returns: as EV3_fence()
+ //////////////////////////////////////////////////////////////////////////////////////////////////////
+ __atomic_store_n(&ev3->lane_on,0,__ATOMIC_RELEASE);
+ return(EV3_fence(ev3));
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// On-brick reactions (Oct 2026)
+//
+// A reaction is one direct command with 9 bytes of globals - the last reading (int32), the elapsed time (int32)
+// and the met flag (int8) - and 20 bytes of locals:
+//    LV0 start time, LV4 scratch, LV8 reading as read (float), LV12 reading as a whole number, LV16 threshold
+// It runs as: take the threshold, start the motors, read the start time, then loop { read; jump to done if the
+// condition holds; jump back to the loop while the time has not run out }, clear the flag and jump to the end,
+// done: set the flag, end: stop the motors and write the results. Jump offsets count from the end of the jump
+// and are always encoded as LC2, so they can be filled in once the code they jump over has been emitted.
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Jump taken when the condition holds, per BT_UNTIL_*
+static const unsigned char BT_until_op[4]={opJR_GTEQ32,opJR_LTEQ32,opJR_EQ32,opJR_NEQ32};
+
+static unsigned char *BT_put_sensor_read(unsigned char *cp, const BT_condition *cond)
+{
+ // Read the condition's sensor into LV12, as a whole number
+ *(cp++)=opINPUT_READSI;
+ *(cp++)=LC0(0);				// <-- layer
+ *(cp++)=LC0(cond->port);
+ cp=BT_put_const(cp,cond->type);
+ cp=BT_put_const(cp,cond->mode);
+ *(cp++)=LV0(8);
+ *(cp++)=opMOVEF_32;
+ *(cp++)=LV0(8);
+ *(cp++)=LV0(12);
+ return(cp);
+}
+
+static void BT_put_jump(unsigned char *at, const unsigned char *to)
+{
+ // Fill in the 3-byte offset parameter at 'at' of a jump to 'to'
+ int offset=to-(at+3);
+ at[0]=LC2_byte0();
+ at[1]=LX_byte1(offset);
+ at[2]=LX_byte2(offset);
+}
+
+int BT_compile_reaction(unsigned char *cmd_string, char lport, char lpower, char rport, char rpower,
+                        const BT_condition *cond, int timeout_ms, int brake_mode)
+{
+ //////////////////////////////////////////////////////////////////////////////////////////////////////
+ // Build the direct command for a reaction: run motors lport at lpower and rport at rpower until
+ // cond holds or timeout_ms have passed, then stop them. See the On-brick reactions section of
+ // btcomm.h. The message id is left at 0 for BT_submit() or BT_io_submit() to stamp.
+ //
+ // Inputs: cmd_string - room for at least 128 bytes
+ //         lport, rport - motor ports (MOTOR_A|MOTOR_D, ...); rport may be 0
+ //         lpower, rpower - their power, -100 to 100
+ //         cond - the condition to wait for
+ //         timeout_ms - longest the motors are run for
+ //         brake_mode - 0 to coast to a stop, 1 to brake
+ //
+ // Returns: the length of the command
+ //          -1 if a parameter is invalid
+ //////////////////////////////////////////////////////////////////////////////////////////////////////
+ unsigned char *cp=cmd_string, *loop, *met_jump, *loop_jump, *end_jump, *done, *end;
+
+ if (lport<0||lport>15||rport<0||rport>15||(lport&rport))
+ {
+  fprintf(stderr,"BT_compile_reaction: Invalid motor port value\n");
+  return(-1);
+ }
+ if (cond->port<0||cond->port>3||cond->until<BT_UNTIL_AT_LEAST||cond->until>BT_UNTIL_NOT_EQUAL)
+ {
+  fprintf(stderr,"BT_compile_reaction: Invalid condition\n");
+  return(-1);
+ }
+ if (timeout_ms<=0)
+ {
+  fprintf(stderr,"BT_compile_reaction: timeout_ms must be positive\n");
+  return(-1);
+ }
+
+ *(cp++)=0x00; *(cp++)=0x00;			// <-- length, filled in below
+ *(cp++)=0x00; *(cp++)=0x00;			// <-- cnt_id, stamped by BT_submit()
+ *(cp++)=DIRECT_COMMAND_REPLY;
+ *(cp++)=9;					// <-- header, 9 bytes of globals and 20 of locals
+ *(cp++)=20<<2;
+
+ // The threshold, relative to the first reading if asked for
+ if (cond->relative)
+ {
+  cp=BT_put_sensor_read(cp,cond);
+  *(cp++)=opADD32;
+  *(cp++)=LV0(12);
+ }
+ else *(cp++)=opMOVE32_32;
+ cp=BT_put_const(cp,cond->value);
+ *(cp++)=LV0(16);
+
+ *(cp++)=opOUTPUT_POWER; *(cp++)=LC0(0); *(cp++)=LC0(lport); cp=BT_put_const(cp,lpower);
+ if (rport) {*(cp++)=opOUTPUT_POWER; *(cp++)=LC0(0); *(cp++)=LC0(rport); cp=BT_put_const(cp,rpower);}
+ *(cp++)=opOUTPUT_START; *(cp++)=LC0(0); *(cp++)=LC0((lport|rport));
+ *(cp++)=opTIMER_READ; *(cp++)=LV0(0);
+
+ loop=cp;
+ cp=BT_put_sensor_read(cp,cond);
+ *(cp++)=BT_until_op[cond->until]; *(cp++)=LV0(12); *(cp++)=LV0(16);
+ met_jump=cp; cp+=3;
+ *(cp++)=opTIMER_READ; *(cp++)=LV0(4);
+ *(cp++)=opSUB32; *(cp++)=LV0(4); *(cp++)=LV0(0); *(cp++)=LV0(4);
+ *(cp++)=opJR_LT32; *(cp++)=LV0(4); cp=BT_put_const(cp,timeout_ms);
+ loop_jump=cp; cp+=3;
+ *(cp++)=opMOVE8_8; *(cp++)=LC0(0); *(cp++)=GV0(8);
+ *(cp++)=opJR;
+ end_jump=cp; cp+=3;
+ done=cp;
+ *(cp++)=opMOVE8_8; *(cp++)=LC0(1); *(cp++)=GV0(8);
+ end=cp;
+ *(cp++)=opOUTPUT_STOP; *(cp++)=LC0(0); *(cp++)=LC0((lport|rport)); *(cp++)=LC0((brake_mode?1:0));
+ *(cp++)=opMOVE32_32; *(cp++)=LV0(12); *(cp++)=GV0(0);
+ *(cp++)=opTIMER_READ; *(cp++)=LV0(4);
+ *(cp++)=opSUB32; *(cp++)=LV0(4); *(cp++)=LV0(0); *(cp++)=GV0(4);
+
+ BT_put_jump(met_jump,done);
+ BT_put_jump(loop_jump,loop);
+ BT_put_jump(end_jump,end);
+ cmd_string[0]=LX_byte1((cp-cmd_string-2));
+ cmd_string[1]=LX_byte2((cp-cmd_string-2));
+ return(cp-cmd_string);
+}
+
+int BT_decode_reaction(const unsigned char *reply, int len, BT_reaction *result)
+{
+ //////////////////////////////////////////////////////////////////////////////////////////////////////
+ // Unpack the reply to a command built with BT_compile_reaction().
+ //
+ // Inputs: reply, len - the reply
+ //         result - where the outcome is returned
+ //
+ // Returns: 1 if the condition was met, 0 if the time ran out
+ //          -1 if the reply is an error response, or too short
+ //////////////////////////////////////////////////////////////////////////////////////////////////////
+ if (len<5+9||reply[4]!=DIRECT_REPLY) return(-1);
+ result->reading=BT_get_int32(&reply[5]);
+ result->elapsed_ms=BT_get_int32(&reply[9]);
+ result->met=(reply[13]!=0);
+ return(result->met);
+}
+
+static int BT_react(BT_ev3 *ev3, char lport, char lpower, char rport, char rpower, const BT_condition *cond,
+                    int timeout_ms, int brake_mode, BT_reaction *result)
+{
+ // Compile a reaction, run it, and wait for its outcome. Returns as BT_decode_reaction().
+ unsigned char cmd_string[128];
+ unsigned char reply[BT_MAX_REPLY];
+ BT_ticket ticket;
+ int len;
+
+ len=BT_compile_reaction(&cmd_string[0],lport,lpower,rport,rpower,cond,timeout_ms,brake_mode);
+ if (len<0||BT_post(ev3,&cmd_string[0],len,&ticket)<0) return(-1);
+ len=BT_collect(ev3,&ticket,&reply[0],BT_MAX_REPLY);
+ if (BT_decode_reaction(&reply[0],len,result)<0)
+ {
+  fprintf(stderr,"BT_react: Command failed\n");
+  return(-1);
+ }
+ return(result->met);
+}
+
+int EV3_run_until(BT_ev3 *ev3, char port_ids, char power, const BT_condition *cond, int timeout_ms, int brake_mode, BT_reaction *result)
+{
+ //////////////////////////////////////////////////////////////////////////////////////////////////////
+ // Run motors at the given power until a sensor condition holds, with the check made on the brick.
+ //
+ // Inputs: port_ids - motors to run (MOTOR_A|MOTOR_D, ...)
+ //         power - their power, -100 to 100
+ //         cond - the condition to wait for
+ //         timeout_ms - longest the motors are run for
+ //         brake_mode - 0 to coast to a stop, 1 to brake
+ //         result - where the outcome is returned
+ //
+ // Returns: 1 if the condition was met, 0 if the time ran out (the motors are stopped either way)
+ //          -1 on error
+ //////////////////////////////////////////////////////////////////////////////////////////////////////
+ BT_stats_begin(BT_CALL_RUN_UNTIL);
+ return(BT_stats_end(BT_react(ev3,port_ids,power,0,0,cond,timeout_ms,brake_mode,result)));
+}
+
+int EV3_turn_until_angle(BT_ev3 *ev3, char lport, char rport, char power, char gyro_port, int degrees, int timeout_ms, BT_reaction *result)
+{
+ //////////////////////////////////////////////////////////////////////////////////////////////////////
+ // Spin on the spot until the gyro has turned by the given angle from where it is now, then brake.
+ // For a positive angle lport runs forward and rport backward, for a negative one the other way
+ // around; mount the gyro so that this turns it towards larger angles. result->reading is the
+ // gyro's angle (not relative to the start) when the motors were stopped.
+ //
+ // Inputs: lport, rport - the left and right motors (MOTOR_A, ...)
+ //         power - 0 to 100
+ //         gyro_port - port of the gyro sensor (PORT_1, ...)
+ //         degrees - angle to turn by
+ //         timeout_ms - longest the motors are run for
+ //         result - where the outcome is returned
+ //
+ // Returns: 1 once turned, 0 if the time ran out, -1 on error
+ //////////////////////////////////////////////////////////////////////////////////////////////////////
+ BT_stats_begin(BT_CALL_TURN_UNTIL_ANGLE);
+ BT_condition cond={gyro_port, EV3_GYRO, 0, BT_UNTIL_AT_LEAST, degrees, 1};
+
+ char lpower=(degrees<0)?-power:power;
+
+ if (degrees<0) cond.until=BT_UNTIL_AT_MOST;
+ return(BT_stats_end(BT_react(ev3,lport,lpower,rport,-lpower,&cond,timeout_ms,1,result)));
+}
+
+int EV3_stop_on_colour(BT_ev3 *ev3, char port_ids, char power, char colour_port, int colour, int timeout_ms, BT_reaction *result)
+{
+ //////////////////////////////////////////////////////////////////////////////////////////////////////
+ // Run motors until the colour sensor sees the given colour, then brake.
+ //
+ // Inputs: port_ids - motors to run (MOTOR_A|MOTOR_D, ...)
+ //         power - their power, -100 to 100
+ //         colour_port - port of the colour sensor (PORT_1, ...)
+ //         colour - the colour index to stop on, as returned by BT_read_colour_sensor()
+ //         timeout_ms - longest the motors are run for
+ //         result - where the outcome is returned
+ //
+ // Returns: 1 if the colour was seen, 0 if the time ran out, -1 on error
+ //////////////////////////////////////////////////////////////////////////////////////////////////////
+ BT_stats_begin(BT_CALL_STOP_ON_COLOUR);
+ BT_condition cond={colour_port, EV3_COLOUR, 2, BT_UNTIL_EQUAL, colour, 0};
+
+ return(BT_stats_end(BT_react(ev3,port_ids,power,0,0,&cond,timeout_ms,1,result)));
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// On-brick programs (Oct 2026)
+//
+// A program image is uploaded like any other file. Starting it is one direct command with 4 bytes of globals
+// (the image size, 0 if the file could not be loaded) and 8 bytes of locals (LV0 size, LV4 address):
+//    PROGRAM_STOP USER_SLOT; FILE LOAD_IMAGE, USER_SLOT, path, LV0, LV4; MOVE32_32 LV0, GV0;
+//    JR_EQ32 LV0, 0, end; PROGRAM_START USER_SLOT, LV0, LV4, 0; end:
+// so a missing or broken file is reported in the reply instead of leaving the slot half set up.
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+int EV3_program_upload(BT_ev3 *ev3, const char *path_dest, const unsigned char *image, int len)
+{
+ //////////////////////////////////////////////////////////////////////////////////////////////////////
+ // Upload a program image, as built by BT_asm_image(), to path_dest on the brick (an .rbf file).
+ //
+ // Inputs: path_dest - where to put it, see BT_upload_file() for the paths
+ //         image, len - the image and its size
+ //
+ // Returns: 0 on success
+ //          -1 if the image is not a program image, or the transfer failed
+ //////////////////////////////////////////////////////////////////////////////////////////////////////
+ BT_stats_begin(BT_CALL_PROGRAM_UPLOAD);
+ FILE *fp;
+ int status;
+
+ if (image==NULL||len<BT_IMAGE_HEADER||memcmp(image,"LEGO",4)!=0||BT_get_int32(&image[4])!=len)
+ {
+  fprintf(stderr,"BT_program_upload: Not a program image\n");
+  return(BT_stats_end(-1));
+ }
+ if (BT_check_dest(path_dest)<0) return(BT_stats_end(-1));
+ if ((fp=fmemopen((void *)image,len,"rb"))==NULL)
+ {
+  perror("BT_program_upload");
+  return(BT_stats_end(-1));
+ }
+ status=BT_upload_stream(ev3,path_dest,fp,len,"BT_program_upload",BT_UPLOAD_WINDOW,NULL);
+ return(BT_stats_end((status==SUCCESS||status==END_OF_FILE)?0:-1));
+}
+
+int EV3_program_start(BT_ev3 *ev3, const char *path)
+{
+ //////////////////////////////////////////////////////////////////////////////////////////////////////
+ // Load the program image at path on the brick into the user slot and start it. A program already
+ // running there is stopped first.
+ //
+ // Inputs: path - the .rbf file, as given to BT_program_upload()
+ //
+ // Returns: 0 once the program has been started
+ //          -1 if it could not be loaded, or on error
+ //////////////////////////////////////////////////////////////////////////////////////////////////////
+ BT_stats_begin(BT_CALL_PROGRAM_START);
+ unsigned char cmd_string[1024];
+ unsigned char reply[BT_MAX_REPLY];
+ unsigned char *cp=&cmd_string[7];
+ BT_ticket ticket;
+ int path_len, len;
+
+ path_len=strlen(path);
+ if (path_len==0||path_len>900)
+ {
+  fprintf(stderr,"BT_program_start: Bad path\n");
+  return(BT_stats_end(-1));
+ }
+ *(cp++)=opPROGRAM_STOP;
+ *(cp++)=LC0(USER_SLOT);
+ *(cp++)=opFILE;
+ *(cp++)=LC0(LOAD_IMAGE);
+ *(cp++)=LC0(USER_SLOT);
+ *(cp++)=LCS;
+ memcpy(cp,path,path_len+1);
+ cp+=path_len+1;
+ *(cp++)=LV0(0);			// <-- Image size
+ *(cp++)=LV0(4);			// <-- Image address
+ *(cp++)=opMOVE32_32;
+ *(cp++)=LV0(0);
+ *(cp++)=GV0(0);
+ *(cp++)=opJR_EQ32;
+ *(cp++)=LV0(0);
+ *(cp++)=LC0(0);
+ *(cp++)=LC0(5);			// <-- Over the PROGRAM_START
+ *(cp++)=opPROGRAM_START;
+ *(cp++)=LC0(USER_SLOT);
+ *(cp++)=LV0(0);
+ *(cp++)=LV0(4);
+ *(cp++)=LC0(0);			// <-- Not in debug mode
+
+ len=cp-&cmd_string[0];
+ cmd_string[0]=LX_byte1((len-2));
+ cmd_string[1]=LX_byte2((len-2));
+ cmd_string[4]=DIRECT_COMMAND_REPLY;
+ cmd_string[5]=4;			// <-- 4 bytes of globals
+ cmd_string[6]=8<<2;			// <-- 8 bytes of locals
+ if (BT_post(ev3,&cmd_string[0],len,&ticket)<0) return(BT_stats_end(-1));
+ len=BT_collect(ev3,&ticket,&reply[0],BT_MAX_REPLY);
+ if (len<9||reply[4]!=DIRECT_REPLY)
+ {
+  fprintf(stderr,"BT_program_start: Command failed\n");
+  return(BT_stats_end(-1));
+ }
+ if (BT_get_int32(&reply[5])==0)
+ {
+  fprintf(stderr,"BT_program_start: Could not load %s\n",path);
+  return(BT_stats_end(-1));
+ }
+ return(BT_stats_end(0));
+}
+
+int EV3_program_stop(BT_ev3 *ev3)
+{
+ //////////////////////////////////////////////////////////////////////////////////////////////////////
+ // Stop the program running in the user slot, if any. The brick stops the motors as it ends.
+ //
+ // Returns: 0 on success
+ //          -1 otherwise
+ //////////////////////////////////////////////////////////////////////////////////////////////////////
+ BT_stats_begin(BT_CALL_PROGRAM_STOP);
+ unsigned char cmd_string[16];
+ unsigned char reply[BT_MAX_REPLY];
+ BT_ticket ticket;
+ int len;
+
+ len=btcmd::direct<0,0>(cmd_string,DIRECT_COMMAND_REPLY,0,
+                        btcmd::op(opPROGRAM_STOP),btcmd::lc0(USER_SLOT));
+ if (BT_post(ev3,&cmd_string[0],len,&ticket)<0) return(BT_stats_end(-1));
+ len=BT_collect(ev3,&ticket,&reply[0],BT_MAX_REPLY);
+ if (len<5||reply[4]!=DIRECT_REPLY)
+ {
+  fprintf(stderr,"BT_program_stop: Command failed\n");
+  return(BT_stats_end(-1));
+ }
+ return(BT_stats_end(0));
+}
+
+int EV3_program_status(BT_ev3 *ev3)
+{
+ //////////////////////////////////////////////////////////////////////////////////////////////////////
+ // Whether a program is running in the user slot.
+ //
+ // Returns: RUNNING or STOPPED (see bytecodes.h)
+ //          -1 on error
+ //////////////////////////////////////////////////////////////////////////////////////////////////////
+ BT_stats_begin(BT_CALL_PROGRAM_STATUS);
+ unsigned char cmd_string[16];
+ unsigned char reply[BT_MAX_REPLY];
+ BT_ticket ticket;
+ int len;
+
+ len=btcmd::direct<1,0>(cmd_string,DIRECT_COMMAND_REPLY,0,
+                        btcmd::op(opPROGRAM_INFO),btcmd::lc0(GET_STATUS),btcmd::lc0(USER_SLOT),btcmd::gv0(0));
+ if (BT_post(ev3,&cmd_string[0],len,&ticket)<0) return(BT_stats_end(-1));
+ len=BT_collect(ev3,&ticket,&reply[0],BT_MAX_REPLY);
+ if (len<6||reply[4]!=DIRECT_REPLY)
+ {
+  fprintf(stderr,"BT_program_status: Command failed\n");
+  return(BT_stats_end(-1));
+ }
+ return(BT_stats_end(reply[5]));
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Default connection (Oct 2026)
+//
+// The BT_* calls are the EV3_* calls on BT_default_ev3.
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+int BT_setEV3name(const char *name)
+{
+ return(EV3_setEV3name(&BT_default_ev3,name));
+}
+
+int BT_play_tone_sequence(const int tone_data[50][3])
+{
+ return(EV3_play_tone_sequence(&BT_default_ev3,tone_data));
+}
+
+int BT_motor_port_start(char port_ids, char power)
+{
+ return(EV3_motor_port_start(&BT_default_ev3,port_ids,power));
+}
+
+int BT_motor_port_stop(char port_ids, int brake_mode)
+{
+ return(EV3_motor_port_stop(&BT_default_ev3,port_ids,brake_mode));
+}
+
+int BT_all_stop(int brake_mode)
+{
+ return(EV3_all_stop(&BT_default_ev3,brake_mode));
+}
+
+int BT_drive(char lport, char rport, char power)
+{
+ return(EV3_drive(&BT_default_ev3,lport,rport,power));
+}
+
+int BT_turn(char lport, char lpower, char rport, char rpower)
+{
+ return(EV3_turn(&BT_default_ev3,lport,lpower,rport,rpower));
+}
+
+int BT_timed_motor_port_start(char port_id, char power, int ramp_up_time, int run_time, int ramp_down_time)
+{
+ return(EV3_timed_motor_port_start(&BT_default_ev3,port_id,power,ramp_up_time,run_time,ramp_down_time));
+}
+
+int BT_timed_motor_port_start_v2(char port_id, char power, int time)
+{
+ return(EV3_timed_motor_port_start_v2(&BT_default_ev3,port_id,power,time));
+}
+
+void BT_get_type_mode(char sensor_port)
+{
+ EV3_get_type_mode(&BT_default_ev3,sensor_port);
+}
+
+int BT_read_touch_sensor(char sensor_port)
+{
+ return(EV3_read_touch_sensor(&BT_default_ev3,sensor_port));
+}
+
+int BT_read_colour_sensor(char sensor_port)
+{
+ return(EV3_read_colour_sensor(&BT_default_ev3,sensor_port));
+}
+
+int BT_read_colour_sensor_RGB(char sensor_port, int RGB[3])
+{
+ return(EV3_read_colour_sensor_RGB(&BT_default_ev3,sensor_port,RGB));
+}
+
+int BT_read_ultrasonic_sensor(char sensor_port)
+{
+ return(EV3_read_ultrasonic_sensor(&BT_default_ev3,sensor_port));
+}
+
+int BT_read_colour_RGBraw_NXT(char sensor_port, int *R, int *G, int *B, int *A)
+{
+ return(EV3_read_colour_RGBraw_NXT(&BT_default_ev3,sensor_port,R,G,B,A));
+}
+
+int BT_read_gyro(char sensor_port, int reset, int *angle, int *rate)
+{
+ return(EV3_read_gyro(&BT_default_ev3,sensor_port,reset,angle,rate));
+}
+
+int BT_play_sound_file(const char *path, int volume)
+{
+ return(EV3_play_sound_file(&BT_default_ev3,path,volume));
+}
+
+int BT_list_files(char *path, char **msg_reply)
+{
+ return(EV3_list_files(&BT_default_ev3,path,msg_reply));
+}
+
+int BT_upload_file(char const *dest, char const *src)
+{
+ return(EV3_upload_file(&BT_default_ev3,dest,src));
+}
+
+int BT_set_LED_colour(int colour)
+{
+ return(EV3_set_LED_colour(&BT_default_ev3,colour));
+}
+
+int BT_draw_image_from_file(int colour, int x_0, int y_0, const char *file_path)
+{
+ return(EV3_draw_image_from_file(&BT_default_ev3,colour,x_0,y_0,file_path));
+}
+
+int BT_store_current_display(int no)
+{
+ return(EV3_store_current_display(&BT_default_ev3,no));
+}
+
+int BT_restore_previous_display(int no)
+{
+ return(EV3_restore_previous_display(&BT_default_ev3,no));
+}
+
+int BT_read_frame(unsigned char *frame, int maxlen)
+{
+ return(EV3_read_frame(&BT_default_ev3,frame,maxlen));
+}
+
+int BT_submit(unsigned char *cmd_string, int len)
+{
+ return(EV3_submit(&BT_default_ev3,cmd_string,len));
+}
+
+int BT_wait_reply(int msg_id, unsigned char *reply, int maxlen)
+{
+ return(EV3_wait_reply(&BT_default_ev3,msg_id,reply,maxlen));
+}
+
+int BT_inflight()
+{
+ return(EV3_inflight(&BT_default_ev3));
+}
+
+int BT_pump()
+{
+ return(EV3_pump(&BT_default_ev3));
+}
+
+int BT_reply_ready(int msg_id)
+{
+ return(EV3_reply_ready(&BT_default_ev3,msg_id));
+}
+
+int BT_read_snapshot(BT_snapshot_plan *plan, BT_snapshot *snap)
+{
+ return(EV3_read_snapshot(&BT_default_ev3,plan,snap));
+}
+
+int BT_decode_snapshot(const BT_snapshot_plan *plan, const unsigned char *reply, int len, BT_snapshot *snap)
+{
+ return(EV3_decode_snapshot(&BT_default_ev3,plan,reply,len,snap));
+}
+
+int BT_read_batch(BT_batch_plan *plan, BT_snapshot *snaps)
+{
+ return(EV3_read_batch(&BT_default_ev3,plan,snaps));
+}
+
+int BT_decode_batch(const BT_batch_plan *plan, const unsigned char *reply, int len, BT_snapshot *snaps)
+{
+ return(EV3_decode_batch(&BT_default_ev3,plan,reply,len,snaps));
+}
+
+int BT_read_motors(char port_ids, BT_motor_state *state)
+{
+ return(EV3_read_motors(&BT_default_ev3,port_ids,state));
+}
+
+int BT_clear_tacho(char port_ids)
+{
+ return(EV3_clear_tacho(&BT_default_ev3,port_ids));
+}
+
+int BT_speed_step(BT_speed_ctl *ctl)
+{
+ return(EV3_speed_step(&BT_default_ev3,ctl));
+}
+
+int BT_speed_start(BT_speed_ctl *ctl, int rate_hz)
+{
+ return(EV3_speed_start(&BT_default_ev3,ctl,rate_hz));
+}
+
+int BT_drive_sync(char lport, char rport, char speed, int turn, int degrees, int brake_mode)
+{
+ return(EV3_drive_sync(&BT_default_ev3,lport,rport,speed,turn,degrees,brake_mode));
+}
+
+int BT_drive_sync_timed(char lport, char rport, char speed, int turn, int time_ms, int brake_mode)
+{
+ return(EV3_drive_sync_timed(&BT_default_ev3,lport,rport,speed,turn,time_ms,brake_mode));
+}
+
+int BT_motors_busy(char port_ids)
+{
+ return(EV3_motors_busy(&BT_default_ev3,port_ids));
+}
+
+int BT_upload_file_windowed(const char *path_dest, const char *path_src, int window, BT_transfer_stats *stats)
+{
+ return(EV3_upload_file_windowed(&BT_default_ev3,path_dest,path_src,window,stats));
+}
+
+int BT_download_file(const char *path_src, BT_sink sink, void *arg, BT_transfer_stats *stats)
+{
+ return(EV3_download_file(&BT_default_ev3,path_src,sink,arg,stats));
+}
+
+int BT_download_file_fd(const char *path_src, int fd, BT_transfer_stats *stats)
+{
+ return(EV3_download_file_fd(&BT_default_ev3,path_src,fd,stats));
+}
+
+int BT_tail_file(const char *path_src, BT_sink sink, void *arg, int poll_ms, int idle_ms)
+{
+ return(EV3_tail_file(&BT_default_ev3,path_src,sink,arg,poll_ms,idle_ms));
+}
+
+int BT_list_dir(const char *path, BT_dir_entry **entries)
+{
+ return(EV3_list_dir(&BT_default_ev3,path,entries));
+}
+
+int BT_list_dir_cached(const char *path, BT_dir_entry **entries)
+{
+ return(EV3_list_dir_cached(&BT_default_ev3,path,entries));
+}
+
+int BT_file_info(const char *path, BT_dir_entry *entry)
+{
+ return(EV3_file_info(&BT_default_ev3,path,entry));
+}
+
+void BT_dir_invalidate(const char *path)
+{
+ EV3_dir_invalidate(&BT_default_ev3,path);
+}
+
+int BT_sync_files(BT_sync_file *files, int n, BT_sync_stats *stats)
+{
+ return(EV3_sync_files(&BT_default_ev3,files,n,stats));
+}
+
+int BT_capture_start(const char *path)
+{
+ return(EV3_capture_start(&BT_default_ev3,path));
+}
+
+int BT_capture_stop()
+{
+ return(EV3_capture_stop(&BT_default_ev3));
+}
+
+int BT_io_start()
+{
+ return(EV3_io_start(&BT_default_ev3));
+}
+
+int BT_io_stop()
+{
+ return(EV3_io_stop(&BT_default_ev3));
+}
+
+int BT_io_submit(const unsigned char *cmd_string, int len, BT_io_callback callback, void *arg)
+{
+ return(EV3_io_submit(&BT_default_ev3,cmd_string,len,callback,arg));
+}
+
+BT_future *BT_io_submit_future(const unsigned char *cmd_string, int len)
+{
+ return(EV3_io_submit_future(&BT_default_ev3,cmd_string,len));
+}
+
+int BT_io_coalesce(int window_us)
+{
+ return(EV3_io_coalesce(&BT_default_ev3,window_us));
+}
+
+int BT_lane_start(int fence_every)
+{
+ return(EV3_lane_start(&BT_default_ev3,fence_every));
+}
+
+int BT_lane_stop()
+{
+ return(EV3_lane_stop(&BT_default_ev3));
+}
+
+int BT_fence()
+{
+ return(EV3_fence(&BT_default_ev3));
+}
+
+int BT_run_until(char port_ids, char power, const BT_condition *cond, int timeout_ms, int brake_mode, BT_reaction *result)
+{
+ return(EV3_run_until(&BT_default_ev3,port_ids,power,cond,timeout_ms,brake_mode,result));
+}
+
+int BT_turn_until_angle(char lport, char rport, char power, char gyro_port, int degrees, int timeout_ms, BT_reaction *result)
+{
+ return(EV3_turn_until_angle(&BT_default_ev3,lport,rport,power,gyro_port,degrees,timeout_ms,result));
+}
+
+int BT_stop_on_colour(char port_ids, char power, char colour_port, int colour, int timeout_ms, BT_reaction *result)
+{
+ return(EV3_stop_on_colour(&BT_default_ev3,port_ids,power,colour_port,colour,timeout_ms,result));
+}
+
+int BT_program_upload(const char *path_dest, const unsigned char *image, int len)
+{
+ return(EV3_program_upload(&BT_default_ev3,path_dest,image,len));
+}
+
+int BT_program_start(const char *path)
+{
+ return(EV3_program_start(&BT_default_ev3,path));
+}
+
+int BT_program_stop(void)
+{
+ return(EV3_program_stop(&BT_default_ev3));
+}
+
+int BT_program_status(void)
+{
+ return(EV3_program_status(&BT_default_ev3));
 }
@@ -45,6 +45,19 @@
 #include <sys/param.h>
 #include <sys/ioctl.h>
 #include <sys/socket.h>
+#include <sys/un.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/eventfd.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <poll.h>
+#include <sched.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <time.h>
 
 
 // Bluetooth libraries - make sure they are installed in your machine
@@ -57,7 +70,8 @@
 #include "c_com.h"  			//     and is distributed under GPL. Please see the license
 					           //     file included with this distribution for details.
 
-extern int message_id_counter;		// <-- Global message id counter
+// The global message id counter (message_id_counter) is now the counter of the default connection, see the
+// "Connections" section at the end of this file.
 
 // Hex identifiers for the 4 motor ports (defined by Lego)
 #define MOTOR_A 0x01
@@ -113,7 +127,8 @@ extern int message_id_counter;		// <-- Global message id counter
 //
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
-// Set up a socket to communicate with your Lego EV3 kit
+// Set up a socket to communicate with your Lego EV3 kit. device_id is the brick's Bluetooth address, or an
+// address for another kind of link, e.g. "tcp:0016535655D9@192.168.1.50" for WiFi (see Transports below).
 int BT_open(const char *device_id);
 
 // Close open socket to your EV3 ending the communication with the bot
@@ -172,4 +187,655 @@ int BT_set_LED_colour(int colour);
 int BT_draw_image_from_file(int colour, int x_0, int y_0, const char *file_path);
 int BT_restore_previous_display(int no);
 int BT_store_current_display(int no);
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Transports (Oct 2026)
+//
+// BT_open() and EV3_open() choose the kind of link from the start of the address:
+//    00:16:53:56:55:D9                      Bluetooth RFCOMM, channel 1 (also with a "bt:" prefix)
+//    tcp:0016535655D9@192.168.1.50[:5555]   WiFi, to the direct command port of an EV3 with a WiFi dongle. The part
+//                                           before the @ is the brick's serial number (its Bluetooth address without
+//                                           the colons, shown under Brick Info), which the brick asks for before it
+//                                           accepts commands. Round trips are several times shorter than over RFCOMM.
+//    unix:/tmp/ev3.sock                     A stand-in brick serving a Unix domain socket (see btcomm_emu.h)
+//
+// Once connected, every BT_* call works the same over any of them. Other links can be added with BT_add_transport():
+// connect() gets the address without its scheme and returns a connected descriptor that behaves as a stream socket
+// (read(), write() and poll() on it), or -1.
+//
+//    static const BT_transport serial={"serial:","serial",my_open_tty};
+//    BT_add_transport(&serial);
+//    BT_open("serial:/dev/ttyUSB0");
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+typedef struct
+{
+ const char *scheme;						// Address prefix, e.g. "tcp:"
+ const char *name;						// For messages and benchmarks, e.g. "tcp"
+ int (*connect)(const char *address);				// Connected descriptor, or -1
+} BT_transport;
+
+int BT_add_transport(const BT_transport *transport);		// 0, or -1 on error
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Pipelined command engine (Oct 2026)
+//
+// The functions above send a command and then wait for its reply before returning, so every call costs one full
+// Bluetooth round trip. The calls below split that in two: BT_submit() stamps the message counter into bytes 2-3
+// (the cnt_id field) and sends the command right away, BT_wait_reply() collects the reply for a given message id.
+// Replies for other messages that arrive in the meantime are parked until their owner asks for them, so you can
+// keep up to BT_MAX_INFLIGHT requests travelling to the EV3 at the same time:
+//
+//    id1=BT_submit(cmd1,len1);      <-- both commands are on their way
+//    id2=BT_submit(cmd2,len2);
+//    BT_wait_reply(id1,reply,1024);  <-- this round trip overlaps with the one for cmd2
+//    BT_wait_reply(id2,reply,1024);
+//
+// Commands of type 0x80/0x81 (no reply) are sent, but not tracked.
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+#define BT_MAX_INFLIGHT 32
+#define BT_MAX_REPLY 1024
+#define BT_RX_BUFFER 4096
+
+int BT_attach(int fd);							// Use an already connected socket (e.g. a stand-in brick)
+int BT_submit(unsigned char *cmd_string, int len);			// Returns the message id, or -1
+int BT_wait_reply(int msg_id, unsigned char *reply, int maxlen);	// Returns the reply length, or -1
+int BT_inflight(void);							// Number of replies not yet collected
+
+// Reply framing - reads the 2-byte length field and then exactly that many bytes, keeping any bytes that belong
+// to the next reply for the next call. All BT_* calls read their replies through this, so a reply that RFCOMM
+// splits over several reads, or merges with the next one, is still delivered whole to the right caller.
+int BT_read_frame(unsigned char *frame, int maxlen);			// Returns the frame length, or -1
+
+// Event loops - rather than blocking in BT_wait_reply(), wait until the socket (BT_default_ev3.socket) is readable
+// with poll(), epoll or similar, call BT_pump() to file the replies that have arrived, and collect the ones that
+// BT_reply_ready() reports with BT_wait_reply(), which then returns at once. btcomm_async.h builds on this.
+int BT_pump(void);							// Replies filed, or -1. Never blocks.
+int BT_reply_ready(int msg_id);						// 1 if arrived, 0 if not, -1 if unknown
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Sensor snapshot (Oct 2026)
+//
+// Reading the touch, colour, ultrasonic and gyro sensors one after the other costs one round trip each. A snapshot
+// reads every configured input port, plus the tacho counts of the selected motors, with a single direct command.
+// Describe what is plugged in where with a BT_port_map, prepare the command once with BT_snapshot_init(), then
+// call BT_read_snapshot() every time you need fresh values:
+//
+//    BT_port_map map={{BT_SENSOR_TOUCH, BT_SENSOR_GYRO, BT_SENSOR_COLOUR, BT_SENSOR_ULTRASONIC}, MOTOR_A|MOTOR_B};
+//    BT_snapshot_plan plan;
+//    BT_snapshot snap;
+//    BT_snapshot_init(&plan,&map);
+//    while (...) { BT_read_snapshot(&plan,&snap); ... snap.touch[PORT_1], snap.angle[PORT_2], snap.tacho[0] ... }
+//
+// Values are in the same units as the single-sensor calls above. Only the entries for the configured ports are
+// filled in. Gyro angles are relative to the reference set with BT_read_gyro(...,1,...).
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+#define BT_SENSOR_NONE 0
+#define BT_SENSOR_TOUCH 1
+#define BT_SENSOR_COLOUR 2					// Indexed colour (see BT_read_colour_sensor())
+#define BT_SENSOR_COLOUR_RGB 3
+#define BT_SENSOR_ULTRASONIC 4
+#define BT_SENSOR_GYRO 5
+
+typedef struct
+{
+ int sensor[4];							// BT_SENSOR_* plugged into PORT_1 to PORT_4
+ char motors;							// Motors whose tacho count is read, e.g. MOTOR_A|MOTOR_B
+} BT_port_map;
+
+typedef struct
+{
+ int touch[4];							// Indexed by input port (PORT_1 to PORT_4)
+ int colour[4];
+ int RGB[4][3];
+ int distance[4];						// mm
+ int angle[4];							// degrees
+ int rate[4];							// degrees/s
+ int tacho[4];							// Indexed by motor (0=A, 1=B, 2=C, 3=D), in degrees
+} BT_snapshot;
+
+typedef struct
+{
+ BT_port_map map;
+ int len;							// Length of the prepared command
+ int offset[4];							// Global variable offset of each port's first value
+ int tacho_offset[4];						// Global variable offset of each motor's count
+ unsigned char cmd_string[128];
+} BT_snapshot_plan;
+
+int BT_snapshot_init(BT_snapshot_plan *plan, const BT_port_map *map);
+int BT_read_snapshot(BT_snapshot_plan *plan, BT_snapshot *snap);
+int BT_decode_snapshot(const BT_snapshot_plan *plan, const unsigned char *reply, int len, BT_snapshot *snap);
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// On-brick sampling (Oct 2026)
+//
+// Polling with snapshots still costs one round trip per sample, and the samples are only as evenly spaced as the
+// Bluetooth link allows. A batch has the EV3 take a number of snapshots itself, period_ms apart (timed by the
+// brick's own timer), and return all of them in a single reply:
+//
+//    BT_batch_plan plan;
+//    BT_snapshot snaps[50];
+//    n=BT_batch_init(&plan,&map,10,50);         <-- 50 samples, 10ms apart, in one command
+//    BT_read_batch(&plan,&snaps[0]);             <-- returns after about 500ms plus one round trip
+//
+// Use samples=0 to get as many per batch as fit in one command (the 1024 byte command and 1019 byte reply limits
+// both apply). For continuous sampling, keep two batches queued so the brick starts the next one as soon as the
+// current one is done, e.g. with BT_submit()/BT_wait_reply() or BT_io_submit(), and decode each reply with
+// BT_decode_batch(). Or let a stream do it - see BT_stream_start_batched() in btcomm_stream.h.
+//
+// Each sample is read exactly as BT_read_snapshot() does; the EV3 VM has opINPUT_SAMPLE for this, but it needs
+// array handles that cannot be returned by a direct command, so the batch is an unrolled sequence of reads.
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+typedef struct
+{
+ BT_port_map map;
+ int samples;							// Samples per batch
+ int period_ms;							// Time between samples
+ int len;							// Length of the prepared command
+ unsigned char cmd_string[1024];
+} BT_batch_plan;
+
+int BT_batch_init(BT_batch_plan *plan, const BT_port_map *map, int period_ms, int samples);	// Samples per batch, or -1
+int BT_read_batch(BT_batch_plan *plan, BT_snapshot *snaps);
+int BT_decode_batch(const BT_batch_plan *plan, const unsigned char *reply, int len, BT_snapshot *snaps);
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Motor feedback and speed control (Oct 2026)
+//
+// BT_read_motors() reads the tacho count (degrees turned since the count was last cleared) and the speed reported
+// by the brick for any set of motors, in one command. BT_clear_tacho() zeroes the counts.
+//
+// A BT_speed_ctl holds the motors at a given speed in degrees per second by measuring how far each one turned since
+// the last step and correcting its power with a PID controller. Each step is one read and one (unanswered) power
+// command, whatever the number of motors. Call BT_speed_step() at a fixed rate from your own loop, or let
+// BT_speed_start() run it in the background:
+//
+//    BT_speed_ctl ctl;
+//    BT_speed_init(&ctl,MOTOR_A|MOTOR_D,0.08,0.4,0.0);   <-- gains, in power % per deg/s, deg and deg/s^2
+//    BT_speed_set(&ctl,MOTOR_A|MOTOR_D,360);               <-- one turn per second
+//    BT_speed_start(&ctl,50);                              <-- 50 steps per second
+//    ...  BT_speed_set(&ctl,MOTOR_D,180); ...
+//    BT_speed_stop(&ctl,1);                                <-- stop the loop, brake the motors
+//
+// Like BT_stream_start(), BT_speed_start() hands the connection to the I/O thread if it is not already there, so
+// the rest of the program can keep using it while the controller runs.
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+typedef struct
+{
+ int tacho[4];							// Indexed by motor (0=A, 1=B, 2=C, 3=D), in degrees
+ int speed[4];							// As reported by the brick, in [-100, 100]
+} BT_motor_state;
+
+typedef struct
+{
+ char motors;							// Motors under control, e.g. MOTOR_A|MOTOR_B
+ double kp, ki, kd;						// Gains
+ double target[4];						// deg/s, indexed by motor - use BT_speed_set()
+ // Controller state, indexed by motor
+ double speed[4];						// Measured speed in the last step, deg/s
+ int power[4];							// Power sent in the last step
+ double integral[4], error[4];
+ int tacho[4];
+ long long t_ns;						// Time of the last reading, 0 before the first step
+ // Background loop
+ struct BT_ev3 *ev3;
+ int period_ms, stop, started_io;
+ pthread_t thread;
+} BT_speed_ctl;
+
+int BT_read_motors(char port_ids, BT_motor_state *state);		// 0, or -1 on error
+int BT_clear_tacho(char port_ids);
+void BT_speed_init(BT_speed_ctl *ctl, char port_ids, double kp, double ki, double kd);
+void BT_speed_set(BT_speed_ctl *ctl, char port_ids, double deg_per_s);
+int BT_speed_step(BT_speed_ctl *ctl);						// 0, or -1 on error
+int BT_speed_start(BT_speed_ctl *ctl, int rate_hz);
+int BT_speed_stop(BT_speed_ctl *ctl, int brake_mode);
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Synchronized drive (Oct 2026)
+//
+// BT_drive() and BT_turn() set the power of each wheel separately, so the wheels drift apart as soon as one motor
+// is a little stronger than the other. These calls use the brick's own synchronization (opOUTPUT_STEP_SYNC and
+// opOUTPUT_TIME_SYNC): the two motors are speed regulated and locked to each other, so a straight drive stays
+// straight and a turn keeps its radius, with no correction traffic over Bluetooth.
+//
+// lport and rport are single motors (MOTOR_A, ...). The lower lettered of the two is the leader and runs at the
+// given speed. turn is in [-200, 200]: 0 drives straight, at 100 the follower stands still, and at 200 it runs at
+// full speed the other way (spin on the spot). Negative values slow the leader instead of the follower.
+// BT_drive_sync() stops after the leader has turned the given number of degrees (0 keeps going until stopped),
+// BT_drive_sync_timed() after the given time. brake_mode is as for BT_motor_port_stop().
+//
+// Both return as soon as the brick has accepted the command; BT_motors_busy() tells whether the motion is done.
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+int BT_drive_sync(char lport, char rport, char speed, int turn, int degrees, int brake_mode);
+int BT_drive_sync_timed(char lport, char rport, char speed, int turn, int time_ms, int brake_mode);
+int BT_motors_busy(char port_ids);					// 1 if busy, 0 if not, -1 on error
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// File transfer (Oct 2026)
+//
+// BT_upload_file() keeps up to BT_UPLOAD_WINDOW CONTINUE_DOWNLOAD chunks travelling to the brick at once, instead of
+// waiting for each chunk to be acknowledged before sending the next, and matches the acknowledgements to the chunks
+// by message id. BT_upload_file_windowed() lets you pick the window (1 gives the old one-chunk-at-a-time behaviour)
+// and reports how the transfer went:
+//
+//    BT_transfer_stats stats;
+//    BT_upload_file_windowed("../prjs/demo/song.rsf","song.rsf",16,&stats);
+//    printf("%.1f KB/s\n",stats.bytes/stats.seconds/1024);
+//
+// Both work with or without the I/O thread. stats may be NULL.
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+#define BT_UPLOAD_WINDOW 8
+
+typedef struct
+{
+ int chunks;							// Chunks transferred
+ long long bytes;						// Payload bytes transferred
+ double seconds;						// Wall time for the whole transfer
+ double chunk_us_min, chunk_us_avg, chunk_us_max;		// Time from sending a chunk to its acknowledgement
+} BT_transfer_stats;
+
+int BT_upload_file_windowed(const char *path_dest, const char *path_src, int window, BT_transfer_stats *stats);
+
+// Downloads go the other way, brick to PC. Each piece of the file is handed to a sink as soon as it arrives, so
+// no buffer the size of the file is needed. The sink returns 0 to go on, 1 to stop early, or -1 to abort with an
+// error. BT_download_file() reads a complete file (BEGIN_UPLOAD/CONTINUE_UPLOAD - "upload" from the brick's point
+// of view), keeping BT_UPLOAD_WINDOW requests in flight. BT_tail_file() follows a file that a program on the
+// brick is still writing, such as a datalog (BEGIN_GETFILE/CONTINUE_GETFILE): whenever there is no new data it
+// waits poll_ms and asks again, until the sink asks to stop or nothing new has arrived for idle_ms (0 = never).
+//
+//    int fd=open("run1.rdf",O_WRONLY|O_CREAT|O_TRUNC,0644);
+//    BT_download_file_fd("../prjs/logger/run1.rdf",fd,NULL);
+//
+// All return 0 on success, the brick's status code if it refused the request, or -1 on any other error.
+#define BT_DOWNLOAD_CHUNK 1012						// Payload bytes per request
+
+typedef int (*BT_sink)(void *arg, const unsigned char *data, int len);
+
+int BT_download_file(const char *path_src, BT_sink sink, void *arg, BT_transfer_stats *stats);
+int BT_download_file_fd(const char *path_src, int fd, BT_transfer_stats *stats);
+int BT_tail_file(const char *path_src, BT_sink sink, void *arg, int poll_ms, int idle_ms);
+
+// Directory listings are read in pages (LIST_FILES, then CONTINUE_LIST_FILES), so they are no longer cut off after
+// one reply, and parsed into entries. Listings are cached per connection, keyed by the path as given, so checking
+// again whether a file is on the brick costs no Bluetooth traffic. Uploads through this library drop the cached
+// listing of the destination directory; anything else that changes the brick's files (a program running on it,
+// another PC) is not seen until you call BT_dir_invalidate().
+//
+//    BT_dir_entry e;
+//    if (BT_file_info("../prjs/demo/song.rsf",&e)!=1) BT_upload_file("../prjs/demo/song.rsf","song.rsf");
+typedef struct
+{
+ char name[256];						// Without the trailing '/' of directories
+ int is_dir;
+ long long size;						// Files only
+ char md5[33];							// Files only, 32 hex digits
+} BT_dir_entry;
+
+int BT_list_dir(const char *path, BT_dir_entry **entries);		// Number of entries (free() the array), or -1
+int BT_list_dir_cached(const char *path, BT_dir_entry **entries);	// The same, from the cache when possible
+int BT_file_info(const char *path, BT_dir_entry *entry);		// 1 if the file exists, 0 if not, -1 on error
+void BT_dir_invalidate(const char *path);				// Forget path and its directory, NULL for all
+
+// BT_sync_files() brings a set of files on the brick up to date. Each local file is hashed and compared with the
+// MD5 and size in the (cached) listing of its destination directory, and only the files that differ are uploaded.
+// The uploads share one window of BT_UPLOAD_WINDOW requests in flight, and up to BT_SYNC_OPEN files are open on
+// the brick at once, so the next file is opened while the chunks of the previous one are still on their way:
+//
+//    BT_sync_file files[]={{"img/logo.rgf","../prjs/demo/logo.rgf"},{"snd/beep.rsf","../prjs/demo/beep.rsf"}};
+//    BT_sync_files(files,2,&stats);     <-- files[i].uploaded and files[i].status tell what happened to each
+//
+// Returns 0 if every file is up to date afterwards, or -1 if any failed.
+#define BT_SYNC_OPEN 4
+
+typedef struct
+{
+ const char *path_src;						// Local file
+ const char *path_dest;						// Where it goes on the brick
+ int uploaded;							// Set to 1 if it was uploaded, 0 if it was already there
+ int status;							// 0, the brick's status code, or -1 on any other error
+} BT_sync_file;
+
+typedef struct
+{
+ int files, skipped, uploaded, failed;
+ long long bytes;						// Payload bytes uploaded
+ double seconds;
+} BT_sync_stats;
+
+int BT_sync_files(BT_sync_file *files, int n, BT_sync_stats *stats);
+void BT_md5(const void *data, long long len, char hex[33]);		// MD5 in the form used by the listings
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Wire capture (Oct 2026)
+//
+// BT_capture_start() records every command sent to the brick and every reply received from it, with a nanosecond
+// timestamp, into a binary file. Unlike the __BT_debug hex dumps, recording a frame costs only a copy into a
+// lock-free ring; a background thread writes the ring out to the file. If the writer falls behind, frames are
+// dropped and counted rather than slowing the connection down.
+//
+//    BT_capture_start("run.btcap");
+//    ... program runs as usual ...
+//    BT_capture_stop();                  <-- returns the number of dropped frames
+//
+// File format (little endian): the 8 bytes "BTCAP\0\1\0", then one record per frame:
+//    8 bytes   time in ns since the capture started
+//    1 byte    BT_CAPTURE_TX (to the brick) or BT_CAPTURE_RX (from the brick)
+//    1 byte    reserved, 0
+//    2 bytes   frame length
+//    ...       the frame, length field included
+//
+// btcomm_replay plays a capture back against the stand-in brick (see btcomm_emu.h), keeping the original timing.
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+#define BT_CAPTURE_RING 1024					// Frames buffered between the connection and the file
+#define BT_CAPTURE_TX 0
+#define BT_CAPTURE_RX 1
+
+typedef struct
+{
+ long long t_ns;
+ int dir;
+ int len;
+ unsigned char data[BT_MAX_REPLY];
+} BT_capture_record;
+
+int BT_capture_start(const char *path);
+int BT_capture_stop(void);							// Dropped frames, or -1
+int BT_capture_read(FILE *fp, BT_capture_record *record);			// 1 per record, 0 at the end, -1 on error
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// I/O thread (Oct 2026)
+//
+// message_id_counter and the socket are shared by every call above, so normally only one thread may talk to the
+// EV3. After BT_io_start() a dedicated I/O thread owns the connection instead. Other threads hand it encoded
+// commands through a lock-free queue, and it sends them, matches the replies by message id, and hands them back.
+// From then on the BT_* calls may be used from any number of threads at once - each one waits only for its own
+// reply, and their round trips overlap. Commands can also be handed over directly:
+//
+//    BT_io_submit(cmd,len,on_reply,arg);       <-- on_reply(arg,reply,len) runs on the I/O thread
+//    f=BT_io_submit_future(cmd,len);           <-- or collect the reply later, from any thread
+//    ...
+//    BT_future_wait(f,reply,1024);
+//
+// The I/O thread stamps its own message ids into commands, so callers need not. Callbacks should be short, as no
+// other reply is processed while one runs, and must not wait for other requests. BT_submit() and BT_wait_reply()
+// are not available while the I/O thread is running. BT_close() stops it.
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+#define BT_IO_QUEUE 256							// Requests waiting to be picked up (power of 2)
+#define BT_IO_TX_BUFFER 4096						// Bytes per connection waiting for room in the socket
+
+typedef void (*BT_io_callback)(void *arg, const unsigned char *reply, int len);	// len is -1 on error
+typedef struct BT_io_request BT_future;
+
+int BT_io_start(void);
+int BT_io_stop(void);
+int BT_io_submit(const unsigned char *cmd_string, int len, BT_io_callback callback, void *arg);
+BT_future *BT_io_submit_future(const unsigned char *cmd_string, int len);	// NULL on error
+int BT_future_wait(BT_future *future, unsigned char *reply, int maxlen);	// Returns the reply length, or -1
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Command coalescing (Oct 2026)
+//
+// Every direct command normally travels in its own packet, with its own header and its own round trip. With a
+// coalescing window set, the I/O thread holds direct commands for up to that many microseconds and sends all that
+// arrived in the meantime as one direct command of up to 1024 bytes. Each command's variables are moved to its own
+// part of the shared global and local areas, and the reply is cut back into one reply per command, so callers see
+// exactly what they would have seen without coalescing:
+//
+//    BT_io_start();
+//    BT_io_coalesce(2000);                     <-- Gather commands for up to 2ms
+//    ...                                       <-- e.g. several threads calling BT_motor_port_start(), BT_set_LED_colour()
+//    BT_io_coalesce(0);                        <-- Back to one packet per command
+//
+// This pays off when commands arrive in bursts - from several threads, coroutines or BT_io_submit() calls - and
+// costs up to the window in latency otherwise. Commands that do not ask for a reply are reported as sent once they
+// have joined a packet. Commands are merged only if every opcode in them is one the library itself sends, and not
+// if they wait on the brick (opTIMER_READY, opOUTPUT_READY, opSOUND_READY), which would hold up the replies of the
+// commands sharing their packet; those go out on their own, in order. If the brick reports an error for a packet,
+// every command in it gets the error reply. System commands are never merged.
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+int BT_io_coalesce(int window_us);					// 0 turns coalescing off
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// No-reply lane (Oct 2026)
+//
+// Each actuator call - BT_motor_port_stop(), BT_drive(), BT_set_LED_colour() and the other calls that only set
+// something on the brick - normally waits for the brick to confirm the command. On the no-reply lane they are sent
+// as DIRECT_COMMAND_NO_REPLY instead, and return as soon as the command is on its way, so a control loop can update
+// its motors at the rate the link carries commands rather than one per round trip:
+//
+//    BT_lane_start(16);                        <-- Fence after every 16 actuator calls
+//    for (...) BT_drive(MOTOR_A,MOTOR_D,power);
+//    if (BT_fence()<0) ...                     <-- Everything sent so far has been run by the brick
+//    BT_lane_stop();                           <-- Back to confirmed calls (with a final fence)
+//
+// A fence is a reply-requesting opNOP. The brick runs direct commands in order, so its reply means every command
+// sent before it has been run. The lane's own fences go out every fence_every actuator calls without waiting;
+// the call that sends the next one first waits for the one before, so no more than about 2*fence_every commands
+// are ever unconfirmed, and a link that has failed is reported within that many calls. Without fences (0) nothing
+// is confirmed until BT_fence(). The brick does not report errors for commands that ask for no reply, so a fence
+// confirms that commands were run, not that they succeeded.
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+int BT_lane_start(int fence_every);					// fence_every actuator calls, 0 for none
+int BT_lane_stop(void);							// Returns as BT_fence()
+int BT_fence(void);							// 0 once all sent so far has run, -1 on error
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// On-brick reactions (Oct 2026)
+//
+// "Drive until the touch sensor is pressed" done from the PC means polling the sensor and stopping the motors one
+// round trip late, so the robot overshoots by however far it travels in that time. A reaction is compiled into a
+// single direct command that starts the motors, loops on the brick reading the sensor, and stops the motors as
+// soon as the condition holds - the brick reacts within a pass of its VM loop instead of a Bluetooth round trip:
+//
+//    BT_condition touch={PORT_1, 16, 0, BT_UNTIL_AT_LEAST, 1, 0};	<-- Touch sensor reads 1 (pressed)
+//    BT_reaction r;
+//    if (BT_run_until(MOTOR_A|MOTOR_D,40,&touch,5000,1,&r)==1) ...	<-- Met, motors braked after r.elapsed_ms
+//    BT_turn_until_angle(MOTOR_A,MOTOR_D,30,PORT_2,90,3000,&r);	<-- Spin on the spot until the gyro has turned 90
+//    BT_stop_on_colour(MOTOR_A|MOTOR_D,30,PORT_3,5,10000,&r);	<-- Until the colour sensor sees red
+//
+// Readings are taken in the mode's SI units and compared as whole numbers (fractions are dropped). With relative
+// set, the threshold is added to the reading taken just before the motors start, e.g. "30 degrees more than now".
+// Each call returns when the condition was met or timeout_ms ran out, whichever comes first; the motors are
+// stopped either way. The brick runs direct commands one at a time, so nothing else sent to it runs until the
+// reaction ends - keep the timeout short enough for that. To run a reaction without blocking, build it with
+// BT_compile_reaction(), send it with BT_io_submit() or BT_submit() and decode the reply with BT_decode_reaction().
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+#define BT_UNTIL_AT_LEAST 0						// Reading >= value
+#define BT_UNTIL_AT_MOST 1						// Reading <= value
+#define BT_UNTIL_EQUAL 2
+#define BT_UNTIL_NOT_EQUAL 3
+
+typedef struct
+{
+ int port;							// PORT_1 to PORT_4
+ int type, mode;						// EV3 sensor type and mode, e.g. 32 and 0 for a gyro's angle
+ int until;							// BT_UNTIL_*
+ int value;							// Threshold
+ int relative;							// If not zero, value is relative to the first reading
+} BT_condition;
+
+typedef struct
+{
+ int met;							// 1 if the condition was met, 0 if the time ran out
+ int reading;							// Last reading taken
+ int elapsed_ms;						// From starting the motors to stopping them
+} BT_reaction;
+
+// Motors lport run at lpower and rport (which may be 0) at rpower. Returns the command length, or -1.
+int BT_compile_reaction(unsigned char *cmd_string, char lport, char lpower, char rport, char rpower,
+                        const BT_condition *cond, int timeout_ms, int brake_mode);
+int BT_decode_reaction(const unsigned char *reply, int len, BT_reaction *result);	// 1 met, 0 timed out, -1
+int BT_run_until(char port_ids, char power, const BT_condition *cond, int timeout_ms, int brake_mode, BT_reaction *result);
+int BT_turn_until_angle(char lport, char rport, char power, char gyro_port, int degrees, int timeout_ms, BT_reaction *result);
+int BT_stop_on_colour(char port_ids, char power, char colour_port, int colour, int timeout_ms, BT_reaction *result);
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// On-brick programs (Oct 2026)
+//
+// A reaction (above) holds the brick's direct command slot while it runs, so it suits a short move, not control
+// logic that has to keep reacting within a few milliseconds for a whole run. That logic can be a program in the
+// brick's user slot instead: built on the PC as a program image (the contents of an .rbf file - BT_asm_image() in
+// btcomm_asm.h assembles one from text), uploaded once, and started and stopped by name. Direct commands keep
+// working while it runs, so the PC supervises over Bluetooth:
+//
+//    len=BT_asm_image(source,image,sizeof(image));
+//    BT_program_upload("../prjs/follow/follow.rbf",image,len);	<-- Once
+//    BT_program_start("../prjs/follow/follow.rbf");		<-- Loads the image into the user slot and runs it
+//    while (BT_program_status()==RUNNING) ...			<-- Sensors, motors and status can still be read
+//    BT_program_stop();						<-- The brick stops the motors as the program ends
+//
+// Starting a program stops the one already running in the user slot. Paths are as for BT_upload_file().
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+#define BT_IMAGE_HEADER 28						// Image header (16 bytes) and one object header (12)
+
+int BT_program_upload(const char *path_dest, const unsigned char *image, int len);	// 0, or -1
+int BT_program_start(const char *path);						// 0, or -1 if it could not be loaded
+int BT_program_stop(void);
+int BT_program_status(void);			// RUNNING or STOPPED (bytecodes.h), or -1
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Connections (Oct 2026)
+//
+// Everything that belongs to one link - socket, message counter, gyro reference angle and reply buffers - is kept
+// in a BT_ev3, so one program can drive several bricks. Each BT_* call has an EV3_* twin that takes the connection
+// as its first argument:
+//
+//    BT_ev3 *left=EV3_open("00:16:53:56:55:D9");
+//    BT_ev3 *right=EV3_open("00:16:53:4A:19:2C");
+//    EV3_drive(left,MOTOR_A,MOTOR_D,50);
+//    EV3_read_touch_sensor(right,PORT_1);
+//    EV3_close(left);
+//
+// The BT_* calls work on a built-in default connection (BT_default_ev3), so existing programs are unchanged.
+//
+// EV3_io_start() hands a connection to the I/O thread. There is only one I/O thread however many connections
+// it serves - it waits on all of their sockets with epoll - so dozens of bricks can be kept busy from one thread.
+// The fields below are managed by the library; do not change them.
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+typedef struct
+{
+ int msg_id;							// Low 16 bits of the message counter (cnt_id field)
+ int state;
+ int len;							// Reply length including the 2-byte length field
+ unsigned char data[BT_MAX_REPLY];
+} BT_pending_slot;
+
+typedef struct BT_ev3
+{
+ int socket;							// -1 when not connected
+ const BT_transport *transport;				// How socket was opened, NULL for EV3_attach()
+ int msg_id;							// Message id counter
+ int ref_angle;							// Reference angle, once set it makes the current
+								// measurement from gyro equal to 0 degrees
+ // Pipelined command engine - one slot per request in flight
+ BT_pending_slot pending[BT_MAX_INFLIGHT];
+ int n_inflight;
+ // Reply framing - bytes between rx_start and rx_end have been read but not handed out yet
+ unsigned char rx_buf[BT_RX_BUFFER];
+ int rx_start, rx_end;
+ // I/O thread - while io_running is set, only the I/O thread touches the socket and the buffers above
+ int io_running;
+ int io_users;							// Callers between checking io_running and queueing a request
+ int io_attached, io_failed;
+ int io_msg_id;
+ struct BT_io_request *io_slot[BT_MAX_INFLIGHT];
+ int io_slot_id[BT_MAX_INFLIGHT];
+ struct BT_io_request *io_backlog, **io_backlog_end;
+ unsigned char io_tx[BT_IO_TX_BUFFER];				// Commands sent but not yet taken by the socket, which
+ int io_tx_start, io_tx_end, io_tx_armed;			// is non-blocking while the I/O thread has it
+ int io_flags;							// The socket's file status flags before that
+ struct BT_io_request *io_detach;				// Detach request waiting for io_tx to drain
+ // Command coalescing - the window, and the packet being gathered while it is open
+ int io_coalesce_us;
+ struct BT_io_request *io_merge;
+ long long io_merge_due;
+ struct BT_ev3 *io_merge_next;					// Next connection with a packet being gathered
+ // No-reply lane - whether actuator calls skip their replies, and the lane's fence still waiting for its reply
+ int lane_on, lane_every, lane_count, lane_failed;
+ int lane_fence_sent, lane_fence_id;
+ struct BT_io_request *lane_fence_future;
+ // Cached directory listings
+ struct BT_dir_cache *dir_cache;
+ // Wire capture
+ struct BT_capture *capture;
+ int capture_users;
+ // Runtime statistics - when each command awaiting a reply was sent and which entry it counts under, indexed by
+ // the low byte of its message id
+ long long stats_sent[256];
+ short stats_key[256];
+} BT_ev3;
+
+extern BT_ev3 BT_default_ev3;
+#define message_id_counter (BT_default_ev3.msg_id)
+
+BT_ev3 *EV3_open(const char *device_id);				// Returns NULL on error
+BT_ev3 *EV3_attach(int fd);
+int EV3_close(BT_ev3 *ev3);
+int EV3_setEV3name(BT_ev3 *ev3, const char *name);
+int EV3_play_tone_sequence(BT_ev3 *ev3, const int tone_data[50][3]);
+int EV3_motor_port_start(BT_ev3 *ev3, char port_ids, char power);
+int EV3_motor_port_stop(BT_ev3 *ev3, char port_ids, int brake_mode);
+int EV3_all_stop(BT_ev3 *ev3, int brake_mode);
+int EV3_drive(BT_ev3 *ev3, char lport, char rport, char power);
+int EV3_turn(BT_ev3 *ev3, char lport, char lpower,  char rport, char rpower);
+int EV3_timed_motor_port_start(BT_ev3 *ev3, char port_id, char power, int ramp_up_time, int run_time, int ramp_down_time);
+int EV3_timed_motor_port_start_v2(BT_ev3 *ev3, char port_id, char power, int time);
+void EV3_get_type_mode(BT_ev3 *ev3, char sensor_port);
+int EV3_read_touch_sensor(BT_ev3 *ev3, char sensor_port);
+int EV3_read_colour_sensor(BT_ev3 *ev3, char sensor_port);
+int EV3_read_colour_sensor_RGB(BT_ev3 *ev3, char sensor_port, int RGB[3]);
+int EV3_read_ultrasonic_sensor(BT_ev3 *ev3, char sensor_port);
+int EV3_play_sound_file(BT_ev3 *ev3, const char *path, int volume);
+int EV3_read_gyro(BT_ev3 *ev3, char sensor_port, int reset, int *angle, int *rate);
+int EV3_read_colour_RGBraw_NXT(BT_ev3 *ev3, char sensor_port, int *R, int *G, int *B, int *A);
+int EV3_list_files(BT_ev3 *ev3, char *path, char **contents);
+int EV3_upload_file(BT_ev3 *ev3, const char *path_dest, const char *path_src);
+int EV3_set_LED_colour(BT_ev3 *ev3, int colour);
+int EV3_draw_image_from_file(BT_ev3 *ev3, int colour, int x_0, int y_0, const char *file_path);
+int EV3_restore_previous_display(BT_ev3 *ev3, int no);
+int EV3_store_current_display(BT_ev3 *ev3, int no);
+int EV3_submit(BT_ev3 *ev3, unsigned char *cmd_string, int len);
+int EV3_wait_reply(BT_ev3 *ev3, int msg_id, unsigned char *reply, int maxlen);
+int EV3_inflight(BT_ev3 *ev3);
+int EV3_pump(BT_ev3 *ev3);
+int EV3_reply_ready(BT_ev3 *ev3, int msg_id);
+int EV3_read_frame(BT_ev3 *ev3, unsigned char *frame, int maxlen);
+int EV3_read_snapshot(BT_ev3 *ev3, BT_snapshot_plan *plan, BT_snapshot *snap);
+int EV3_decode_snapshot(BT_ev3 *ev3, const BT_snapshot_plan *plan, const unsigned char *reply, int len, BT_snapshot *snap);
+int EV3_read_batch(BT_ev3 *ev3, BT_batch_plan *plan, BT_snapshot *snaps);
+int EV3_decode_batch(BT_ev3 *ev3, const BT_batch_plan *plan, const unsigned char *reply, int len, BT_snapshot *snaps);
+int EV3_read_motors(BT_ev3 *ev3, char port_ids, BT_motor_state *state);
+int EV3_clear_tacho(BT_ev3 *ev3, char port_ids);
+int EV3_speed_step(BT_ev3 *ev3, BT_speed_ctl *ctl);
+int EV3_speed_start(BT_ev3 *ev3, BT_speed_ctl *ctl, int rate_hz);
+int EV3_drive_sync(BT_ev3 *ev3, char lport, char rport, char speed, int turn, int degrees, int brake_mode);
+int EV3_drive_sync_timed(BT_ev3 *ev3, char lport, char rport, char speed, int turn, int time_ms, int brake_mode);
+int EV3_motors_busy(BT_ev3 *ev3, char port_ids);
+int EV3_upload_file_windowed(BT_ev3 *ev3, const char *path_dest, const char *path_src, int window, BT_transfer_stats *stats);
+int EV3_download_file(BT_ev3 *ev3, const char *path_src, BT_sink sink, void *arg, BT_transfer_stats *stats);
+int EV3_download_file_fd(BT_ev3 *ev3, const char *path_src, int fd, BT_transfer_stats *stats);
+int EV3_tail_file(BT_ev3 *ev3, const char *path_src, BT_sink sink, void *arg, int poll_ms, int idle_ms);
+int EV3_list_dir(BT_ev3 *ev3, const char *path, BT_dir_entry **entries);
+int EV3_list_dir_cached(BT_ev3 *ev3, const char *path, BT_dir_entry **entries);
+int EV3_file_info(BT_ev3 *ev3, const char *path, BT_dir_entry *entry);
+void EV3_dir_invalidate(BT_ev3 *ev3, const char *path);
+int EV3_sync_files(BT_ev3 *ev3, BT_sync_file *files, int n, BT_sync_stats *stats);
+int EV3_capture_start(BT_ev3 *ev3, const char *path);
+int EV3_capture_stop(BT_ev3 *ev3);
+int EV3_io_start(BT_ev3 *ev3);
+int EV3_io_stop(BT_ev3 *ev3);
+int EV3_io_submit(BT_ev3 *ev3, const unsigned char *cmd_string, int len, BT_io_callback callback, void *arg);
+BT_future *EV3_io_submit_future(BT_ev3 *ev3, const unsigned char *cmd_string, int len);
+int EV3_io_coalesce(BT_ev3 *ev3, int window_us);
+int EV3_lane_start(BT_ev3 *ev3, int fence_every);
+int EV3_lane_stop(BT_ev3 *ev3);
+int EV3_fence(BT_ev3 *ev3);
+int EV3_run_until(BT_ev3 *ev3, char port_ids, char power, const BT_condition *cond, int timeout_ms, int brake_mode, BT_reaction *result);
+int EV3_turn_until_angle(BT_ev3 *ev3, char lport, char rport, char power, char gyro_port, int degrees, int timeout_ms, BT_reaction *result);
+int EV3_stop_on_colour(BT_ev3 *ev3, char port_ids, char power, char colour_port, int colour, int timeout_ms, BT_reaction *result);
+int EV3_program_upload(BT_ev3 *ev3, const char *path_dest, const unsigned char *image, int len);
+int EV3_program_start(BT_ev3 *ev3, const char *path);
+int EV3_program_stop(BT_ev3 *ev3);
+int EV3_program_status(BT_ev3 *ev3);
 #endif
@@ -0,0 +1,1338 @@
+/***********************************************************************************************************************
+ *
+ * 	Byte code assembler and disassembler for the BT Communications library - see btcomm_asm.h for an overview.
+ *
+ *      This library is free software, distributed under the GPL license. Please see the attached license file for
+ *      details.
+ *
+ * ********************************************************************************************************************/
+#include "btcomm_asm.h"
+#include <stdarg.h>
+#include <math.h>
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Opcode tables
+//
+// Each opcode lists its parameters, one letter each: lower case for inputs, upper case for outputs (which must be
+// variables), by data type:
+//    b DATA8   h DATA16   w DATA32   f DATAF   s string   j jump offset (DATA32)
+//    n DATA8 count - the next letter is repeated that many times (the count must be a constant)
+//    x DATA8 format of opINPUT_READEXT - V, the values that follow, are DATA8, DATA32 or DATAF accordingly
+// Opcodes that take a sub-command have no list of their own; the sub-command's list applies after it.
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+typedef struct
+{
+ int code;
+ const char *name;
+ const char *params;
+} BT_asm_sub;
+
+typedef struct
+{
+ int code;
+ const char *name;				// Without the "op" prefix
+ const char *params;				// NULL if the first parameter is a sub-command
+ const BT_asm_sub *subs;
+} BT_asm_op;
+
+#define BT_OP(name,params) {op##name,#name,params,NULL}
+#define BT_OPS(name,subs) {op##name,#name,NULL,subs}
+#define BT_SUB(name,params) {name,#name,params}
+#define BT_SUB_END {-1,NULL,NULL}
+
+static const BT_asm_sub BT_program_info_subs[]={
+ BT_SUB(OBJ_STOP,"hh"), BT_SUB(OBJ_START,"hh"), BT_SUB(GET_STATUS,"hB"), BT_SUB(GET_SPEED,"hW"),
+ BT_SUB(GET_PRGRESULT,"hB"), BT_SUB(SET_INSTR,"h"), BT_SUB_END};
+
+static const BT_asm_sub BT_ui_read_subs[]={
+ BT_SUB(GET_VBATT,"F"), BT_SUB(GET_IBATT,"F"), BT_SUB(GET_OS_VERS,"bS"), BT_SUB(GET_TBATT,"F"),
+ BT_SUB(GET_IINT,"F"), BT_SUB(GET_IMOTOR,"F"), BT_SUB(GET_HW_VERS,"bS"), BT_SUB(GET_FW_VERS,"bS"),
+ BT_SUB(GET_FW_BUILD,"bS"), BT_SUB(GET_OS_BUILD,"bS"), BT_SUB(GET_SHUTDOWN,"B"), BT_SUB(GET_WARNING,"B"),
+ BT_SUB(GET_LBATT,"B"), BT_SUB(GET_POWER,"FFFF"), BT_SUB(GET_SDCARD,"BWW"), BT_SUB(GET_USBSTICK,"BWW"),
+ BT_SUB_END};
+
+static const BT_asm_sub BT_ui_write_subs[]={
+ BT_SUB(WRITE_FLUSH,""), BT_SUB(FLOATVALUE,"fbb"), BT_SUB(PUT_STRING,"s"), BT_SUB(VALUE8,"b"),
+ BT_SUB(VALUE16,"h"), BT_SUB(VALUE32,"w"), BT_SUB(VALUEF,"f"), BT_SUB(SET_BUSY,"b"), BT_SUB(LED,"b"),
+ BT_SUB_END};
+
+static const BT_asm_sub BT_ui_button_subs[]={
+ BT_SUB(SHORTPRESS,"bB"), BT_SUB(LONGPRESS,"bB"), BT_SUB(WAIT_FOR_PRESS,""), BT_SUB(FLUSH,""),
+ BT_SUB(PRESS,"b"), BT_SUB(RELEASE,"b"), BT_SUB(PRESSED,"bB"), BT_SUB(TESTSHORTPRESS,"bB"),
+ BT_SUB(TESTLONGPRESS,"bB"), BT_SUB(GET_BUMBED,"bB"), BT_SUB_END};
+
+static const BT_asm_sub BT_ui_draw_subs[]={
+ BT_SUB(UPDATE,""), BT_SUB(CLEAN,""), BT_SUB(PIXEL,"bhh"), BT_SUB(LINE,"bhhhh"), BT_SUB(CIRCLE,"bhhh"),
+ BT_SUB(TEXT,"bhhs"), BT_SUB(ICON,"bhhbb"), BT_SUB(VALUE,"bhhfbb"), BT_SUB(FILLRECT,"bhhhh"),
+ BT_SUB(RECT,"bhhhh"), BT_SUB(INVERSERECT,"hhhh"), BT_SUB(SELECT_FONT,"b"), BT_SUB(TOPLINE,"b"),
+ BT_SUB(FILLWINDOW,"bhh"), BT_SUB(DOTLINE,"bhhhhhh"), BT_SUB(FILLCIRCLE,"bhhh"), BT_SUB(STORE,"b"),
+ BT_SUB(RESTORE,"b"), BT_SUB(BMPFILE,"bhhs"), BT_SUB_END};
+
+static const BT_asm_sub BT_math_subs[]={
+ BT_SUB(EXP,"fF"), BT_SUB(MOD,"ffF"), BT_SUB(FLOOR,"fF"), BT_SUB(CEIL,"fF"), BT_SUB(ROUND,"fF"),
+ BT_SUB(ABS,"fF"), BT_SUB(NEGATE,"fF"), BT_SUB(SQRT,"fF"), BT_SUB(LOG,"fF"), BT_SUB(LN,"fF"), BT_SUB(SIN,"fF"),
+ BT_SUB(COS,"fF"), BT_SUB(TAN,"fF"), BT_SUB(ASIN,"fF"), BT_SUB(ACOS,"fF"), BT_SUB(ATAN,"fF"),
+ BT_SUB(MOD8,"bbB"), BT_SUB(MOD16,"hhH"), BT_SUB(MOD32,"wwW"), BT_SUB(POW,"ffF"), BT_SUB(TRUNC,"fbF"),
+ BT_SUB_END};
+
+static const BT_asm_sub BT_com_get_subs[]={BT_SUB(GET_BRICKNAME,"bS"), BT_SUB_END};
+static const BT_asm_sub BT_com_set_subs[]={BT_SUB(SET_BRICKNAME,"s"), BT_SUB_END};
+
+static const BT_asm_sub BT_sound_subs[]={
+ BT_SUB(BREAK,""), BT_SUB(TONE,"bhh"), BT_SUB(PLAY,"bs"), BT_SUB(REPEAT,"bs"), BT_SUB(SERVICE,""), BT_SUB_END};
+
+static const BT_asm_sub BT_input_device_subs[]={
+ BT_SUB(GET_FORMAT,"bbBBBB"), BT_SUB(CAL_MINMAX,"bbww"), BT_SUB(CAL_DEFAULT,"bb"), BT_SUB(GET_TYPEMODE,"bbBB"),
+ BT_SUB(GET_SYMBOL,"bbbS"), BT_SUB(CAL_MIN,"bbw"), BT_SUB(CAL_MAX,"bbw"), BT_SUB(CLR_ALL,"b"),
+ BT_SUB(GET_RAW,"bbW"), BT_SUB(GET_CONNECTION,"bbB"), BT_SUB(STOP_ALL,"b"), BT_SUB(GET_NAME,"bbbS"),
+ BT_SUB(GET_MODENAME,"bbbbS"), BT_SUB(GET_FIGURES,"bbBB"), BT_SUB(GET_CHANGES,"bbF"), BT_SUB(CLR_CHANGES,"bb"),
+ BT_SUB(READY_PCT,"bbbbnB"), BT_SUB(READY_RAW,"bbbbnW"), BT_SUB(READY_SI,"bbbbnF"), BT_SUB(GET_MINMAX,"bbFF"),
+ BT_SUB(GET_BUMPS,"bbF"), BT_SUB_END};
+
+static const BT_asm_sub BT_file_subs[]={
+ BT_SUB(OPEN_APPEND,"sH"), BT_SUB(OPEN_READ,"sHW"), BT_SUB(OPEN_WRITE,"sH"), BT_SUB(READ_TEXT,"hbhS"),
+ BT_SUB(WRITE_TEXT,"hbs"), BT_SUB(CLOSE,"h"), BT_SUB(LOAD_IMAGE,"hsWW"), BT_SUB(MAKE_FOLDER,"sB"),
+ BT_SUB(REMOVE,"s"), BT_SUB_END};
+
+static const BT_asm_op BT_asm_ops[]={
+ // Program control
+ BT_OP(ERROR,""), BT_OP(NOP,""), BT_OP(PROGRAM_STOP,"h"), BT_OP(PROGRAM_START,"hwwb"), BT_OP(OBJECT_STOP,"h"),
+ BT_OP(OBJECT_START,"h"), BT_OP(OBJECT_TRIG,"h"), BT_OP(OBJECT_WAIT,"h"), BT_OP(RETURN,""), BT_OP(OBJECT_END,""),
+ BT_OP(SLEEP,""), BT_OPS(PROGRAM_INFO,BT_program_info_subs), BT_OP(LABEL,"b"),
+ // Arithmetic, logic and moves
+ BT_OP(ADD8,"bbB"), BT_OP(ADD16,"hhH"), BT_OP(ADD32,"wwW"), BT_OP(ADDF,"ffF"),
+ BT_OP(SUB8,"bbB"), BT_OP(SUB16,"hhH"), BT_OP(SUB32,"wwW"), BT_OP(SUBF,"ffF"),
+ BT_OP(MUL8,"bbB"), BT_OP(MUL16,"hhH"), BT_OP(MUL32,"wwW"), BT_OP(MULF,"ffF"),
+ BT_OP(DIV8,"bbB"), BT_OP(DIV16,"hhH"), BT_OP(DIV32,"wwW"), BT_OP(DIVF,"ffF"),
+ BT_OP(OR8,"bbB"), BT_OP(OR16,"hhH"), BT_OP(OR32,"wwW"),
+ BT_OP(AND8,"bbB"), BT_OP(AND16,"hhH"), BT_OP(AND32,"wwW"),
+ BT_OP(XOR8,"bbB"), BT_OP(XOR16,"hhH"), BT_OP(XOR32,"wwW"),
+ BT_OP(RL8,"bbB"), BT_OP(RL16,"hhH"), BT_OP(RL32,"wwW"),
+ BT_OP(MOVE8_8,"bB"), BT_OP(MOVE8_16,"bH"), BT_OP(MOVE8_32,"bW"), BT_OP(MOVE8_F,"bF"),
+ BT_OP(MOVE16_8,"hB"), BT_OP(MOVE16_16,"hH"), BT_OP(MOVE16_32,"hW"), BT_OP(MOVE16_F,"hF"),
+ BT_OP(MOVE32_8,"wB"), BT_OP(MOVE32_16,"wH"), BT_OP(MOVE32_32,"wW"), BT_OP(MOVE32_F,"wF"),
+ BT_OP(MOVEF_8,"fB"), BT_OP(MOVEF_16,"fH"), BT_OP(MOVEF_32,"fW"), BT_OP(MOVEF_F,"fF"),
+ BT_OPS(MATH,BT_math_subs), BT_OP(RANDOM,"hhH"),
+ // Branches and compares
+ BT_OP(JR,"j"), BT_OP(JR_FALSE,"bj"), BT_OP(JR_TRUE,"bj"), BT_OP(JR_NAN,"fj"),
+ BT_OP(CP_LT8,"bbB"), BT_OP(CP_LT16,"hhB"), BT_OP(CP_LT32,"wwB"), BT_OP(CP_LTF,"ffB"),
+ BT_OP(CP_GT8,"bbB"), BT_OP(CP_GT16,"hhB"), BT_OP(CP_GT32,"wwB"), BT_OP(CP_GTF,"ffB"),
+ BT_OP(CP_EQ8,"bbB"), BT_OP(CP_EQ16,"hhB"), BT_OP(CP_EQ32,"wwB"), BT_OP(CP_EQF,"ffB"),
+ BT_OP(CP_NEQ8,"bbB"), BT_OP(CP_NEQ16,"hhB"), BT_OP(CP_NEQ32,"wwB"), BT_OP(CP_NEQF,"ffB"),
+ BT_OP(CP_LTEQ8,"bbB"), BT_OP(CP_LTEQ16,"hhB"), BT_OP(CP_LTEQ32,"wwB"), BT_OP(CP_LTEQF,"ffB"),
+ BT_OP(CP_GTEQ8,"bbB"), BT_OP(CP_GTEQ16,"hhB"), BT_OP(CP_GTEQ32,"wwB"), BT_OP(CP_GTEQF,"ffB"),
+ BT_OP(SELECT8,"bbbB"), BT_OP(SELECT16,"bhhH"), BT_OP(SELECT32,"bwwW"), BT_OP(SELECTF,"bffF"),
+ BT_OP(JR_LT8,"bbj"), BT_OP(JR_LT16,"hhj"), BT_OP(JR_LT32,"wwj"), BT_OP(JR_LTF,"ffj"),
+ BT_OP(JR_GT8,"bbj"), BT_OP(JR_GT16,"hhj"), BT_OP(JR_GT32,"wwj"), BT_OP(JR_GTF,"ffj"),
+ BT_OP(JR_EQ8,"bbj"), BT_OP(JR_EQ16,"hhj"), BT_OP(JR_EQ32,"wwj"), BT_OP(JR_EQF,"ffj"),
+ BT_OP(JR_NEQ8,"bbj"), BT_OP(JR_NEQ16,"hhj"), BT_OP(JR_NEQ32,"wwj"), BT_OP(JR_NEQF,"ffj"),
+ BT_OP(JR_LTEQ8,"bbj"), BT_OP(JR_LTEQ16,"hhj"), BT_OP(JR_LTEQ32,"wwj"), BT_OP(JR_LTEQF,"ffj"),
+ BT_OP(JR_GTEQ8,"bbj"), BT_OP(JR_GTEQ16,"hhj"), BT_OP(JR_GTEQ32,"wwj"), BT_OP(JR_GTEQF,"ffj"),
+ // System, user interface, timers, communication and sound
+ BT_OP(SYSTEM,"sW"), BT_OP(NOTE_TO_FREQ,"sH"), BT_OP(UI_FLUSH,""), BT_OPS(UI_READ,BT_ui_read_subs),
+ BT_OPS(UI_WRITE,BT_ui_write_subs), BT_OPS(UI_BUTTON,BT_ui_button_subs), BT_OPS(UI_DRAW,BT_ui_draw_subs),
+ BT_OP(TIMER_WAIT,"wW"), BT_OP(TIMER_READY,"w"), BT_OP(TIMER_READ,"W"), BT_OP(TIMER_READ_US,"W"),
+ BT_OP(KEEP_ALIVE,"B"), BT_OPS(COM_GET,BT_com_get_subs), BT_OPS(COM_SET,BT_com_set_subs),
+ BT_OPS(SOUND,BT_sound_subs), BT_OP(SOUND_TEST,"B"), BT_OP(SOUND_READY,""),
+ // Inputs and outputs
+ BT_OPS(INPUT_DEVICE,BT_input_device_subs), BT_OP(INPUT_READ,"bbbbB"), BT_OP(INPUT_TEST,"bbB"),
+ BT_OP(INPUT_READY,"bb"), BT_OP(INPUT_READSI,"bbbbF"), BT_OP(INPUT_READEXT,"bbbbxnV"),
+ BT_OP(OUTPUT_GET_TYPE,"bbB"), BT_OP(OUTPUT_SET_TYPE,"bbb"), BT_OP(OUTPUT_RESET,"bb"), BT_OP(OUTPUT_STOP,"bbb"),
+ BT_OP(OUTPUT_POWER,"bbb"), BT_OP(OUTPUT_SPEED,"bbb"), BT_OP(OUTPUT_START,"bb"), BT_OP(OUTPUT_POLARITY,"bbb"),
+ BT_OP(OUTPUT_READ,"bbBW"), BT_OP(OUTPUT_TEST,"bbB"), BT_OP(OUTPUT_READY,"bb"), BT_OP(OUTPUT_POSITION,"bbw"),
+ BT_OP(OUTPUT_STEP_POWER,"bbbwwwb"), BT_OP(OUTPUT_TIME_POWER,"bbbwwwb"), BT_OP(OUTPUT_STEP_SPEED,"bbbwwwb"),
+ BT_OP(OUTPUT_TIME_SPEED,"bbbwwwb"), BT_OP(OUTPUT_STEP_SYNC,"bbbhwb"), BT_OP(OUTPUT_TIME_SYNC,"bbbhwb"),
+ BT_OP(OUTPUT_CLR_COUNT,"bb"), BT_OP(OUTPUT_GET_COUNT,"bbW"), BT_OP(OUTPUT_PRG_STOP,""),
+ // Files and memory
+ BT_OPS(FILE,BT_file_subs), BT_OP(MEMORY_USAGE,"WW")};
+
+#define BT_ASM_NOPS ((int)(sizeof(BT_asm_ops)/sizeof(BT_asm_ops[0])))
+#define BT_ASM_HASH 512
+
+static const BT_asm_op *BT_asm_by_code[256];		// Opcode -> entry, NULL if not known
+static const BT_asm_op *BT_asm_by_name[BT_ASM_HASH];	// Open addressing on BT_asm_hash() of the name
+static pthread_once_t BT_asm_once=PTHREAD_ONCE_INIT;
+
+static unsigned int BT_asm_hash(const char *name, int len)
+{
+ // FNV-1a
+ unsigned int h=2166136261u;
+ for (int i=0; i<len; i++) h=(h^(unsigned char)name[i])*16777619u;
+ return(h);
+}
+
+static void BT_asm_init(void)
+{
+ unsigned int h;
+
+ for (int i=0; i<BT_ASM_NOPS; i++)
+ {
+  BT_asm_by_code[BT_asm_ops[i].code]=&BT_asm_ops[i];
+  h=BT_asm_hash(BT_asm_ops[i].name,strlen(BT_asm_ops[i].name));
+  while (BT_asm_by_name[h%BT_ASM_HASH]!=NULL) h++;
+  BT_asm_by_name[h%BT_ASM_HASH]=&BT_asm_ops[i];
+ }
+}
+
+static const BT_asm_op *BT_asm_find(const char *name, int len)
+{
+ // The entry for an opcode name, with or without the "op" prefix, or NULL
+ const BT_asm_op *op;
+ unsigned int h;
+
+ if (len>2&&name[0]=='o'&&name[1]=='p') {name+=2; len-=2;}
+ h=BT_asm_hash(name,len);
+ while ((op=BT_asm_by_name[h%BT_ASM_HASH])!=NULL)
+ {
+  if ((int)strlen(op->name)==len&&strncmp(op->name,name,len)==0) return(op);
+  h++;
+ }
+ return(NULL);
+}
+
+static const BT_asm_sub *BT_asm_find_sub(const BT_asm_op *op, int code)
+{
+ for (const BT_asm_sub *sub=op->subs; sub->name!=NULL; sub++)
+  if (sub->code==code) return(sub);
+ return(NULL);
+}
+
+// Walking through the parameter letters of an instruction
+typedef struct
+{
+ const char *spec;				// Letters still to come
+ int repeat;					// Times letter is still to be repeated (after an 'n')
+ char letter;
+ int format;					// Last 'x' parameter
+ long last;					// Last constant parameter, the length of an 'S' that follows it
+} BT_asm_cursor;
+
+static char BT_asm_next(BT_asm_cursor *c)
+{
+ // The letter of the next parameter, or 0 at the end of the instruction
+ if (c->repeat>0)
+ {
+  c->repeat--;
+  return(c->letter);
+ }
+ if (*c->spec=='\0') return(0);
+ return(*(c->spec++));
+}
+
+static int BT_asm_counted(BT_asm_cursor *c, char letter, long value)
+{
+ // Take note of a constant parameter. After an 'n' the next letter repeats value times. Returns -1 if the
+ // count or format is out of range.
+ c->last=value;
+ if (letter=='x')
+ {
+  if (value!=DATA_PCT&&value!=DATA_RAW&&value!=DATA_SI) return(-1);
+  c->format=value;
+ }
+ if (letter=='n')
+ {
+  if (value<0||value>255||*c->spec=='\0') return(-1);
+  c->repeat=value;
+  c->letter=*(c->spec++);
+  if (c->letter=='V') c->letter=(c->format==DATA_PCT)?'B':(c->format==DATA_SI)?'F':'W';
+ }
+ return(0);
+}
+
+static int BT_asm_width(char letter, long last)
+{
+ // Bytes of a variable used as a parameter of this kind
+ switch (letter)
+ {
+  case 'h': case 'H': return(2);
+  case 'w': case 'W': case 'f': case 'F': case 'j': return(4);
+  case 'S': return((last>0&&last<=1019)?(int)last:1);
+  default: return(1);
+ }
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Assembler
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+#define BT_ASM_LABELS 64
+#define BT_ASM_FIXUPS 128
+
+typedef struct
+{
+ unsigned char *buf, *p, *end;			// Command being written
+ const char *caller;
+ int line;
+ int globals, locals;				// Variable space used so far
+ int set_globals, set_locals;			// Set by .globals and .locals, -1 if not
+ int labels;
+ char label_name[BT_ASM_LABELS][32];
+ int label_at[BT_ASM_LABELS];
+ int fixups;
+ int fixup_at[BT_ASM_FIXUPS];			// Where a jump's LC2 offset goes
+ int fixup_label[BT_ASM_FIXUPS];
+ int fixup_line[BT_ASM_FIXUPS];
+ const char *fixup_name[BT_ASM_FIXUPS];		// Label not defined yet: its name in the source ...
+ int fixup_len[BT_ASM_FIXUPS];			// ... and the name's length
+ BT_asm_command *command;			// Where placeholders are recorded, NULL if they are not allowed
+} BT_asm_state;
+
+static void BT_asm_put32(unsigned char *p, long v)
+{
+ p[0]=LX_byte1(v); p[1]=LX_byte2(v); p[2]=LX_byte3(v); p[3]=LX_byte4(v);
+}
+
+static int BT_asm_error(BT_asm_state *s, const char *fmt, ...)
+{
+ va_list ap;
+
+ fprintf(stderr,"%s: line %d: ",s->caller,s->line);
+ va_start(ap,fmt);
+ vfprintf(stderr,fmt,ap);
+ va_end(ap);
+ fprintf(stderr,"\n");
+ return(-1);
+}
+
+static int BT_asm_room(BT_asm_state *s, int n)
+{
+ if (s->p+n<=s->end) return(0);
+ return(BT_asm_error(s,"command does not fit in %d bytes",(int)(s->end-s->buf)));
+}
+
+static int BT_asm_const(BT_asm_state *s, long v, int size)
+{
+ // Emit a constant in the given encoding (1, 2, 3 or 5 bytes), or the shortest that holds it (size 0)
+ if (size==0) size=(v>=-32&&v<=31)?1:(v>=-128&&v<=127)?2:(v>=-32768&&v<=32767)?3:5;
+ if (BT_asm_room(s,size)<0) return(-1);
+ if (size==1) *(s->p++)=LC0(v);
+ else if (size==2) {*(s->p++)=LC1_byte0(); *(s->p++)=LX_byte1(v);}
+ else if (size==3) {*(s->p++)=LC2_byte0(); *(s->p++)=LX_byte1(v); *(s->p++)=LX_byte2(v);}
+ else
+ {
+  *(s->p++)=PRIMPAR_LONG|PRIMPAR_CONST|PRIMPAR_4_BYTES;
+  *(s->p++)=LX_byte1(v); *(s->p++)=LX_byte2(v); *(s->p++)=LX_byte3(v); *(s->p++)=LX_byte4(v);
+ }
+ return(0);
+}
+
+static int BT_asm_var(BT_asm_state *s, int global, long offset, int size, int flags, int width)
+{
+ // Emit a variable reference in the given encoding (1, 2, 3 or 5 bytes) or the shortest (size 0), and count
+ // the variable space it needs
+ int kind=PRIMPAR_VARIABEL|(global?PRIMPAR_GLOBAL:PRIMPAR_LOCAL);
+
+ if (offset<0||offset>0xFFFF) return(BT_asm_error(s,"variable offset %ld out of range",offset));
+ if (size==0) size=(offset<32&&!flags)?1:(offset<256)?2:3;
+ if (BT_asm_room(s,size)<0) return(-1);
+ if (size==1) *(s->p++)=PRIMPAR_SHORT|kind|offset;
+ else if (size==2) {*(s->p++)=PRIMPAR_LONG|kind|flags|PRIMPAR_1_BYTE; *(s->p++)=LX_byte1(offset);}
+ else if (size==3) {*(s->p++)=PRIMPAR_LONG|kind|flags|PRIMPAR_2_BYTES; *(s->p++)=LX_byte1(offset); *(s->p++)=LX_byte2(offset);}
+ else
+ {
+  *(s->p++)=PRIMPAR_LONG|kind|flags|PRIMPAR_4_BYTES;
+  *(s->p++)=LX_byte1(offset); *(s->p++)=LX_byte2(offset); *(s->p++)=0; *(s->p++)=0;
+ }
+ if (global) s->globals=MAX(s->globals,(int)offset+width);
+ else s->locals=MAX(s->locals,(int)offset+width);
+ return(0);
+}
+
+static int BT_asm_string(BT_asm_state *s, const char *t, const char *end)
+{
+ // Emit a string constant from its quoted source text (t points at the opening quote)
+ int c;
+
+ if (BT_asm_room(s,1)<0) return(-1);
+ *(s->p++)=PRIMPAR_LONG|PRIMPAR_STRING;
+ for (t++; t<end&&*t!='"'; t++)
+ {
+  c=*t;
+  if (c=='\\'&&t+1<end)
+  {
+   t++;
+   if (*t=='n') c='\n';
+   else if (*t=='x'&&t+2<end&&isxdigit(t[1])&&isxdigit(t[2]))
+   {
+    c=(isdigit(t[1])?t[1]-'0':(toupper(t[1])-'A'+10))*16+(isdigit(t[2])?t[2]-'0':(toupper(t[2])-'A'+10));
+    t+=2;
+   }
+   else c=*t;
+  }
+  if (c=='\0') return(BT_asm_error(s,"strings cannot contain a zero byte"));
+  if (BT_asm_room(s,1)<0) return(-1);
+  *(s->p++)=c;
+ }
+ if (t>=end||t+1!=end) return(BT_asm_error(s,"badly quoted string"));
+ if (BT_asm_room(s,1)<0) return(-1);
+ *(s->p++)='\0';
+ return(0);
+}
+
+static int BT_asm_label(BT_asm_state *s, const char *name, int len)
+{
+ // Index of a defined label, or -1
+ for (int i=0; i<s->labels; i++)
+  if ((int)strlen(s->label_name[i])==len&&strncmp(s->label_name[i],name,len)==0) return(i);
+ return(-1);
+}
+
+static int BT_asm_is_name(const char *t, int len)
+{
+ if (len<1||!(isalpha(t[0])||t[0]=='_')) return(0);
+ for (int i=1; i<len; i++) if (!(isalnum(t[i])||t[i]=='_')) return(0);
+ return(1);
+}
+
+static int BT_asm_encoding(const char *t, int len, int *kind, int *size, long *value, int *flags)
+{
+ // Parse LCn(v), LVn(i), GVn(i), LVi, GVi, and HND()/ADR() around a variable. kind is 0 for a constant,
+ // 1 local, 2 global; size is the encoded size, 0 for the shortest. Returns 1 if parsed, 0 if t is not
+ // one of these, -1 if it is but badly formed.
+ char *e;
+ int n;
+
+ *flags=0;
+ if (len>5&&(strncmp(t,"HND(",4)==0||strncmp(t,"ADR(",4)==0)&&t[len-1]==')')
+ {
+  *flags=(t[0]=='H')?PRIMPAR_HANDLE:PRIMPAR_ADDR;
+  n=*flags;
+  if (BT_asm_encoding(t+4,len-5,kind,size,value,flags)!=1||*kind==0||*size==1) return(-1);
+  *flags=n;
+  return(1);
+ }
+ if (len<3||!((t[0]=='L'&&(t[1]=='C'||t[1]=='V'))||(t[0]=='G'&&t[1]=='V'))||!isdigit(t[2])) return(0);
+ *kind=(t[1]=='C')?0:(t[0]=='L')?1:2;
+ if (len>4&&t[3]=='('&&t[len-1]==')')
+ {
+  // Explicit encoding: LC0(v), LV1(i), ...
+  n=t[2]-'0';
+  if (n!=0&&n!=1&&n!=2&&n!=4) return(-1);
+  *size=(n==4)?5:n+1;
+  *value=strtol(t+4,&e,0);
+  if (e!=t+len-1) return(-1);
+  return(1);
+ }
+ if (*kind==0) return(0);
+ *size=0;
+ *value=strtol(t+2,&e,10);
+ return(e==t+len?1:-1);
+}
+
+static int BT_asm_fits(long v, int size, int is_const)
+{
+ // Does v fit in the given encoding?
+ if (size==1) return(is_const?(v>=-32&&v<=31):(v>=0&&v<32));
+ if (size==2) return(is_const?(v>=-128&&v<=127):(v>=0&&v<256));
+ if (size==3) return(is_const?(v>=-32768&&v<=32767):(v>=0&&v<65536));
+ return(1);
+}
+
+static int BT_asm_param(BT_asm_state *s, const BT_asm_op *op, const BT_asm_sub *sub, BT_asm_cursor *c, char letter,
+                        int first, const char *t, int len)
+{
+ // Encode one parameter, given as source text t (trimmed)
+ int kind, size, flags, r, is_out=isupper(letter), is_float=(letter=='f'||letter=='F');
+ long v;
+ char *e;
+ float f;
+ double d;
+
+ if (len==0) return(BT_asm_error(s,"missing parameter for %s",op->name));
+ if (first&&op->subs!=NULL)
+ {
+  // Sub-command, by name or number: already looked up by the caller
+  return(BT_asm_const(s,sub->code,0));
+ }
+ r=BT_asm_encoding(t,len,&kind,&size,&v,&flags);
+ if (r<0) return(BT_asm_error(s,"bad parameter '%.*s'",len,t));
+ if (r>0)
+ {
+  if (size!=0&&!BT_asm_fits(v,size,kind==0)) return(BT_asm_error(s,"'%.*s' does not fit its encoding",len,t));
+  if (kind!=0) return(BT_asm_var(s,kind==2,v,size,flags,BT_asm_width(letter,c->last)));
+  if (is_out) return(BT_asm_error(s,"output parameter of %s must be a variable",op->name));
+  if (BT_asm_counted(c,letter,v)<0) return(BT_asm_error(s,"bad count or format %ld",v));
+  return(BT_asm_const(s,v,size));
+ }
+ if (is_out) return(BT_asm_error(s,"output parameter of %s must be a variable",op->name));
+ if (t[0]=='"')
+ {
+  if (letter!='s') return(BT_asm_error(s,"string given for a numeric parameter of %s",op->name));
+  return(BT_asm_string(s,t,t+len));
+ }
+ if (t[0]=='$')
+ {
+  v=strtol(t+1,&e,10);
+  if (e!=t+len||v<0||v>=BT_ASM_HOLES) return(BT_asm_error(s,"bad placeholder '%.*s'",len,t));
+  if (s->command==NULL) return(BT_asm_error(s,"placeholders need BT_asm_compile()"));
+  if (letter=='n'||letter=='x'||letter=='j'||letter=='s') return(BT_asm_error(s,"this parameter cannot be a placeholder"));
+  if (s->command->sites>=BT_ASM_SITES) return(BT_asm_error(s,"too many placeholders"));
+  if (BT_asm_room(s,5)<0) return(-1);
+  s->command->site_at[s->command->sites]=(s->p+1)-s->buf;
+  s->command->site_hole[s->command->sites]=v;
+  s->command->site_float[s->command->sites]=is_float;
+  s->command->sites++;
+  c->last=0;
+  return(BT_asm_const(s,0,5));
+ }
+ if (letter=='j'&&BT_asm_is_name(t,len))
+ {
+  // A label - defined already or later, the offset is filled in at the end
+  if (s->fixups>=BT_ASM_FIXUPS) return(BT_asm_error(s,"too many jumps"));
+  if (BT_asm_room(s,3)<0) return(-1);
+  s->fixup_at[s->fixups]=s->p-s->buf;
+  s->fixup_label[s->fixups]=BT_asm_label(s,t,len);
+  s->fixup_line[s->fixups]=s->line;
+  s->fixup_name[s->fixups]=t;
+  s->fixup_len[s->fixups]=len;
+  s->fixups++;
+  s->p+=3;
+  return(0);
+ }
+ v=strtol(t,&e,0);
+ if (e==t+len&&e!=t)
+ {
+  if (is_float)
+  {
+   f=(float)v;
+   memcpy(&r,&f,4);
+   v=r;
+  }
+  else if (BT_asm_counted(c,letter,v)<0) return(BT_asm_error(s,"bad count or format %ld",v));
+  return(BT_asm_const(s,(int32_t)v,0));
+ }
+ d=strtod(t,&e);
+ if (e==t+len&&e!=t)
+ {
+  if (!is_float) return(BT_asm_error(s,"float given for an integer parameter of %s",op->name));
+  f=(float)d;
+  memcpy(&r,&f,4);
+  return(BT_asm_const(s,r,0));
+ }
+ return(BT_asm_error(s,"unknown name or bad number '%.*s'",len,t));
+}
+
+static const char *BT_asm_trim(const char *t, const char **end)
+{
+ while (t<*end&&isspace(*t)) t++;
+ while (*end>t&&isspace((*end)[-1])) (*end)--;
+ return(t);
+}
+
+static const char *BT_asm_field(const char *t, const char *end)
+{
+ // End of the parameter starting at t: the next comma outside quotes and brackets, or end
+ int quoted=0, depth=0;
+
+ for (; t<end; t++)
+ {
+  if (quoted)
+  {
+   if (*t=='\\'&&t+1<end) t++;
+   else if (*t=='"') quoted=0;
+  }
+  else if (*t=='"') quoted=1;
+  else if (*t=='(') depth++;
+  else if (*t==')') depth--;
+  else if (*t==','&&depth==0) return(t);
+ }
+ return(end);
+}
+
+static int BT_asm_directive(BT_asm_state *s, const char *t, const char *end)
+{
+ // .globals n, .locals n, .bytes b, b, ...
+ const char *w=t, *f;
+ char *e;
+ long v;
+
+ while (w<end&&!isspace(*w)) w++;
+ if ((w-t==8&&strncmp(t,".globals",8)==0)||(w-t==7&&strncmp(t,".locals",7)==0))
+ {
+  v=strtol(w,&e,0);
+  if (e==w||BT_asm_trim(e,&end)!=end||v<0) return(BT_asm_error(s,"bad %.*s",(int)(w-t),t));
+  if (t[1]=='g') s->set_globals=v;
+  else s->set_locals=v;
+  return(0);
+ }
+ if (w-t==6&&strncmp(t,".bytes",6)==0)
+ {
+  while (w<end)
+  {
+   f=BT_asm_field(w,end);
+   const char *fe=f;
+   const char *b=BT_asm_trim(w,&fe);
+   v=strtol(b,&e,0);
+   if (e!=fe||e==b||v<0||v>255) return(BT_asm_error(s,"bad byte '%.*s'",(int)(fe-b),b));
+   if (BT_asm_room(s,1)<0) return(-1);
+   *(s->p++)=v;
+   w=(f<end)?f+1:f;
+  }
+  return(0);
+ }
+ return(BT_asm_error(s,"unknown directive '%.*s'",(int)(w-t),t));
+}
+
+static int BT_asm_statement(BT_asm_state *s, const char *t, const char *end)
+{
+ // Assemble one statement: [label:] OPCODE params, or a directive
+ const BT_asm_op *op;
+ const BT_asm_sub *sub=NULL;
+ BT_asm_cursor c;
+ const char *w, *f, *pe, *pt;
+ char letter, *e;
+ long v;
+ int first;
+
+ t=BT_asm_trim(t,&end);
+ w=t;
+ while (w<end&&(isalnum(*w)||*w=='_')) w++;
+ if (w>t&&w<end&&*w==':')
+ {
+  // Label
+  if (w-t>31) return(BT_asm_error(s,"label name too long"));
+  if (BT_asm_label(s,t,w-t)>=0) return(BT_asm_error(s,"label '%.*s' defined twice",(int)(w-t),t));
+  if (s->labels>=BT_ASM_LABELS) return(BT_asm_error(s,"too many labels"));
+  memcpy(s->label_name[s->labels],t,w-t);
+  s->label_name[s->labels][w-t]='\0';
+  s->label_at[s->labels++]=s->p-s->buf;
+  t=w+1;
+  t=BT_asm_trim(t,&end);
+  w=t;
+  while (w<end&&(isalnum(*w)||*w=='_')) w++;
+ }
+ if (t==end) return(0);
+ if (*t=='.') return(BT_asm_directive(s,t,end));
+ if ((op=BT_asm_find(t,w-t))==NULL) return(BT_asm_error(s,"unknown opcode '%.*s'",(int)(w-t),t));
+ if (BT_asm_room(s,1)<0) return(-1);
+ *(s->p++)=op->code;
+
+ c.spec=(op->params!=NULL)?op->params:"b";
+ c.repeat=0;
+ c.format=DATA_RAW;
+ c.last=0;
+ first=1;
+ w=BT_asm_trim(w,&end);
+ while (w<end||first)
+ {
+  f=BT_asm_field(w,end);
+  pe=f;
+  pt=BT_asm_trim(w,&pe);
+  if (first&&op->subs!=NULL)
+  {
+   // The sub-command, by name or number - followed by a comma or just a space
+   if (pt==pe) return(BT_asm_error(s,"%s needs a sub-command",op->name));
+   for (e=(char *)pt; e<pe&&!isspace(*e); e++);
+   if (e<pe)
+   {
+    f=e;
+    pe=e;
+   }
+   v=strtol(pt,&e,0);
+   for (sub=op->subs; sub->name!=NULL; sub++)
+    if ((e==pe&&e!=pt)?(sub->code==v):((int)strlen(sub->name)==pe-pt&&strncmp(sub->name,pt,pe-pt)==0)) break;
+   if (sub->name==NULL) return(BT_asm_error(s,"unknown sub-command '%.*s' for %s",(int)(pe-pt),pt,op->name));
+   if (BT_asm_param(s,op,sub,&c,'b',1,pt,pe-pt)<0) return(-1);
+   c.spec=sub->params;
+  }
+  else
+  {
+   if ((letter=BT_asm_next(&c))==0)
+   {
+    if (pt==pe&&f==end) break;
+    return(BT_asm_error(s,"too many parameters for %s",op->name));
+   }
+   if (BT_asm_param(s,op,NULL,&c,letter,0,pt,pe-pt)<0) return(-1);
+  }
+  first=0;
+  w=(f<end)?f+1:f;
+  if (f==end) break;
+ }
+ if (BT_asm_next(&c)!=0) return(BT_asm_error(s,"too few parameters for %s",op->name));
+ return(0);
+}
+
+static void BT_asm_begin(BT_asm_state *s, unsigned char *buf, int maxlen, int header, BT_asm_command *command,
+                         const char *caller)
+{
+ // Set up to assemble into buf, after a header of the given size
+ pthread_once(&BT_asm_once,BT_asm_init);
+ s->buf=buf;
+ s->p=buf+header;
+ s->end=buf+maxlen;
+ s->caller=caller;
+ s->line=1;
+ s->globals=s->locals=0;
+ s->set_globals=s->set_locals=-1;
+ s->labels=s->fixups=0;
+ s->command=command;
+}
+
+static int BT_asm_source(BT_asm_state *s, const char *source)
+{
+ // Assemble every statement of source, then fill in the jumps. Returns 0, or -1.
+ const char *t, *end;
+ int quoted, offset;
+
+ // Statements end at a newline or a ';', comments at the end of the line
+ t=source;
+ while (*t)
+ {
+  quoted=0;
+  for (end=t; *end&&*end!='\n'&&(quoted||*end!=';'); end++)
+  {
+   if (quoted&&*end=='\\'&&end[1]) end++;
+   else if (*end=='"') quoted=!quoted;
+   else if (!quoted&&(*end=='#'||(*end=='/'&&end[1]=='/'))) break;
+  }
+  if (BT_asm_statement(s,t,end)<0) return(-1);
+  if (*end=='#'||*end=='/') while (*end&&*end!='\n') end++;
+  if (*end=='\n') s->line++;
+  t=*end?end+1:end;
+ }
+
+ for (int i=0; i<s->fixups; i++)
+ {
+  s->line=s->fixup_line[i];
+  if (s->fixup_label[i]<0) s->fixup_label[i]=BT_asm_label(s,s->fixup_name[i],s->fixup_len[i]);
+  if (s->fixup_label[i]<0) return(BT_asm_error(s,"undefined label '%.*s'",s->fixup_len[i],s->fixup_name[i]));
+  offset=s->label_at[s->fixup_label[i]]-(s->fixup_at[i]+3);
+  if (offset<-32768||offset>32767) return(BT_asm_error(s,"jump to '%.*s' is too far",s->fixup_len[i],s->fixup_name[i]));
+  s->buf[s->fixup_at[i]]=LC2_byte0();
+  s->buf[s->fixup_at[i]+1]=LX_byte1(offset);
+  s->buf[s->fixup_at[i]+2]=LX_byte2(offset);
+ }
+ if (s->set_globals>=0) s->globals=s->set_globals;
+ if (s->set_locals>=0) s->locals=s->set_locals;
+ return(0);
+}
+
+static int BT_asm_run(const char *source, unsigned char type, unsigned char *cmd_string, int maxlen,
+                      BT_asm_command *command, const char *caller)
+{
+ // Assemble source into a direct command. Returns the length, or -1.
+ BT_asm_state state;
+ int len;
+
+ if (type!=DIRECT_COMMAND_REPLY&&type!=DIRECT_COMMAND_NO_REPLY)
+ {
+  fprintf(stderr,"%s: Only direct commands can be assembled\n",caller);
+  return(-1);
+ }
+ if (maxlen<7)
+ {
+  fprintf(stderr,"%s: Buffer too small\n",caller);
+  return(-1);
+ }
+ BT_asm_begin(&state,cmd_string,MIN(maxlen,1024),7,command,caller);
+ if (BT_asm_source(&state,source)<0) return(-1);
+ if (state.globals>1019||state.locals>63)
+ {
+  fprintf(stderr,"%s: %d bytes of globals and %d of locals is more than a direct command can have\n",caller,
+          state.globals,state.locals);
+  return(-1);
+ }
+ len=state.p-cmd_string;
+ cmd_string[0]=LX_byte1((len-2));
+ cmd_string[1]=LX_byte2((len-2));
+ cmd_string[2]=0x00;
+ cmd_string[3]=0x00;
+ cmd_string[4]=type;
+ cmd_string[5]=LX_byte1(state.globals);
+ cmd_string[6]=(LX_byte2(state.globals)&0x03)|(state.locals<<2);
+ return(len);
+}
+
+int BT_assemble(const char *source, unsigned char type, unsigned char *cmd_string, int maxlen)
+{
+ //////////////////////////////////////////////////////////////////////////////////////////////////////
+ // Assemble a direct command from source text. See btcomm_asm.h for the syntax.
+ //
+ // Inputs: source - the program, one instruction per line or separated by ';'
+ //         type - DIRECT_COMMAND_REPLY or DIRECT_COMMAND_NO_REPLY
+ //         cmd_string, maxlen - where the command goes; the message id is left at 0
+ //
+ // Returns: the length of the command
+ //          -1 if the source has an error (printed to stderr) or the command does not fit
+ //////////////////////////////////////////////////////////////////////////////////////////////////////
+ return(BT_asm_run(source,type,cmd_string,maxlen,NULL,"BT_assemble"));
+}
+
+int BT_asm_compile(const char *source, unsigned char type, BT_asm_command *command)
+{
+ //////////////////////////////////////////////////////////////////////////////////////////////////////
+ // Assemble a direct command that has placeholders ($0 to $15) for values to be filled in later
+ // with BT_asm_fill().
+ //
+ // Inputs: source, type - as for BT_assemble()
+ //         command - where the command and its placeholders are kept
+ //
+ // Returns: the length of the command, or -1 on error
+ //////////////////////////////////////////////////////////////////////////////////////////////////////
+ command->sites=0;
+ command->len=BT_asm_run(source,type,&command->cmd_string[0],1024,command,"BT_asm_compile");
+ return(command->len);
+}
+
+int BT_asm_fill(const BT_asm_command *command, unsigned char *cmd_string, int msg_id, const int *values)
+{
+ //////////////////////////////////////////////////////////////////////////////////////////////////////
+ // Write out a command compiled with BT_asm_compile(), with values[n] in place of each $n.
+ //
+ // Inputs: command - the compiled command
+ //         cmd_string - where it goes, at least command->len bytes
+ //         msg_id - value for the cnt_id field
+ //         values - one per placeholder; converted to float for DATAF parameters
+ //
+ // Returns: the length of the command
+ //////////////////////////////////////////////////////////////////////////////////////////////////////
+ int32_t v;
+ float f;
+
+ memcpy(cmd_string,&command->cmd_string[0],command->len);
+ cmd_string[2]=LX_byte1(msg_id);
+ cmd_string[3]=LX_byte2(msg_id);
+ for (int i=0; i<command->sites; i++)
+ {
+  v=values[command->site_hole[i]];
+  if (command->site_float[i])
+  {
+   f=(float)v;
+   memcpy(&v,&f,4);
+  }
+  BT_asm_put32(cmd_string+command->site_at[i],v);
+ }
+ return(command->len);
+}
+
+int BT_asm_image(const char *source, unsigned char *image, int maxlen)
+{
+ //////////////////////////////////////////////////////////////////////////////////////////////////////
+ // Assemble a program image - the contents of an .rbf file - with one thread, which runs the
+ // source from the top. An opOBJECT_END is added at the end. GVn are the program's globals and
+ // LVn the thread's locals, and neither has the limits of a direct command.
+ //
+ // Inputs: source - as for BT_assemble(), without placeholders
+ //         image, maxlen - where the image goes
+ //
+ // Returns: the size of the image, or -1 on error
+ //////////////////////////////////////////////////////////////////////////////////////////////////////
+ BT_asm_state state;
+ int len, version=(int)(BYTECODE_VERSION*100.0+0.5);
+
+ if (maxlen<BT_IMAGE_HEADER+1)
+ {
+  fprintf(stderr,"BT_asm_image: Buffer too small\n");
+  return(-1);
+ }
+ BT_asm_begin(&state,image,maxlen,BT_IMAGE_HEADER,NULL,"BT_asm_image");
+ if (BT_asm_source(&state,source)<0||BT_asm_room(&state,1)<0) return(-1);
+ *(state.p++)=opOBJECT_END;
+ len=state.p-image;
+
+ // IMGHEAD: sign, image size, version, number of objects, global bytes
+ memcpy(image,"LEGO",4);
+ BT_asm_put32(image+4,len);
+ image[8]=LX_byte1(version);
+ image[9]=LX_byte2(version);
+ image[10]=1;
+ image[11]=0;
+ BT_asm_put32(image+12,state.globals);
+ // OBJHEAD of the thread: offset to its instructions, owner object, trigger count, local bytes
+ BT_asm_put32(image+16,BT_IMAGE_HEADER);
+ memset(image+20,0,4);
+ BT_asm_put32(image+24,state.locals);
+ return(len);
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Disassembler
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+#define BT_ASM_CONST 0
+#define BT_ASM_LOCAL 1
+#define BT_ASM_GLOBAL 2
+#define BT_ASM_STRING 3
+
+typedef struct
+{
+ int kind;
+ long value;					// The constant, or the variable's offset
+ int size;					// Bytes the parameter takes
+ int flags;					// PRIMPAR_HANDLE or PRIMPAR_ADDR on a variable
+ const unsigned char *str;			// String constant, up to its terminating zero
+} BT_asm_par;
+
+typedef struct
+{
+ char *p, *end;					// Listing being written
+ int full;					// Something did not fit
+} BT_asm_text;
+
+typedef struct
+{
+ int offset;					// In the global area
+ char letter;
+ int width;
+ const char *op;
+} BT_asm_output;
+
+typedef struct
+{
+ // What a walk over the byte codes of a direct command collects
+ const unsigned char *body;
+ int len;
+ unsigned char start[1025];			// 1 where an instruction starts (or at the end)
+ unsigned char target[1025];			// 1 where an LC2 jump lands
+ short label[1025];				// Label number of each target that is also a start
+ BT_asm_output *outputs;			// Global outputs, for decoding replies, or NULL
+ int n_outputs, max_outputs;
+} BT_asm_walk;
+
+static void BT_asm_print(BT_asm_text *out, const char *fmt, ...)
+{
+ va_list ap;
+ int n;
+
+ if (out->full) return;
+ va_start(ap,fmt);
+ n=vsnprintf(out->p,out->end-out->p,fmt,ap);
+ va_end(ap);
+ if (n<0||n>=out->end-out->p)
+ {
+  out->full=1;
+  return;
+ }
+ out->p+=n;
+}
+
+static int BT_asm_decode(const unsigned char **pc, const unsigned char *end, BT_asm_par *par)
+{
+ // Decode the parameter at *pc. Returns 0, or -1 if it is malformed or a kind we do not handle.
+ const unsigned char *p=*pc;
+ int b, n;
+
+ if (p>=end) return(-1);
+ b=*(p++);
+ par->flags=0;
+ par->value=0;
+ if (!(b&PRIMPAR_LONG))
+ {
+  if (b&PRIMPAR_VARIABEL)
+  {
+   par->kind=(b&PRIMPAR_GLOBAL)?BT_ASM_GLOBAL:BT_ASM_LOCAL;
+   par->value=b&PRIMPAR_INDEX;
+  }
+  else
+  {
+   par->kind=BT_ASM_CONST;
+   par->value=(b&PRIMPAR_CONST_SIGN)?(b&PRIMPAR_VALUE)-64:(b&PRIMPAR_VALUE);
+  }
+  par->size=1;
+  *pc=p;
+  return(0);
+ }
+ n=b&PRIMPAR_BYTES;
+ if (!(b&PRIMPAR_VARIABEL))
+ {
+  if (b&(PRIMPAR_LABEL|PRIMPAR_HANDLE|PRIMPAR_ADDR)) return(-1);
+  if (n==PRIMPAR_STRING)
+  {
+   par->kind=BT_ASM_STRING;
+   par->str=p;
+   while (p<end&&*p) p++;
+   if (p>=end) return(-1);
+   par->size=p+1-*pc;
+   *pc=p+1;
+   return(0);
+  }
+  if (n!=PRIMPAR_1_BYTE&&n!=PRIMPAR_2_BYTES&&n!=PRIMPAR_4_BYTES) return(-1);
+  par->kind=BT_ASM_CONST;
+ }
+ else
+ {
+  if (n!=PRIMPAR_1_BYTE&&n!=PRIMPAR_2_BYTES&&n!=PRIMPAR_4_BYTES) return(-1);
+  par->kind=(b&PRIMPAR_GLOBAL)?BT_ASM_GLOBAL:BT_ASM_LOCAL;
+  par->flags=b&(PRIMPAR_HANDLE|PRIMPAR_ADDR);
+  if (par->flags==(PRIMPAR_HANDLE|PRIMPAR_ADDR)) return(-1);
+ }
+ if (n==PRIMPAR_4_BYTES) n=4;
+ if (p+n>end) return(-1);
+ for (int i=n-1; i>=0; i--) par->value=(par->value<<8)|p[i];
+ if (par->kind==BT_ASM_CONST||n==4)
+ {
+  if (n==1) par->value=(int8_t)par->value;
+  else if (n==2) par->value=(int16_t)par->value;
+  else par->value=(int32_t)par->value;
+ }
+ if (par->kind!=BT_ASM_CONST&&(par->value<0||par->value>0xFFFF)) return(-1);
+ par->size=n+1;
+ *pc=p+n;
+ return(0);
+}
+
+static int BT_asm_shortest(const BT_asm_par *par)
+{
+ // Size of the encoding the assembler would pick for this parameter
+ long v=par->value;
+
+ if (par->kind==BT_ASM_CONST) return((v>=-32&&v<=31)?1:(v>=-128&&v<=127)?2:(v>=-32768&&v<=32767)?3:5);
+ return((v<32&&!par->flags)?1:(v<256)?2:3);
+}
+
+static void BT_asm_print_par(BT_asm_text *out, const BT_asm_walk *w, const BT_asm_par *par, char letter,
+                             const unsigned char *next)
+{
+ // Write out a parameter so that the assembler turns it back into the same bytes
+ static const char *names[]={"LC","LV","GV"};
+ int size_digit=(par->size==5)?4:par->size-1, target;
+ float f;
+ int32_t bits;
+
+ if (par->kind==BT_ASM_STRING)
+ {
+  BT_asm_print(out,"\"");
+  for (const unsigned char *c=par->str; *c; c++)
+  {
+   if (*c=='"'||*c=='\\') BT_asm_print(out,"\\%c",*c);
+   else if (*c=='\n') BT_asm_print(out,"\\n");
+   else if (*c<32||*c>126) BT_asm_print(out,"\\x%02X",*c);
+   else BT_asm_print(out,"%c",*c);
+  }
+  BT_asm_print(out,"\"");
+  return;
+ }
+ if (par->kind!=BT_ASM_CONST)
+ {
+  if (par->flags) BT_asm_print(out,"%s(",(par->flags&PRIMPAR_HANDLE)?"HND":"ADR");
+  if (par->size==BT_asm_shortest(par)) BT_asm_print(out,"%s%ld",names[par->kind],par->value);
+  else BT_asm_print(out,"%s%d(%ld)",names[par->kind],size_digit,par->value);
+  if (par->flags) BT_asm_print(out,")");
+  return;
+ }
+ if (letter=='j'&&par->size==3)
+ {
+  target=(next-w->body)+par->value;
+  if (target>=0&&target<=w->len&&w->start[target])
+  {
+   BT_asm_print(out,"L%d",w->label[target]);
+   return;
+  }
+ }
+ if (par->size!=BT_asm_shortest(par))
+ {
+  BT_asm_print(out,"LC%d(%ld)",size_digit,par->value);
+  return;
+ }
+ if (letter=='f'||letter=='F')
+ {
+  bits=par->value;
+  memcpy(&f,&bits,4);
+  if (isfinite(f))
+  {
+   char number[32];
+   snprintf(number,sizeof(number),"%.9g",f);
+   // Make sure it reads back as a float, not as an integer of the same digits
+   BT_asm_print(out,"%s%s",number,strpbrk(number,".en")?"":".0");
+   return;
+  }
+  BT_asm_print(out,"LC%d(%ld)",size_digit,par->value);
+  return;
+ }
+ BT_asm_print(out,"%ld",par->value);
+}
+
+static int BT_asm_insn(BT_asm_walk *w, const unsigned char *pc, BT_asm_text *out)
+{
+ // Decode the instruction at pc, writing it out if out is set. Returns its length, or -1 if it is not
+ // one the tables describe (nothing is written then).
+ const unsigned char *p=pc+1, *end=w->body+w->len;
+ const BT_asm_op *op=BT_asm_by_code[*pc];
+ const BT_asm_sub *sub=NULL;
+ BT_asm_cursor c;
+ BT_asm_par par;
+ char line[2048];
+ BT_asm_text l={&line[0],&line[sizeof(line)],0};
+ char letter;
+ int n=0, target;
+
+ if (op==NULL) return(-1);
+ BT_asm_print(&l,"  %s",op->name);
+ if (op->subs!=NULL)
+ {
+  if (BT_asm_decode(&p,end,&par)<0||par.kind!=BT_ASM_CONST||(sub=BT_asm_find_sub(op,par.value))==NULL) return(-1);
+  if (par.size!=BT_asm_shortest(&par)) return(-1);	// The assembler always writes sub-commands in the shortest form
+  BT_asm_print(&l," %s",sub->name);
+  n=1;
+ }
+ c.spec=(sub!=NULL)?sub->params:op->params;
+ c.repeat=0;
+ c.format=DATA_RAW;
+ c.last=0;
+ while ((letter=BT_asm_next(&c))!=0)
+ {
+  if (BT_asm_decode(&p,end,&par)<0) return(-1);
+  if (isupper(letter)&&par.kind!=BT_ASM_LOCAL&&par.kind!=BT_ASM_GLOBAL) return(-1);
+  if (par.kind==BT_ASM_STRING&&letter!='s') return(-1);
+  if (par.kind==BT_ASM_CONST&&BT_asm_counted(&c,letter,par.value)<0) return(-1);
+  if ((letter=='n'||letter=='x')&&par.kind!=BT_ASM_CONST) return(-1);
+  if (letter=='j'&&par.kind==BT_ASM_CONST&&par.size==3)
+  {
+   target=(p-w->body)+par.value;
+   if (target>=0&&target<=w->len) w->target[target]=1;
+  }
+  if (isupper(letter)&&par.kind==BT_ASM_GLOBAL&&w->outputs!=NULL&&w->n_outputs<w->max_outputs)
+  {
+   BT_asm_output *o=&w->outputs[w->n_outputs++];
+   o->offset=par.value;
+   o->letter=letter;
+   o->width=BT_asm_width(letter,c.last);
+   o->op=op->name;
+  }
+  if (out!=NULL)
+  {
+   BT_asm_print(&l,(n++==0)?" ":", ");
+   BT_asm_print_par(&l,w,&par,letter,p);
+  }
+ }
+ if (out!=NULL)
+ {
+  if (l.full) return(-1);
+  BT_asm_print(out,"%s\n",line);
+ }
+ return(p-pc);
+}
+
+static void BT_asm_bytes(BT_asm_text *out, const unsigned char *p, int n)
+{
+ // Raw bytes, as .bytes lines of 16
+ for (int i=0; i<n; i++)
+ {
+  if (i%16==0) BT_asm_print(out,"%s  .bytes 0x%02X",i?"\n":"",p[i]);
+  else BT_asm_print(out,", 0x%02X",p[i]);
+ }
+ if (n>0) BT_asm_print(out,"\n");
+}
+
+static void BT_asm_walk_body(BT_asm_walk *w, BT_asm_text *out)
+{
+ // Go through the byte codes once to find instructions and jump targets (out NULL), or to write them out
+ const unsigned char *pc=w->body, *end=w->body+w->len;
+ int n;
+
+ while (pc<end)
+ {
+  if (out!=NULL&&w->target[pc-w->body]&&w->start[pc-w->body]) BT_asm_print(out,"L%d:\n",w->label[pc-w->body]);
+  w->start[pc-w->body]=1;
+  if ((n=BT_asm_insn(w,pc,out))<0)
+  {
+   // Not an instruction we know: the rest can only be shown as bytes
+   if (out!=NULL) BT_asm_bytes(out,pc,end-pc);
+   return;
+  }
+  pc+=n;
+ }
+ w->start[w->len]=1;
+ if (out!=NULL&&w->target[w->len]) BT_asm_print(out,"L%d:\n",w->label[w->len]);
+}
+
+static void BT_asm_prepare(BT_asm_walk *w, const unsigned char *cmd_string, int len)
+{
+ // Find the instructions and jump targets of a direct command, and number the labels
+ int labels=0;
+
+ pthread_once(&BT_asm_once,BT_asm_init);
+ w->body=cmd_string+7;
+ w->len=len-7;
+ memset(w->start,0,sizeof(w->start));
+ memset(w->target,0,sizeof(w->target));
+ BT_asm_walk_body(w,NULL);
+ for (int i=0; i<=w->len; i++)
+  if (w->target[i]&&w->start[i]) w->label[i]=++labels;
+}
+
+// System commands: name, and the layout of the fields after the command byte - a digit for an integer of
+// that many bytes, 's' for a path, '*' for data to the end
+static const struct {int code; const char *name; const char *fields;} BT_asm_system[]={
+ {BEGIN_DOWNLOAD,"BEGIN_DOWNLOAD","4s"}, {CONTINUE_DOWNLOAD,"CONTINUE_DOWNLOAD","1*"},
+ {BEGIN_UPLOAD,"BEGIN_UPLOAD","2s"}, {CONTINUE_UPLOAD,"CONTINUE_UPLOAD","12"},
+ {BEGIN_GETFILE,"BEGIN_GETFILE","2s"}, {CONTINUE_GETFILE,"CONTINUE_GETFILE","12"},
+ {CLOSE_FILEHANDLE,"CLOSE_FILEHANDLE","1*"}, {LIST_FILES,"LIST_FILES","2s"},
+ {CONTINUE_LIST_FILES,"CONTINUE_LIST_FILES","12"}, {CREATE_DIR,"CREATE_DIR","s"}, {DELETE_FILE,"DELETE_FILE","s"},
+ {LIST_OPEN_HANDLES,"LIST_OPEN_HANDLES",""}, {WRITEMAILBOX,"WRITEMAILBOX","*"}, {BLUETOOTHPIN,"BLUETOOTHPIN","*"},
+ {ENTERFWUPDATE,"ENTERFWUPDATE",""}};
+
+static const char *BT_asm_system_name(int code)
+{
+ for (int i=0; i<(int)(sizeof(BT_asm_system)/sizeof(BT_asm_system[0])); i++)
+  if (BT_asm_system[i].code==code) return(BT_asm_system[i].name);
+ return(NULL);
+}
+
+static void BT_asm_print_system(BT_asm_text *out, const unsigned char *cmd, int len)
+{
+ // "BEGIN_DOWNLOAD 1234, "path"" and the like
+ const char *fields=NULL, *name;
+ const unsigned char *p=cmd+6, *end=cmd+len;
+ long v;
+ int n;
+
+ for (int i=0; i<(int)(sizeof(BT_asm_system)/sizeof(BT_asm_system[0])); i++)
+  if (BT_asm_system[i].code==cmd[5]) fields=BT_asm_system[i].fields;
+ name=BT_asm_system_name(cmd[5]);
+ if (name==NULL)
+ {
+  BT_asm_print(out,"  system command 0x%02X\n",cmd[5]);
+  BT_asm_bytes(out,p,end-p);
+  return;
+ }
+ BT_asm_print(out,"  %s",name);
+ for (n=0; *fields&&p<end; fields++, n++)
+ {
+  BT_asm_print(out,n?", ":" ");
+  if (*fields=='s')
+  {
+   BT_asm_print(out,"\"%.*s\"",(int)strnlen((const char *)p,end-p),p);
+   p=end;
+  }
+  else if (*fields=='*')
+  {
+   BT_asm_print(out,"%d bytes",(int)(end-p));
+   p=end;
+  }
+  else
+  {
+   v=0;
+   for (int i=*fields-'1'; i>=0; i--) v=(v<<8)|((p+i<end)?p[i]:0);
+   BT_asm_print(out,"%ld",v);
+   p+=*fields-'0';
+  }
+ }
+ BT_asm_print(out,"\n");
+}
+
+int BT_disassemble(const unsigned char *cmd_string, int len, char *text, int maxlen)
+{
+ //////////////////////////////////////////////////////////////////////////////////////////////////////
+ // Turn a command back into text. A direct command comes out as source that BT_assemble()
+ // turns into the same bytes, under a comment line with its type and message id; a system
+ // command as its name and fields.
+ //
+ // Inputs: cmd_string, len - the command, including the length field
+ //         text, maxlen - where the text goes
+ //
+ // Returns: the length of the text
+ //          -1 if it does not fit in maxlen bytes
+ //////////////////////////////////////////////////////////////////////////////////////////////////////
+ BT_asm_text out={text,text+maxlen,0};
+ BT_asm_walk *w;
+
+ if (maxlen<1) return(-1);
+ text[0]='\0';
+ if (len<5||len>1026)
+ {
+  BT_asm_print(&out,"// %d byte frame\n",len);
+  if (len>0) BT_asm_bytes(&out,cmd_string,MIN(len,1026));
+  return(out.full?-1:out.p-text);
+ }
+ BT_asm_print(&out,"// %s, id %d\n",(cmd_string[4]==DIRECT_COMMAND_REPLY)?"DIRECT_COMMAND_REPLY":
+              (cmd_string[4]==DIRECT_COMMAND_NO_REPLY)?"DIRECT_COMMAND_NO_REPLY":
+              (cmd_string[4]==SYSTEM_COMMAND_REPLY)?"SYSTEM_COMMAND_REPLY":
+              (cmd_string[4]==SYSTEM_COMMAND_NO_REPLY)?"SYSTEM_COMMAND_NO_REPLY":"unknown type",
+              cmd_string[2]|(cmd_string[3]<<8));
+ if ((cmd_string[4]==SYSTEM_COMMAND_REPLY||cmd_string[4]==SYSTEM_COMMAND_NO_REPLY)&&len>=6)
+  BT_asm_print_system(&out,cmd_string,len);
+ else if ((cmd_string[4]==DIRECT_COMMAND_REPLY||cmd_string[4]==DIRECT_COMMAND_NO_REPLY)&&len>=7)
+ {
+  w=(BT_asm_walk *)malloc(sizeof(BT_asm_walk));
+  if (w==NULL) return(-1);
+  w->outputs=NULL;
+  BT_asm_prepare(w,cmd_string,len);
+  BT_asm_print(&out,".globals %d\n.locals %d\n",cmd_string[5]|((cmd_string[6]&0x03)<<8),cmd_string[6]>>2);
+  BT_asm_walk_body(w,&out);
+  free(w);
+ }
+ else BT_asm_bytes(&out,cmd_string+5,len-5);
+ return(out.full?-1:out.p-text);
+}
+
+static void BT_asm_print_value(BT_asm_text *out, const unsigned char *p, const BT_asm_output *o)
+{
+ float f;
+
+ switch (o->letter)
+ {
+  case 'B': BT_asm_print(out,"%d",(int8_t)p[0]); break;
+  case 'H': BT_asm_print(out,"%d",(int16_t)(p[0]|(p[1]<<8))); break;
+  case 'W': BT_asm_print(out,"%d",(int32_t)((uint32_t)p[0]|((uint32_t)p[1]<<8)|((uint32_t)p[2]<<16)|((uint32_t)p[3]<<24))); break;
+  case 'F': memcpy(&f,p,4); BT_asm_print(out,"%.9g",f); break;
+  default: BT_asm_print(out,"\"%.*s\"",(int)strnlen((const char *)p,o->width),p); break;
+ }
+}
+
+int BT_disassemble_reply(const unsigned char *reply, int len, const unsigned char *cmd_string, int cmd_len,
+                         char *text, int maxlen)
+{
+ //////////////////////////////////////////////////////////////////////////////////////////////////////
+ // Turn a reply into text. Given the direct command it answers, each value in the reply is
+ // shown with the variable it was written to, e.g. "GV4 = 1.5  // INPUT_READSI"; without it, or
+ // for a system reply, the payload is shown as bytes.
+ //
+ // Inputs: reply, len - the reply, including the length field
+ //         cmd_string, cmd_len - the command it answers, or NULL
+ //         text, maxlen - where the text goes
+ //
+ // Returns: the length of the text
+ //          -1 if it does not fit in maxlen bytes
+ //////////////////////////////////////////////////////////////////////////////////////////////////////
+ BT_asm_text out={text,text+maxlen,0};
+ BT_asm_output outputs[256];
+ BT_asm_walk *w;
+ const char *name;
+ int type;
+
+ if (maxlen<1) return(-1);
+ text[0]='\0';
+ if (len<5)
+ {
+  BT_asm_print(&out,"// %d byte frame\n",len);
+  BT_asm_bytes(&out,reply,MAX(len,0));
+  return(out.full?-1:out.p-text);
+ }
+ type=reply[4];
+ BT_asm_print(&out,"// %s, id %d\n",(type==DIRECT_REPLY)?"DIRECT_REPLY":(type==DIRECT_REPLY_ERROR)?"DIRECT_REPLY_ERROR":
+              (type==SYSTEM_REPLY)?"SYSTEM_REPLY":(type==SYSTEM_REPLY_ERROR)?"SYSTEM_REPLY_ERROR":"unknown type",
+              reply[2]|(reply[3]<<8));
+ if ((type==SYSTEM_REPLY||type==SYSTEM_REPLY_ERROR)&&len>=7)
+ {
+  static const char *status[]={"SUCCESS","UNKNOWN_HANDLE","HANDLE_NOT_READY","CORRUPT_FILE","NO_HANDLES_AVAILABLE",
+                               "NO_PERMISSION","ILLEGAL_PATH","FILE_EXITS","END_OF_FILE","SIZE_ERROR","UNKNOWN_ERROR",
+                               "ILLEGAL_FILENAME","ILLEGAL_CONNECTION"};
+  name=BT_asm_system_name(reply[5]);
+  if (name!=NULL) BT_asm_print(&out,"  %s",name);
+  else BT_asm_print(&out,"  system command 0x%02X",reply[5]);
+  if (reply[6]<=ILLEGAL_CONNECTION) BT_asm_print(&out," %s\n",status[reply[6]]);
+  else BT_asm_print(&out," status 0x%02X\n",reply[6]);
+  BT_asm_bytes(&out,reply+7,len-7);
+ }
+ else if (type==DIRECT_REPLY&&cmd_string!=NULL&&cmd_len>=7&&(cmd_string[4]&0x7F)==DIRECT_COMMAND_REPLY)
+ {
+  w=(BT_asm_walk *)malloc(sizeof(BT_asm_walk));
+  if (w==NULL) return(-1);
+  w->outputs=&outputs[0];
+  w->n_outputs=0;
+  w->max_outputs=256;
+  BT_asm_prepare(w,cmd_string,cmd_len);
+  for (int i=0; i<w->n_outputs; i++)
+  {
+   if (5+outputs[i].offset+outputs[i].width>len) continue;
+   BT_asm_print(&out,"  GV%d = ",outputs[i].offset);
+   BT_asm_print_value(&out,reply+5+outputs[i].offset,&outputs[i]);
+   BT_asm_print(&out,"  // %s\n",outputs[i].op);
+  }
+  free(w);
+ }
+ else BT_asm_bytes(&out,reply+5,len-5);
+ return(out.full?-1:out.p-text);
+}
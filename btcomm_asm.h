@@ -0,0 +1,88 @@
+/***********************************************************************************************************************
+ *
+ * 	Byte code assembler and disassembler for the BT Communications library.
+ *
+ * 	Fixed commands are best written with the builder in btcomm_cmd.h, which encodes them at compile time. The
+ * 	assembler is for commands that are worked out at run time - loaded from a file, typed in a test tool, or
+ * 	put together by the program - and the disassembler turns captured commands and replies back into text.
+ *
+ * 	Usage:
+ * 	   len=BT_assemble("OUTPUT_POWER 0, 9, 50\n"
+ * 	                   "OUTPUT_START 0, 9\n"
+ * 	                   "loop: INPUT_READ 0, 0, 16, 0, GV0\n"
+ * 	                   "JR_EQ8 GV0, 0, loop\n"
+ * 	                   "OUTPUT_STOP 0, 9, 1", DIRECT_COMMAND_REPLY, cmd_string, 1024);
+ * 	   BT_submit(cmd_string,len);
+ *
+ * 	   BT_disassemble(cmd_string,len,text,4096);       <-- The same program back, as text
+ * 	   BT_disassemble_reply(reply,rlen,cmd_string,len,text,4096);   <-- "GV0 = 1  // INPUT_READ", ...
+ *
+ * 	Source is one instruction per line (or separated by ';'), with comments starting at "//" or '#':
+ * 	   [label:] OPCODE param, param, ...
+ * 	Opcodes are the names in bytecodes.h, with or without the "op" prefix. Opcodes that take a sub-command
+ * 	(INPUT_DEVICE, UI_DRAW, SOUND, ...) take its name as their first parameter. Parameters are:
+ * 	   12, -3, 0x1F          - integer constants, encoded in the shortest form (LC0, LC1, LC2 or LC4)
+ * 	   1.5, -0.25            - float constants, for DATAF parameters (any number given to one is a float)
+ * 	   "text"                - string constants (LCS), with \" \\ \n and \xNN escapes
+ * 	   LV4, GV0              - local and global variables, by byte offset, in the shortest form
+ * 	   LC1(5), LV2(4), ...   - any of the bytecodes.h encodings, taken as written (LC0-LC4, LV0-LV4, GV0-GV4)
+ * 	   HND(LV4), ADR(GV0)    - a variable used as a handle or an address
+ * 	   loop                  - a label, for the offset of a jump (always LC2, so any distance fits)
+ * 	   $0 ... $15            - placeholders, see BT_asm_compile() below
+ * 	The global and local variable space is worked out from the variables used, or set with ".globals n" and
+ * 	".locals n" lines. ".bytes 0x01, 0x02, ..." emits raw bytes. BT_assemble() prints what is wrong, and on
+ * 	which line, to stderr.
+ *
+ * 	Only the opcodes whose parameters are listed in btcomm_asm.c are known - the ones the library sends and
+ * 	the arithmetic, compare, move, jump and program control families around them. The disassembler writes
+ * 	anything else as a .bytes line, so its output always assembles back to the same bytes.
+ *
+ * 	Generating commands in a control loop: compile the text once with BT_asm_compile(), using $n where values
+ * 	change, and stamp each command out of it with BT_asm_fill(), which only copies the bytes and patches the
+ * 	values in (placeholders are encoded as 4-byte constants so any value fits):
+ * 	   BT_asm_command drive;
+ * 	   BT_asm_compile("OUTPUT_POWER 0, 9, $0; OUTPUT_START 0, 9",DIRECT_COMMAND_NO_REPLY,&drive);
+ * 	   for (...) { int v[1]={power}; len=BT_asm_fill(&drive,cmd_string,0,v); BT_submit(cmd_string,len); }
+ *
+ * 	Programs that run on the brick on their own: BT_asm_image() assembles the same source into a program image,
+ * 	the contents of an .rbf file, which BT_program_upload() puts on the brick and BT_program_start() runs (see
+ * 	btcomm.h). The image has one thread, and GVn are the program's globals:
+ * 	   len=BT_asm_image("loop: INPUT_READ 0, 0, 16, 0, LV0\n"
+ * 	                    "JR_EQ8 LV0, 0, loop\n"
+ * 	                    "OUTPUT_STOP 0, 15, 1", image, sizeof(image));
+ *
+ *      This library is free software, distributed under the GPL license. Please refer to the include license
+ *      file for details.
+ *
+ * ********************************************************************************************************************/
+
+#ifndef __btcomm_asm_header
+#define __btcomm_asm_header
+
+#include "btcomm.h"
+
+#define BT_ASM_HOLES 16					// Placeholders $0 to $15
+#define BT_ASM_SITES 64					// Uses of placeholders in one command
+
+typedef struct
+{
+ int len;						// Length of the command, including the length field
+ int sites;						// Number of placeholder uses
+ short site_at[BT_ASM_SITES];				// Where the 4 value bytes of each use are
+ unsigned char site_hole[BT_ASM_SITES];			// Which placeholder it is
+ unsigned char site_float[BT_ASM_SITES];		// 1 for a DATAF parameter - the value is converted
+ unsigned char cmd_string[1024];
+} BT_asm_command;
+
+// type is DIRECT_COMMAND_REPLY or DIRECT_COMMAND_NO_REPLY. The message id is left at 0.
+int BT_assemble(const char *source, unsigned char type, unsigned char *cmd_string, int maxlen);	// Length, or -1
+int BT_asm_compile(const char *source, unsigned char type, BT_asm_command *command);		// Length, or -1
+int BT_asm_fill(const BT_asm_command *command, unsigned char *cmd_string, int msg_id, const int *values);
+
+int BT_asm_image(const char *source, unsigned char *image, int maxlen);	// Image size, or -1
+
+// Direct and system commands and replies. The reply is decoded against the command it answers, if given.
+int BT_disassemble(const unsigned char *cmd_string, int len, char *text, int maxlen);	// Text length, or -1
+int BT_disassemble_reply(const unsigned char *reply, int len, const unsigned char *cmd_string, int cmd_len,
+                         char *text, int maxlen);
+#endif
@@ -0,0 +1,417 @@
+/***********************************************************************************************************************
+ *
+ * 	Coroutine API for the BT Communications library.
+ *
+ * 	Every BT_* call holds up its thread for a whole Bluetooth round trip. Here the same requests are awaitable:
+ * 	a coroutine that asks for a sensor reading is suspended until the reply is in, and meanwhile the thread runs
+ * 	whatever else is ready - planning, other sensor reads, motor commands, other bricks. A btasync::loop drives all
+ * 	of it from one thread by polling the sockets of its connections, so no thread is spawned per request.
+ *
+ * 	Usage:
+ * 	   btasync::loop loop;
+ * 	   btasync::ev3 robot(loop);                           <-- BT_default_ev3, or btasync::ev3 robot(loop,EV3_open(...))
+ *
+ * 	   btasync::task<void> balance()
+ * 	   {
+ * 	    while (...)
+ * 	    {
+ * 	     int angle=co_await robot.read_gyro(PORT_2);       <-- other coroutines run while this one waits
+ * 	     co_await robot.motor_start(MOTOR_A|MOTOR_D,gain*angle);
+ * 	     co_await loop.sleep(10);
+ * 	    }
+ * 	   }
+ *
+ * 	   loop.spawn(balance());
+ * 	   loop.spawn(plan_route());
+ * 	   loop.run();                                         <-- returns when every spawned coroutine has finished
+ *
+ * 	A btasync::task<T> is a coroutine returning T. It starts when it is awaited, or when handed to loop.spawn().
+ * 	Requests are sent right away, up to BT_MAX_INFLIGHT per connection (further ones wait their turn), and their
+ * 	round trips overlap. Failed requests return -1, as the BT_* calls do.
+ *
+ * 	Single-sensor reads are snapshot commands with one port (see BT_snapshot_init()), so they accept the same
+ * 	sensors; read_gyro() returns the angle relative to the reference set with BT_read_gyro(port,1,...). For any
+ * 	other request, build the command (e.g. with btcmd::direct()) and co_await robot.command(cmd,len).
+ *
+ * 	The loop uses the pipelined command engine (BT_submit(), BT_pump()) directly, so its connections must not be
+ * 	handed to the I/O thread while it runs, and only the loop's thread may use them. Needs a C++20 compiler.
+ *
+ *      This library is free software, distributed under the GPL license. Please refer to the include license
+ *      file for details.
+ *
+ * ********************************************************************************************************************/
+
+#ifndef __btcomm_async_header
+#define __btcomm_async_header
+
+#include "btcomm.h"
+#include "btcomm_cmd.h"
+#include <coroutine>
+#include <deque>
+#include <exception>
+#include <map>
+#include <utility>
+#include <vector>
+
+namespace btasync
+{
+
+class loop;
+
+// Where a task's result is kept - nothing for task<void>
+template<class T> struct task_result
+{
+ T value{};
+ void return_value(T v) { value=std::move(v); }
+ T result() { return(std::move(value)); }
+};
+template<> struct task_result<void>
+{
+ void return_void() {}
+ void result() {}
+};
+
+template<class T=void>
+class task
+{
+ public:
+ struct promise_type : task_result<T>
+ {
+  std::coroutine_handle<> continuation;			// Who awaits this task, if anyone
+
+  task get_return_object() { return(task(std::coroutine_handle<promise_type>::from_promise(*this))); }
+  std::suspend_always initial_suspend() noexcept { return {}; }
+  struct final_awaiter
+  {
+   bool await_ready() noexcept { return(false); }
+   std::coroutine_handle<> await_suspend(std::coroutine_handle<promise_type> h) noexcept
+   {
+    // Go straight back to the awaiting coroutine; a spawned task stays suspended here for the loop to free
+    if (h.promise().continuation) return(h.promise().continuation);
+    return(std::noop_coroutine());
+   }
+   void await_resume() noexcept {}
+  };
+  final_awaiter final_suspend() noexcept { return {}; }
+  void unhandled_exception() { std::terminate(); }
+ };
+
+ task(task &&other) noexcept : h(std::exchange(other.h,{})) {}
+ task(const task &)=delete;
+ task &operator=(const task &)=delete;
+ ~task() { if (h) h.destroy(); }
+
+ bool await_ready() { return(false); }
+ std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting)
+ {
+  h.promise().continuation=awaiting;
+  return(h);
+ }
+ T await_resume() { return(h.promise().result()); }
+
+ private:
+ friend class loop;
+ explicit task(std::coroutine_handle<promise_type> handle) : h(handle) {}
+ std::coroutine_handle<promise_type> h;
+};
+
+// One request on its way to the brick. It lives in the awaiting coroutine's frame, so nothing is allocated.
+struct request
+{
+ BT_ev3 *ev3;
+ unsigned char cmd_string[1024];
+ int len;
+ int msg_id;
+ unsigned char reply[BT_MAX_REPLY];
+ int rlen;						// Reply length, -1 on error
+ std::coroutine_handle<> waiting;
+};
+
+class loop
+{
+ public:
+ loop() {}
+ loop(const loop &)=delete;
+ ~loop() { for (auto h : spawned) h.destroy(); }
+
+ void spawn(task<void> &&t)
+ {
+  //////////////////////////////////////////////////////////////////////////////////////////////////////
+  // Start a coroutine on this loop. It runs the next time run() gets to it, and the loop frees it
+  // when it has finished.
+  //////////////////////////////////////////////////////////////////////////////////////////////////////
+  std::coroutine_handle<> h=std::exchange(t.h,{});
+  spawned.push_back(h);
+  ready.push_back(h);
+ }
+
+ void run()
+ {
+  //////////////////////////////////////////////////////////////////////////////////////////////////////
+  // Run coroutines until every one that was spawned has finished: resume those that can go on,
+  // send queued requests, then sleep in poll() until a reply arrives or a timer expires.
+  //////////////////////////////////////////////////////////////////////////////////////////////////////
+  std::vector<struct pollfd> pfd;
+  std::vector<BT_ev3 *> polled;
+  long long now;
+  int timeout;
+
+  while (!spawned.empty())
+  {
+   while (!ready.empty())
+   {
+    std::coroutine_handle<> h=ready.front();
+    ready.pop_front();
+    h.resume();
+   }
+   for (size_t i=0; i<spawned.size(); )
+   {
+    if (spawned[i].done())
+    {
+     spawned[i].destroy();
+     spawned[i]=spawned.back();
+     spawned.pop_back();
+    }
+    else i++;
+   }
+   if (spawned.empty()) break;
+
+   send_backlog();
+   now=now_ns();
+   while (!timers.empty()&&timers.begin()->first<=now)
+   {
+    ready.push_back(timers.begin()->second);
+    timers.erase(timers.begin());
+   }
+   if (!ready.empty()) continue;
+
+   // Nothing to run - wait for a reply or the next timer
+   pfd.clear();
+   polled.clear();
+   for (request *r : waiting)
+   {
+    bool seen=false;
+    for (BT_ev3 *e : polled) seen|=(e==r->ev3);
+    if (seen) continue;
+    polled.push_back(r->ev3);
+    pfd.push_back({r->ev3->socket,POLLIN,0});
+   }
+   if (pfd.empty()&&timers.empty()&&backlog.empty()) return;	// <-- Deadlock: nothing can wake anyone
+   timeout=-1;
+   if (!timers.empty()) timeout=(int)((timers.begin()->first-now+999999)/1000000);
+   if (!backlog.empty()&&pfd.empty()) timeout=1;
+   if (poll(pfd.data(),pfd.size(),timeout)<0&&errno!=EINTR) return;
+   for (size_t i=0; i<pfd.size(); i++)
+    if (pfd[i].revents!=0&&EV3_pump(polled[i])<0) fail(polled[i]);
+   collect();
+  }
+ }
+
+ // co_await loop.sleep(ms) suspends the coroutine for that long, co_await loop.sleep_until(t) until
+ // CLOCK_MONOTONIC reaches t (in ns) - useful for fixed-rate control loops
+ struct timer_awaiter
+ {
+  loop *l;
+  long long t_ns;
+  bool await_ready() { return(t_ns<=now_ns()); }
+  void await_suspend(std::coroutine_handle<> h) { l->timers.emplace(t_ns,h); }
+  void await_resume() {}
+ };
+ timer_awaiter sleep(int ms) { return {this,now_ns()+ms*1000000LL}; }
+ timer_awaiter sleep_until(long long t_ns) { return {this,t_ns}; }
+
+ static long long now_ns()
+ {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC,&ts);
+  return((long long)ts.tv_sec*1000000000LL+ts.tv_nsec);
+ }
+
+ // Used by command_awaiter
+ bool send(request *r)
+ {
+  // Send now if a reply slot is free, otherwise queue. Returns true if the coroutine must wait.
+  if (backlog.empty()&&submit(r)) return(r->rlen==-2);
+  backlog.push_back(r);
+  return(true);
+ }
+
+ private:
+ bool submit(request *r)
+ {
+  // Returns false if every reply slot of the connection is taken. Otherwise rlen is -2 if the
+  // request now waits for its reply, 0 if it needs none, and -1 if it failed.
+  if (!(r->cmd_string[4]&0x80)&&EV3_inflight(r->ev3)>=BT_MAX_INFLIGHT) return(false);
+  r->msg_id=EV3_submit(r->ev3,&r->cmd_string[0],r->len);
+  if (r->msg_id<0) r->rlen=-1;
+  else if (r->cmd_string[4]&0x80) r->rlen=0;
+  else
+  {
+   r->rlen=-2;
+   waiting.push_back(r);
+  }
+  return(true);
+ }
+
+ void send_backlog()
+ {
+  while (!backlog.empty()&&submit(backlog.front()))
+  {
+   if (backlog.front()->rlen!=-2) ready.push_back(backlog.front()->waiting);
+   backlog.pop_front();
+  }
+ }
+
+ void collect()
+ {
+  // Hand every reply that has arrived to its coroutine
+  for (size_t i=0; i<waiting.size(); )
+  {
+   request *r=waiting[i];
+   if (EV3_reply_ready(r->ev3,r->msg_id)==0) {i++; continue;}
+   r->rlen=EV3_wait_reply(r->ev3,r->msg_id,&r->reply[0],BT_MAX_REPLY);
+   ready.push_back(r->waiting);
+   waiting[i]=waiting.back();
+   waiting.pop_back();
+  }
+ }
+
+ void fail(BT_ev3 *ev3)
+ {
+  // The connection is gone - every request on it fails
+  for (size_t i=0; i<waiting.size(); )
+  {
+   if (waiting[i]->ev3!=ev3) {i++; continue;}
+   waiting[i]->rlen=-1;
+   ready.push_back(waiting[i]->waiting);
+   waiting[i]=waiting.back();
+   waiting.pop_back();
+  }
+ }
+
+ std::vector<std::coroutine_handle<>> spawned;
+ std::deque<std::coroutine_handle<>> ready;
+ std::multimap<long long,std::coroutine_handle<>> timers;
+ std::vector<request *> waiting;			// Sent, reply not collected yet
+ std::deque<request *> backlog;				// Not sent yet - every reply slot was taken
+};
+
+// co_await on this sends the command and resumes with the reply length (-1 on error); the reply is in
+// reply[] of the awaiter
+struct command_awaiter
+{
+ loop *l;
+ request r;
+ bool await_ready() { return(false); }
+ bool await_suspend(std::coroutine_handle<> h)
+ {
+  r.waiting=h;
+  return(l->send(&r));
+ }
+ int await_resume() { return(r.rlen); }
+};
+
+class ev3
+{
+ public:
+ explicit ev3(loop &l, BT_ev3 *connection=&BT_default_ev3) : l(&l), conn(connection) {}
+
+ task<int> command(const unsigned char *cmd_string, int len, unsigned char *reply=NULL, int maxlen=0)
+ {
+  //////////////////////////////////////////////////////////////////////////////////////////////////////
+  // Send any encoded command (the message id is filled in) and wait for its reply. Like every task,
+  // this starts when awaited, so cmd_string must still be valid then.
+  //
+  // Returns: the reply length, and the reply in reply[] if given (truncated to maxlen)
+  //          0 for commands that do not ask for a reply, -1 on error
+  //////////////////////////////////////////////////////////////////////////////////////////////////////
+  command_awaiter a=prepare(cmd_string,len);
+  int rlen=co_await a;
+  if (rlen>0&&reply!=NULL) memcpy(reply,&a.r.reply[0],MIN(rlen,maxlen));
+  co_return(rlen);
+ }
+
+ task<int> snapshot(BT_snapshot_plan *plan, BT_snapshot *snap)
+ {
+  // Same as BT_read_snapshot(). Returns 0, or -1 on error.
+  command_awaiter a=prepare(&plan->cmd_string[0],plan->len);
+  int rlen=co_await a;
+  co_return(rlen<0?-1:EV3_decode_snapshot(conn,plan,&a.r.reply[0],rlen,snap));
+ }
+
+ task<int> read_touch(char port) { return(read_port(port,BT_SENSOR_TOUCH)); }
+ task<int> read_colour(char port) { return(read_port(port,BT_SENSOR_COLOUR)); }
+ task<int> read_ultrasonic(char port) { return(read_port(port,BT_SENSOR_ULTRASONIC)); }	// mm
+ task<int> read_gyro(char port) { return(read_port(port,BT_SENSOR_GYRO)); }		// degrees
+
+ task<int> motor_start(char port_ids, char power)
+ {
+  // Same as BT_motor_port_start(), but waits for the brick to confirm. Returns 0, or -1 on error.
+  unsigned char cmd_string[15];
+  int len=btcmd::direct<0,0>(cmd_string,DIRECT_COMMAND_REPLY,0,
+                             btcmd::op(opOUTPUT_POWER),btcmd::lc0(0),btcmd::lc0(port_ids),btcmd::lc1(power),
+                             btcmd::op(opOUTPUT_START),btcmd::lc0(0),btcmd::lc0(port_ids));
+  co_return(co_await confirm(cmd_string,len));
+ }
+
+ task<int> motor_stop(char port_ids, int brake_mode)
+ {
+  // Same as BT_motor_port_stop(). Returns 0, or -1 on error.
+  unsigned char cmd_string[11];
+  int len=btcmd::direct<0,0>(cmd_string,DIRECT_COMMAND_REPLY,0,
+                             btcmd::op(opOUTPUT_STOP),btcmd::lc0(0),btcmd::lc0(port_ids),btcmd::lc0(brake_mode));
+  co_return(co_await confirm(cmd_string,len));
+ }
+
+ task<int> drive(char lport, char rport, char power) { return(motor_start(lport|rport,power)); }
+
+ BT_ev3 *connection() { return(conn); }
+
+ private:
+ command_awaiter prepare(const unsigned char *cmd_string, int len)
+ {
+  command_awaiter a;
+  a.l=l;
+  a.r.ev3=conn;
+  a.r.len=MIN(len,1024);
+  memcpy(&a.r.cmd_string[0],cmd_string,a.r.len);
+  return(a);
+ }
+
+ task<int> confirm(const unsigned char *cmd_string, int len)
+ {
+  // cmd_string is copied when this starts, i.e. when the caller awaits it
+  command_awaiter a=prepare(cmd_string,len);
+  int rlen=co_await a;
+  co_return((rlen>=5&&a.r.reply[4]==DIRECT_REPLY)?0:-1);
+ }
+
+ task<int> read_port(char port, int sensor)
+ {
+  // One-port snapshot; plans are built on first use and kept
+  BT_snapshot snap;
+  if (port<PORT_1||port>PORT_4) co_return(-1);
+  BT_snapshot_plan &plan=plans[(int)port][sensor];
+  if (plan.len==0)
+  {
+   BT_port_map map={{BT_SENSOR_NONE,BT_SENSOR_NONE,BT_SENSOR_NONE,BT_SENSOR_NONE},0};
+   map.sensor[(int)port]=sensor;
+   if (BT_snapshot_init(&plan,&map)<0) co_return(-1);
+  }
+  if (co_await snapshot(&plan,&snap)<0) co_return(-1);
+  switch (sensor)
+  {
+   case BT_SENSOR_TOUCH: co_return(snap.touch[(int)port]);
+   case BT_SENSOR_COLOUR: co_return(snap.colour[(int)port]);
+   case BT_SENSOR_ULTRASONIC: co_return(snap.distance[(int)port]);
+   default: co_return(snap.angle[(int)port]);
+  }
+ }
+
+ loop *l;
+ BT_ev3 *conn;
+ BT_snapshot_plan plans[4][BT_SENSOR_GYRO+1]={};
+};
+
+}
+#endif
@@ -0,0 +1,796 @@
+/* EV3 API
+ *  Copyright (C) 2018-2019 Francisco Estrada and Lioudmila Tishkina
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// Throughput benchmark for the pipelined command engine, the I/O thread,
+// command coalescing, coroutines, multi-brick connections and sensor
+// streaming, followed by a latency suite that times every BT_* call on its
+// own. Runs against the stand-in brick in btcomm_emu.c, so no EV3 is needed.
+// Before the suite, one batch of samples is checked against the values the
+// stand-in brick was given; the exit status is 1 if any came back wrong.
+//
+// Usage: btcomm_bench [-n commands] [-l one-way link delay in us]
+//                     [-b link bytes/s] [-k brick us per direct command]
+//                     [-t pair|unix|tcp] [-c capture file]
+//                     [-s] [-o results.json] [-r baseline.json] [-x tolerance]
+//
+//   -k  time the stand-in brick spends on each direct command, which is what
+//       coalescing commands into shared packets saves
+//   -t  how the default connection reaches the stand-in brick: a socket pair
+//       (the default), or through BT_open() over a Unix socket or over TCP
+//       on the loopback interface, as over WiFi
+//   -s  run only the per-call latency suite
+//   -o  write the suite's results as JSON, one call per line
+//   -r  compare with results written earlier by -o (same -n, -l, -b, -k and -t);
+//       exits with status 1 if any call's p50 latency or rate is worse by
+//       more than the tolerance factor (default 1.25)
+
+#include "btcomm.h"
+#include "btcomm_async.h"
+#include "btcomm_asm.h"
+#include "btcomm_cmd.h"
+#include "btcomm_emu.h"
+#include "btcomm_stream.h"
+#include <time.h>
+
+static double now_s() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Keeps 'depth' touch sensor reads in flight until n of them completed.
+// Returns commands per second.
+static double run_pipelined(int n, int depth) {
+  unsigned char cmd[15] = {0x0D, 0x00, 0x00, 0x00, 0x00, 0x01, 0x00, opINPUT_DEVICE,
+                           LC0(READY_PCT), 0x00, PORT_1, LC0(0x10), 0x00, LC0(0x01), GV0(0x00)};
+  unsigned char reply[BT_MAX_REPLY];
+  int ids[BT_MAX_INFLIGHT];
+  int sent = 0, done = 0;
+  double t0 = now_s();
+
+  while (done < n) {
+    while (sent < n && sent - done < depth) ids[sent++ % depth] = BT_submit(cmd, 15);
+    if (BT_wait_reply(ids[done++ % depth], reply, BT_MAX_REPLY) < 0) return -1;
+  }
+  return n / (now_s() - t0);
+}
+
+// One control tick worth of sensor reads: four separate calls versus one
+// snapshot. Returns ticks per second.
+static double run_sensor_ticks(int n, int use_snapshot) {
+  BT_port_map map = {{BT_SENSOR_TOUCH, BT_SENSOR_GYRO, BT_SENSOR_COLOUR, BT_SENSOR_ULTRASONIC},
+                     MOTOR_A | MOTOR_B};
+  BT_snapshot_plan plan;
+  BT_snapshot snap;
+  int angle, rate;
+  double t0 = now_s();
+
+  BT_snapshot_init(&plan, &map);
+  for (int i = 0; i < n; i++) {
+    if (use_snapshot) {
+      BT_read_snapshot(&plan, &snap);
+    } else {
+      BT_read_touch_sensor(PORT_1);
+      BT_read_gyro(PORT_2, 0, &angle, &rate);
+      BT_read_colour_sensor(PORT_3);
+      BT_read_ultrasonic_sensor(PORT_4);
+    }
+  }
+  return n / (now_s() - t0);
+}
+
+// Motor updates with confirmed calls (fence_every < 0) or on the no-reply
+// lane, finished by a fence. Returns updates per second.
+static double run_lane(int n, int fence_every) {
+  double t0 = now_s();
+  if (fence_every >= 0) BT_lane_start(fence_every);
+  for (int i = 0; i < n; i++) BT_drive(MOTOR_A, MOTOR_D, 20 + i % 10);
+  if (fence_every >= 0)
+    BT_lane_stop();
+  else
+    BT_fence();
+  return n / (now_s() - t0);
+}
+
+// Drive motor A until the touch sensor is pressed, 200ms in: polling the
+// sensor from the PC, with an on-brick reaction, or with a program in the
+// brick's user slot (uploaded once by upload_touch_program()). Returns how far
+// the motor turned after the press, in degrees.
+struct Press {
+  EMU_brick *brick;
+  int tacho;
+};
+
+static void *press_touch(void *arg) {
+  Press *press = (Press *)arg;
+  int speed;
+  usleep(200000);
+  EMU_get_motor(press->brick, 0, &press->tacho, &speed);
+  EMU_set_sensor(press->brick, PORT_1, 16, 1, 0, 0);
+  return NULL;
+}
+
+static const char *touch_program = "../prjs/bench/touch.rbf";
+
+static int upload_touch_program() {
+  unsigned char image[256];
+  int len = BT_asm_image(
+      "OUTPUT_POWER 0, 1, 50; OUTPUT_START 0, 1\n"
+      "loop: INPUT_READ 0, 0, 16, 0, LV0\n"
+      "JR_EQ8 LV0, 0, loop\n"
+      "OUTPUT_STOP 0, 1, 1",
+      image, sizeof(image));
+  return len < 0 ? -1 : BT_program_upload(touch_program, image, len);
+}
+
+enum { POLLED, REACTION, PROGRAM };
+static const char *reaction_modes[] = {"polled from the PC", "on-brick reaction", "on-brick program"};
+
+static double run_reaction(EMU_brick *brick, int mode) {
+  BT_condition touch = {PORT_1, 16, 0, BT_UNTIL_AT_LEAST, 1, 0};
+  BT_reaction result;
+  Press press = {brick, 0};
+  pthread_t thread;
+  int tacho, speed;
+  EMU_set_sensor(brick, PORT_1, 16, 0, 0, 0);
+  pthread_create(&thread, NULL, press_touch, &press);
+  if (mode == REACTION) {
+    BT_run_until(MOTOR_A, 50, &touch, 5000, 1, &result);
+  } else if (mode == PROGRAM) {
+    if (BT_program_start(touch_program) == 0)
+      while (BT_program_status() == RUNNING) {
+      }
+  } else {
+    BT_motor_port_start(MOTOR_A, 50);
+    while (BT_read_touch_sensor(PORT_1) != 1) {
+    }
+    BT_motor_port_stop(MOTOR_A, 1);
+  }
+  pthread_join(thread, NULL);
+  usleep(100000);  // Let the motor come to rest
+  EMU_get_motor(brick, 0, &tacho, &speed);
+  EMU_set_sensor(brick, PORT_1, 16, 0, 0, 0);
+  return tacho - press.tacho;
+}
+
+// Command encoding cost only (no I/O). The "legacy" versions copy the way
+// BT_read_gyro() and BT_drive() used to build their commands: a pre-defined
+// array copied into a 1024 byte buffer next to a cleared 1024 byte reply
+// buffer, then patched byte by byte.
+// Same map, sampled on the brick in batches, 1ms apart by the brick's timer.
+// Returns samples per second.
+static double run_batch_ticks(int n, int *per_batch) {
+  BT_port_map map = {{BT_SENSOR_TOUCH, BT_SENSOR_GYRO, BT_SENSOR_COLOUR, BT_SENSOR_ULTRASONIC},
+                     MOTOR_A | MOTOR_B};
+  static BT_batch_plan plan;
+  static BT_snapshot snaps[1019];
+  int samples = 0;
+  *per_batch = BT_batch_init(&plan, &map, 1, 0);
+  if (*per_batch <= 0) return 0;
+  double t0 = now_s();
+  while (samples < n) samples += BT_read_batch(&plan, snaps);
+  return samples / (now_s() - t0);
+}
+
+// One full batch from a gyro alone, whose globals run well past 255 bytes (so
+// the later samples are written through GV2 references), checked against the
+// angle the stand-in brick was given. Returns the number of wrong samples.
+static int check_batch(EMU_brick *brick) {
+  BT_port_map map = {{0, BT_SENSOR_GYRO, 0, 0}, 0};
+  static BT_batch_plan plan;
+  static BT_snapshot snaps[1019];
+  int wrong = 0;
+  EMU_set_sensor(brick, PORT_2, 32, 123, 0, 0);
+  int n = BT_batch_init(&plan, &map, 1, 0);
+  if (n <= 0 || BT_read_batch(&plan, snaps) != n) return 1;
+  for (int i = 0; i < n; i++)
+    if (snaps[i].angle[PORT_2] != 123) wrong++;
+  printf("\n# batch check: %d of %d samples (%d bytes of globals) wrong\n", wrong, n,
+         plan.cmd_string[5] | ((plan.cmd_string[6] & 0x03) << 8));
+  EMU_set_sensor(brick, PORT_2, 32, 0, 0, 0);
+  return wrong;
+}
+
+static volatile unsigned sink;
+
+static int legacy_gyro(unsigned char *cmd_string, char port) {
+  unsigned char reply[1024];
+  unsigned char CMD_READ_GYRO_ANGRATE[17] = {0x0F, 0x00, 0x00, 0x00, 0x00, 0x80, 0x00, 0x99, 0x1C,
+                                             0x00, 0x01, 0x81, 0x20, 0x03, 0x02, 0x60, 0x64};
+  memset(&reply[0], 0, 1024);
+  int cmdlen = CMD_READ_GYRO_ANGRATE[0] + 2;
+  memcpy(cmd_string, &CMD_READ_GYRO_ANGRATE[0], cmdlen);
+  unsigned char *cp = (unsigned char *)&message_id_counter;
+  cmd_string[2] = *cp;
+  cmd_string[3] = *(cp + 1);
+  cmd_string[10] = port;
+  sink = sink + reply[port & 3];
+  return cmdlen;
+}
+
+static int builder_gyro(unsigned char *cmd_string, char port) {
+  return btcmd::direct_at<8, 0>(cmd_string, DIRECT_COMMAND_REPLY, message_id_counter,
+                                btcmd::op(opINPUT_DEVICE), btcmd::lc0(READY_RAW), btcmd::lc0(0),
+                                btcmd::lc0(port), btcmd::lc1(EV3_GYRO), btcmd::lc0(3), btcmd::lc0(2),
+                                btcmd::gv0(0x00), btcmd::gv0(0x04));
+}
+
+static int legacy_drive(unsigned char *cmd_string, char ports, char power) {
+  unsigned char cmd[15] = {0x0D, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xA4,
+                           0x00, 0x00, 0x81, 0x00, 0xA6, 0x00, 0x00};
+  unsigned char *cp = (unsigned char *)&message_id_counter;
+  cmd[2] = *cp;
+  cmd[3] = *(cp + 1);
+  cmd[9] = ports;
+  cmd[11] = power;
+  cmd[14] = ports;
+  memcpy(cmd_string, cmd, 15);
+  return 15;
+}
+
+static int builder_drive(unsigned char *cmd_string, char ports, char power) {
+  return btcmd::direct_at<0, 0>(cmd_string, DIRECT_COMMAND_REPLY, message_id_counter,
+                                btcmd::op(opOUTPUT_POWER), btcmd::lc0(0), btcmd::lc0(ports),
+                                btcmd::lc1(power), btcmd::op(opOUTPUT_START), btcmd::lc0(0),
+                                btcmd::lc0(ports));
+}
+
+// Several threads making blocking BT_* calls at once through the I/O
+// thread. Returns commands per second over all threads.
+static void *touch_loop(void *arg) {
+  int n = *(int *)arg;
+  for (int i = 0; i < n; i++) BT_read_touch_sensor(PORT_1);
+  return NULL;
+}
+
+static double run_threads(int n, int threads) {
+  pthread_t tid[BT_MAX_INFLIGHT];
+  int per_thread = n / threads;
+  double t0 = now_s();
+  for (int i = 0; i < threads; i++) pthread_create(&tid[i], NULL, touch_loop, &per_thread);
+  for (int i = 0; i < threads; i++) pthread_join(tid[i], NULL);
+  return per_thread * threads / (now_s() - t0);
+}
+
+// Control loops on several threads, each tick starting a motor, setting the
+// LED and reading a sensor, with the I/O thread coalescing commands over the
+// given window. Returns commands per second; *bytes gets the bytes sent to
+// the brick per command.
+static void *control_loop(void *arg) {
+  int n = *(int *)arg;
+  for (int i = 0; i < n; i += 3) {
+    BT_motor_port_start(MOTOR_A, 20);
+    BT_set_LED_colour(LED_GREEN);
+    BT_read_touch_sensor(PORT_1);
+  }
+  return NULL;
+}
+
+static double run_coalesced(int n, int window_us, EMU_brick *brick, double *bytes) {
+  pthread_t tid[BT_MAX_INFLIGHT];
+  int per_thread = n / BT_MAX_INFLIGHT;
+  long long tx0, rx0, tx, rx;
+  BT_io_coalesce(window_us);
+  EMU_traffic(brick, &tx0, &rx0);
+  double t0 = now_s();
+  for (int i = 0; i < BT_MAX_INFLIGHT; i++) pthread_create(&tid[i], NULL, control_loop, &per_thread);
+  for (int i = 0; i < BT_MAX_INFLIGHT; i++) pthread_join(tid[i], NULL);
+  double rate = per_thread * BT_MAX_INFLIGHT / (now_s() - t0);
+  EMU_traffic(brick, &tx, &rx);
+  *bytes = (double)(tx - tx0) / (per_thread * BT_MAX_INFLIGHT);
+  BT_io_coalesce(0);
+  return rate;
+}
+
+// Same reads, from coroutines that all run on this thread. Returns commands
+// per second.
+static btasync::task<void> touch_task(btasync::ev3 *robot, int n) {
+  for (int i = 0; i < n; i++)
+    if (co_await robot->read_touch(PORT_1) < 0) break;
+}
+
+static double run_coroutines(int n, int coroutines) {
+  btasync::loop loop;
+  btasync::ev3 robot(loop);
+  int per_task = n / coroutines;
+  double t0 = now_s();
+  for (int i = 0; i < coroutines; i++) loop.spawn(touch_task(&robot, per_task));
+  loop.run();
+  return per_task * coroutines / (now_s() - t0);
+}
+
+// Several stand-in bricks, all served by the one I/O thread. Each round
+// reads the touch sensor of every brick once. Returns commands per second
+// over all bricks.
+static double run_bricks(int n, int bricks, int latency_us) {
+  unsigned char cmd[15] = {0x0D, 0x00, 0x00, 0x00, 0x00, 0x01, 0x00, opINPUT_DEVICE,
+                           LC0(READY_PCT), 0x00, PORT_1, LC0(0x10), 0x00, LC0(0x01), GV0(0x00)};
+  unsigned char reply[BT_MAX_REPLY];
+  EMU_brick *emu[BT_MAX_INFLIGHT];
+  BT_ev3 *ev3[BT_MAX_INFLIGHT];
+  BT_future *f[BT_MAX_INFLIGHT];
+  int fd, rounds = n / bricks;
+  double t0, rate = -1;
+  for (int b = 0; b < bricks; b++) {
+    emu[b] = EMU_start(latency_us, &fd);
+    ev3[b] = EV3_attach(fd);
+    EV3_io_start(ev3[b]);
+  }
+  t0 = now_s();
+  for (int r = 0; r < rounds; r++) {
+    for (int b = 0; b < bricks; b++) f[b] = EV3_io_submit_future(ev3[b], cmd, 15);
+    for (int b = 0; b < bricks; b++)
+      if (f[b] == NULL || BT_future_wait(f[b], reply, BT_MAX_REPLY) < 0) goto done;
+  }
+  rate = rounds * bricks / (now_s() - t0);
+done:
+  for (int b = 0; b < bricks; b++) {
+    EV3_close(ev3[b]);
+    EMU_stop(emu[b]);
+  }
+  return rate;
+}
+
+// Background streaming at a target rate for one second: achieved rate,
+// mean round trip, and the cost of reading the latest sample.
+static void run_stream(double rate_hz) {
+  BT_port_map map = {{BT_SENSOR_TOUCH, BT_SENSOR_GYRO, BT_SENSOR_COLOUR, BT_SENSOR_ULTRASONIC},
+                     MOTOR_A | MOTOR_B};
+  static BT_sample window[BT_STREAM_RING];
+  BT_sample latest;
+  struct timespec one_s = {1, 0};
+  long long t_end, rtt = 0;
+  int n, reads = 1000000;
+  BT_stream *stream = BT_stream_start(&map, rate_hz);
+  if (stream == NULL) return;
+  nanosleep(&one_s, NULL);
+  t_end = BT_stream_now_ns();
+  n = BT_stream_window(stream, PORT_2, t_end - 1000000000LL, t_end, window, BT_STREAM_RING);
+  for (int i = 0; i < n; i++) rtt += window[i].rtt_us;
+  double t0 = now_s();
+  for (int i = 0; i < reads; i++) sink = sink + BT_stream_latest(stream, PORT_1, &latest);
+  double ns = (now_s() - t0) * 1e9 / reads;
+  BT_stream_stop(stream);
+  printf("\n%-24s %12s %12s %12s\n", "stream", "samples/s", "rtt us", "latest ns");
+  printf("%-24.0f %12d %12.0f %12.1f\n", rate_hz, n, n ? (double)rtt / n : 0.0, ns);
+}
+
+// Uploads a file of the given size with each window size and reports the
+// transfer rate and the mean time each chunk took to be acknowledged.
+static void run_upload(int kbytes) {
+  char path[] = "/tmp/btcomm_benchXXXXXX";
+  static char block[1024];
+  BT_transfer_stats stats;
+  int fd = mkstemp(path);
+  if (fd < 0) return;
+  for (int i = 0; i < kbytes; i++) {
+    if (write(fd, block, sizeof(block)) < 0) break;
+  }
+  close(fd);
+  printf("\n%6s %12s %12s %8s\n", "window", "KB/s", "chunk us", "speedup");
+  double base = 0;
+  for (int window = 1; window <= BT_MAX_INFLIGHT; window *= 2) {
+    if (BT_upload_file_windowed("../prjs/bench/data.bin", path, window, &stats) < 0) break;
+    double rate = stats.bytes / stats.seconds / 1024;
+    if (window == 1) base = rate;
+    printf("%6d %12.1f %12.0f %8.2f\n", window, rate, stats.chunk_us_avg, rate / base);
+  }
+  unlink(path);
+}
+
+static void run_encoding(int n) {
+  unsigned char cmd_string[1024];
+  double t, ns[4];
+
+  for (int k = 0; k < 4; k++) {
+    t = now_s();
+    for (int i = 0; i < n; i++) {
+      switch (k) {
+        case 0: sink = sink + legacy_gyro(cmd_string, i & 3); break;
+        case 1: sink = sink + builder_gyro(cmd_string, i & 3); break;
+        case 2: sink = sink + legacy_drive(cmd_string, i & 15, i % 100); break;
+        case 3: sink = sink + builder_drive(cmd_string, i & 15, i % 100); break;
+      }
+      sink = sink + cmd_string[i & 7];
+    }
+    ns[k] = (now_s() - t) * 1e9 / n;
+  }
+  printf("\n%-24s %12s %12s\n", "encoding", "legacy ns", "builder ns");
+  printf("%-24s %12.1f %12.1f\n", "gyro read", ns[0], ns[1]);
+  printf("%-24s %12.1f %12.1f\n", "drive", ns[2], ns[3]);
+
+  // The same drive command from text: assembled each time, stamped out of a
+  // command compiled once, and turned back into text
+  static const char drive_text[] = "OUTPUT_POWER 0, $0, $1; OUTPUT_START 0, $0";
+  static BT_asm_command drive;
+  char text[1024];
+  int len = BT_asm_compile(drive_text, DIRECT_COMMAND_NO_REPLY, &drive);
+  for (int k = 0; k < 3; k++) {
+    int m = (k == 0) ? n / 10 : n;  // Assembling is much the slowest
+    t = now_s();
+    for (int i = 0; i < m; i++) {
+      int values[2] = {i & 15, i % 100};
+      switch (k) {
+        case 0:
+          sink = sink + BT_assemble("OUTPUT_POWER 0, 9, 50; OUTPUT_START 0, 9",
+                                    DIRECT_COMMAND_NO_REPLY, cmd_string, 1024);
+          break;
+        case 1: sink = sink + BT_asm_fill(&drive, cmd_string, i, values); break;
+        case 2: sink = sink + BT_disassemble(cmd_string, len, text, sizeof(text)); break;
+      }
+      sink = sink + cmd_string[i & 7];
+    }
+    ns[k] = (now_s() - t) * 1e9 / m;
+  }
+  printf("%-24s %12.1f\n", "drive, BT_assemble", ns[0]);
+  printf("%-24s %12.1f\n", "drive, BT_asm_fill", ns[1]);
+  printf("%-24s %12.1f\n", "drive, BT_disassemble", ns[2]);
+}
+
+// Per-call latency suite. Each case makes one blocking call (or, for the
+// pipelined and batched variants, one round of them) and reports how many
+// operations - commands, samples or files - that round delivered.
+struct CallCase {
+  const char *name;
+  int (*call)(void);
+  int ops;      // Operations per call
+  int divisor;  // Run n / divisor calls (for the slow ones)
+};
+
+struct CallResult {
+  char name[64];
+  int calls;
+  double mean_us, p50_us, p99_us, p999_us, ops_per_s, bytes_per_s;
+};
+
+static BT_snapshot_plan suite_snapshot;
+static BT_batch_plan suite_batch;
+static char suite_file[] = "/tmp/btcomm_suiteXXXXXX";
+
+static int call_touch(void) { return BT_read_touch_sensor(PORT_1); }
+static int call_colour(void) { return BT_read_colour_sensor(PORT_3); }
+static int call_colour_rgb(void) {
+  int rgb[3];
+  return BT_read_colour_sensor_RGB(PORT_3, rgb);
+}
+static int call_ultrasonic(void) { return BT_read_ultrasonic_sensor(PORT_4); }
+static int call_gyro(void) {
+  int angle, rate;
+  return BT_read_gyro(PORT_2, 0, &angle, &rate);
+}
+static int call_drive(void) { return BT_drive(MOTOR_A, MOTOR_D, 20); }
+static int call_motor_stop(void) { return BT_motor_port_stop(MOTOR_A | MOTOR_D, 0); }
+static int call_all_stop(void) { return BT_all_stop(0); }
+static int call_read_motors(void) {
+  BT_motor_state state;
+  return BT_read_motors(MOTOR_A | MOTOR_D, &state);
+}
+static int call_clear_tacho(void) { return BT_clear_tacho(MOTOR_A | MOTOR_D); }
+static int call_drive_sync(void) { return BT_drive_sync(MOTOR_B, MOTOR_C, 20, 0, 0, 0); }
+static int call_motors_busy(void) { return BT_motors_busy(MOTOR_B | MOTOR_C); }
+static int call_led(void) { return BT_set_LED_colour(LED_GREEN); }
+static int call_fence(void) { return BT_fence(); }
+static int call_snapshot(void) {
+  BT_snapshot snap;
+  return BT_read_snapshot(&suite_snapshot, &snap);
+}
+static int call_batch(void) {
+  static BT_snapshot snaps[1019];
+  return BT_read_batch(&suite_batch, snaps);
+}
+static int call_pipelined(void) {
+  unsigned char cmd[15] = {0x0D, 0x00, 0x00, 0x00, 0x00, 0x01, 0x00, opINPUT_DEVICE,
+                           LC0(READY_PCT), 0x00, PORT_1, LC0(0x10), 0x00, LC0(0x01), GV0(0x00)};
+  unsigned char reply[BT_MAX_REPLY];
+  int ids[8];
+  for (int i = 0; i < 8; i++) ids[i] = BT_submit(cmd, 15);
+  for (int i = 0; i < 8; i++)
+    if (BT_wait_reply(ids[i], reply, BT_MAX_REPLY) < 0) return -1;
+  return 0;
+}
+static int call_upload(void) { return BT_upload_file("../prjs/bench/suite.bin", suite_file) < 0 ? -1 : 0; }
+static int null_sink(void *arg, const unsigned char *data, int len) { return 0; }
+static int call_download(void) {
+  return BT_download_file("../prjs/bench/suite.bin", null_sink, NULL, NULL);
+}
+static int call_list_dir(void) {
+  BT_dir_entry *entries;
+  int n = BT_list_dir("../prjs/bench", &entries);
+  free(entries);
+  return n;
+}
+static int call_file_info(void) {
+  BT_dir_entry entry;
+  return BT_file_info("../prjs/bench/suite.bin", &entry);
+}
+
+static int compare_double(const void *a, const void *b) {
+  double x = *(const double *)a, y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+static double percentile(const double *sorted, int n, double p) {
+  int i = (int)(p * n);
+  return sorted[i < n ? i : n - 1];
+}
+
+static void run_case(const CallCase *c, int n, EMU_brick *brick, CallResult *r) {
+  static double us[100000];
+  long long to0, from0, to1, from1;
+  double t0, t;
+  n = n / c->divisor;
+  if (n < 20) n = 20;
+  if (n > 100000) n = 100000;
+  c->call();  // Warm up (and fill caches the call relies on)
+  EMU_traffic(brick, &to0, &from0);
+  t0 = now_s();
+  for (int i = 0; i < n; i++) {
+    t = now_s();
+    c->call();
+    us[i] = (now_s() - t) * 1e6;
+  }
+  double seconds = now_s() - t0;
+  EMU_traffic(brick, &to1, &from1);
+  qsort(us, n, sizeof(double), compare_double);
+  snprintf(r->name, sizeof(r->name), "%s", c->name);
+  r->calls = n;
+  r->mean_us = 0;
+  for (int i = 0; i < n; i++) r->mean_us += us[i] / n;
+  r->p50_us = percentile(us, n, 0.5);
+  r->p99_us = percentile(us, n, 0.99);
+  r->p999_us = percentile(us, n, 0.999);
+  r->ops_per_s = (double)n * c->ops / seconds;
+  r->bytes_per_s = (to1 - to0 + from1 - from0) / seconds;
+}
+
+// Runs every case and prints a table. Returns the number of results.
+static int run_calls(int n, EMU_brick *brick, CallResult *results) {
+  BT_port_map map = {{BT_SENSOR_TOUCH, BT_SENSOR_GYRO, BT_SENSOR_COLOUR, BT_SENSOR_ULTRASONIC},
+                     MOTOR_A | MOTOR_B};
+  static char block[16384];
+  char batch_name[32];
+  BT_snapshot_init(&suite_snapshot, &map);
+  int per_batch = BT_batch_init(&suite_batch, &map, 1, 0);
+  snprintf(batch_name, sizeof(batch_name), "batch_of_%d", per_batch);
+  int fd = mkstemp(suite_file);
+  if (fd < 0 || write(fd, block, sizeof(block)) < 0) return 0;
+  close(fd);
+
+  const CallCase cases[] = {
+      {"read_touch_sensor", call_touch, 1, 1},
+      {"read_colour_sensor", call_colour, 1, 1},
+      {"read_colour_sensor_RGB", call_colour_rgb, 1, 1},
+      {"read_ultrasonic_sensor", call_ultrasonic, 1, 1},
+      {"read_gyro", call_gyro, 1, 1},
+      {"drive", call_drive, 1, 1},
+      {"motor_port_stop", call_motor_stop, 1, 1},
+      {"all_stop", call_all_stop, 1, 1},
+      {"read_motors", call_read_motors, 1, 1},
+      {"clear_tacho", call_clear_tacho, 1, 1},
+      {"drive_sync", call_drive_sync, 1, 1},
+      {"motors_busy", call_motors_busy, 1, 1},
+      {"set_LED_colour", call_led, 1, 1},
+      {"fence", call_fence, 1, 1},
+      {"read_snapshot", call_snapshot, 1, 1},
+      {batch_name, call_batch, per_batch, 4},
+      {"touch_pipelined_x8", call_pipelined, 8, 8},
+      {"upload_file_16k", call_upload, 1, 10},
+      {"download_file_16k", call_download, 1, 10},
+      {"list_dir", call_list_dir, 1, 4},
+      {"file_info_cached", call_file_info, 1, 1},
+  };
+  int count = sizeof(cases) / sizeof(cases[0]);
+
+  printf("\n%-24s %7s %9s %9s %9s %10s %10s\n", "call", "calls", "p50 us", "p99 us", "p999 us",
+         "ops/s", "KB/s");
+  for (int i = 0; i < count; i++) {
+    run_case(&cases[i], n, brick, &results[i]);
+    CallResult *r = &results[i];
+    printf("%-24s %7d %9.0f %9.0f %9.0f %10.1f %10.1f\n", r->name, r->calls, r->p50_us, r->p99_us,
+           r->p999_us, r->ops_per_s, r->bytes_per_s / 1024);
+  }
+  BT_all_stop(0);
+  unlink(suite_file);
+  return count;
+}
+
+static void write_results(const char *path, const char *transport, int n, int latency_us,
+                          int bandwidth, int command_us, const CallResult *results, int count) {
+  FILE *fp = fopen(path, "w");
+  if (fp == NULL) {
+    perror(path);
+    return;
+  }
+  fprintf(fp,
+          "{\"transport\": \"%s\", \"commands\": %d, \"latency_us\": %d, \"bandwidth\": %d, "
+          "\"command_us\": %d, \"results\": [\n",
+          transport, n, latency_us, bandwidth, command_us);
+  for (int i = 0; i < count; i++) {
+    const CallResult *r = &results[i];
+    fprintf(fp,
+            "{\"name\": \"%s\", \"calls\": %d, \"mean_us\": %.1f, \"p50_us\": %.1f, "
+            "\"p99_us\": %.1f, \"p999_us\": %.1f, \"ops_per_s\": %.1f, \"bytes_per_s\": %.1f}%s\n",
+            r->name, r->calls, r->mean_us, r->p50_us, r->p99_us, r->p999_us, r->ops_per_s,
+            r->bytes_per_s, i + 1 < count ? "," : "");
+  }
+  fprintf(fp, "]}\n");
+  fclose(fp);
+}
+
+// Compares with a file written by write_results(). Returns the number of
+// calls that got slower than the tolerance allows.
+static int check_baseline(const char *path, double tolerance, const CallResult *results,
+                          int count) {
+  char line[512], name[64];
+  double p50, rate;
+  int worse = 0;
+  FILE *fp = fopen(path, "r");
+  if (fp == NULL) {
+    perror(path);
+    return 1;
+  }
+  while (fgets(line, sizeof(line), fp) != NULL) {
+    if (sscanf(line,
+               "{\"name\": \"%63[^\"]\", \"calls\": %*d, \"mean_us\": %*f, \"p50_us\": %lf, "
+               "\"p99_us\": %*f, \"p999_us\": %*f, \"ops_per_s\": %lf",
+               name, &p50, &rate) != 3)
+      continue;
+    for (int i = 0; i < count; i++) {
+      if (strcmp(results[i].name, name) != 0) continue;
+      if (results[i].p50_us > p50 * tolerance || results[i].ops_per_s * tolerance < rate) {
+        printf("REGRESSION %-24s p50 %.0f -> %.0f us, %.1f -> %.1f ops/s\n", name, p50,
+               results[i].p50_us, rate, results[i].ops_per_s);
+        worse++;
+      }
+    }
+  }
+  fclose(fp);
+  if (worse == 0) printf("\n# no regressions against %s\n", path);
+  return worse;
+}
+
+int main(int argc, char *argv[]) {
+  int n = 2000;
+  int latency_us = 15000, bandwidth = 0, command_us = 0, suite_only = 0, status = 0;
+  const char *capture = NULL, *output = NULL, *baseline = NULL, *transport = "pair";
+  double tolerance = 1.25;
+  static CallResult results[64];
+  int opt, fd, count;
+  double base = 0, rate;
+
+  while ((opt = getopt(argc, argv, "n:l:b:k:t:c:so:r:x:")) != -1) {
+    if (opt == 'n') n = atoi(optarg);
+    if (opt == 'l') latency_us = atoi(optarg);
+    if (opt == 'b') bandwidth = atoi(optarg);
+    if (opt == 'k') command_us = atoi(optarg);
+    if (opt == 't') transport = optarg;
+    if (opt == 'c') capture = optarg;
+    if (opt == 's') suite_only = 1;
+    if (opt == 'o') output = optarg;
+    if (opt == 'r') baseline = optarg;
+    if (opt == 'x') tolerance = atof(optarg);
+  }
+
+  EMU_config config = {latency_us, bandwidth, command_us};
+  EMU_brick *brick;
+  char address[128];
+  if (strcmp(transport, "pair") == 0) {
+    brick = EMU_start_config(&config, &fd);
+    if (brick == NULL || BT_attach(fd) < 0) return 1;
+  } else if (strcmp(transport, "unix") == 0 || strcmp(transport, "tcp") == 0) {
+    // A per-process socket path or port, so several benchmarks can run at once
+    if (transport[0] == 'u')
+      snprintf(address, sizeof(address), "/tmp/btcomm_bench.%d.sock", (int)getpid());
+    else
+      snprintf(address, sizeof(address), "tcp:%d", 20000 + (int)getpid() % 20000);
+    brick = EMU_listen(&config, address);
+    if (brick == NULL) return 1;
+    if (transport[0] == 'u')
+      snprintf(address, sizeof(address), "unix:/tmp/btcomm_bench.%d.sock", (int)getpid());
+    else
+      snprintf(address, sizeof(address), "tcp:0016535655D9@127.0.0.1:%d", 20000 + (int)getpid() % 20000);
+    if (BT_open(address) < 0) return 1;
+  } else {
+    fprintf(stderr, "Unknown transport %s (pair, unix or tcp)\n", transport);
+    return 1;
+  }
+  if (capture != NULL && BT_capture_start(capture) < 0) return 1;
+
+  printf("# %s link, delay %d us, %d bytes/s, %d us per direct command, %d commands per run\n",
+         transport, latency_us, bandwidth, command_us, n);
+  if (suite_only) goto suite;
+  printf("%6s %12s %8s\n", "depth", "cmds/s", "speedup");
+  for (int depth = 1; depth <= BT_MAX_INFLIGHT; depth *= 2) {
+    rate = run_pipelined(n, depth);
+    if (depth == 1) base = rate;
+    printf("%6d %12.1f %8.2f\n", depth, rate, rate / base);
+  }
+
+  base = run_sensor_ticks(n / 8, 0);
+  rate = run_sensor_ticks(n / 8, 1);
+  printf("\n%-24s %12s %8s\n", "sensor tick", "ticks/s", "speedup");
+  printf("%-24s %12.1f %8.2f\n", "4 separate reads", base, 1.0);
+  printf("%-24s %12.1f %8.2f\n", "snapshot", rate, rate / base);
+  int per_batch;
+  rate = run_batch_ticks(n / 8, &per_batch);
+  char label[32];
+  snprintf(label, sizeof(label), "batch of %d", per_batch);
+  printf("%-24s %12.1f %8.2f\n", label, rate, rate / base);
+
+  printf("\n%-24s %12s %8s\n", "motor updates", "updates/s", "speedup");
+  base = run_lane(n / 8, -1);
+  printf("%-24s %12.1f %8.2f\n", "confirmed", base, 1.0);
+  for (int every = 64; every >= 0; every = every > 16 ? 16 : every - 16) {
+    rate = run_lane(n, every);
+    snprintf(label, sizeof(label), every ? "lane, fence every %d" : "lane, no fences", every);
+    printf("%-24s %12.1f %8.2f\n", label, rate, rate / base);
+  }
+
+  printf("\n%-24s %12s\n", "stop on touch", "overshoot");
+  for (int mode = POLLED; mode <= PROGRAM; mode++) {
+    double degrees = 0;
+    if (mode == PROGRAM && upload_touch_program() < 0) break;
+    for (int i = 0; i < 5; i++) degrees += run_reaction(brick, mode) / 5;
+    printf("%-24s %10.1f d\n", reaction_modes[mode], degrees);
+  }
+
+  BT_io_start();
+  printf("\n%6s %12s %8s\n", "threads", "cmds/s", "speedup");
+  for (int threads = 1; threads <= BT_MAX_INFLIGHT; threads *= 2) {
+    rate = run_threads(n, threads);
+    if (threads == 1) base = rate;
+    printf("%6d %12.1f %8.2f\n", threads, rate, rate / base);
+  }
+
+  double bytes;
+  printf("\n%6s %12s %8s %10s\n", "window", "cmds/s", "speedup", "bytes/cmd");
+  for (int window_us = 0; window_us <= 4000; window_us = window_us ? window_us * 4 : 250) {
+    rate = run_coalesced(n, window_us, brick, &bytes);
+    if (window_us == 0) base = rate;
+    printf("%6d %12.1f %8.2f %10.1f\n", window_us, rate, rate / base, bytes);
+  }
+  BT_io_stop();
+
+  printf("\n%6s %12s %8s\n", "coros", "cmds/s", "speedup");
+  for (int coroutines = 1; coroutines <= 2 * BT_MAX_INFLIGHT; coroutines *= 2) {
+    rate = run_coroutines(n, coroutines);
+    if (coroutines == 1) base = rate;
+    printf("%6d %12.1f %8.2f\n", coroutines, rate, rate / base);
+  }
+
+  printf("\n%6s %12s %8s\n", "bricks", "cmds/s", "speedup");
+  for (int bricks = 1; bricks <= BT_MAX_INFLIGHT; bricks *= 2) {
+    rate = run_bricks(n, bricks, latency_us);
+    if (bricks == 1) base = rate;
+    printf("%6d %12.1f %8.2f\n", bricks, rate, rate / base);
+  }
+
+  run_stream(200);
+  run_upload(n / 4);
+  run_encoding(n * 1000);
+
+suite:
+  if (check_batch(brick) > 0) status = 1;
+  count = run_calls(n, brick, results);
+  if (output != NULL) write_results(output, transport, n, latency_us, bandwidth, command_us, results, count);
+  if (baseline != NULL && check_baseline(baseline, tolerance, results, count) > 0) status = 1;
+
+  if (capture != NULL) printf("\n# capture: %d frames dropped\n", BT_capture_stop());
+  BT_close();
+  EMU_stop(brick);
+  return status;
+}
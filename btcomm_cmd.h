@@ -0,0 +1,129 @@
+/***********************************************************************************************************************
+ *
+ * 	Direct command builder for the BT Communications library.
+ *
+ * 	Instead of writing out a byte array by hand and counting offsets, a command is described as a list of
+ * 	opcodes and encoded parameters, and the builder works out the rest. For example, BT_drive() is:
+ *
+ * 	   len=btcmd::direct<0,0>(cmd_string, DIRECT_COMMAND_REPLY, message_id_counter,
+ * 	                          btcmd::op(opOUTPUT_POWER), btcmd::lc0(0), btcmd::lc0(ports), btcmd::lc1(power),
+ * 	                          btcmd::op(opOUTPUT_START), btcmd::lc0(0), btcmd::lc0(ports));
+ *
+ * 	The template arguments are the number of global and local variable bytes. Every parameter kind has a fixed
+ * 	encoded size (lc0 is 1 byte, lc1 2 bytes, lc2 3 bytes, ...), so the command length and the memory header are
+ * 	computed by the compiler, and a command that would not fit in the 1024 byte limit does not compile. Parameter
+ * 	*values* may still be run-time values. The bytes are written straight into the caller's buffer, nothing else
+ * 	is touched, and no memory is allocated. When cmd_string is an array, the compiler also checks that the
+ * 	command fits in it; use btcmd::direct_at() to write through a plain pointer instead.
+ *
+ * 	Parameter encoders follow the macros in bytecodes.h:
+ * 	   lc0(v) lc1(v) lc2(v) lc4(v)   - constants (6-bit, 8-bit, 16-bit, 32-bit)
+ * 	   lcs("text")                   - string constant; only literals, so that its size is known
+ * 	   lv0(i) lv1(i)                 - local variables
+ * 	   gv0(i) gv1(i)                 - global variables (reply area)
+ * 	   op(x)                         - an opcode or a raw sub-command byte
+ *
+ * 	This header needs a C++17 compiler (g++ is used for the whole library already).
+ *
+ *      This library is free software, distributed under the GPL license. Please refer to the include license
+ *      file for details.
+ *
+ * ********************************************************************************************************************/
+
+#ifndef __btcomm_cmd_header
+#define __btcomm_cmd_header
+
+#include "bytecodes.h"
+#include "c_com.h"
+
+namespace btcmd
+{
+
+// Each parameter kind knows its encoded size at compile time, and how to write itself.
+struct Op  { unsigned char v; static constexpr int size=1;
+             unsigned char *emit(unsigned char *p) const { *p=v; return(p+1); } };
+struct Lc0 { int v; static constexpr int size=1;
+             unsigned char *emit(unsigned char *p) const { *p=LC0(v); return(p+1); } };
+struct Lc1 { int v; static constexpr int size=2;
+             unsigned char *emit(unsigned char *p) const { p[0]=LC1_byte0(); p[1]=LX_byte1(v); return(p+2); } };
+struct Lc2 { int v; static constexpr int size=3;
+             unsigned char *emit(unsigned char *p) const { p[0]=LC2_byte0(); p[1]=LX_byte1(v); p[2]=LX_byte2(v); return(p+3); } };
+struct Lc4 { int v; static constexpr int size=5;
+             unsigned char *emit(unsigned char *p) const { p[0]=PRIMPAR_LONG|PRIMPAR_CONST|PRIMPAR_4_BYTES;
+                                                           p[1]=LX_byte1(v); p[2]=LX_byte2(v); p[3]=LX_byte3(v); p[4]=LX_byte4(v);
+                                                           return(p+5); } };
+struct Lv0 { int i; static constexpr int size=1;
+             unsigned char *emit(unsigned char *p) const { *p=LV0(i); return(p+1); } };
+struct Lv1 { int i; static constexpr int size=2;
+             unsigned char *emit(unsigned char *p) const { p[0]=PRIMPAR_LONG|PRIMPAR_VARIABEL|PRIMPAR_LOCAL|PRIMPAR_1_BYTE;
+                                                           p[1]=LX_byte1(i); return(p+2); } };
+struct Gv0 { int i; static constexpr int size=1;
+             unsigned char *emit(unsigned char *p) const { *p=GV0(i); return(p+1); } };
+struct Gv1 { int i; static constexpr int size=2;
+             unsigned char *emit(unsigned char *p) const { p[0]=GV1_byte0(i); p[1]=LX_byte1(i); return(p+2); } };
+template<int N>
+struct Lcs { const char (&s)[N]; static constexpr int size=N+1;
+             unsigned char *emit(unsigned char *p) const { *(p++)=PRIMPAR_LONG|PRIMPAR_STRING;
+                                                           for (int i=0; i<N; i++) *(p++)=s[i];
+                                                           return(p); } };
+
+inline constexpr Op  op(unsigned char v) { return Op{v}; }
+inline constexpr Lc0 lc0(int v) { return Lc0{v}; }
+inline constexpr Lc1 lc1(int v) { return Lc1{v}; }
+inline constexpr Lc2 lc2(int v) { return Lc2{v}; }
+inline constexpr Lc4 lc4(int v) { return Lc4{v}; }
+template<int N> inline constexpr Lcs<N> lcs(const char (&s)[N]) { return Lcs<N>{s}; }
+inline constexpr Lv0 lv0(int i) { return Lv0{i}; }
+inline constexpr Lv1 lv1(int i) { return Lv1{i}; }
+inline constexpr Gv0 gv0(int i) { return Gv0{i}; }
+inline constexpr Gv1 gv1(int i) { return Gv1{i}; }
+
+// Total encoded size of a list of parameters
+template<class... P> inline constexpr int body_size=(P::size+...+0);
+
+// Length of a direct command with the given body, including the 2-byte length field
+template<class... P> inline constexpr int direct_size=7+body_size<P...>;
+
+template<int Globals, int Locals, class... P>
+inline int direct_at(unsigned char *cmd_string, unsigned char type, int msg_id, const P&... parts)
+{
+ //////////////////////////////////////////////////////////////////////////////////////////////////////
+ // Write a complete direct command into cmd_string: length, cnt_id, type, memory header and body.
+ //
+ // Inputs: Globals, Locals - bytes of global (reply) and local variable space the command uses
+ //         cmd_string - destination, must hold at least direct_size<P...> bytes
+ //         type - DIRECT_COMMAND_REPLY or DIRECT_COMMAND_NO_REPLY
+ //         msg_id - value for the cnt_id field (usually message_id_counter)
+ //         parts - the opcodes and parameters, in order
+ //
+ // Returns: the number of bytes written
+ //////////////////////////////////////////////////////////////////////////////////////////////////////
+ constexpr int len=direct_size<P...>;
+ static_assert(len<=1024,"Direct commands are limited to 1024 bytes");
+ static_assert(Globals>=0&&Globals<=1019,"Global variable space is limited to 1019 bytes");
+ static_assert(Locals>=0&&Locals<=63,"Local variable space is limited to 63 bytes");
+ constexpr unsigned char header0=Globals&0xFF;
+ constexpr unsigned char header1=((Globals>>8)&0x03)|(Locals<<2);
+
+ unsigned char *p=cmd_string;
+ *(p++)=LX_byte1((len-2));
+ *(p++)=LX_byte2((len-2));
+ *(p++)=LX_byte1(msg_id);
+ *(p++)=LX_byte2(msg_id);
+ *(p++)=type;
+ *(p++)=header0;
+ *(p++)=header1;
+ ((p=parts.emit(p)),...);
+ return(len);
+}
+
+// Same as direct_at(), for a fixed-size array - also checks at compile time that the command fits in it
+template<int Globals, int Locals, int N, class... P>
+inline int direct(unsigned char (&cmd_string)[N], unsigned char type, int msg_id, const P&... parts)
+{
+ static_assert(direct_size<P...><=N,"Command does not fit in the destination buffer");
+ return(direct_at<Globals,Locals>(&cmd_string[0],type,msg_id,parts...));
+}
+
+}
+#endif
@@ -0,0 +1,1694 @@
+/***********************************************************************************************************************
+ *
+ * 	Stand-in EV3 brick for the BT Communications library - see btcomm_emu.h for an overview.
+ *
+ *      This library is free software, distributed under the GPL license. Please see the attached license file for
+ *      details.
+ *
+ * ********************************************************************************************************************/
+#include "btcomm.h"
+#include "btcomm_emu.h"
+#include <math.h>
+#include <poll.h>
+#include <pthread.h>
+#include <time.h>
+
+#define EMU_MAX_QUEUED 256		// <-- Replies that can be travelling back to the host at the same time
+#define EMU_RX_SIZE 4096
+#define EMU_HANDLES 32			// <-- File handles the brick can have open at once
+#define EMU_SYS_DIR "/home/root/lms2012/sys"	// <-- Where relative paths start, as on the brick
+#define EMU_LAG_US 30000		// <-- Time constant of a motor settling to a new speed
+#define EMU_COAST_US 200000		// <-- ... and of a motor running down without the brake
+#define EMU_READY_MAX_US 600000000LL	// <-- opOUTPUT_READY gives up after this long
+#define EMU_LOOP_US 1000		// <-- Brick time taken by one pass through a loop (a jump taken backwards)
+#define EMU_PROGRAMS 8			// <-- Program runs whose threads may not have been joined yet
+
+typedef struct
+{
+ long long due_us;			// <-- Time at which the reply leaves the fake link
+ int len;
+ unsigned char data[BT_MAX_REPLY];
+} EMU_reply;
+
+typedef struct EMU_file
+{
+ char *path;				// <-- Absolute, no trailing '/'
+ int is_dir;
+ unsigned char *data;
+ int size;
+ struct EMU_file *next;
+} EMU_file;
+
+// What a file handle is being used for
+#define EMU_HANDLE_FREE 0
+#define EMU_HANDLE_DOWNLOAD 1		// <-- Receiving a file from the host
+#define EMU_HANDLE_UPLOAD 2		// <-- Sending a file to the host, closed at the end
+#define EMU_HANDLE_GETFILE 3		// <-- Sending a file that may still grow, left open at the end
+#define EMU_HANDLE_LIST 4		// <-- Sending a directory listing, closed at the end
+
+typedef struct
+{
+ int kind;
+ char *path;
+ unsigned char *data;			// <-- File being received, or the file or listing being sent
+ int size, pos;
+} EMU_handle;
+
+typedef struct
+{
+ int type;
+ int value[3];
+ long long t_us;			// <-- When the values were set - a gyro's angle moves on from there
+} EMU_sensor;
+
+typedef struct
+{
+ double power;				// <-- -100 to 100
+ double speed;				// <-- Degrees per second
+ double tacho;				// <-- Degrees since the last clear
+ int running, brake;
+ long long end_us;			// <-- Timed move: when it ends, or -1
+ int step_ref;				// <-- Stepped move: the motor whose count decides when it ends, or -1
+ double step_from, step_len;
+ int end_brake;				// <-- Brake or coast when the move ends
+ int group;				// <-- Motors that end the move together
+} EMU_motor;
+
+typedef struct
+{
+ struct EMU_brick *brick;
+ unsigned char *image;			// <-- Copy of the image loaded when the program was started
+ int size;
+ unsigned char *globals, *locals;
+ int n_globals, n_locals, offset;	// <-- offset: of the first object's instructions in the image
+ int halt;				// <-- Set to stop the program at its next pass through a loop
+ int done;				// <-- Set by the program's thread as it ends
+ pthread_t thread;
+} EMU_program;
+
+struct EMU_brick
+{
+ EMU_config config;
+ int fd;				// <-- Brick end of the link, -1 while waiting for a host
+ int listen_fd;				// <-- Socket served by EMU_listen(), or -1
+ char *listen_path;			// <-- Unix socket to remove when stopped, or NULL
+ int wifi;				// <-- Hosts must unlock the brick as over WiFi before sending commands
+ int stop;
+ pthread_t thread;
+ unsigned char rx[EMU_RX_SIZE];		// <-- Bytes received from the host, not yet a complete command
+ int rx_len;
+ EMU_reply *queue;			// <-- Ring of replies waiting for their delay to expire
+ int q_head, q_count;
+ long long up_free_us, down_free_us;	// <-- When each direction of the link has finished its last frame
+ long long rx_bytes, tx_bytes;		// <-- Bytes received from and sent to the host so far
+
+ // Everything below is shared with the EMU_set/get calls, and guarded by lock
+ pthread_mutex_t lock;
+ long long t0_us;			// <-- Power-on time, zero of the brick's millisecond timer
+ long long vm_free_us;			// <-- When the VM will be done with the direct commands received so far
+ long long sim_us;			// <-- Time up to which the motors have been simulated
+ long long sound_end_us;
+ EMU_motor motor[4];
+ EMU_sensor sensor[4];
+ EMU_file *files;
+ EMU_handle handle[EMU_HANDLES];
+ char name[16];
+ unsigned char *image;			// <-- Loaded by opFILE LOAD_IMAGE into the user slot, or NULL
+ int image_size;
+ EMU_program *program;			// <-- Running in the user slot, or NULL
+ EMU_program *runs[EMU_PROGRAMS];	// <-- Runs whose threads are still to be joined
+};
+
+static long long EMU_now_us()
+{
+ struct timespec ts;
+ clock_gettime(CLOCK_MONOTONIC,&ts);
+ return((long long)ts.tv_sec*1000000LL+ts.tv_nsec/1000);
+}
+
+static long long EMU_wire_us(EMU_brick *brick, int len)
+{
+ // Time len bytes take to cross the link
+ if (brick->config.bandwidth<=0) return(0);
+ return((long long)len*1000000LL/brick->config.bandwidth);
+}
+
+static void EMU_queue_reply(EMU_brick *brick, const unsigned char *reply, int len, long long done_us)
+{
+ EMU_reply *r;
+ if (brick->q_count==EMU_MAX_QUEUED)
+ {
+  fprintf(stderr,"EMU: Reply queue full, dropping reply\n");
+  return;
+ }
+ r=&brick->queue[(brick->q_head+brick->q_count)%EMU_MAX_QUEUED];
+ r->due_us=done_us+brick->config.latency_us;
+ if (brick->config.bandwidth>0)
+ {
+  r->due_us=MAX(r->due_us,brick->down_free_us)+EMU_wire_us(brick,len);
+  brick->down_free_us=r->due_us;
+ }
+ r->len=len;
+ memcpy(&r->data[0],reply,len);
+ brick->q_count++;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Motors and sensors
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+static void EMU_send_due(EMU_brick *brick)
+{
+ // Send every reply whose delay has expired
+ long long now=EMU_now_us();
+
+ while (brick->q_count>0&&brick->queue[brick->q_head].due_us<=now)
+ {
+  EMU_reply *r=&brick->queue[brick->q_head];
+  if (write(brick->fd,&r->data[0],r->len)<0) break;
+  __atomic_fetch_add(&brick->tx_bytes,r->len,__ATOMIC_RELAXED);
+  brick->q_head=(brick->q_head+1)%EMU_MAX_QUEUED;
+  brick->q_count--;
+ }
+}
+
+static void EMU_motor_stop(EMU_brick *brick, int nos, int brake)
+{
+ for (int i=0; i<4; i++)
+  if (nos&(1<<i))
+  {
+   brick->motor[i].running=0;
+   brick->motor[i].brake=brake;
+   brick->motor[i].end_us=-1;
+   brick->motor[i].step_ref=-1;
+  }
+}
+
+static void EMU_simulate(EMU_brick *brick, long long t_us)
+{
+ // Advance the motors to t_us, in steps of at most 1ms
+ EMU_motor *m;
+ long long step;
+ double target;
+ int moving;
+
+ while (brick->sim_us<t_us)
+ {
+  moving=0;
+  for (int i=0; i<4; i++) moving|=brick->motor[i].running||fabs(brick->motor[i].speed)>1e-3;
+  if (!moving)
+  {
+   brick->sim_us=t_us;
+   break;
+  }
+  step=MIN(1000LL,t_us-brick->sim_us);
+  brick->sim_us+=step;
+  for (int i=0; i<4; i++)
+  {
+   m=&brick->motor[i];
+   target=m->running?m->power*EMU_MAX_SPEED/100.0:0.0;
+   m->speed+=(target-m->speed)*MIN(1.0,step/(double)((m->running||m->brake)?EMU_LAG_US:EMU_COAST_US));
+   m->tacho+=m->speed*step*1e-6;
+  }
+  for (int i=0; i<4; i++)
+  {
+   m=&brick->motor[i];
+   if (m->running&&((m->end_us>=0&&brick->sim_us>=m->end_us)||
+                    (m->step_ref>=0&&fabs(brick->motor[m->step_ref].tacho-m->step_from)>=m->step_len)))
+    EMU_motor_stop(brick,m->group,m->end_brake);
+  }
+ }
+}
+
+static void EMU_motor_move(EMU_brick *brick, int nos, int mask, double power, long long end_us, int step_ref,
+                           double step_len, int brake)
+{
+ // Start the motors in mask (part of the group nos) at power. The move ends at end_us, or once motor step_ref
+ // has turned step_len degrees; -1 for either means it runs until stopped.
+ EMU_motor *m;
+
+ for (int i=0; i<4; i++)
+ {
+  if (!(mask&(1<<i))) continue;
+  m=&brick->motor[i];
+  m->power=MAX(-100.0,MIN(100.0,power));
+  m->running=1;
+  m->brake=0;
+  m->end_us=end_us;
+  m->step_ref=step_ref;
+  m->step_from=(step_ref>=0)?brick->motor[step_ref].tacho:0;
+  m->step_len=fabs(step_len);
+  m->end_brake=brake;
+  m->group=nos;
+ }
+}
+
+static int EMU_sensor_value(EMU_brick *brick, int port, int mode, int i, long long t_us)
+{
+ // Value i of what the sensor on port reads in mode at t_us
+ EMU_sensor *s;
+ int angle;
+
+ if (port<0||port>3||i<0||i>2) return(0);
+ s=&brick->sensor[port];
+ if (s->type==EV3_GYRO)
+ {
+  angle=s->value[0]+(int)(s->value[1]*((t_us-s->t_us)*1e-6));
+  if (mode==1) return(i==0?s->value[1]:0);		// <-- Rate
+  if (mode==3) return(i==0?angle:(i==1?s->value[1]:0));	// <-- Angle and rate
+  return(i==0?angle:0);
+ }
+ return(s->value[i]);
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Byte code interpreter for direct commands
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+#define EMU_CONST 0
+#define EMU_LOCAL 1
+#define EMU_GLOBAL 2
+#define EMU_STRING 3
+
+typedef struct
+{
+ int kind;
+ long value;				// <-- The constant, or the variable's offset
+ const char *str;
+} EMU_arg;
+
+typedef struct
+{
+ const unsigned char *start, *pc, *end;
+ unsigned char *globals, *locals;
+ int n_globals, n_locals;
+ long long t_us;			// <-- Brick time the command has got to
+ int error;
+ int *halt;				// <-- A program's stop flag, NULL for a direct command
+} EMU_vm;
+
+static int EMU_load_image(EMU_brick *brick, int slot, const char *name);
+static int EMU_program_start(EMU_brick *brick, int slot, long size, long long t_us);
+static void EMU_program_stop(EMU_brick *brick, int slot, long long t_us);
+
+static void EMU_decode(EMU_vm *vm, EMU_arg *a)
+{
+ // Decode the next parameter, in any of the encodings of bytecodes.h
+ int b, n;
+
+ a->kind=EMU_CONST;
+ a->value=0;
+ a->str="";
+ if (vm->pc>=vm->end)
+ {
+  vm->error=1;
+  return;
+ }
+ b=*(vm->pc++);
+ if (!(b&PRIMPAR_LONG))
+ {
+  if (b&PRIMPAR_VARIABEL)
+  {
+   a->kind=(b&PRIMPAR_GLOBAL)?EMU_GLOBAL:EMU_LOCAL;
+   a->value=b&PRIMPAR_INDEX;
+  }
+  else a->value=(b&PRIMPAR_CONST_SIGN)?(b&PRIMPAR_VALUE)-64:(b&PRIMPAR_VALUE);
+  return;
+ }
+ n=b&PRIMPAR_BYTES;
+ if (!(b&PRIMPAR_VARIABEL)&&(n==PRIMPAR_STRING||n==PRIMPAR_STRING_OLD))
+ {
+  a->kind=EMU_STRING;
+  a->str=(const char *)vm->pc;
+  while (vm->pc<vm->end&&*vm->pc) vm->pc++;
+  if (vm->pc>=vm->end) vm->error=1;
+  else vm->pc++;
+  return;
+ }
+ if (n==PRIMPAR_4_BYTES) n=4;
+ if (n>4||vm->pc+n>vm->end)
+ {
+  vm->error=1;
+  return;
+ }
+ for (int i=n-1; i>=0; i--) a->value=(a->value<<8)|vm->pc[i];
+ vm->pc+=n;
+ if (b&PRIMPAR_VARIABEL) a->kind=(b&PRIMPAR_GLOBAL)?EMU_GLOBAL:EMU_LOCAL;
+ else if (n<4&&(a->value&(1L<<(8*n-1)))) a->value-=1L<<(8*n);	// <-- Constants are signed
+ else if (n==4) a->value=(int32_t)a->value;
+}
+
+static unsigned char *EMU_var(EMU_vm *vm, const EMU_arg *a, int width)
+{
+ // Where a variable parameter lives, or NULL if it is not a variable or lies outside the command's memory
+ if (a->kind==EMU_GLOBAL&&a->value>=0&&a->value+width<=vm->n_globals) return(vm->globals+a->value);
+ if (a->kind==EMU_LOCAL&&a->value>=0&&a->value+width<=vm->n_locals) return(vm->locals+a->value);
+ return(NULL);
+}
+
+static long EMU_in(EMU_vm *vm, int width)
+{
+ // Next parameter as an input of width bytes (1, 2 or 4)
+ EMU_arg a;
+ unsigned char *p;
+ long v=0;
+
+ EMU_decode(vm,&a);
+ if (a.kind==EMU_CONST) return(a.value);
+ if ((p=EMU_var(vm,&a,width))==NULL) return(0);
+ for (int i=width-1; i>=0; i--) v=(v<<8)|p[i];
+ if (width==1) return((int8_t)v);
+ if (width==2) return((int16_t)v);
+ return((int32_t)v);
+}
+
+static const char *EMU_in_str(EMU_vm *vm)
+{
+ EMU_arg a;
+
+ EMU_decode(vm,&a);
+ return(a.str);
+}
+
+static void EMU_out(EMU_vm *vm, int width, long v)
+{
+ // Next parameter as an output of width bytes. As on the brick, a value that runs past the end of the memory
+ // the command asked for is cut short (e.g. a 32-bit reading into a 1-byte reply).
+ EMU_arg a;
+ unsigned char *p;
+
+ EMU_decode(vm,&a);
+ while (width>0&&(p=EMU_var(vm,&a,width))==NULL) width--;
+ for (int i=0; i<width; i++) p[i]=(unsigned char)(v>>(8*i));
+}
+
+static void EMU_out_f(EMU_vm *vm, float v)
+{
+ EMU_arg a;
+ unsigned char *p;
+
+ EMU_decode(vm,&a);
+ if ((p=EMU_var(vm,&a,4))!=NULL) memcpy(p,&v,4);
+}
+
+// Bytes per value of the DATA8, DATA16, DATA32 and DATAF forms, picked by the low two bits of the MOVE, ADD, SUB
+// and JR_xx opcodes
+static const int EMU_width[4]={1,2,4,4};
+
+static double EMU_in_n(EMU_vm *vm, int form)
+{
+ // Next parameter as an input in one of those forms. A float constant is its bit pattern, as LC4.
+ EMU_arg a;
+ unsigned char *p;
+ int32_t bits;
+ float f=0;
+
+ if (form<3) return(EMU_in(vm,EMU_width[form]));
+ EMU_decode(vm,&a);
+ if (a.kind==EMU_CONST) {bits=(int32_t)a.value; memcpy(&f,&bits,4);}
+ else if ((p=EMU_var(vm,&a,4))!=NULL) memcpy(&f,p,4);
+ return(f);
+}
+
+static void EMU_out_n(EMU_vm *vm, int form, double v)
+{
+ if (form==3) EMU_out_f(vm,(float)v);
+ else EMU_out(vm,EMU_width[form],(long)v);	// <-- Floats are truncated, as by the brick
+}
+
+static void EMU_skip(EMU_vm *vm, int n)
+{
+ EMU_arg a;
+
+ for (int i=0; i<n; i++) EMU_decode(vm,&a);
+}
+
+static void EMU_read_values(EMU_brick *brick, EMU_vm *vm, int port, int mode, int format, int n)
+{
+ // The result parameters of a sensor read: n values in DATA_PCT, DATA_RAW or DATA_SI form
+ int v;
+
+ EMU_simulate(brick,vm->t_us);
+ for (int i=0; i<n; i++)
+ {
+  v=EMU_sensor_value(brick,port,mode,i,vm->t_us);
+  if (format==DATA_PCT) EMU_out(vm,1,MAX(0,MIN(100,v)));
+  else if (format==DATA_RAW) EMU_out(vm,4,v);
+  else EMU_out_f(vm,(float)v);
+ }
+}
+
+static void EMU_wait(EMU_brick *brick, EMU_vm *vm, int nos)
+{
+ // opOUTPUT_READY: hold the VM until the timed or stepped moves of nos have ended
+ long long give_up=vm->t_us+EMU_READY_MAX_US;
+ int busy=1;
+
+ while (busy&&vm->t_us<give_up)
+ {
+  busy=0;
+  for (int i=0; i<4; i++)
+   if ((nos&(1<<i))&&brick->motor[i].running&&(brick->motor[i].end_us>=0||brick->motor[i].step_ref>=0)) busy=1;
+  if (busy)
+  {
+   vm->t_us+=1000;
+   EMU_simulate(brick,vm->t_us);
+  }
+ }
+}
+
+static void EMU_sync(EMU_brick *brick, EMU_vm *vm, int timed)
+{
+ // opOUTPUT_STEP_SYNC/TIME_SYNC: the first motor of the pair at speed, the second slowed (or reversed) by turn,
+ // or the other way around for a negative turn. Steps are counted on the faster motor.
+ int nos, speed, turn, brake, first=-1, second=-1, master;
+ long amount;
+ double ratio;
+
+ EMU_in(vm,1);
+ nos=EMU_in(vm,1);
+ speed=EMU_in(vm,1);
+ turn=EMU_in(vm,2);
+ amount=EMU_in(vm,4);
+ brake=EMU_in(vm,1);
+ for (int i=0; i<4; i++)
+  if (nos&(1<<i))
+  {
+   if (first<0) first=i;
+   else if (second<0) second=i;
+  }
+ if (second<0) return;
+ turn=MAX(-200,MIN(200,turn));
+ ratio=(100-abs(turn))/100.0;
+ master=(turn>=0)?first:second;
+ EMU_simulate(brick,vm->t_us);
+ nos=(1<<first)|(1<<second);
+ EMU_motor_move(brick,nos,1<<first,(turn>=0)?speed:speed*ratio,-1,-1,0,brake);
+ EMU_motor_move(brick,nos,1<<second,(turn>=0)?speed*ratio:speed,-1,-1,0,brake);
+ if (amount!=0)
+  for (int i=0; i<4; i++)
+   if (nos&(1<<i))
+   {
+    if (timed) brick->motor[i].end_us=vm->t_us+amount*1000LL;
+    else
+    {
+     brick->motor[i].step_ref=master;
+     brick->motor[i].step_from=brick->motor[master].tacho;
+     brick->motor[i].step_len=labs(amount);
+    }
+   }
+}
+
+static const signed char EMU_ui_draw_args[33]={0,0,3,5,4,4,5,-1,6,5,5,-1,-1,-1,-1,-1,4,1,1,3,-1,7,-1,-1,4,1,1,-1,4,
+                                               -1,-1,-1,-1};	// <-- Parameters of each opUI_DRAW sub-command, -1 if not handled
+
+static int EMU_pass(EMU_brick *brick, EMU_vm *vm)
+{
+ // A pass through a loop has ended. The brick's clock moves on, and once it is ahead of real time the VM waits
+ // for real time to catch up - with the lock released, and sending the replies that fall due meanwhile - so a
+ // command that loops until a sensor changes sees the values set with EMU_set_sensor() while it runs.
+ // Returns -1 if the brick, or the program, is being stopped.
+ long long ahead;
+
+ vm->t_us+=EMU_LOOP_US;
+ while ((ahead=vm->t_us-EMU_now_us())>EMU_LOOP_US)
+ {
+  pthread_mutex_unlock(&brick->lock);
+  if (vm->halt==NULL) EMU_send_due(brick);	// <-- Replies are only sent by the brick's own thread
+  usleep(MIN(ahead,10000LL));
+  pthread_mutex_lock(&brick->lock);
+  if (__atomic_load_n(&brick->stop,__ATOMIC_ACQUIRE)||(vm->halt!=NULL&&*vm->halt)) return(-1);
+ }
+ return(0);
+}
+
+static int EMU_jump(EMU_brick *brick, EMU_vm *vm, int taken)
+{
+ // The offset parameter of a jump, followed if taken. Offsets count from the end of the jump. Returns -1 if
+ // the jump leaves the command, or the brick is being stopped.
+ long offset=EMU_in(vm,4);
+
+ if (!taken||vm->error) return(0);
+ if (offset<vm->start-vm->pc||offset>vm->end-vm->pc) return(-1);
+ vm->pc+=offset;
+ return(offset<0?EMU_pass(brick,vm):0);
+}
+
+static int EMU_run(EMU_brick *brick, EMU_vm *vm)
+{
+ // Execute the byte codes of one direct command. Returns 0, or -1 at an opcode we do not know.
+ int op, sub, port, mode, n, nos, brake, format, taken;
+ long amount;
+ double a, b;
+
+ while (vm->pc<vm->end&&!vm->error)
+ {
+  op=*(vm->pc++);
+  switch (op)
+  {
+   case opNOP:
+    break;
+   case opOBJECT_END:
+    vm->pc=vm->end;
+    break;
+   case opFILE:
+    if (EMU_in(vm,1)!=LOAD_IMAGE) return(-1);
+    n=EMU_in(vm,2);
+    amount=EMU_load_image(brick,n,EMU_in_str(vm));
+    EMU_out(vm,4,amount);		// <-- Image size, 0 if it could not be loaded
+    EMU_out(vm,4,0);			// <-- Image address, which only opPROGRAM_START uses
+    break;
+   case opPROGRAM_START:
+    n=EMU_in(vm,2);
+    amount=EMU_in(vm,4);
+    EMU_skip(vm,2);			// <-- Image address and debug mode
+    if (EMU_program_start(brick,n,amount,vm->t_us)<0) return(-1);
+    break;
+   case opPROGRAM_STOP:
+    EMU_program_stop(brick,EMU_in(vm,2),vm->t_us);
+    if (vm->halt!=NULL&&*vm->halt) vm->pc=vm->end;	// <-- A program that stopped itself
+    break;
+   case opPROGRAM_INFO:
+    if (EMU_in(vm,1)!=GET_STATUS) return(-1);
+    n=EMU_in(vm,2);
+    EMU_out(vm,1,(n==USER_SLOT&&brick->program!=NULL)?RUNNING:STOPPED);
+    break;
+   case opINPUT_DEVICE:
+    sub=EMU_in(vm,1);
+    if (sub==GET_TYPEMODE)
+    {
+     EMU_in(vm,1);
+     port=EMU_in(vm,1);
+     EMU_out(vm,1,(port>=0&&port<4)?brick->sensor[port].type:0);
+     EMU_out(vm,1,0);
+    }
+    else if (sub==READY_PCT||sub==READY_RAW||sub==READY_SI)
+    {
+     EMU_in(vm,1);
+     port=EMU_in(vm,1);
+     EMU_in(vm,1);
+     mode=EMU_in(vm,1);
+     n=EMU_in(vm,1);
+     format=(sub==READY_PCT)?DATA_PCT:(sub==READY_RAW)?DATA_RAW:DATA_SI;
+     EMU_read_values(brick,vm,port,mode,format,n);
+    }
+    else if (sub==CLR_ALL) EMU_in(vm,1);
+    else return(-1);
+    break;
+   case opINPUT_READ:
+   case opINPUT_READSI:
+    EMU_in(vm,1);
+    port=EMU_in(vm,1);
+    EMU_in(vm,1);
+    mode=EMU_in(vm,1);
+    EMU_read_values(brick,vm,port,mode,(op==opINPUT_READ)?DATA_PCT:DATA_SI,1);
+    break;
+   case opINPUT_READEXT:
+    EMU_in(vm,1);
+    port=EMU_in(vm,1);
+    EMU_in(vm,1);
+    mode=EMU_in(vm,1);
+    format=EMU_in(vm,1);
+    n=EMU_in(vm,1);
+    if (format!=DATA_PCT&&format!=DATA_RAW&&format!=DATA_SI) return(-1);
+    EMU_read_values(brick,vm,port,mode,format,n);
+    break;
+   case opOUTPUT_RESET:
+   case opOUTPUT_CLR_COUNT:
+    EMU_in(vm,1);
+    nos=EMU_in(vm,1);
+    EMU_simulate(brick,vm->t_us);
+    for (int i=0; i<4; i++)
+     if (nos&(1<<i))
+     {
+      brick->motor[i].step_from-=brick->motor[i].tacho;
+      brick->motor[i].tacho=0;
+     }
+    break;
+   case opOUTPUT_SET_TYPE:
+   case opOUTPUT_POLARITY:
+    EMU_skip(vm,3);
+    break;
+   case opOUTPUT_STOP:
+    EMU_in(vm,1);
+    nos=EMU_in(vm,1);
+    brake=EMU_in(vm,1);
+    EMU_simulate(brick,vm->t_us);
+    EMU_motor_stop(brick,nos,brake);
+    break;
+   case opOUTPUT_POWER:
+   case opOUTPUT_SPEED:
+    EMU_in(vm,1);
+    nos=EMU_in(vm,1);
+    n=EMU_in(vm,1);
+    EMU_simulate(brick,vm->t_us);
+    for (int i=0; i<4; i++) if (nos&(1<<i)) brick->motor[i].power=MAX(-100,MIN(100,n));
+    break;
+   case opOUTPUT_START:
+    EMU_in(vm,1);
+    nos=EMU_in(vm,1);
+    EMU_simulate(brick,vm->t_us);
+    for (int i=0; i<4; i++)
+     if ((nos&(1<<i))&&!brick->motor[i].running)
+      EMU_motor_move(brick,nos,1<<i,brick->motor[i].power,-1,-1,0,0);
+    break;
+   case opOUTPUT_STEP_POWER:
+   case opOUTPUT_TIME_POWER:
+   case opOUTPUT_STEP_SPEED:
+   case opOUTPUT_TIME_SPEED:
+    EMU_in(vm,1);
+    nos=EMU_in(vm,1);
+    n=EMU_in(vm,1);
+    amount=EMU_in(vm,4);		// <-- Ramp up, constant and ramp down phases, taken as one
+    amount+=EMU_in(vm,4);
+    amount+=EMU_in(vm,4);
+    brake=EMU_in(vm,1);
+    EMU_simulate(brick,vm->t_us);
+    for (int i=0; i<4; i++)
+    {
+     if (!(nos&(1<<i))) continue;
+     if (amount==0) EMU_motor_move(brick,nos,1<<i,n,-1,-1,0,brake);
+     else if (op==opOUTPUT_TIME_POWER||op==opOUTPUT_TIME_SPEED)
+      EMU_motor_move(brick,nos,1<<i,n,vm->t_us+amount*1000LL,-1,0,brake);
+     else EMU_motor_move(brick,1<<i,1<<i,n,-1,i,amount,brake);
+    }
+    break;
+   case opOUTPUT_STEP_SYNC:
+   case opOUTPUT_TIME_SYNC:
+    EMU_sync(brick,vm,op==opOUTPUT_TIME_SYNC);
+    break;
+   case opOUTPUT_READ:
+    EMU_in(vm,1);
+    n=EMU_in(vm,1);
+    EMU_simulate(brick,vm->t_us);
+    n=MAX(0,MIN(3,n));
+    EMU_out(vm,1,lround(brick->motor[n].speed*100.0/EMU_MAX_SPEED));
+    EMU_out(vm,4,lround(brick->motor[n].tacho));
+    break;
+   case opOUTPUT_GET_COUNT:
+    EMU_in(vm,1);
+    n=EMU_in(vm,1);
+    EMU_simulate(brick,vm->t_us);
+    EMU_out(vm,4,lround(brick->motor[MAX(0,MIN(3,n))].tacho));
+    break;
+   case opOUTPUT_TEST:
+    EMU_in(vm,1);
+    nos=EMU_in(vm,1);
+    EMU_simulate(brick,vm->t_us);
+    n=0;
+    for (int i=0; i<4; i++) if ((nos&(1<<i))&&brick->motor[i].running) n=1;
+    EMU_out(vm,1,n);
+    break;
+   case opOUTPUT_READY:
+    EMU_in(vm,1);
+    nos=EMU_in(vm,1);
+    EMU_simulate(brick,vm->t_us);
+    EMU_wait(brick,vm,nos);
+    break;
+   case opOUTPUT_PRG_STOP:
+    EMU_simulate(brick,vm->t_us);
+    EMU_motor_stop(brick,0x0F,1);
+    break;
+   case opSOUND:
+    sub=EMU_in(vm,1);
+    if (sub==BREAK) brick->sound_end_us=vm->t_us;
+    else if (sub==TONE)
+    {
+     EMU_in(vm,1);
+     EMU_in(vm,2);
+     brick->sound_end_us=vm->t_us+EMU_in(vm,2)*1000LL;
+    }
+    else if (sub==PLAY||sub==REPEAT) EMU_skip(vm,2);	// <-- Sound files are taken to be silent
+    else if (sub!=SERVICE) return(-1);
+    break;
+   case opSOUND_TEST:
+    EMU_out(vm,1,brick->sound_end_us>vm->t_us);
+    break;
+   case opSOUND_READY:
+    vm->t_us=MAX(vm->t_us,brick->sound_end_us);
+    break;
+   case opUI_DRAW:
+    sub=EMU_in(vm,1);
+    if (sub<0||sub>32||EMU_ui_draw_args[sub]<0) return(-1);
+    EMU_skip(vm,EMU_ui_draw_args[sub]);
+    break;
+   case opUI_WRITE:
+    if (EMU_in(vm,1)!=LED) return(-1);
+    EMU_in(vm,1);
+    break;
+   case opCOM_SET:
+    if (EMU_in(vm,1)!=SET_BRICKNAME) return(-1);
+    strncpy(&brick->name[0],EMU_in_str(vm),sizeof(brick->name)-1);
+    break;
+   case opTIMER_WAIT:
+    amount=EMU_in(vm,4);
+    EMU_out(vm,4,(vm->t_us-brick->t0_us)/1000+amount);
+    break;
+   case opTIMER_READY:
+    amount=EMU_in(vm,4);
+    vm->t_us=MAX(vm->t_us,brick->t0_us+amount*1000LL);
+    break;
+   case opTIMER_READ:
+    EMU_out(vm,4,(vm->t_us-brick->t0_us)/1000);
+    break;
+   case opTIMER_READ_US:
+    EMU_out(vm,4,vm->t_us-brick->t0_us);
+    break;
+   case opMOVE8_8: case opMOVE8_16: case opMOVE8_32: case opMOVE8_F:
+   case opMOVE16_8: case opMOVE16_16: case opMOVE16_32: case opMOVE16_F:
+   case opMOVE32_8: case opMOVE32_16: case opMOVE32_32: case opMOVE32_F:
+   case opMOVEF_8: case opMOVEF_16: case opMOVEF_32: case opMOVEF_F:
+    a=EMU_in_n(vm,(op>>2)&3);
+    EMU_out_n(vm,op&3,a);
+    break;
+   case opADD8: case opADD16: case opADD32: case opADDF:
+   case opSUB8: case opSUB16: case opSUB32: case opSUBF:
+    a=EMU_in_n(vm,op&3);
+    b=EMU_in_n(vm,op&3);
+    EMU_out_n(vm,op&3,(op<opSUB8)?a+b:a-b);
+    break;
+   case opMUL8: case opMUL16: case opMUL32: case opMULF:
+   case opDIV8: case opDIV16: case opDIV32: case opDIVF:
+    if ((op&3)==3)
+    {
+     a=EMU_in_n(vm,3);
+     b=EMU_in_n(vm,3);
+     EMU_out_f(vm,(op==opMULF)?a*b:a/b);
+     break;
+    }
+    amount=EMU_in(vm,EMU_width[op&3]);
+    n=EMU_in(vm,EMU_width[op&3]);
+    EMU_out(vm,EMU_width[op&3],(op<opDIV8)?amount*n:(n!=0)?amount/n:0);	// <-- Dividing by zero gives 0 here
+    break;
+   case opJR:
+    if (EMU_jump(brick,vm,1)<0) return(-1);
+    break;
+   case opJR_FALSE:
+   case opJR_TRUE:
+    taken=(EMU_in(vm,1)!=0)==(op==opJR_TRUE);
+    if (EMU_jump(brick,vm,taken)<0) return(-1);
+    break;
+   case opJR_LT8: case opJR_LT16: case opJR_LT32: case opJR_LTF:
+   case opJR_GT8: case opJR_GT16: case opJR_GT32: case opJR_GTF:
+   case opJR_EQ8: case opJR_EQ16: case opJR_EQ32: case opJR_EQF:
+   case opJR_NEQ8: case opJR_NEQ16: case opJR_NEQ32: case opJR_NEQF:
+   case opJR_LTEQ8: case opJR_LTEQ16: case opJR_LTEQ32: case opJR_LTEQF:
+   case opJR_GTEQ8: case opJR_GTEQ16: case opJR_GTEQ32: case opJR_GTEQF:
+    a=EMU_in_n(vm,op&3);
+    b=EMU_in_n(vm,op&3);
+    switch ((op-opJR_LT8)>>2)		// <-- LT, GT, EQ, NEQ, LTEQ, GTEQ
+    {
+     case 0: taken=(a<b); break;
+     case 1: taken=(a>b); break;
+     case 2: taken=(a==b); break;
+     case 3: taken=(a!=b); break;
+     case 4: taken=(a<=b); break;
+     default: taken=(a>=b); break;
+    }
+    if (EMU_jump(brick,vm,taken)<0) return(-1);
+    break;
+   default:
+    return(-1);
+  }
+ }
+ return(vm->error?-1:0);
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// In-memory file system for system commands
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+static void EMU_path(const char *in, char *out)
+{
+ // Absolute form of a brick path, with '.', '..' and repeated or trailing '/' resolved. out holds 1024 bytes.
+ char buf[2048];
+ char *comp, *save;
+ int n=0;
+
+ if (in[0]=='/') snprintf(&buf[0],sizeof(buf),"%s",in);
+ else snprintf(&buf[0],sizeof(buf),"%s/%s",EMU_SYS_DIR,in);
+ out[0]='\0';
+ for (comp=strtok_r(&buf[0],"/",&save); comp!=NULL; comp=strtok_r(NULL,"/",&save))
+ {
+  if (strcmp(comp,".")==0) continue;
+  if (strcmp(comp,"..")==0)
+  {
+   while (n>0&&out[n]!='/') n--;
+   out[n]='\0';
+   continue;
+  }
+  n+=snprintf(out+n,1024-n,"/%s",comp);
+  if (n>=1023) n=1023;
+ }
+ if (n==0) strcpy(out,"/");
+}
+
+static EMU_file *EMU_find(EMU_brick *brick, const char *path)
+{
+ for (EMU_file *f=brick->files; f!=NULL; f=f->next) if (strcmp(f->path,path)==0) return(f);
+ return(NULL);
+}
+
+static EMU_file *EMU_add(EMU_brick *brick, const char *path, int is_dir)
+{
+ EMU_file *f=(EMU_file *)calloc(1,sizeof(EMU_file));
+ f->path=strdup(path);
+ f->is_dir=is_dir;
+ f->next=brick->files;
+ brick->files=f;
+ return(f);
+}
+
+static int EMU_mkdirs(EMU_brick *brick, const char *path)
+{
+ // Create path and any missing directories above it. Returns -1 if a file is in the way.
+ char buf[1024];
+ EMU_file *f;
+
+ if (strcmp(path,"/")==0) return(0);
+ snprintf(&buf[0],sizeof(buf),"%s",path);
+ for (char *p=&buf[1]; ; p++)
+  if (*p=='/'||*p=='\0')
+  {
+   char c=*p;
+   *p='\0';
+   f=EMU_find(brick,&buf[0]);
+   if (f==NULL) EMU_add(brick,&buf[0],1);
+   else if (!f->is_dir) return(-1);
+   *p=c;
+   if (c=='\0') break;
+  }
+ return(0);
+}
+
+static int EMU_store(EMU_brick *brick, const char *path, const unsigned char *data, int size)
+{
+ // Create or replace the file at path (absolute form). Returns 0, or -1 if the path is taken by a directory.
+ char dir[1024];
+ EMU_file *f;
+
+ snprintf(&dir[0],sizeof(dir),"%s",path);
+ *strrchr(&dir[0],'/')='\0';
+ if (EMU_mkdirs(brick,dir[0]?&dir[0]:"/")<0) return(-1);
+ f=EMU_find(brick,path);
+ if (f==NULL) f=EMU_add(brick,path,0);
+ else if (f->is_dir) return(-1);
+ free(f->data);
+ f->data=(unsigned char *)malloc(MAX(size,1));
+ memcpy(f->data,data,size);
+ f->size=size;
+ return(0);
+}
+
+static int EMU_in_dir(const char *dir, const char *path, const char **name)
+{
+ // Whether path is directly inside dir, and if so its name there
+ int n=strlen(dir);
+
+ if (strcmp(dir,"/")==0) n=0;
+ if (strncmp(path,dir,n)!=0||path[n]!='/'||path[n+1]=='\0'||strchr(path+n+1,'/')!=NULL) return(0);
+ *name=path+n+1;
+ return(1);
+}
+
+static int EMU_listing(EMU_brick *brick, const char *dir, unsigned char **text)
+{
+ // LIST_FILES text for a directory: "name/" for directories, "md5 size name" for files, one per line
+ const char *name;
+ char md5[33];
+ int len=0, size=0;
+
+ *text=NULL;
+ for (EMU_file *f=brick->files; f!=NULL; f=f->next)
+ {
+  if (!EMU_in_dir(dir,f->path,&name)) continue;
+  if (len+strlen(name)+64>(size_t)size)
+  {
+   size=2*size+strlen(name)+1024;
+   *text=(unsigned char *)realloc(*text,size);
+  }
+  if (f->is_dir) len+=sprintf((char *)*text+len,"%s/\n",name);
+  else
+  {
+   BT_md5(f->data,f->size,md5);
+   len+=sprintf((char *)*text+len,"%s %08X %s\n",md5,f->size,name);
+  }
+ }
+ return(len);
+}
+
+static int EMU_open(EMU_brick *brick, int kind, const char *path, unsigned char *data, int size)
+{
+ // A free handle set up for kind, or -1. Takes ownership of data.
+ for (int h=0; h<EMU_HANDLES; h++)
+  if (brick->handle[h].kind==EMU_HANDLE_FREE)
+  {
+   brick->handle[h].kind=kind;
+   brick->handle[h].path=strdup(path);
+   brick->handle[h].data=data;
+   brick->handle[h].size=size;
+   brick->handle[h].pos=0;
+   return(h);
+  }
+ free(data);
+ return(-1);
+}
+
+static void EMU_close(EMU_brick *brick, int h)
+{
+ free(brick->handle[h].path);
+ free(brick->handle[h].data);
+ memset(&brick->handle[h],0,sizeof(EMU_handle));
+}
+
+static int EMU_send_part(EMU_brick *brick, int h, int maxbytes, unsigned char *payload, int room)
+{
+ // Copy the next part of what handle h is sending. Returns the number of bytes; the handle is closed at the
+ // end, except for BEGIN_GETFILE handles, which may have more to send once the file grows.
+ EMU_handle *hd=&brick->handle[h];
+ EMU_file *f;
+ int n;
+
+ if (hd->kind==EMU_HANDLE_GETFILE)
+ {
+  f=EMU_find(brick,hd->path);
+  hd->size=(f!=NULL&&!f->is_dir)?f->size:hd->pos;
+  n=MAX(0,MIN(MIN(maxbytes,room),hd->size-hd->pos));
+  if (n>0) memcpy(payload,f->data+hd->pos,n);
+ }
+ else
+ {
+  n=MAX(0,MIN(MIN(maxbytes,room),hd->size-hd->pos));
+  memcpy(payload,hd->data+hd->pos,n);
+ }
+ hd->pos+=n;
+ return(n);
+}
+
+static int EMU_system(EMU_brick *brick, const unsigned char *cmd, int len, unsigned char *reply)
+{
+ // Carry out one system command and build its reply. Returns the reply length.
+ char arg[1024], path[1024];
+ const char *name;
+ unsigned char *data;
+ EMU_file *f;
+ int h, n, size, status=SUCCESS, rlen=7;
+ int command=cmd[5];
+
+ // The path, where there is one, runs from the given offset to the end of the command
+ #define EMU_PATH_AT(off) {n=MAX(0,MIN(len-(off),1023)); memcpy(&arg[0],cmd+(off),n); arg[n]='\0'; EMU_path(&arg[0],&path[0]);}
+
+ switch (command)
+ {
+  case BEGIN_DOWNLOAD:
+   if (len<11) {status=SIZE_ERROR; break;}
+   size=cmd[6]|(cmd[7]<<8)|(cmd[8]<<16)|(cmd[9]<<24);
+   EMU_PATH_AT(10);
+   if (size<0) {status=SIZE_ERROR; break;}
+   f=EMU_find(brick,&path[0]);
+   if (f!=NULL&&f->is_dir) {status=ILLEGAL_PATH; break;}
+   if (size==0)
+   {
+    if (EMU_store(brick,&path[0],NULL,0)<0) status=ILLEGAL_PATH;
+    reply[7]=0;
+    rlen=8;
+    break;
+   }
+   h=EMU_open(brick,EMU_HANDLE_DOWNLOAD,&path[0],(unsigned char *)malloc(size),size);
+   if (h<0) {status=NO_HANDLES_AVAILABLE; break;}
+   reply[7]=h;
+   rlen=8;
+   break;
+  case CONTINUE_DOWNLOAD:
+   h=(len>6)?cmd[6]:-1;
+   if (h<0||h>=EMU_HANDLES||brick->handle[h].kind!=EMU_HANDLE_DOWNLOAD) {status=UNKNOWN_HANDLE; break;}
+   n=len-7;
+   if (brick->handle[h].pos+n>brick->handle[h].size)
+   {
+    EMU_close(brick,h);
+    status=SIZE_ERROR;
+    break;
+   }
+   memcpy(brick->handle[h].data+brick->handle[h].pos,cmd+7,n);
+   brick->handle[h].pos+=n;
+   reply[7]=h;
+   rlen=8;
+   if (brick->handle[h].pos==brick->handle[h].size)
+   {
+    if (EMU_store(brick,brick->handle[h].path,brick->handle[h].data,brick->handle[h].size)<0) status=ILLEGAL_PATH;
+    else status=END_OF_FILE;
+    EMU_close(brick,h);
+   }
+   break;
+  case BEGIN_UPLOAD:
+  case BEGIN_GETFILE:
+  case LIST_FILES:
+   if (len<9) {status=SIZE_ERROR; break;}
+   EMU_PATH_AT(8);
+   f=EMU_find(brick,&path[0]);
+   if (f==NULL||(command==LIST_FILES)!=f->is_dir) {status=UNKNOWN_HANDLE; break;}
+   if (command==LIST_FILES) h=EMU_open(brick,EMU_HANDLE_LIST,&path[0],NULL,EMU_listing(brick,&path[0],&data));
+   else if (command==BEGIN_GETFILE) h=EMU_open(brick,EMU_HANDLE_GETFILE,&path[0],NULL,0);
+   else
+   {
+    data=(unsigned char *)malloc(MAX(f->size,1));
+    memcpy(data,f->data,f->size);
+    h=EMU_open(brick,EMU_HANDLE_UPLOAD,&path[0],data,f->size);
+   }
+   if (h<0) {status=NO_HANDLES_AVAILABLE; break;}
+   if (command==LIST_FILES) brick->handle[h].data=data;
+   n=EMU_send_part(brick,h,cmd[6]|(cmd[7]<<8),reply+12,BT_MAX_REPLY-12);
+   size=brick->handle[h].size;
+   for (int i=0; i<4; i++) reply[7+i]=(unsigned char)(size>>(8*i));
+   reply[11]=h;
+   rlen=12+n;
+   if (brick->handle[h].pos==size)
+   {
+    status=END_OF_FILE;
+    if (command!=BEGIN_GETFILE) EMU_close(brick,h);
+   }
+   break;
+  case CONTINUE_UPLOAD:
+  case CONTINUE_GETFILE:
+  case CONTINUE_LIST_FILES:
+   h=(len>=9)?cmd[6]:-1;
+   n=(command==CONTINUE_UPLOAD)?EMU_HANDLE_UPLOAD:(command==CONTINUE_GETFILE)?EMU_HANDLE_GETFILE:EMU_HANDLE_LIST;
+   if (h<0||h>=EMU_HANDLES||brick->handle[h].kind!=n) {status=UNKNOWN_HANDLE; break;}
+   if (command==CONTINUE_GETFILE)		// <-- Replies with the file size, as BEGIN_GETFILE
+   {
+    n=EMU_send_part(brick,h,cmd[7]|(cmd[8]<<8),reply+12,BT_MAX_REPLY-12);
+    for (int i=0; i<4; i++) reply[7+i]=(unsigned char)(brick->handle[h].size>>(8*i));
+    reply[11]=h;
+    rlen=12+n;
+    if (brick->handle[h].pos==brick->handle[h].size) status=END_OF_FILE;
+    break;
+   }
+   n=EMU_send_part(brick,h,cmd[7]|(cmd[8]<<8),reply+8,BT_MAX_REPLY-8);
+   reply[7]=h;
+   rlen=8+n;
+   if (brick->handle[h].pos==brick->handle[h].size)
+   {
+    status=END_OF_FILE;
+    EMU_close(brick,h);
+   }
+   break;
+  case CLOSE_FILEHANDLE:
+   h=(len>6)?cmd[6]:-1;
+   if (h<0||h>=EMU_HANDLES||brick->handle[h].kind==EMU_HANDLE_FREE) {status=UNKNOWN_HANDLE; break;}
+   EMU_close(brick,h);
+   break;
+  case CREATE_DIR:
+   EMU_PATH_AT(6);
+   if (EMU_find(brick,&path[0])!=NULL) status=FILE_EXITS;
+   else if (EMU_mkdirs(brick,&path[0])<0) status=ILLEGAL_PATH;
+   break;
+  case DELETE_FILE:
+   EMU_PATH_AT(6);
+   f=EMU_find(brick,&path[0]);
+   if (f==NULL) {status=UNKNOWN_HANDLE; break;}
+   for (EMU_file *c=brick->files; c!=NULL&&status==SUCCESS; c=c->next)
+    if (EMU_in_dir(&path[0],c->path,&name)) status=NO_PERMISSION;	// <-- Directory not empty
+   if (status!=SUCCESS) break;
+   for (EMU_file **p=&brick->files; *p!=NULL; p=&(*p)->next)
+    if (*p==f)
+    {
+     *p=f->next;
+     break;
+    }
+   free(f->path);
+   free(f->data);
+   free(f);
+   break;
+  case LIST_OPEN_HANDLES:
+   memset(reply+7,0,EMU_HANDLES/8);
+   for (h=0; h<EMU_HANDLES; h++) if (brick->handle[h].kind!=EMU_HANDLE_FREE) reply[7+h/8]|=1<<(h%8);
+   rlen=7+EMU_HANDLES/8;
+   break;
+  case WRITEMAILBOX:
+   break;
+  default:
+   status=UNKNOWN_ERROR;
+ }
+ #undef EMU_PATH_AT
+
+ reply[4]=(status==SUCCESS||status==END_OF_FILE)?SYSTEM_REPLY:SYSTEM_REPLY_ERROR;
+ reply[5]=command;
+ reply[6]=status;
+ return(rlen);
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Programs in the user slot
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+static long EMU_le32(const unsigned char *p)
+{
+ return((int32_t)((uint32_t)p[0]|((uint32_t)p[1]<<8)|((uint32_t)p[2]<<16)|((uint32_t)p[3]<<24)));
+}
+
+static int EMU_load_image(EMU_brick *brick, int slot, const char *name)
+{
+ // opFILE LOAD_IMAGE: keep a copy of the program image in the file for opPROGRAM_START. Returns its size, or 0
+ // if the file is not a program image.
+ char path[1024];
+ EMU_file *f;
+
+ EMU_path(name,&path[0]);
+ f=EMU_find(brick,&path[0]);
+ if (slot!=USER_SLOT||f==NULL||f->is_dir||f->size<BT_IMAGE_HEADER||memcmp(f->data,"LEGO",4)!=0||
+     EMU_le32(f->data+4)!=f->size) return(0);
+ free(brick->image);
+ brick->image=(unsigned char *)malloc(f->size);
+ memcpy(brick->image,f->data,f->size);
+ brick->image_size=f->size;
+ return(f->size);
+}
+
+static void EMU_program_free(EMU_program *prg)
+{
+ free(prg->image);
+ free(prg->globals);
+ free(prg->locals);
+ free(prg);
+}
+
+static void *EMU_program_thread(void *arg)
+{
+ // Runs the first object of a program - its main thread - until it ends or is stopped
+ EMU_program *prg=(EMU_program *)arg;
+ EMU_brick *brick=prg->brick;
+ EMU_vm vm;
+
+ pthread_mutex_lock(&brick->lock);
+ vm.globals=prg->globals;
+ vm.locals=prg->locals;
+ vm.n_globals=prg->n_globals;
+ vm.n_locals=prg->n_locals;
+ vm.start=vm.pc=prg->image+prg->offset;
+ vm.end=prg->image+prg->size;
+ vm.t_us=EMU_now_us();
+ vm.error=0;
+ vm.halt=&prg->halt;
+ if (!prg->halt) EMU_run(brick,&vm);
+ if (brick->program==prg) EMU_program_stop(brick,USER_SLOT,vm.t_us);
+ prg->done=1;
+ pthread_mutex_unlock(&brick->lock);
+ return(NULL);
+}
+
+static int EMU_program_start(EMU_brick *brick, int slot, long size, long long t_us)
+{
+ // opPROGRAM_START: run the image loaded into the slot in a thread of its own, stopping the program already
+ // running there, if any. Returns -1 if nothing is loaded or the image is not one we can run.
+ const unsigned char *img=brick->image;
+ EMU_program *prg;
+ int objects, run=-1;
+
+ if (slot!=USER_SLOT||img==NULL||size!=brick->image_size) return(-1);
+ objects=img[10]|(img[11]<<8);
+ if (objects<1||size<16+12*objects) return(-1);
+ EMU_program_stop(brick,slot,t_us);
+ for (int i=0; i<EMU_PROGRAMS; i++)
+ {
+  if (brick->runs[i]!=NULL&&brick->runs[i]->done)	// <-- Its thread has let go of the lock for the last time
+  {
+   pthread_join(brick->runs[i]->thread,NULL);
+   EMU_program_free(brick->runs[i]);
+   brick->runs[i]=NULL;
+  }
+  if (brick->runs[i]==NULL&&run<0) run=i;
+ }
+ if (run<0)
+ {
+  fprintf(stderr,"EMU: Too many programs still stopping\n");
+  return(-1);
+ }
+
+ prg=(EMU_program *)calloc(1,sizeof(EMU_program));
+ prg->brick=brick;
+ prg->size=size;
+ prg->n_globals=EMU_le32(img+12);
+ prg->offset=EMU_le32(img+16);
+ prg->n_locals=EMU_le32(img+24);
+ if (prg->offset<16+12*objects||prg->offset>=size||prg->n_globals<0||prg->n_globals>(1<<20)||
+     prg->n_locals<0||prg->n_locals>(1<<20))
+ {
+  free(prg);
+  return(-1);
+ }
+ prg->image=(unsigned char *)malloc(size);
+ memcpy(prg->image,img,size);
+ prg->globals=(unsigned char *)calloc(MAX(prg->n_globals,1),1);
+ prg->locals=(unsigned char *)calloc(MAX(prg->n_locals,1),1);
+ if (pthread_create(&prg->thread,NULL,EMU_program_thread,prg)!=0)
+ {
+  EMU_program_free(prg);
+  return(-1);
+ }
+ brick->runs[run]=prg;
+ brick->program=prg;
+ return(0);
+}
+
+static void EMU_program_stop(EMU_brick *brick, int slot, long long t_us)
+{
+ // opPROGRAM_STOP, or the program has ended: the motors are stopped, as by opOUTPUT_PRG_STOP. The program's
+ // thread sees its halt flag at its next pass through a loop.
+ if (slot!=USER_SLOT||brick->program==NULL) return;
+ brick->program->halt=1;
+ brick->program=NULL;
+ EMU_simulate(brick,t_us);
+ EMU_motor_stop(brick,0x0F,1);
+}
+
+static void EMU_handle_command(EMU_brick *brick, const unsigned char *cmd, int len, long long rx_time)
+{
+ // Runs one complete command (cmd includes the length field) and queues the reply the EV3 would send
+ unsigned char reply[BT_MAX_REPLY];
+ unsigned char locals[64];
+ EMU_vm vm;
+ int rlen;
+ long long done;
+
+ memset(&reply[0],0,BT_MAX_REPLY);
+ reply[2]=cmd[2];			// <-- Replies carry the cnt_id of the command they answer
+ reply[3]=cmd[3];
+
+ // The command has arrived once its last byte has crossed the link
+ if (brick->config.bandwidth>0)
+ {
+  rx_time=MAX(rx_time,brick->up_free_us)+EMU_wire_us(brick,len);
+  brick->up_free_us=rx_time;
+ }
+
+ pthread_mutex_lock(&brick->lock);
+ if (len<5) rlen=0;
+ else if (cmd[4]==DIRECT_COMMAND_REPLY||cmd[4]==DIRECT_COMMAND_NO_REPLY)
+ {
+  // Direct commands queue up for the VM, one at a time
+  memset(&locals[0],0,sizeof(locals));
+  vm.n_globals=(len>6)?(cmd[5]|((cmd[6]&0x03)<<8)):0;
+  vm.n_locals=(len>6)?(cmd[6]>>2):0;
+  vm.globals=&reply[5];
+  vm.locals=&locals[0];
+  vm.start=vm.pc=cmd+7;
+  vm.end=cmd+len;
+  vm.t_us=MAX(rx_time,brick->vm_free_us)+brick->config.command_us;
+  vm.error=0;
+  vm.halt=NULL;
+  reply[4]=(len>=7&&EMU_run(brick,&vm)==0)?DIRECT_REPLY:DIRECT_REPLY_ERROR;
+  brick->vm_free_us=vm.t_us;
+  done=vm.t_us;
+  rlen=5+MIN(vm.n_globals,BT_MAX_REPLY-5);
+ }
+ else
+ {
+  rlen=(len>=6)?EMU_system(brick,cmd,len,&reply[0]):0;
+  done=rx_time;
+ }
+ pthread_mutex_unlock(&brick->lock);
+
+ if (rlen==0||(cmd[4]&0x80)) return;	// <-- No reply requested
+ reply[0]=LX_byte1(rlen-2);
+ reply[1]=LX_byte2(rlen-2);
+ EMU_queue_reply(brick,&reply[0],rlen,done);
+}
+
+static int EMU_hangup(EMU_brick *brick)
+{
+ // The host has gone. A brick at the end of a socket pair stops; one serving a socket forgets the link
+ // (keeping its files, motors and sensors) and waits for the next host. Returns 1 to stop.
+ if (brick->listen_fd<0) return(1);
+ close(brick->fd);
+ brick->fd=-1;
+ brick->rx_len=0;
+ brick->q_head=brick->q_count=0;
+ pthread_mutex_lock(&brick->lock);
+ for (int h=0; h<EMU_HANDLES; h++) if (brick->handle[h].kind!=EMU_HANDLE_FREE) EMU_close(brick,h);
+ pthread_mutex_unlock(&brick->lock);
+ return(0);
+}
+
+static int EMU_unlock(EMU_brick *brick)
+{
+ // A host has connected over TCP. Wait (up to a second) for its unlock request, which ends with
+ // "Protocol: EV3", and accept it. Returns 0, or -1 if the host sent something else or nothing.
+ static const char accept_msg[]="Accept:EV340\r\n\r\n";
+ char request[256];
+ struct pollfd pfd;
+ int n=0, r, one=1;
+
+ setsockopt(brick->fd,IPPROTO_TCP,TCP_NODELAY,&one,sizeof(one));
+ pfd.fd=brick->fd;
+ pfd.events=POLLIN;
+ while (n<(int)sizeof(request)-1)
+ {
+  if (poll(&pfd,1,1000)<=0) return(-1);
+  r=read(brick->fd,&request[n],sizeof(request)-1-n);
+  if (r<=0) return(-1);
+  n+=r;
+  request[n]='\0';
+  if (strstr(&request[0],"Protocol: EV3")!=NULL) break;
+ }
+ if (strncmp(&request[0],"GET /target?sn=",15)!=0||strstr(&request[0],"Protocol: EV3")==NULL) return(-1);
+ return(write(brick->fd,&accept_msg[0],strlen(accept_msg))<0?-1:0);
+}
+
+static void *EMU_thread(void *arg)
+{
+ EMU_brick *brick=(EMU_brick *)arg;
+ struct pollfd pfd;
+ long long now;
+ int n, timeout, off, flen;
+
+ while (!__atomic_load_n(&brick->stop,__ATOMIC_ACQUIRE))
+ {
+  if (brick->fd<0)
+  {
+   // Waiting for a host to connect
+   pfd.fd=brick->listen_fd;
+   pfd.events=POLLIN;
+   if (poll(&pfd,1,50)>0) brick->fd=accept(brick->listen_fd,NULL,NULL);
+   if (brick->fd>=0&&brick->wifi&&EMU_unlock(brick)<0)
+   {
+    close(brick->fd);
+    brick->fd=-1;
+   }
+   continue;
+  }
+
+  EMU_send_due(brick);
+  now=EMU_now_us();
+  timeout=50;
+  if (brick->q_count>0)
+  {
+   long long wait=brick->queue[brick->q_head].due_us-now;
+   timeout=(int)MAX(0LL,MIN((long long)timeout,(wait+999)/1000));
+  }
+  pfd.fd=brick->fd;
+  pfd.events=POLLIN;
+  if (poll(&pfd,1,timeout)<=0) continue;
+
+  n=read(brick->fd,&brick->rx[brick->rx_len],EMU_RX_SIZE-brick->rx_len);
+  if (n<=0)				// <-- Host closed the connection
+  {
+   if (EMU_hangup(brick)) return(NULL);
+   continue;
+  }
+  brick->rx_len+=n;
+  __atomic_fetch_add(&brick->rx_bytes,n,__ATOMIC_RELAXED);
+  now=EMU_now_us();
+
+  // Split the received bytes into commands, keep any incomplete tail for the next read
+  off=0;
+  while (brick->rx_len-off>=2)
+  {
+   flen=(brick->rx[off]|(brick->rx[off+1]<<8))+2;
+   if (brick->rx_len-off<flen) break;
+   EMU_handle_command(brick,&brick->rx[off],flen,now);
+   off+=flen;
+  }
+  memmove(&brick->rx[0],&brick->rx[off],brick->rx_len-off);
+  brick->rx_len-=off;
+ }
+ return(NULL);
+}
+
+static EMU_brick *EMU_new(const EMU_config *config)
+{
+ // A powered-on brick: default sensors, motors at rest, and the standard directories
+ static const int types[4]={16,EV3_GYRO,EV3_COLOUR,30};
+ EMU_brick *brick;
+
+ brick=(EMU_brick *)calloc(1,sizeof(EMU_brick));
+ brick->queue=(EMU_reply *)malloc(EMU_MAX_QUEUED*sizeof(EMU_reply));
+ brick->config=*config;
+ brick->fd=-1;
+ brick->listen_fd=-1;
+ pthread_mutex_init(&brick->lock,NULL);
+ brick->t0_us=EMU_now_us();
+ brick->sim_us=brick->t0_us;
+ for (int i=0; i<4; i++)
+ {
+  brick->motor[i].end_us=-1;
+  brick->motor[i].step_ref=-1;
+  brick->sensor[i].type=types[i];
+  brick->sensor[i].t_us=brick->t0_us;
+ }
+ brick->sensor[PORT_3].value[0]=6;	// <-- White
+ brick->sensor[PORT_4].value[0]=250;	// <-- 25cm to the nearest object
+ EMU_mkdirs(brick,EMU_SYS_DIR);
+ EMU_mkdirs(brick,"/home/root/lms2012/prjs");
+ EMU_mkdirs(brick,"/home/root/lms2012/apps");
+ EMU_mkdirs(brick,"/home/root/lms2012/tools");
+ strcpy(&brick->name[0],"EV3");
+ return(brick);
+}
+
+static void EMU_free(EMU_brick *brick)
+{
+ EMU_file *next;
+
+ for (int h=0; h<EMU_HANDLES; h++) if (brick->handle[h].kind!=EMU_HANDLE_FREE) EMU_close(brick,h);
+ for (EMU_file *f=brick->files; f!=NULL; f=next)
+ {
+  next=f->next;
+  free(f->path);
+  free(f->data);
+  free(f);
+ }
+ for (int i=0; i<EMU_PROGRAMS; i++) if (brick->runs[i]!=NULL) EMU_program_free(brick->runs[i]);
+ free(brick->image);
+ pthread_mutex_destroy(&brick->lock);
+ free(brick->listen_path);
+ free(brick->queue);
+ free(brick);
+}
+
+EMU_brick *EMU_start_config(const EMU_config *config, int *host_fd)
+{
+ //////////////////////////////////////////////////////////////////////////////////////////////////////
+ // Start a stand-in brick at the end of a socket pair.
+ //
+ // Inputs: config - link delay, bandwidth and command time (see btcomm_emu.h)
+ //         host_fd - receives the host end of the link, pass it to BT_attach()
+ //
+ // Returns: a brick handle to pass to EMU_stop()
+ //          NULL on error
+ //////////////////////////////////////////////////////////////////////////////////////////////////////
+ int sv[2];
+ EMU_brick *brick;
+
+ if (socketpair(AF_UNIX,SOCK_STREAM,0,sv)<0)
+ {
+  perror("EMU_start");
+  return(NULL);
+ }
+ brick=EMU_new(config);
+ brick->fd=sv[1];
+ if (pthread_create(&brick->thread,NULL,EMU_thread,brick)!=0)
+ {
+  fprintf(stderr,"EMU_start: Unable to start brick thread\n");
+  close(sv[0]);
+  close(sv[1]);
+  EMU_free(brick);
+  return(NULL);
+ }
+ *host_fd=sv[0];
+ return(brick);
+}
+
+EMU_brick *EMU_start(int latency_us, int *host_fd)
+{
+ //////////////////////////////////////////////////////////////////////////////////////////////////////
+ // Start a stand-in brick with a one-way delay of latency_us and no bandwidth limit
+ //////////////////////////////////////////////////////////////////////////////////////////////////////
+ EMU_config config={latency_us,0,0};
+ return(EMU_start_config(&config,host_fd));
+}
+
+static int EMU_listen_tcp(const char *address)
+{
+ // Listening TCP socket for [host:]port, on the loopback interface unless a host is given
+ struct addrinfo hints, *res=NULL;
+ char host[256]="127.0.0.1";
+ const char *port=address, *colon=strrchr(address,':');
+ int fd, one=1, rv;
+
+ if (colon!=NULL)
+ {
+  snprintf(&host[0],sizeof(host),"%.*s",(int)(colon-address),address);
+  port=colon+1;
+ }
+ memset(&hints,0,sizeof(hints));
+ hints.ai_family=AF_UNSPEC;
+ hints.ai_socktype=SOCK_STREAM;
+ hints.ai_flags=AI_PASSIVE;
+ rv=getaddrinfo(&host[0],port,&hints,&res);
+ if (rv!=0)
+ {
+  fprintf(stderr,"EMU_listen: %s: %s\n",address,gai_strerror(rv));
+  return(-1);
+ }
+ fd=socket(res->ai_family,res->ai_socktype,res->ai_protocol);
+ if (fd>=0) setsockopt(fd,SOL_SOCKET,SO_REUSEADDR,&one,sizeof(one));
+ if (fd<0||bind(fd,res->ai_addr,res->ai_addrlen)<0||listen(fd,1)<0)
+ {
+  perror("EMU_listen");
+  if (fd>=0) close(fd);
+  fd=-1;
+ }
+ freeaddrinfo(res);
+ return(fd);
+}
+
+static int EMU_listen_unix(const char *path)
+{
+ struct sockaddr_un addr;
+ int fd;
+
+ memset(&addr,0,sizeof(addr));
+ addr.sun_family=AF_UNIX;
+ if (strlen(path)>=sizeof(addr.sun_path))
+ {
+  fprintf(stderr,"EMU_listen: Socket path too long\n");
+  return(-1);
+ }
+ strcpy(addr.sun_path,path);
+ unlink(path);
+ fd=socket(AF_UNIX,SOCK_STREAM,0);
+ if (fd<0||bind(fd,(struct sockaddr *)&addr,sizeof(addr))<0||listen(fd,1)<0)
+ {
+  perror("EMU_listen");
+  if (fd>=0) close(fd);
+  return(-1);
+ }
+ return(fd);
+}
+
+EMU_brick *EMU_listen(const EMU_config *config, const char *address)
+{
+ //////////////////////////////////////////////////////////////////////////////////////////////////////
+ // Start a stand-in brick that serves a socket, one host at a time:
+ //    "tcp:[host:]port" - a TCP port (on 127.0.0.1 unless a host is given), reached with
+ //                        BT_open("tcp:<any serial>@127.0.0.1:<port>"). Hosts must unlock the brick
+ //                        first, as with a real EV3 over WiFi.
+ //    "[unix:]path"     - a Unix domain socket, reached with BT_open("unix:<path>"). Any file
+ //                        already at path is replaced.
+ //
+ // Returns: a brick handle to pass to EMU_stop()
+ //          NULL on error
+ //////////////////////////////////////////////////////////////////////////////////////////////////////
+ EMU_brick *brick;
+ int fd, wifi=strncmp(address,"tcp:",4)==0;
+
+ if (strncmp(address,"unix:",5)==0) address+=5;
+ fd=wifi?EMU_listen_tcp(address+4):EMU_listen_unix(address);
+ if (fd<0) return(NULL);
+ brick=EMU_new(config);
+ brick->listen_fd=fd;
+ brick->wifi=wifi;
+ if (!wifi) brick->listen_path=strdup(address);
+ if (pthread_create(&brick->thread,NULL,EMU_thread,brick)!=0)
+ {
+  fprintf(stderr,"EMU_listen: Unable to start brick thread\n");
+  close(fd);
+  if (!wifi) unlink(address);
+  EMU_free(brick);
+  return(NULL);
+ }
+ return(brick);
+}
+
+void EMU_stop(EMU_brick *brick)
+{
+ //////////////////////////////////////////////////////////////////////////////////////////////////////
+ // Stop a stand-in brick started with EMU_start() or EMU_listen(). The host end of the link is not
+ // closed here, that is done by BT_close().
+ //////////////////////////////////////////////////////////////////////////////////////////////////////
+ if (brick==NULL) return;
+ __atomic_store_n(&brick->stop,1,__ATOMIC_RELEASE);
+ pthread_join(brick->thread,NULL);
+ for (int i=0; i<EMU_PROGRAMS; i++)		// <-- Programs see the stop flag at their next pass through a loop
+  if (brick->runs[i]!=NULL) pthread_join(brick->runs[i]->thread,NULL);
+ if (brick->fd>=0) close(brick->fd);
+ if (brick->listen_fd>=0) close(brick->listen_fd);
+ if (brick->listen_path!=NULL) unlink(brick->listen_path);
+ EMU_free(brick);
+}
+
+void EMU_set_sensor(EMU_brick *brick, int port, int type, int v0, int v1, int v2)
+{
+ //////////////////////////////////////////////////////////////////////////////////////////////////////
+ // Plug a sensor of the given type into port, reading v0, v1, v2 from now on
+ //////////////////////////////////////////////////////////////////////////////////////////////////////
+ if (port<0||port>3) return;
+ pthread_mutex_lock(&brick->lock);
+ brick->sensor[port].type=type;
+ brick->sensor[port].value[0]=v0;
+ brick->sensor[port].value[1]=v1;
+ brick->sensor[port].value[2]=v2;
+ brick->sensor[port].t_us=EMU_now_us();
+ pthread_mutex_unlock(&brick->lock);
+}
+
+void EMU_get_motor(EMU_brick *brick, int motor, int *tacho, int *speed)
+{
+ //////////////////////////////////////////////////////////////////////////////////////////////////////
+ // Tacho count and speed of a motor, as of now (or as of the last command the brick ran, if its
+ // timers have taken it further)
+ //////////////////////////////////////////////////////////////////////////////////////////////////////
+ motor=MAX(0,MIN(3,motor));
+ pthread_mutex_lock(&brick->lock);
+ EMU_simulate(brick,EMU_now_us());
+ *tacho=lround(brick->motor[motor].tacho);
+ *speed=lround(brick->motor[motor].speed);
+ pthread_mutex_unlock(&brick->lock);
+}
+
+int EMU_write_file(EMU_brick *brick, const char *path, const void *data, int len)
+{
+ //////////////////////////////////////////////////////////////////////////////////////////////////////
+ // Put a file on the brick, as if it had been downloaded to it. Returns 0, or -1 if path is a directory.
+ //////////////////////////////////////////////////////////////////////////////////////////////////////
+ char abs[1024];
+ int r;
+
+ EMU_path(path,&abs[0]);
+ pthread_mutex_lock(&brick->lock);
+ r=EMU_store(brick,&abs[0],(const unsigned char *)data,len);
+ pthread_mutex_unlock(&brick->lock);
+ return(r);
+}
+
+int EMU_read_file(EMU_brick *brick, const char *path, void **data)
+{
+ //////////////////////////////////////////////////////////////////////////////////////////////////////
+ // Copy out a file on the brick. Returns its length, with the contents in *data (free() it), or -1
+ // if there is no such file.
+ //////////////////////////////////////////////////////////////////////////////////////////////////////
+ char abs[1024];
+ EMU_file *f;
+ int len=-1;
+
+ EMU_path(path,&abs[0]);
+ *data=NULL;
+ pthread_mutex_lock(&brick->lock);
+ f=EMU_find(brick,&abs[0]);
+ if (f!=NULL&&!f->is_dir)
+ {
+  len=f->size;
+  *data=malloc(MAX(len,1));
+  memcpy(*data,f->data,len);
+ }
+ pthread_mutex_unlock(&brick->lock);
+ return(len);
+}
+
+void EMU_traffic(EMU_brick *brick, long long *to_brick, long long *from_brick)
+{
+ //////////////////////////////////////////////////////////////////////////////////////////////////////
+ // Bytes that have crossed the link in each direction since the brick was started
+ //////////////////////////////////////////////////////////////////////////////////////////////////////
+ *to_brick=__atomic_load_n(&brick->rx_bytes,__ATOMIC_RELAXED);
+ *from_brick=__atomic_load_n(&brick->tx_bytes,__ATOMIC_RELAXED);
+}
@@ -0,0 +1,85 @@
+/***********************************************************************************************************************
+ *
+ * 	Stand-in EV3 brick for the BT Communications library. This runs a fake brick in a background thread at the
+ * 	far end of a local socket, so programs using btcomm.c can be exercised and benchmarked without hardware.
+ *
+ * 	Usage:
+ * 	   int fd;
+ * 	   EMU_brick *brick=EMU_start(15000, &fd);   <-- Stand-in brick with a 15ms one-way link delay
+ * 	   BT_attach(fd);                             <-- All BT_* calls now talk to the stand-in
+ * 	   ...
+ * 	   BT_close();
+ * 	   EMU_stop(brick);
+ *
+ * 	or, to reach it through BT_open() - from this program or another one:
+ * 	   EMU_config config={15000, 24000, 0};       <-- 15ms delay, about the 24 KB/s an EV3 manages over RFCOMM
+ * 	   EMU_brick *brick=EMU_listen(&config, "/tmp/ev3.sock");
+ * 	   BT_open("unix:/tmp/ev3.sock");
+ *
+ * 	or over TCP, unlocked like an EV3 on WiFi:
+ * 	   EMU_brick *brick=EMU_listen(&config, "tcp:5555");
+ * 	   BT_open("tcp:0016535655D9@127.0.0.1:5555");
+ *
+ * 	The stand-in accepts the same direct and system command framing as the EV3, and runs direct commands through
+ * 	a small byte code interpreter that knows the opcodes btcomm.c sends:
+ * 	   opINPUT_DEVICE (GET_TYPEMODE, READY_PCT/RAW/SI, CLR_ALL), opINPUT_READ, opINPUT_READSI, opINPUT_READEXT
+ * 	   opOUTPUT_* (power, speed, start, stop, timed and stepped moves, STEP_SYNC/TIME_SYNC, counts, test, ready)
+ * 	   opSOUND, opSOUND_TEST, opSOUND_READY, opUI_DRAW, opUI_WRITE (LED), opCOM_SET (brick name)
+ * 	   opTIMER_WAIT, opTIMER_READY, opTIMER_READ, opTIMER_READ_US, opNOP
+ * 	   opMOVEx_y, opADDx, opSUBx, opJR, opJR_TRUE/FALSE and the opJR_xx compares (8, 16, 32 bit and float)
+ * 	   opMULx, opDIVx, opFILE (LOAD_IMAGE), opPROGRAM_START, opPROGRAM_STOP, opPROGRAM_INFO (GET_STATUS), opOBJECT_END
+ * 	Results are written into the global variable area exactly as the brick would. A command with an opcode it does
+ * 	not know is answered with DIRECT_REPLY_ERROR.
+ *
+ * 	Motors are simulated: power sets a target speed (EMU_MAX_SPEED degrees/s at 100%) that the motor approaches
+ * 	with a short lag, tacho counts follow the speed, and timed or stepped moves stop by themselves. Sensors return
+ * 	whatever was last set with EMU_set_sensor(); a gyro's angle keeps moving at the rate it was given. The defaults
+ * 	are a touch sensor on port 1, a gyro on port 2, a colour sensor on port 3 and an ultrasonic sensor on port 4.
+ *
+ * 	Direct commands run one after another, as on the brick's VM: opTIMER_READY, opSOUND_READY and opOUTPUT_READY
+ * 	hold up the reply, and the commands behind it, until the brick would have got past them. Each pass through a
+ * 	loop (a jump back) takes a millisecond of brick time, and a looping command is kept in step with real time, so
+ * 	it sees sensor values set while it runs. System commands keep
+ * 	files in memory: uploads, downloads, BEGIN_GETFILE, LIST_FILES (with real MD5 sums), CREATE_DIR, DELETE_FILE
+ * 	and CLOSE_FILEHANDLE behave as on the EV3. Relative paths are taken from /home/root/lms2012/sys.
+ *
+ * 	A program image uploaded as a file can be loaded into the user slot and started, as BT_program_start() does.
+ * 	It runs the main thread of the image (its first object) with the same interpreter, in a thread of its own, next
+ * 	to the direct commands, until it ends or is stopped; either way the motors are stopped.
+ *
+ * 	Every reply is held back by the configured delay, measured from when the command was received, so several
+ * 	commands can be travelling over the fake link at once exactly as they would over RFCOMM. With a bandwidth set,
+ * 	each frame also occupies its direction of the link for as long as its bytes take to cross.
+ *
+ *      This library is free software, distributed under the GPL license. Please refer to the include license
+ *      file for details.
+ *
+ * ********************************************************************************************************************/
+
+#ifndef __btcomm_emu_header
+#define __btcomm_emu_header
+
+#define EMU_MAX_SPEED 1050		// Degrees per second of a motor at 100% power
+
+typedef struct EMU_brick EMU_brick;
+
+typedef struct
+{
+ int latency_us;			// One-way delay added to every reply, in microseconds
+ int bandwidth;				// Bytes per second in each direction of the link, 0 for unlimited
+ int command_us;			// Time the brick takes to run each direct command
+} EMU_config;
+
+EMU_brick *EMU_start(int latency_us, int *host_fd);	// Start a stand-in brick, host_fd gets our end of the link
+EMU_brick *EMU_start_config(const EMU_config *config, int *host_fd);
+EMU_brick *EMU_listen(const EMU_config *config, const char *address);	// Serve a Unix socket or "tcp:[host:]port"
+void EMU_stop(EMU_brick *brick);			// Stop the brick thread and release its resources
+
+// Brick state, for tests. port is PORT_1..PORT_4, motor 0..3 for A..D. type is the EV3 sensor type (16 touch,
+// 29 colour, 30 ultrasonic, 32 gyro); for a gyro, values are the angle and the rate in degrees/s.
+void EMU_set_sensor(EMU_brick *brick, int port, int type, int v0, int v1, int v2);
+void EMU_get_motor(EMU_brick *brick, int motor, int *tacho, int *speed);	// speed in degrees/s
+int EMU_write_file(EMU_brick *brick, const char *path, const void *data, int len);	// 0, or -1
+int EMU_read_file(EMU_brick *brick, const char *path, void **data);	// Length (free() *data), or -1
+void EMU_traffic(EMU_brick *brick, long long *to_brick, long long *from_brick);	// Bytes over the link so far
+#endif
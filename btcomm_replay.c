@@ -0,0 +1,198 @@
+/* EV3 API
+ *  Copyright (C) 2018-2019 Francisco Estrada and Lioudmila Tishkina
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// Plays a wire capture (see BT_capture_start()) back against the stand-in
+// brick in btcomm_emu.c. Every command the program sent to the brick is sent
+// again, at the same time offset as in the capture (or back to back with -f),
+// and the round trip times of the replay are compared with those recorded.
+// With -d the capture is only listed: each command disassembled, and each
+// reply decoded against the command it answers (see btcomm_asm.h).
+//
+// Usage: btcomm_replay [-l one-way link delay in us] [-f] [-o replay.btcap] [-d] capture.btcap
+
+#include "btcomm.h"
+#include "btcomm_emu.h"
+#include "btcomm_asm.h"
+#include <algorithm>
+#include <time.h>
+#include <vector>
+
+static long long now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+struct Frame {
+  long long t_ns;
+  int len;
+  unsigned char data[BT_MAX_REPLY];
+};
+
+struct Pending {
+  long long t_sent;
+  std::vector<double> *rtt_us;
+  int *outstanding;
+};
+
+static void on_reply(void *arg, const unsigned char *reply, int len) {
+  Pending *p = (Pending *)arg;
+  if (len > 0) p->rtt_us->push_back((now_ns() - p->t_sent) / 1e3);
+  __atomic_fetch_sub(p->outstanding, 1, __ATOMIC_RELEASE);
+  delete p;
+}
+
+static void print_rtt(const char *label, std::vector<double> &us) {
+  double sum = 0;
+  if (us.empty()) {
+    printf("%-10s %8d\n", label, 0);
+    return;
+  }
+  std::sort(us.begin(), us.end());
+  for (double v : us) sum += v;
+  printf("%-10s %8zu %10.1f %10.1f %10.1f %10.1f\n", label, us.size(), sum / us.size(),
+         us[us.size() / 2], us[(us.size() * 99) / 100], us.back());
+}
+
+// Writes out the capture as text. Replies are decoded against the last command
+// sent with the same message id.
+static int list_capture(const char *path) {
+  static char text[65536];
+  std::vector<int> last(0x10000, -1);
+  std::vector<Frame> commands;
+  BT_capture_record rec;
+  FILE *fp = fopen(path, "rb");
+  int r;
+
+  if (fp == NULL) {
+    perror(path);
+    return 1;
+  }
+  while ((r = BT_capture_read(fp, &rec)) > 0) {
+    int id = rec.len >= 4 ? rec.data[2] | (rec.data[3] << 8) : 0;
+    printf("%12.3f ms %s\n", rec.t_ns * 1e-6, rec.dir == BT_CAPTURE_TX ? "sent" : "received");
+    if (rec.dir == BT_CAPTURE_TX) {
+      if (BT_disassemble(rec.data, rec.len, text, sizeof(text)) >= 0) fputs(text, stdout);
+      Frame f;
+      f.t_ns = rec.t_ns;
+      f.len = rec.len;
+      memcpy(f.data, rec.data, rec.len);
+      last[id] = commands.size();
+      commands.push_back(f);
+    } else {
+      const Frame *cmd = last[id] >= 0 ? &commands[last[id]] : NULL;
+      if (BT_disassemble_reply(rec.data, rec.len, cmd ? cmd->data : NULL, cmd ? cmd->len : 0, text,
+                               sizeof(text)) >= 0)
+        fputs(text, stdout);
+    }
+  }
+  fclose(fp);
+  return r < 0 ? 1 : 0;
+}
+
+int main(int argc, char *argv[]) {
+  int latency_us = 15000, fast = 0, list = 0;
+  const char *out = NULL;
+  int opt, fd, r;
+
+  while ((opt = getopt(argc, argv, "l:fo:d")) != -1) {
+    if (opt == 'l') latency_us = atoi(optarg);
+    if (opt == 'f') fast = 1;
+    if (opt == 'o') out = optarg;
+    if (opt == 'd') list = 1;
+  }
+  if (optind >= argc) {
+    fprintf(stderr, "Usage: %s [-l latency_us] [-f] [-o replay.btcap] [-d] capture.btcap\n", argv[0]);
+    return 1;
+  }
+  if (list) return list_capture(argv[optind]);
+  FILE *fp = fopen(argv[optind], "rb");
+  if (fp == NULL) {
+    perror(argv[optind]);
+    return 1;
+  }
+
+  // Commands to send again, and the round trips recorded for them: a reply is
+  // matched to the last command sent with the same message id.
+  std::vector<Frame> frames;
+  std::vector<double> captured_us, replayed_us;
+  std::vector<long long> sent_at(0x10000, -1);
+  BT_capture_record rec;
+  while ((r = BT_capture_read(fp, &rec)) > 0) {
+    if (rec.len < 5) continue;
+    int id = rec.data[2] | (rec.data[3] << 8);
+    if (rec.dir == BT_CAPTURE_TX) {
+      Frame f;
+      f.t_ns = rec.t_ns;
+      f.len = rec.len;
+      memcpy(f.data, rec.data, rec.len);
+      frames.push_back(f);
+      sent_at[id] = rec.t_ns;
+    } else if (sent_at[id] >= 0) {
+      captured_us.push_back((rec.t_ns - sent_at[id]) / 1e3);
+      sent_at[id] = -1;
+    }
+  }
+  fclose(fp);
+  if (r < 0) return 1;
+
+  EMU_brick *brick = EMU_start(latency_us, &fd);
+  if (brick == NULL) return 1;
+  BT_attach(fd);
+  if (out != NULL && BT_capture_start(out) < 0) return 1;
+  BT_io_start();
+
+  int outstanding = 0;
+  long long t0 = now_ns();
+  for (const Frame &f : frames) {
+    if (!fast) {
+      long long wait = f.t_ns - (now_ns() - t0);
+      if (wait > 0) {
+        struct timespec ts = {(time_t)(wait / 1000000000LL), (long)(wait % 1000000000LL)};
+        nanosleep(&ts, NULL);
+      }
+    }
+    if (f.data[4] & 0x80) {
+      BT_io_submit(f.data, f.len, NULL, NULL);
+      continue;
+    }
+    Pending *p = new Pending{now_ns(), &replayed_us, &outstanding};
+    __atomic_fetch_add(&outstanding, 1, __ATOMIC_RELAXED);
+    if (BT_io_submit(f.data, f.len, on_reply, p) < 0) {
+      __atomic_fetch_sub(&outstanding, 1, __ATOMIC_RELAXED);
+      delete p;
+    }
+  }
+  while (__atomic_load_n(&outstanding, __ATOMIC_ACQUIRE) > 0) {
+    struct timespec ts = {0, 1000000};
+    nanosleep(&ts, NULL);
+  }
+  double seconds = (now_ns() - t0) * 1e-9;
+  BT_io_stop();
+  if (out != NULL) BT_capture_stop();
+
+  long long span = frames.empty() ? 0 : frames.back().t_ns;
+  printf("# %zu commands, captured over %.3f s, replayed in %.3f s%s, link delay %d us\n",
+         frames.size(), span * 1e-9, seconds, fast ? " (as fast as possible)" : "", latency_us);
+  printf("%-10s %8s %10s %10s %10s %10s\n", "rtt (us)", "replies", "mean", "p50", "p99", "max");
+  print_rtt("captured", captured_us);
+  print_rtt("replayed", replayed_us);
+
+  BT_close();
+  EMU_stop(brick);
+  return 0;
+}
@@ -0,0 +1,380 @@
+/***********************************************************************************************************************
+ *
+ * 	Runtime statistics for the BT Communications library - see btcomm_stats.h for an overview.
+ *
+ *      This library is free software, distributed under the GPL license. Please see the attached license file for
+ *      details.
+ *
+ * ********************************************************************************************************************/
+#include "btcomm_stats.h"
+#include <time.h>
+
+// Slots are updated with relaxed atomic adds from whatever thread makes the call or reads the reply, and never move
+// or go away, so a snapshot can be taken at any time without stopping anyone; it may be a few counts out of step
+// between fields. Entry points have a slot each, named in BT_stats_calls[] below. Opcodes (256 direct, then 256
+// system commands) get theirs the first time one is sent. Which entry point a thread is in, when it started and
+// whether anything failed in it, is kept in thread-local variables so nested calls and errors are attributed to the
+// outermost call.
+#define BT_STATS_KEYS 512				// Opcodes, then system commands
+
+typedef struct
+{
+ char name[32];
+ long long count, errors, timed, sum_us, max_us;
+ long long hist[BT_STATS_BUCKETS];
+} BT_stats_slot;
+
+static BT_stats_slot BT_stats_calls[BT_STATS_CALLS]={	// In the order of the BT_CALL_* numbers
+ {"BT_setEV3name"}, {"BT_play_tone_sequence"}, {"BT_motor_port_start"}, {"BT_motor_port_stop"}, {"BT_all_stop"},
+ {"BT_drive"}, {"BT_turn"}, {"BT_timed_motor_port_start"}, {"BT_timed_motor_port_start_v2"}, {"BT_get_type_mode"},
+ {"BT_read_touch_sensor"}, {"BT_read_colour_sensor"}, {"BT_read_colour_sensor_RGB"}, {"BT_read_ultrasonic_sensor"},
+ {"BT_read_colour_RGBraw_NXT"}, {"BT_read_gyro"}, {"BT_play_sound_file"}, {"BT_list_files"}, {"BT_upload_file"},
+ {"BT_set_LED_colour"}, {"BT_draw_image_from_file"}, {"BT_store_current_display"}, {"BT_restore_previous_display"},
+ {"BT_read_snapshot"}, {"BT_read_batch"}, {"BT_read_motors"}, {"BT_clear_tacho"}, {"BT_speed_step"},
+ {"BT_drive_sync"}, {"BT_drive_sync_timed"}, {"BT_motors_busy"}, {"BT_upload_file_windowed"}, {"BT_download_file"},
+ {"BT_download_file_fd"}, {"BT_tail_file"}, {"BT_list_dir"}, {"BT_list_dir_cached"}, {"BT_file_info"},
+ {"BT_sync_files"}, {"BT_fence"}, {"BT_run_until"}, {"BT_turn_until_angle"}, {"BT_stop_on_colour"},
+ {"BT_program_upload"}, {"BT_program_start"}, {"BT_program_stop"}, {"BT_program_status"}
+};
+static BT_stats_slot *BT_stats_keys[BT_STATS_KEYS];
+static __thread int BT_stats_depth;			// Instrumented calls this thread is inside
+static __thread int BT_stats_call;			// The outermost one,
+static __thread long long BT_stats_t0;			// when it started,
+static __thread int BT_stats_failed;			// and whether a command of it failed
+
+static const struct {int key; const char *name;} BT_stats_names[]={
+ {opNOP,"opNOP"}, {opUI_WRITE,"opUI_WRITE"}, {opUI_DRAW,"opUI_DRAW"}, {opTIMER_WAIT,"opTIMER_WAIT"},
+ {opTIMER_READY,"opTIMER_READY"}, {opTIMER_READ,"opTIMER_READ"}, {opSOUND,"opSOUND"}, {opSOUND_TEST,"opSOUND_TEST"},
+ {opSOUND_READY,"opSOUND_READY"}, {opINPUT_DEVICE,"opINPUT_DEVICE"}, {opINPUT_READ,"opINPUT_READ"},
+ {opINPUT_READSI,"opINPUT_READSI"}, {opINPUT_READEXT,"opINPUT_READEXT"}, {opOUTPUT_STOP,"opOUTPUT_STOP"},
+ {opOUTPUT_POWER,"opOUTPUT_POWER"}, {opOUTPUT_SPEED,"opOUTPUT_SPEED"}, {opOUTPUT_START,"opOUTPUT_START"},
+ {opOUTPUT_TEST,"opOUTPUT_TEST"}, {opOUTPUT_READY,"opOUTPUT_READY"}, {opOUTPUT_READ,"opOUTPUT_READ"},
+ {opOUTPUT_STEP_POWER,"opOUTPUT_STEP_POWER"}, {opOUTPUT_TIME_POWER,"opOUTPUT_TIME_POWER"},
+ {opOUTPUT_STEP_SPEED,"opOUTPUT_STEP_SPEED"}, {opOUTPUT_TIME_SPEED,"opOUTPUT_TIME_SPEED"},
+ {opOUTPUT_STEP_SYNC,"opOUTPUT_STEP_SYNC"}, {opOUTPUT_TIME_SYNC,"opOUTPUT_TIME_SYNC"},
+ {opOUTPUT_CLR_COUNT,"opOUTPUT_CLR_COUNT"}, {opOUTPUT_GET_COUNT,"opOUTPUT_GET_COUNT"}, {opCOM_SET,"opCOM_SET"},
+ {256+BEGIN_DOWNLOAD,"BEGIN_DOWNLOAD"}, {256+CONTINUE_DOWNLOAD,"CONTINUE_DOWNLOAD"},
+ {256+BEGIN_UPLOAD,"BEGIN_UPLOAD"}, {256+CONTINUE_UPLOAD,"CONTINUE_UPLOAD"}, {256+BEGIN_GETFILE,"BEGIN_GETFILE"},
+ {256+CONTINUE_GETFILE,"CONTINUE_GETFILE"}, {256+CLOSE_FILEHANDLE,"CLOSE_FILEHANDLE"},
+ {256+LIST_FILES,"LIST_FILES"}, {256+CONTINUE_LIST_FILES,"CONTINUE_LIST_FILES"}, {256+CREATE_DIR,"CREATE_DIR"},
+ {256+DELETE_FILE,"DELETE_FILE"}};
+
+static long long BT_stats_now_ns()
+{
+ struct timespec ts;
+ clock_gettime(CLOCK_MONOTONIC,&ts);
+ return((long long)ts.tv_sec*1000000000LL+ts.tv_nsec);
+}
+
+static int BT_stats_bucket(long long us)
+{
+ // Exact below 32us, then 16 buckets per power of two
+ int shift;
+ if (us<32) return(us<0?0:(int)us);
+ shift=63-__builtin_clzll((unsigned long long)us)-4;
+ if (shift>26) return(BT_STATS_BUCKETS-1);
+ return((shift+1)*16+(int)((us>>shift)&15));
+}
+
+static long long BT_stats_bucket_low(int i)
+{
+ // Smallest latency that falls into bucket i
+ if (i<32) return(i);
+ return((long long)(16+i%16)<<(i/16-1));
+}
+
+static void BT_stats_add(BT_stats_slot *slot, long long us, int failed)
+{
+ long long max=__atomic_load_n(&slot->max_us,__ATOMIC_RELAXED);
+ __atomic_fetch_add(&slot->hist[BT_stats_bucket(us)],1,__ATOMIC_RELAXED);
+ __atomic_fetch_add(&slot->sum_us,us,__ATOMIC_RELAXED);
+ __atomic_fetch_add(&slot->timed,1,__ATOMIC_RELAXED);
+ if (failed) __atomic_fetch_add(&slot->errors,1,__ATOMIC_RELAXED);
+ while (us>max&&!__atomic_compare_exchange_n(&slot->max_us,&max,us,1,__ATOMIC_RELAXED,__ATOMIC_RELAXED));
+}
+
+void BT_stats_begin(int call)
+{
+ // An entry point has been called. One called from inside another is not timed on its own.
+ if (BT_stats_depth++>0) return;
+ BT_stats_call=call;
+ BT_stats_failed=0;
+ BT_stats_t0=BT_stats_now_ns();
+}
+
+int BT_stats_end(int result)
+{
+ // The entry point is about to return result, which is handed back so a return can go through here
+ BT_stats_slot *slot;
+
+ if (--BT_stats_depth>0) return(result);
+ slot=&BT_stats_calls[BT_stats_call];
+ __atomic_fetch_add(&slot->count,1,__ATOMIC_RELAXED);
+ BT_stats_add(slot,(BT_stats_now_ns()-BT_stats_t0)/1000,BT_stats_failed);
+ return(result);
+}
+
+void BT_stats_check(const void *reply, int len)
+{
+ // Called with every reply handed back to a caller - marks the current call as failed if the command
+ // was lost or the brick answered with an error
+ const unsigned char *p=(const unsigned char *)reply;
+ if (len<0||(len>=5&&(p[4]==DIRECT_REPLY_ERROR||p[4]==SYSTEM_REPLY_ERROR))) BT_stats_failed=1;
+}
+
+static BT_stats_slot *BT_stats_key_slot(int key)
+{
+ BT_stats_slot *slot=__atomic_load_n(&BT_stats_keys[key],__ATOMIC_ACQUIRE), *expected=NULL;
+ if (slot!=NULL) return(slot);
+ slot=(BT_stats_slot *)calloc(1,sizeof(BT_stats_slot));
+ if (slot==NULL) return(NULL);
+ snprintf(&slot->name[0],sizeof(slot->name),key<256?"op 0x%02X":"system 0x%02X",key&0xFF);
+ for (unsigned int i=0; i<sizeof(BT_stats_names)/sizeof(BT_stats_names[0]); i++)
+  if (BT_stats_names[i].key==key) snprintf(&slot->name[0],sizeof(slot->name),"%s",BT_stats_names[i].name);
+ if (!__atomic_compare_exchange_n(&BT_stats_keys[key],&expected,slot,0,__ATOMIC_ACQ_REL,__ATOMIC_ACQUIRE))
+ {
+  free(slot);
+  slot=expected;
+ }
+ return(slot);
+}
+
+void BT_stats_sent(BT_ev3 *ev3, const unsigned char *cmd_string, int len)
+{
+ // A command has just been written to the socket, with its message id in place
+ BT_stats_slot *slot;
+ int system=cmd_string[4]&0x01, key, id;
+
+ if (len<(system?6:8)) return;
+ key=system?256+cmd_string[5]:cmd_string[7];
+ slot=BT_stats_key_slot(key);
+ if (slot==NULL) return;
+ __atomic_fetch_add(&slot->count,1,__ATOMIC_RELAXED);
+ if (cmd_string[4]&0x80) return;
+ id=cmd_string[2];
+ ev3->stats_key[id]=key;
+ ev3->stats_sent[id]=BT_stats_now_ns();
+}
+
+void BT_stats_received(BT_ev3 *ev3, const unsigned char *frame, int len)
+{
+ // A reply has just been read from the socket - time it against its command
+ BT_stats_slot *slot;
+ long long t;
+ int id;
+
+ if (len<5) return;
+ id=frame[2];
+ t=ev3->stats_sent[id];
+ if (t==0) return;
+ ev3->stats_sent[id]=0;
+ slot=BT_stats_keys[ev3->stats_key[id]];
+ BT_stats_add(slot,(BT_stats_now_ns()-t)/1000,frame[4]==DIRECT_REPLY_ERROR||frame[4]==SYSTEM_REPLY_ERROR);
+}
+
+static void BT_stats_copy(const BT_stats_slot *slot, BT_stats_entry *entry)
+{
+ memcpy(&entry->name[0],&slot->name[0],sizeof(entry->name));
+ entry->count=__atomic_load_n(&slot->count,__ATOMIC_RELAXED);
+ entry->errors=__atomic_load_n(&slot->errors,__ATOMIC_RELAXED);
+ entry->timed=__atomic_load_n(&slot->timed,__ATOMIC_RELAXED);
+ entry->sum_us=__atomic_load_n(&slot->sum_us,__ATOMIC_RELAXED);
+ entry->max_us=__atomic_load_n(&slot->max_us,__ATOMIC_RELAXED);
+ for (int i=0; i<BT_STATS_BUCKETS; i++) entry->hist[i]=__atomic_load_n(&slot->hist[i],__ATOMIC_RELAXED);
+}
+
+int BT_stats_snapshot(BT_stats_entry **entries)
+{
+ ////////////////////////////////////////////////////////////////////////////////////////////////
+ // Copy out the statistics of every entry point and opcode used so far: entry points in the
+ // order of their BT_CALL_* numbers, then direct command opcodes, then system commands.
+ //
+ // Returns: the number of entries in *entries, which must be released with free()
+ //          -1 if out of memory
+ //////////////////////////////////////////////////////////////////////////////////////////////////
+ BT_stats_slot *slot;
+ int n=0;
+
+ *entries=(BT_stats_entry *)malloc((BT_STATS_CALLS+BT_STATS_KEYS)*sizeof(BT_stats_entry));
+ if (*entries==NULL)
+ {
+  fprintf(stderr,"BT_stats_snapshot: Out of memory\n");
+  return(-1);
+ }
+ for (int i=0; i<BT_STATS_CALLS; i++)
+  if (__atomic_load_n(&BT_stats_calls[i].count,__ATOMIC_RELAXED)>0) BT_stats_copy(&BT_stats_calls[i],&(*entries)[n++]);
+ for (int i=0; i<BT_STATS_KEYS; i++)
+ {
+  slot=__atomic_load_n(&BT_stats_keys[i],__ATOMIC_ACQUIRE);
+  if (slot!=NULL&&__atomic_load_n(&slot->count,__ATOMIC_RELAXED)>0) BT_stats_copy(slot,&(*entries)[n++]);
+ }
+ return(n);
+}
+
+double BT_stats_percentile(const BT_stats_entry *entry, double p)
+{
+ ////////////////////////////////////////////////////////////////////////////////////////////////
+ // Latency below which a fraction p of the timed calls or commands fell, in microseconds - the
+ // middle of the histogram bucket it is in, so within about 3% of the true value. 0 if nothing
+ // was timed.
+ //////////////////////////////////////////////////////////////////////////////////////////////////
+ long long rank, seen=0, low, high;
+
+ if (entry->timed<=0) return(0);
+ rank=(long long)(p*entry->timed+0.5);
+ if (rank<1) rank=1;
+ if (rank>entry->timed) rank=entry->timed;
+ for (int i=0; i<BT_STATS_BUCKETS; i++)
+ {
+  seen+=entry->hist[i];
+  if (seen<rank) continue;
+  low=BT_stats_bucket_low(i);
+  high=(i+1<BT_STATS_BUCKETS)?BT_stats_bucket_low(i+1):low;
+  return(MIN((low+high)/2.0,(double)entry->max_us));
+ }
+ return((double)entry->max_us);
+}
+
+int BT_stats_write(FILE *fp)
+{
+ ////////////////////////////////////////////////////////////////////////////////////////////////
+ // Print the statistics as a table: one line per entry point and opcode, latencies in us.
+ //
+ // Returns: 0 on success, -1 on error
+ //////////////////////////////////////////////////////////////////////////////////////////////////
+ BT_stats_entry *entries, *e;
+ int n=BT_stats_snapshot(&entries);
+
+ if (n<0) return(-1);
+ fprintf(fp,"%-24s %9s %7s %9s %9s %9s %9s %9s\n","name","count","errors","mean","p50","p99","p999","max");
+ for (int i=0; i<n; i++)
+ {
+  e=&entries[i];
+  fprintf(fp,"%-24s %9lld %7lld %9.0f %9.0f %9.0f %9.0f %9lld\n",e->name,e->count,e->errors,
+          e->timed>0?(double)e->sum_us/e->timed:0.0,BT_stats_percentile(e,0.5),BT_stats_percentile(e,0.99),
+          BT_stats_percentile(e,0.999),e->max_us);
+ }
+ free(entries);
+ return(ferror(fp)?-1:0);
+}
+
+void BT_stats_reset()
+{
+ ////////////////////////////////////////////////////////////////////////////////////////////////
+ // Zero every counter and histogram. Calls and commands that are under way while this runs
+ // may be partly counted.
+ //////////////////////////////////////////////////////////////////////////////////////////////////
+ BT_stats_slot *slot;
+ for (int i=0; i<BT_STATS_CALLS+BT_STATS_KEYS; i++)
+ {
+  slot=(i<BT_STATS_CALLS)?&BT_stats_calls[i]:__atomic_load_n(&BT_stats_keys[i-BT_STATS_CALLS],__ATOMIC_ACQUIRE);
+  if (slot==NULL) continue;
+  __atomic_store_n(&slot->count,0,__ATOMIC_RELAXED);
+  __atomic_store_n(&slot->errors,0,__ATOMIC_RELAXED);
+  __atomic_store_n(&slot->timed,0,__ATOMIC_RELAXED);
+  __atomic_store_n(&slot->sum_us,0,__ATOMIC_RELAXED);
+  __atomic_store_n(&slot->max_us,0,__ATOMIC_RELAXED);
+  for (int j=0; j<BT_STATS_BUCKETS; j++) __atomic_store_n(&slot->hist[j],0,__ATOMIC_RELAXED);
+ }
+}
+
+// Periodic dump - the table is written to a temporary file that is then renamed over the target, so a reader
+// never sees a half-written table
+static struct
+{
+ char path[1024];
+ int period_ms;
+ int running, stop;
+ pthread_mutex_t lock;
+ pthread_cond_t wake;
+ pthread_t thread;
+} BT_stats_dump={"",0,0,0,PTHREAD_MUTEX_INITIALIZER,PTHREAD_COND_INITIALIZER};
+
+static void BT_stats_dump_once()
+{
+ char tmp[1040], stamp[32];
+ time_t now=time(NULL);
+ struct tm tm;
+ FILE *fp;
+ snprintf(&tmp[0],sizeof(tmp),"%s.tmp",&BT_stats_dump.path[0]);
+ fp=fopen(&tmp[0],"w");
+ if (fp==NULL) return;
+ strftime(&stamp[0],sizeof(stamp),"%Y-%m-%d %H:%M:%S",localtime_r(&now,&tm));
+ fprintf(fp,"# btcomm statistics, %s\n",&stamp[0]);
+ if (BT_stats_write(fp)<0||fclose(fp)!=0||rename(&tmp[0],&BT_stats_dump.path[0])<0) unlink(&tmp[0]);
+}
+
+static void *BT_stats_dump_loop(void *unused)
+{
+ struct timespec ts;
+ pthread_mutex_lock(&BT_stats_dump.lock);
+ while (!BT_stats_dump.stop)
+ {
+  clock_gettime(CLOCK_REALTIME,&ts);
+  ts.tv_sec+=BT_stats_dump.period_ms/1000;
+  ts.tv_nsec+=(BT_stats_dump.period_ms%1000)*1000000L;
+  if (ts.tv_nsec>=1000000000L) {ts.tv_sec++; ts.tv_nsec-=1000000000L;}
+  while (!BT_stats_dump.stop&&pthread_cond_timedwait(&BT_stats_dump.wake,&BT_stats_dump.lock,&ts)==0);
+  BT_stats_dump_once();
+ }
+ pthread_mutex_unlock(&BT_stats_dump.lock);
+ return(NULL);
+}
+
+int BT_stats_dump_start(const char *path, int period_ms)
+{
+ ////////////////////////////////////////////////////////////////////////////////////////////////
+ // Start a background thread that rewrites the statistics table (see BT_stats_write()) into
+ // the file at path every period_ms milliseconds, and once more when stopped.
+ //
+ // Returns: 0 on success
+ //          -1 if a dump is already running, or the thread cannot be started
+ //////////////////////////////////////////////////////////////////////////////////////////////////
+ if (period_ms<1||strlen(path)>=sizeof(BT_stats_dump.path))
+ {
+  fprintf(stderr,"BT_stats_dump_start: Invalid path or period\n");
+  return(-1);
+ }
+ pthread_mutex_lock(&BT_stats_dump.lock);
+ if (BT_stats_dump.running)
+ {
+  pthread_mutex_unlock(&BT_stats_dump.lock);
+  fprintf(stderr,"BT_stats_dump_start: A dump is already running\n");
+  return(-1);
+ }
+ strcpy(&BT_stats_dump.path[0],path);
+ BT_stats_dump.period_ms=period_ms;
+ BT_stats_dump.stop=0;
+ if (pthread_create(&BT_stats_dump.thread,NULL,BT_stats_dump_loop,NULL)!=0)
+ {
+  pthread_mutex_unlock(&BT_stats_dump.lock);
+  fprintf(stderr,"BT_stats_dump_start: Unable to start the dump thread\n");
+  return(-1);
+ }
+ BT_stats_dump.running=1;
+ pthread_mutex_unlock(&BT_stats_dump.lock);
+ return(0);
+}
+
+int BT_stats_dump_stop()
+{
+ ////////////////////////////////////////////////////////////////////////////////////////////////
+ // Stop the dump thread started by BT_stats_dump_start(), after a final dump.
+ //
+ // Returns: 0 on success, -1 if no dump was running
+ //////////////////////////////////////////////////////////////////////////////////////////////////
+ pthread_mutex_lock(&BT_stats_dump.lock);
+ if (!BT_stats_dump.running)
+ {
+  pthread_mutex_unlock(&BT_stats_dump.lock);
+  return(-1);
+ }
+ BT_stats_dump.stop=1;
+ pthread_cond_signal(&BT_stats_dump.wake);
+ pthread_mutex_unlock(&BT_stats_dump.lock);
+ pthread_join(BT_stats_dump.thread,NULL);
+ pthread_mutex_lock(&BT_stats_dump.lock);
+ BT_stats_dump.running=0;
+ pthread_mutex_unlock(&BT_stats_dump.lock);
+ return(0);
+}
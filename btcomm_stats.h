@@ -0,0 +1,116 @@
+/***********************************************************************************************************************
+ *
+ * 	Runtime statistics for the BT Communications library.
+ *
+ * 	The library counts and times every BT_* call and every command it sends, for all connections together, so a
+ * 	slow control loop can be traced to the sensor read or motor command responsible. Statistics are always on;
+ * 	keeping them costs a clock read and a few atomic adds per call and per command. There is one entry
+ * 	   per entry point, e.g. BT_read_touch_sensor (the EV3_* twin counts under the same name), timed from call to
+ * 	   return. A call made by another one, like BT_read_motors() inside BT_speed_step(), counts only for the
+ * 	   outer one.
+ * 	   per opcode, e.g. opINPUT_DEVICE (the first opcode of a direct command) or BEGIN_DOWNLOAD (a system
+ * 	   command), timed from the write() of the command to the read() of its reply. Commands without a reply are
+ * 	   counted only.
+ * 	errors counts calls that got an error reply or lost the connection, and commands the brick answered with an
+ * 	error.
+ *
+ * 	Latencies go into log-linear histograms, as in HdrHistogram: exact up to 32us, then 16 buckets per power of
+ * 	two, so any percentile is within about 3% of the true value.
+ *
+ * 	Usage:
+ * 	   BT_stats_entry *entries;
+ * 	   n=BT_stats_snapshot(&entries);
+ * 	   for (i=0; i<n; i++) printf("%s %.0f\n",entries[i].name,BT_stats_percentile(&entries[i],0.99));
+ * 	   free(entries);
+ *
+ * 	   BT_stats_dump_start("robot.stats",1000);   <-- rewrite the table in robot.stats every second
+ * 	   ...
+ * 	   BT_stats_dump_stop();
+ *
+ *      This library is free software, distributed under the GPL license. Please refer to the include license
+ *      file for details.
+ *
+ * ********************************************************************************************************************/
+
+#ifndef __btcomm_stats_header
+#define __btcomm_stats_header
+
+#include "btcomm.h"
+
+#define BT_STATS_BUCKETS 448						// Histogram buckets, up to about 35 minutes
+
+typedef struct
+{
+ char name[32];
+ long long count;						// Calls, or commands sent
+ long long errors;
+ long long timed;						// Latencies in the histogram
+ long long sum_us, max_us;
+ long long hist[BT_STATS_BUCKETS];				// See BT_stats_percentile()
+} BT_stats_entry;
+
+int BT_stats_snapshot(BT_stats_entry **entries);			// Entries in use (free() *entries), or -1
+double BT_stats_percentile(const BT_stats_entry *entry, double p);	// Latency in us for p in [0,1]
+int BT_stats_write(FILE *fp);						// Print all entries as a table
+void BT_stats_reset(void);
+int BT_stats_dump_start(const char *path, int period_ms);		// Rewrite the table in a file periodically
+int BT_stats_dump_stop(void);
+
+// Used by btcomm.c. Every EV3_* entry point starts with BT_stats_begin() and its number below, and returns through
+// BT_stats_end(), e.g. return(BT_stats_end(0)). Each command sent and reply read is passed to BT_stats_sent() and
+// BT_stats_received(), and each reply handed back to a caller to BT_stats_check().
+#define BT_CALL_SETEV3NAME 0
+#define BT_CALL_PLAY_TONE_SEQUENCE 1
+#define BT_CALL_MOTOR_PORT_START 2
+#define BT_CALL_MOTOR_PORT_STOP 3
+#define BT_CALL_ALL_STOP 4
+#define BT_CALL_DRIVE 5
+#define BT_CALL_TURN 6
+#define BT_CALL_TIMED_MOTOR_PORT_START 7
+#define BT_CALL_TIMED_MOTOR_PORT_START_V2 8
+#define BT_CALL_GET_TYPE_MODE 9
+#define BT_CALL_READ_TOUCH_SENSOR 10
+#define BT_CALL_READ_COLOUR_SENSOR 11
+#define BT_CALL_READ_COLOUR_SENSOR_RGB 12
+#define BT_CALL_READ_ULTRASONIC_SENSOR 13
+#define BT_CALL_READ_COLOUR_RGBRAW_NXT 14
+#define BT_CALL_READ_GYRO 15
+#define BT_CALL_PLAY_SOUND_FILE 16
+#define BT_CALL_LIST_FILES 17
+#define BT_CALL_UPLOAD_FILE 18
+#define BT_CALL_SET_LED_COLOUR 19
+#define BT_CALL_DRAW_IMAGE_FROM_FILE 20
+#define BT_CALL_STORE_CURRENT_DISPLAY 21
+#define BT_CALL_RESTORE_PREVIOUS_DISPLAY 22
+#define BT_CALL_READ_SNAPSHOT 23
+#define BT_CALL_READ_BATCH 24
+#define BT_CALL_READ_MOTORS 25
+#define BT_CALL_CLEAR_TACHO 26
+#define BT_CALL_SPEED_STEP 27
+#define BT_CALL_DRIVE_SYNC 28
+#define BT_CALL_DRIVE_SYNC_TIMED 29
+#define BT_CALL_MOTORS_BUSY 30
+#define BT_CALL_UPLOAD_FILE_WINDOWED 31
+#define BT_CALL_DOWNLOAD_FILE 32
+#define BT_CALL_DOWNLOAD_FILE_FD 33
+#define BT_CALL_TAIL_FILE 34
+#define BT_CALL_LIST_DIR 35
+#define BT_CALL_LIST_DIR_CACHED 36
+#define BT_CALL_FILE_INFO 37
+#define BT_CALL_SYNC_FILES 38
+#define BT_CALL_FENCE 39
+#define BT_CALL_RUN_UNTIL 40
+#define BT_CALL_TURN_UNTIL_ANGLE 41
+#define BT_CALL_STOP_ON_COLOUR 42
+#define BT_CALL_PROGRAM_UPLOAD 43
+#define BT_CALL_PROGRAM_START 44
+#define BT_CALL_PROGRAM_STOP 45
+#define BT_CALL_PROGRAM_STATUS 46
+#define BT_STATS_CALLS 47
+
+void BT_stats_begin(int call);
+int BT_stats_end(int result);							// Returns result
+void BT_stats_sent(BT_ev3 *ev3, const unsigned char *cmd_string, int len);
+void BT_stats_received(BT_ev3 *ev3, const unsigned char *frame, int len);
+void BT_stats_check(const void *reply, int len);
+#endif
@@ -0,0 +1,398 @@
+/***********************************************************************************************************************
+ *
+ * 	Sensor streaming for the BT Communications library - see btcomm_stream.h for an overview.
+ *
+ *      This library is free software, distributed under the GPL license. Please see the attached license file for
+ *      details.
+ *
+ * ********************************************************************************************************************/
+#include "btcomm_stream.h"
+#include <time.h>
+
+// Each channel is a ring written only by the I/O thread (see BT_stream_reply()) and read by any number of other
+// threads without locks. Every cell carries a sequence number: 2*pos+1 while sample number pos is being written
+// into it, 2*pos+2 once it is complete. A reader copies the cell and then checks that the sequence number still
+// says the sample it wanted, so it never returns a half-written or already overwritten sample.
+typedef struct
+{
+ unsigned int seq;
+ BT_sample sample;
+} BT_stream_cell;
+
+typedef struct
+{
+ unsigned int head;				// Number of samples written so far
+ BT_stream_cell cell[BT_STREAM_RING];
+} BT_stream_ring;
+
+struct BT_stream
+{
+ BT_ev3 *ev3;
+ BT_snapshot_plan plan;
+ BT_batch_plan *batch;				// Set if the brick does the sampling (see EV3_stream_start_batched())
+ BT_snapshot *snaps;				// A decoded batch
+ long long batch_end;				// When the last batch reply arrived
+ long long batch_rtt;				// Round trip estimate for batches
+ long long period_ns;
+ int depth;					// Polls allowed in flight
+ int started_io;				// The stream handed the connection to the I/O thread
+ int stop;
+ int inflight;					// Polls handed to the I/O thread and not answered yet
+ pthread_t thread;
+ BT_stream_ring ring[BT_STREAM_CHANNELS];
+};
+
+long long BT_stream_now_ns(void)
+{
+ struct timespec ts;
+ clock_gettime(CLOCK_MONOTONIC,&ts);
+ return((long long)ts.tv_sec*1000000000LL+ts.tv_nsec);
+}
+
+static void BT_stream_put(BT_stream_ring *ring, const BT_sample *sample)
+{
+ unsigned int pos=ring->head;
+ BT_stream_cell *cell=&ring->cell[pos&(BT_STREAM_RING-1)];
+
+ __atomic_store_n(&cell->seq,2*pos+1,__ATOMIC_RELAXED);
+ __atomic_thread_fence(__ATOMIC_RELEASE);
+ __atomic_store_n(&cell->sample.t_ns,sample->t_ns,__ATOMIC_RELAXED);
+ __atomic_store_n(&cell->sample.rtt_us,sample->rtt_us,__ATOMIC_RELAXED);
+ for (int i=0; i<3; i++) __atomic_store_n(&cell->sample.value[i],sample->value[i],__ATOMIC_RELAXED);
+ __atomic_store_n(&cell->seq,2*pos+2,__ATOMIC_RELEASE);
+ __atomic_store_n(&ring->head,pos+1,__ATOMIC_RELEASE);
+}
+
+static int BT_stream_get(BT_stream_ring *ring, unsigned int pos, BT_sample *sample)
+{
+ // Copy sample number pos. Returns 0 on success, -1 if it has been overwritten in the meantime.
+ BT_stream_cell *cell=&ring->cell[pos&(BT_STREAM_RING-1)];
+ unsigned int seq;
+
+ seq=__atomic_load_n(&cell->seq,__ATOMIC_ACQUIRE);
+ if (seq!=2*pos+2) return(-1);
+ sample->t_ns=__atomic_load_n(&cell->sample.t_ns,__ATOMIC_RELAXED);
+ sample->rtt_us=__atomic_load_n(&cell->sample.rtt_us,__ATOMIC_RELAXED);
+ for (int i=0; i<3; i++) sample->value[i]=__atomic_load_n(&cell->sample.value[i],__ATOMIC_RELAXED);
+ __atomic_thread_fence(__ATOMIC_ACQUIRE);
+ if (__atomic_load_n(&cell->seq,__ATOMIC_RELAXED)!=seq) return(-1);
+ return(0);
+}
+
+typedef struct
+{
+ BT_stream *stream;
+ long long t0;					// When the poll was handed to the I/O thread
+} BT_stream_tick;
+
+static void BT_stream_split(BT_stream *stream, const BT_snapshot *snap, long long t_ns, int rtt_us)
+{
+ // Split one snapshot up into the channel rings
+ const BT_port_map *map=&stream->plan.map;
+ BT_sample sample;
+
+ sample.t_ns=t_ns;
+ sample.rtt_us=rtt_us;
+ for (int port=0; port<4; port++)
+ {
+  sample.value[0]=sample.value[1]=sample.value[2]=0;
+  switch (map->sensor[port])
+  {
+   case BT_SENSOR_TOUCH:
+    sample.value[0]=snap->touch[port];
+    break;
+   case BT_SENSOR_COLOUR:
+    sample.value[0]=snap->colour[port];
+    break;
+   case BT_SENSOR_COLOUR_RGB:
+    for (int c=0; c<3; c++) sample.value[c]=snap->RGB[port][c];
+    break;
+   case BT_SENSOR_ULTRASONIC:
+    sample.value[0]=snap->distance[port];
+    break;
+   case BT_SENSOR_GYRO:
+    sample.value[0]=snap->angle[port];
+    sample.value[1]=snap->rate[port];
+    break;
+   default:
+    continue;
+  }
+  BT_stream_put(&stream->ring[port],&sample);
+ }
+ sample.value[1]=sample.value[2]=0;
+ for (int motor=0; motor<4; motor++)
+  if (map->motors&(1<<motor))
+  {
+   sample.value[0]=snap->tacho[motor];
+   BT_stream_put(&stream->ring[BT_STREAM_TACHO(motor)],&sample);
+  }
+}
+
+static void BT_stream_batch_reply(BT_stream *stream, BT_stream_tick *tick, const unsigned char *reply, int len, long long t1)
+{
+ // Sample i of a batch was read i periods after the brick started the batch, and the reply was sent
+ // one period after the last sample. A batch that was not queued behind the previous one started as
+ // soon as it arrived, so it also tells us the round trip time; queued ones only tell us when the
+ // brick got round to them, so they are left out of the estimate.
+ int n=stream->batch->samples;
+ long long rtt;
+
+ if (EV3_decode_batch(stream->ev3,stream->batch,reply,len,stream->snaps)==n)
+ {
+  if (tick->t0>=stream->batch_end)
+  {
+   rtt=t1-tick->t0-n*stream->period_ns;
+   if (rtt<0) rtt=0;
+   if (stream->batch_rtt<0||rtt<stream->batch_rtt) stream->batch_rtt=rtt;
+  }
+  rtt=stream->batch_rtt>0?stream->batch_rtt:0;
+  for (int i=0; i<n; i++)
+   BT_stream_split(stream,&stream->snaps[i],t1-rtt/2-(n-i)*stream->period_ns,(int)(rtt/1000));
+ }
+ stream->batch_end=t1;
+}
+
+static void BT_stream_reply(void *arg, const unsigned char *reply, int len)
+{
+ // Runs on the I/O thread when a poll is answered, and splits the snapshot up into the channel rings.
+ // Replies to one connection are handled in order on that one thread, so each ring has a single writer.
+ BT_stream_tick *tick=(BT_stream_tick *)arg;
+ BT_stream *stream=tick->stream;
+ BT_snapshot snap;
+ long long t1=BT_stream_now_ns();
+
+ if (stream->batch!=NULL) BT_stream_batch_reply(stream,tick,reply,len,t1);
+ else if (EV3_decode_snapshot(stream->ev3,&stream->plan,reply,len,&snap)==0)
+  BT_stream_split(stream,&snap,tick->t0+(t1-tick->t0)/2,(int)((t1-tick->t0)/1000));
+ free(tick);
+ __atomic_fetch_sub(&stream->inflight,1,__ATOMIC_RELEASE);
+}
+
+static void *BT_stream_loop(void *arg)
+{
+ // Body of the poller thread: hands one snapshot command to the I/O thread per period. Polls are not
+ // waited for, so the rate is not limited by the round trip time - only by BT_STREAM_INFLIGHT.
+ // For a batched stream the same loop just keeps two batches queued on the brick.
+ BT_stream *stream=(BT_stream *)arg;
+ BT_stream_tick *tick;
+ struct timespec ts;
+ long long next, now;
+
+ next=BT_stream_now_ns();
+ while (!__atomic_load_n(&stream->stop,__ATOMIC_ACQUIRE))
+ {
+  if (__atomic_load_n(&stream->inflight,__ATOMIC_ACQUIRE)<stream->depth)
+  {
+   tick=(BT_stream_tick *)malloc(sizeof(BT_stream_tick));
+   if (tick!=NULL)
+   {
+    tick->stream=stream;
+    tick->t0=BT_stream_now_ns();
+    __atomic_fetch_add(&stream->inflight,1,__ATOMIC_ACQUIRE);
+    if ((stream->batch!=NULL?
+         EV3_io_submit(stream->ev3,&stream->batch->cmd_string[0],stream->batch->len,BT_stream_reply,tick):
+         EV3_io_submit(stream->ev3,&stream->plan.cmd_string[0],stream->plan.len,BT_stream_reply,tick))<0)
+    {
+     __atomic_fetch_sub(&stream->inflight,1,__ATOMIC_RELEASE);
+     free(tick);
+    }
+   }
+  }
+
+  // Wait for the next slot. If we are already past it, start right away and drop the slots we missed.
+  next+=stream->period_ns;
+  now=BT_stream_now_ns();
+  if (next<now) next=now;
+  ts.tv_sec=next/1000000000LL;
+  ts.tv_nsec=next%1000000000LL;
+  while (clock_nanosleep(CLOCK_MONOTONIC,TIMER_ABSTIME,&ts,NULL)==EINTR);
+ }
+ return(NULL);
+}
+
+static void BT_stream_free(BT_stream *stream)
+{
+ free(stream->batch);
+ free(stream->snaps);
+ free(stream);
+}
+
+static BT_stream *BT_stream_run(BT_stream *stream)
+{
+ // Take over the connection if needed and start the poller thread. Frees the stream on failure.
+ if (!__atomic_load_n(&stream->ev3->io_running,__ATOMIC_ACQUIRE))
+ {
+  if (EV3_io_start(stream->ev3)<0)
+  {
+   BT_stream_free(stream);
+   return(NULL);
+  }
+  stream->started_io=1;
+ }
+ if (pthread_create(&stream->thread,NULL,BT_stream_loop,stream)!=0)
+ {
+  fprintf(stderr,"BT_stream_start: Unable to start the poller thread\n");
+  if (stream->started_io) EV3_io_stop(stream->ev3);
+  BT_stream_free(stream);
+  return(NULL);
+ }
+ return(stream);
+}
+
+BT_stream *EV3_stream_start(BT_ev3 *ev3, const BT_port_map *map, double rate_hz)
+{
+ //////////////////////////////////////////////////////////////////////////////////////////////////////
+ // Start polling the ports in map in the background.
+ //
+ // Inputs: ev3 - the connection
+ //         map - what is plugged in where, and which motors' tacho counts to read
+ //         rate_hz - target number of polls per second
+ //
+ // Returns: the stream, to be released with BT_stream_stop(), or NULL on error
+ //////////////////////////////////////////////////////////////////////////////////////////////////////
+ BT_stream *stream;
+
+ if (rate_hz<=0)
+ {
+  fprintf(stderr,"BT_stream_start: The sampling rate must be positive\n");
+  return(NULL);
+ }
+ stream=(BT_stream *)calloc(1,sizeof(BT_stream));
+ if (stream==NULL)
+ {
+  fprintf(stderr,"BT_stream_start: Out of memory\n");
+  return(NULL);
+ }
+ stream->ev3=ev3;
+ stream->period_ns=(long long)(1e9/rate_hz);
+ stream->depth=BT_STREAM_INFLIGHT;
+ if (BT_snapshot_init(&stream->plan,map)<0)
+ {
+  BT_stream_free(stream);
+  return(NULL);
+ }
+ return(BT_stream_run(stream));
+}
+
+BT_stream *EV3_stream_start_batched(BT_ev3 *ev3, const BT_port_map *map, int period_ms, int samples)
+{
+ //////////////////////////////////////////////////////////////////////////////////////////////////////
+ // Start sampling the ports in map on the brick itself, see BT_batch_init().
+ //
+ // Inputs: ev3 - the connection
+ //         map - what is plugged in where, and which motors' tacho counts to read
+ //         period_ms - time between samples
+ //         samples - samples per batch, 0 for as many as fit
+ //
+ // Returns: the stream, to be released with BT_stream_stop(), or NULL on error
+ //////////////////////////////////////////////////////////////////////////////////////////////////////
+ BT_stream *stream;
+
+ stream=(BT_stream *)calloc(1,sizeof(BT_stream));
+ if (stream!=NULL) stream->batch=(BT_batch_plan *)malloc(sizeof(BT_batch_plan));
+ if (stream==NULL||stream->batch==NULL)
+ {
+  fprintf(stderr,"BT_stream_start: Out of memory\n");
+  free(stream);
+  return(NULL);
+ }
+ stream->ev3=ev3;
+ if (BT_snapshot_init(&stream->plan,map)<0||BT_batch_init(stream->batch,map,period_ms,samples)<0)
+ {
+  BT_stream_free(stream);
+  return(NULL);
+ }
+ stream->snaps=(BT_snapshot *)calloc(stream->batch->samples,sizeof(BT_snapshot));
+ if (stream->snaps==NULL)
+ {
+  fprintf(stderr,"BT_stream_start: Out of memory\n");
+  BT_stream_free(stream);
+  return(NULL);
+ }
+ stream->period_ns=period_ms*1000000LL;
+ stream->depth=2;
+ stream->batch_rtt=-1;
+ return(BT_stream_run(stream));
+}
+
+BT_stream *BT_stream_start_batched(const BT_port_map *map, int period_ms, int samples)
+{
+ return(EV3_stream_start_batched(&BT_default_ev3,map,period_ms,samples));
+}
+
+BT_stream *BT_stream_start(const BT_port_map *map, double rate_hz)
+{
+ return(EV3_stream_start(&BT_default_ev3,map,rate_hz));
+}
+
+int BT_stream_stop(BT_stream *stream)
+{
+ //////////////////////////////////////////////////////////////////////////////////////////////////////
+ // Stop polling and release the stream. Samples already copied out remain valid.
+ //////////////////////////////////////////////////////////////////////////////////////////////////////
+ struct timespec ts={0,1000000};
+
+ if (stream==NULL) return(-1);
+
+ __atomic_store_n(&stream->stop,1,__ATOMIC_RELEASE);
+ pthread_join(stream->thread,NULL);
+ while (__atomic_load_n(&stream->inflight,__ATOMIC_ACQUIRE)>0) nanosleep(&ts,NULL);	// Let the last polls land
+ if (stream->started_io) EV3_io_stop(stream->ev3);
+ BT_stream_free(stream);
+ return(0);
+}
+
+int BT_stream_latest(BT_stream *stream, int channel, BT_sample *sample)
+{
+ //////////////////////////////////////////////////////////////////////////////////////////////////////
+ // Copy the most recent sample of a channel.
+ //
+ // Inputs: channel - PORT_1 to PORT_4, or BT_STREAM_TACHO(motor)
+ //
+ // Returns: 0 on success, -1 if the channel has no samples (yet)
+ //////////////////////////////////////////////////////////////////////////////////////////////////////
+ BT_stream_ring *ring;
+ unsigned int head;
+
+ if (channel<0||channel>=BT_STREAM_CHANNELS) return(-1);
+ ring=&stream->ring[channel];
+ do
+ {
+  head=__atomic_load_n(&ring->head,__ATOMIC_ACQUIRE);
+  if (head==0) return(-1);
+ } while (BT_stream_get(ring,head-1,sample)<0);
+ return(0);
+}
+
+int BT_stream_window(BT_stream *stream, int channel, long long t_from_ns, long long t_to_ns,
+                     BT_sample *samples, int max_samples)
+{
+ //////////////////////////////////////////////////////////////////////////////////////////////////////
+ // Copy the samples of a channel taken between t_from_ns and t_to_ns (inclusive, see
+ // BT_stream_now_ns()). Only the last BT_STREAM_RING samples are kept; if more than max_samples
+ // match, the newest max_samples are returned.
+ //
+ // Returns: the number of samples copied, oldest first
+ //////////////////////////////////////////////////////////////////////////////////////////////////////
+ BT_stream_ring *ring;
+ BT_sample tmp;
+ unsigned int head, pos;
+ int n=0;
+
+ if (channel<0||channel>=BT_STREAM_CHANNELS||max_samples<=0) return(0);
+ ring=&stream->ring[channel];
+ head=__atomic_load_n(&ring->head,__ATOMIC_ACQUIRE);
+ for (pos=head; pos>0&&head-pos<BT_STREAM_RING&&n<max_samples; pos--)
+ {
+  if (BT_stream_get(ring,pos-1,&samples[n])<0) break;	// The writer has lapped us
+  if (samples[n].t_ns<t_from_ns) break;
+  if (samples[n].t_ns<=t_to_ns) n++;
+ }
+ for (int i=0; i<n/2; i++)
+ {
+  tmp=samples[i];
+  samples[i]=samples[n-1-i];
+  samples[n-1-i]=tmp;
+ }
+ return(n);
+}
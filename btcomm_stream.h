@@ -0,0 +1,70 @@
+/***********************************************************************************************************************
+ *
+ * 	Sensor streaming for the BT Communications library.
+ *
+ * 	A BT_read_* call only tells you what a sensor read at the moment you asked, and makes you wait a Bluetooth
+ * 	round trip for it. A stream instead polls the configured ports in the background at a fixed rate, and keeps
+ * 	the most recent samples of every port in a ring buffer. Readers never touch Bluetooth and never block: they
+ * 	copy out the latest sample, or every sample within a time window.
+ *
+ * 	Usage:
+ * 	   BT_port_map map={{BT_SENSOR_TOUCH, BT_SENSOR_GYRO, BT_SENSOR_NONE, BT_SENSOR_ULTRASONIC}, MOTOR_A|MOTOR_B};
+ * 	   BT_stream *s=BT_stream_start(&map,50);           <-- 50 samples per second of every port in the map
+ * 	   BT_sample now;
+ * 	   BT_stream_latest(s,PORT_2,&now);                <-- now.value[0] is the gyro angle, now.value[1] the rate
+ * 	   BT_stream_latest(s,BT_STREAM_TACHO(0),&now);    <-- tacho count of motor A
+ * 	   ...
+ * 	   BT_stream_stop(s);
+ *
+ * 	Each poll is one snapshot command (see BT_snapshot_init()), so all ports of a sample are read together.
+ * 	Polls go out on schedule without waiting for the previous reply, so the rate is not limited by the round
+ * 	trip time; if BT_STREAM_INFLIGHT polls are still unanswered, a slot is skipped rather than made up later.
+ * 	Samples carry the host CLOCK_MONOTONIC time at which the brick is estimated to have taken them (half way
+ * 	through the round trip), and the round trip time itself.
+ *
+ * 	A batched stream (BT_stream_start_batched()) has the brick take the samples itself, period_ms apart by its own
+ * 	timer, and return them a batch at a time (see BT_batch_init()). Two batches are kept queued on the brick so
+ * 	there are no gaps between them. Samples are evenly spaced and cost far less Bluetooth traffic, but arrive
+ * 	one batch late; their times are worked out backwards from the reply and the estimated round trip time.
+ *
+ * 	The poller shares the connection with the rest of the program through the I/O thread. If the connection
+ * 	is not already served by it, BT_stream_start() hands it over (see BT_io_start()) and BT_stream_stop() takes
+ * 	it back.
+ *
+ *      This library is free software, distributed under the GPL license. Please refer to the include license
+ *      file for details.
+ *
+ * ********************************************************************************************************************/
+
+#ifndef __btcomm_stream_header
+#define __btcomm_stream_header
+
+#include "btcomm.h"
+
+#define BT_STREAM_RING 256				// Samples kept per port (power of 2)
+#define BT_STREAM_INFLIGHT 8				// Polls that may be waiting for their reply at once
+#define BT_STREAM_CHANNELS 8
+#define BT_STREAM_TACHO(motor) (4+(motor))		// Channel for a motor's tacho count (0=A, 1=B, 2=C, 3=D)
+
+typedef struct
+{
+ long long t_ns;					// Host CLOCK_MONOTONIC time of the sample
+ int rtt_us;						// Round trip time of the read that produced it
+ int value[3];						// value[0] for touch, colour, distance and tacho counts,
+							// R,G,B for BT_SENSOR_COLOUR_RGB, angle,rate for BT_SENSOR_GYRO
+} BT_sample;
+
+typedef struct BT_stream BT_stream;
+
+BT_stream *BT_stream_start(const BT_port_map *map, double rate_hz);		// NULL on error
+BT_stream *EV3_stream_start(BT_ev3 *ev3, const BT_port_map *map, double rate_hz);
+BT_stream *BT_stream_start_batched(const BT_port_map *map, int period_ms, int samples);	// NULL on error
+BT_stream *EV3_stream_start_batched(BT_ev3 *ev3, const BT_port_map *map, int period_ms, int samples);
+int BT_stream_stop(BT_stream *stream);
+
+// channel is PORT_1..PORT_4 or BT_STREAM_TACHO(motor). These never block.
+int BT_stream_latest(BT_stream *stream, int channel, BT_sample *sample);		// 0, or -1 if no sample yet
+int BT_stream_window(BT_stream *stream, int channel, long long t_from_ns, long long t_to_ns,
+                     BT_sample *samples, int max_samples);				// Number of samples copied
+long long BT_stream_now_ns(void);							// Same clock as BT_sample.t_ns
+#endif
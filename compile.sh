@@ -1 +1,3 @@
-g++ btcomm_test.c btcomm.c -lbluetooth
+g++ btcomm_test.c btcomm.c btcomm_stream.c btcomm_stats.c -lbluetooth -lpthread
+g++ -std=c++20 -O2 btcomm_bench.c btcomm.c btcomm_emu.c btcomm_stream.c btcomm_stats.c btcomm_asm.c -lbluetooth -lpthread -o btcomm_bench
+g++ -O2 btcomm_replay.c btcomm.c btcomm_emu.c btcomm_stream.c btcomm_stats.c btcomm_asm.c -lbluetooth -lpthread -o btcomm_replay